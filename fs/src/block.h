@@ -84,6 +84,27 @@ int block_halt();
  **/
 int block_read(blockno_t block, void *buf);
 
+/**
+ * \brief Start reading a contiguous run of blocks ahead of time.
+ * 
+ * This is a hint for long sequential reads.  Drivers which support it start transferring the run
+ * in the background, and block_read() calls for the run's blocks, in order, are served from it
+ * without waiting for the medium each time.  Reading any other block, or writing, stops the run.
+ * Drivers which do not support it just return 0.
+ * 
+ * \param block is the first block of the run
+ * \param count is the number of blocks in the run
+ * \return 0 on success, anything else to indicate an error.
+ **/
+int block_stream_start(blockno_t block, blockno_t count);
+
+/**
+ * \brief Stop a run started by block_stream_start(), if there is one.
+ * 
+ * \return 0 on success, anything else to indicate an error.
+ **/
+int block_stream_stop();
+
 /**
  * \brief Write a block from memory to the volume at the specified block address.
  * 
@@ -96,6 +117,111 @@ int block_read(blockno_t block, void *buf);
  **/
 int block_write(blockno_t block, void *buf);
 
+/**
+ * \brief Write a contiguous run of blocks from memory to the volume.
+ * 
+ * Writes count * #BLOCK_SIZE bytes, starting at the given block.  Drivers which support it
+ * send the run to the medium in one multi-block operation, which is much faster than writing
+ * the blocks one at a time; others just call block_write() for each block.
+ * 
+ * \param block is the first block number to write to.
+ * \param count is the number of blocks to write.
+ * \param buf is a pointer to count * #BLOCK_SIZE bytes to be written to the volume
+ * \return 0 on success, anything else to indicate an error.
+ **/
+int block_write_blocks(blockno_t block, blockno_t count, void *buf);
+
+/**
+ * \brief Start or move a recording session, for a long sequential write like a log or a video.
+ *
+ * SD cards only promise their Speed Class write rate while the host follows the recording rules:
+ * it announces the recording, then writes whole allocation units (AUs, see
+ * block_profile::au_blocks) in order, with multi-block writes.  After this call,
+ * block_record_write() writes from the given block on.  Calling it again while a session is
+ * running moves the session, e.g. to the next free AU, and announces it again.  The block should
+ * be the first one of an AU.  Other reads and writes may happen in between; they just interrupt
+ * the multi-block write.  Drivers without a recording mode write the blocks as
+ * block_write_blocks() does.
+ *
+ * \param block is the first block to record to
+ * \return 0 on success, anything else to indicate an error.
+ **/
+int block_record_start(blockno_t block);
+
+/**
+ * \brief Write the next blocks of a recording session.
+ *
+ * Writes count * #BLOCK_SIZE bytes to the blocks following the ones written so far.  Drivers
+ * which support it keep one multi-block write open across calls, and only close it at the end
+ * of each AU.  Blocks written here are only certain to be persistent after block_flush_cache()
+ * or block_record_stop().
+ *
+ * \param buf is a pointer to count * #BLOCK_SIZE bytes to be written to the volume
+ * \param count is the number of blocks to write.
+ * \return 0 on success, anything else to indicate an error.
+ **/
+int block_record_write(void *buf, blockno_t count);
+
+/**
+ * \brief End the recording session, if there is one, and finish its last write.
+ *
+ * \return 0 on success, anything else to indicate an error.
+ **/
+int block_record_stop();
+
+/**
+ * \brief Make every block written so far persistent.
+ * 
+ * Some media acknowledge writes before they are stored permanently, e.g. SD cards with a
+ * volatile write cache.  This function returns once all previous writes have reached
+ * non-volatile storage, so it can be used as a barrier by fsync() style calls.  Drivers for
+ * media without a write cache just return 0.
+ * 
+ * \return 0 on success, anything else to indicate an error.
+ **/
+int block_flush_cache();
+
+/**
+ * \brief Performance profile of the storage medium, filled in by block_probe().
+ *
+ * Cards from different vendors differ a lot in how fast they are, so the layers above can use
+ * this to pick their policies, e.g. how much to write at once or how often to flush.  Anything
+ * the driver could not find out is left as 0, which callers should treat as "unknown".
+ **/
+typedef struct {
+  uint32_t  au_blocks;          /**< allocation unit size, in blocks */
+  uint32_t  read_us;            /**< mean latency of a random single block read */
+  uint32_t  read_max_us;        /**< worst random single block read */
+  uint32_t  write_us;           /**< mean time per block of a sequential write */
+  uint32_t  write_max_us;       /**< worst single block of the sequential write */
+  uint8_t   speed_class;        /**< SD speed class, in MB/s (2, 4, 6 or 10) */
+  uint8_t   uhs_grade;          /**< UHS speed grade (1 is 10MB/s, 3 is 30MB/s) */
+  uint8_t   video_class;        /**< video speed class, in MB/s */
+  uint8_t   probed;             /**< non zero once block_probe() has run */
+} block_profile;
+
+/**
+ * \brief Measure the medium and fill in its profile.
+ *
+ * Reads what the medium says about itself (e.g. an SD card's speed class), then times a few
+ * random block reads and a short sequential write.  The write test only uses the scratch area
+ * given, and it puts back what was there, so it does not change the volume's contents.  A count
+ * of 0 skips the write test.  This takes a few tens of milliseconds on a typical card, so it is
+ * meant to run once, at mount.
+ *
+ * \param scratch is the first block of an area which the filesystem does not use
+ * \param count is the number of blocks in the scratch area
+ * \return 0 on success, anything else to indicate an error.
+ **/
+int block_probe(blockno_t scratch, blockno_t count);
+
+/**
+ * \brief Get the profile measured by block_probe().
+ *
+ * \return Pointer to the driver's profile, all zero until block_probe() has run.
+ **/
+const block_profile *block_get_profile();
+
 /**
  * \brief Get the size of the volume which contains the filesystem in blocks.
  * 
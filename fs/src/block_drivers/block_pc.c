@@ -30,6 +30,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <time.h>
 #include "hash.h"
 #include "../block.h"
 #include "block_pc.h"
@@ -38,17 +39,47 @@ uint64_t block_fs_size=0;
 uint8_t *blocks = NULL;
 int block_ro;
 static const char *image_name = NULL;
+static block_profile profile;
+static uint32_t read_latency_us = 0;
+static uint32_t write_latency_us = 0;
+static uint32_t reads = 0;
+static uint32_t writes = 0;
 
 void block_pc_set_image_name(const char * const filename) {
     image_name = filename;
     return;
 }
 
+/* make each block read and write wait as long as a card might, to see how the layers above
+   behave while the medium is busy (the thread sleeps, as a task on a card would) */
+void block_pc_set_latency(uint32_t read_us, uint32_t write_us) {
+  read_latency_us = read_us;
+  write_latency_us = write_us;
+}
+
+/* how many blocks have been read and written since block_init(), for tests to see what an
+   operation costs */
+void block_pc_get_counts(uint32_t *read_count, uint32_t *write_count) {
+  *read_count = reads;
+  *write_count = writes;
+}
+
+static void block_pc_wait(uint32_t us) {
+  struct timespec t;
+  if(us) {
+    t.tv_sec = us / 1000000;
+    t.tv_nsec = (us % 1000000) * 1000L;
+    nanosleep(&t, NULL);
+  }
+}
+
 int block_init() {
   FILE *block_fp;
   if(!(block_fp = fopen(image_name, "rb"))) {
     return -1;
   }
+  reads = 0;
+  writes = 0;
   fseek(block_fp, 0, SEEK_END);
   block_fs_size = ftell(block_fp);
   if(!(block_fs_size < 2048L * 1024L * 1024L)) {
@@ -93,6 +124,8 @@ int block_read(blockno_t block, void *buffer) {
 //   }
 //   fflush(block_fp);
   memcpy(buffer, blocks + block * BLOCK_SIZE, BLOCK_SIZE);
+  reads++;
+  block_pc_wait(read_latency_us);
   return 0;
 }
 
@@ -108,9 +141,76 @@ int block_write(blockno_t block, void *buffer) {
 //   }
 //   fflush(block_fp);
   memcpy(blocks + block * BLOCK_SIZE, buffer, BLOCK_SIZE);
+  writes++;
+  block_pc_wait(write_latency_us);
   return 0;
 }
 
+int block_write_blocks(blockno_t block, blockno_t count, void *buffer) {
+  blockno_t i;
+  for(i=0;i<count;i++) {
+    if(block_write(block + i, (uint8_t *)buffer + i * BLOCK_SIZE)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* the image is held in memory, so reads never need to wait */
+int block_stream_start(blockno_t block, blockno_t count) {
+  (void)block;
+  (void)count;
+  return 0;
+}
+
+int block_stream_stop() {
+  return 0;
+}
+
+/* the image has no allocation units to line up with, so a recording session just writes its
+   blocks in order */
+static blockno_t record_block = 0;
+static int record_active = 0;
+
+int block_record_start(blockno_t block) {
+  if(block >= block_get_volume_size()) {
+    return -1;
+  }
+  record_block = block;
+  record_active = 1;
+  return 0;
+}
+
+int block_record_write(void *buffer, blockno_t count) {
+  if(!record_active || block_write_blocks(record_block, count, buffer)) {
+    return -1;
+  }
+  record_block += count;
+  return 0;
+}
+
+int block_record_stop() {
+  record_active = 0;
+  return 0;
+}
+
+/* the image is held in memory, so there is no cache to flush */
+int block_flush_cache() {
+  return 0;
+}
+
+/* there is nothing to measure on an image in memory, so the profile stays "unknown" */
+int block_probe(blockno_t scratch, blockno_t count) {
+  (void)scratch;
+  (void)count;
+  profile.probed = 1;
+  return 0;
+}
+
+const block_profile *block_get_profile() {
+  return &profile;
+}
+
 blockno_t block_get_volume_size() {
   return block_fs_size / BLOCK_SIZE;
 }
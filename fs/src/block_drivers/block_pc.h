@@ -32,6 +32,8 @@
 void block_pc_set_image_name(const char * const filename);
 void block_pc_set_ro();
 void block_pc_set_rw();
+void block_pc_set_latency(uint32_t read_us, uint32_t write_us);
+void block_pc_get_counts(uint32_t *read_count, uint32_t *write_count);
 int block_pc_snapshot(const char *filename, uint64_t start, uint64_t len);
 int block_pc_snapshot_all(const char *filename);
 int block_pc_hash(uint64_t start, uint64_t len, uint8_t hash[16]);
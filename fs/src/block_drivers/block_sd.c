@@ -24,339 +24,642 @@
  * POSSIBILITY OF SUCH DAMAGE.
  *
  * This file is part of the Gristle FAT16/32 compatible filesystem driver.
+ *
+ * SPI mode driver for the STM32L4, for boards which connect the card to an SPI
+ * peripheral instead of the SD/MMC one.  Data blocks are moved with DMA, runs
+ * of blocks use the multi-block commands (CMD18 / CMD25), and the SPI clock is
+ * raised once the card has been identified.
  */
 
+#include <stddef.h>
 #include <stdint.h>
-#include <libopencm3/stm32/spi.h>
-#include <libopencm3/stm32/f1/rcc.h>
-#include <libopencm3/stm32/f1/gpio.h>
+#include <string.h>
 #include "block_sd.h"
 #include "../block.h"
-#include "config.h"
 
-SDCard card = {0, 0, 0, 0};
+SDCard card = {0, 0, 0, 0, 0};
+spi_dma_bus sd_bus = {SD_SPI, SD_SPI_DMA, SD_SPI_DMA_RX, SD_SPI_DMA_TX, SD_SPI_DMA_REQ};
+GPIO_TypeDef *sd_cs_port = SD_CS_PORT;
+
+/* state of a streaming read (CMD18) started by block_stream_start() */
+static int stream_active = 0;
+static blockno_t stream_block = 0;
+static blockno_t stream_left = 0;
+
+/* performance profile from block_probe(), and its copy of the scratch area */
+static block_profile profile;
+static uint8_t probe_buf[SD_PROBE_BLOCKS * BLOCK_SIZE];
+
+/* recording session from block_record_start(): the next block to write */
+static int record_active = 0;
+static blockno_t record_block = 0;
+
+static uint8_t sd_byte(uint8_t b) {
+  return spi_xfer(sd_bus.spi, b);
+}
+
+static void sd_select() {
+  gpio_lo(sd_cs_port, SD_CS_PIN);
+}
+
+static void sd_deselect() {
+  gpio_hi(sd_cs_port, SD_CS_PIN);
+  sd_byte(0xFF);              /* the card only releases MISO on the next clock */
+}
+
+/* block address for a command argument, standard capacity cards use bytes */
+static uint32_t sd_addr(blockno_t block) {
+  if(card.card_type == SD_CARD_SC) {
+    return block << 9;
+  }
+  return block;
+}
+
+/**
+ * sd_wait_ready - the card holds MISO low while it is busy programming, wait
+ *                 until it lets go.
+ **/
+static int sd_wait_ready(uint32_t timeout) {
+  uint32_t start = tick;
+  while(sd_byte(0xFF) != 0xFF) {
+    if((tick - start) > timeout) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * sd_transfer - move a block of data, tx or rx may be NULL to send 0xFF or
+ *               throw away the received bytes.
+ **/
+static int sd_transfer(const uint8_t *tx, uint8_t *rx, uint16_t len) {
+#if SD_SPI_DMA_BLOCKS
+  return spi_dma_xfer(&sd_bus, tx, rx, len);
+#else
+  uint16_t i;
+  uint8_t c;
+  for(i=0;i<len;i++) {
+    c = sd_byte(tx ? tx[i] : 0xFF);
+    if(rx) {
+      rx[i] = c;
+    }
+  }
+  return 0;
+#endif
+}
+
+/* CRC7 of a command frame, only checked for CMD0 and CMD8 in SPI mode */
+static uint8_t sd_crc7(const uint8_t *p, int len) {
+  uint8_t crc = 0;
+  int i, j;
+  for(i=0;i<len;i++) {
+    crc ^= p[i];
+    for(j=0;j<8;j++) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x12 : (crc << 1);
+    }
+  }
+  return crc | 0x01;          /* CRC in the top 7 bits, then the end bit */
+}
+
 /**
  *  sd_command - internal function to send a properly formatted command to
- *               to the SD card.
+ *               to the SD card.  Returns the R1 response, or 0xFF if there
+ *               was none.
  */
-uint16_t sd_command(uint8_t code, uint32_t data, uint8_t chksm) {
-  uint16_t c;
+static uint8_t sd_command(uint8_t code, uint32_t data) {
+  uint8_t frame[6];
+  uint8_t c;
   int i;
-  
+
   if(code & 0x80) {
     /* it's an ACMD, so send CMD 55 first */
-    spi_xfer(SD_SPI, 0xFF);
-  
-    spi_xfer(SD_SPI, 0x40 + 55);
-    spi_xfer(SD_SPI, 0x00);
-    spi_xfer(SD_SPI, 0x00);
-    spi_xfer(SD_SPI, 0x00);
-    spi_xfer(SD_SPI, 0x00);
-    spi_xfer(SD_SPI, 0x01);
-
-    do {
-      c = spi_xfer(SD_SPI, 0xFF);
-    } while(c == 0xFF);
+    c = sd_command(CMD55, 0);
+    if(c > SD_R1_IDLE) {
+      return c;
+    }
   }
 
-  spi_xfer(SD_SPI, 0xFF);
+  /* a block written earlier may still be programming; CMD12 has to interrupt
+     a read though, and CMD0 resets the card whatever it is doing */
+  if(code != CMD12 && code != CMD0 && sd_wait_ready(SD_WRITE_TIMEOUT_MS)) {
+    return 0xFF;
+  }
 
-  spi_xfer(SD_SPI, 0x40 + (code & 0x7F));
-  spi_xfer(SD_SPI, (data >> 24) & 0xFF);
-  spi_xfer(SD_SPI, (data >> 16) & 0xFF);
-  spi_xfer(SD_SPI, (data >> 8) & 0xFF);
-  spi_xfer(SD_SPI, (data & 0xFF));
-  spi_xfer(SD_SPI, chksm);
+  frame[0] = 0x40 + (code & 0x7F);
+  frame[1] = (data >> 24) & 0xFF;
+  frame[2] = (data >> 16) & 0xFF;
+  frame[3] = (data >> 8) & 0xFF;
+  frame[4] = (data & 0xFF);
+  frame[5] = sd_crc7(frame, 5);
+  for(i=0;i<6;i++) {
+    sd_byte(frame[i]);
+  }
 
   if(code == CMD12) {
-    spi_xfer(SD_SPI, 0xFF);     /* for CMD12 we have to discard a byte */
+    sd_byte(0xFF);            /* for CMD12 we have to discard a byte */
   }
 
-  for(i=0;i<SD_RETRIES;i++) {
-    c = spi_xfer(SD_SPI, 0xFF);
-    if(c != 0xFF) {
+  for(i=0;i<SD_NCR_BYTES;i++) {
+    c = sd_byte(0xFF);
+    if(!(c & 0x80)) {
       return c;
     }
   }
 
-  return c;
+  return 0xFF;
 }
 
 /**
- * sd_card_reset - performs a software reset on the card to get it ready for
- *                 use.
+ * sd_read_data - wait for a data block's start token and read the block.
  **/
-int sd_card_reset() {
-  int i;
-  uint16_t c;
+static int sd_read_data(uint8_t *buf, uint16_t len) {
+  uint32_t start = tick;
+  uint8_t c;
+
+  /* the card sends 0xFF until the data is ready, or an error token */
+  while((c = sd_byte(0xFF)) == 0xFF) {
+    if((tick - start) > SD_READ_TIMEOUT_MS) {
+      return -1;
+    }
+  }
+  if(c != SD_TOKEN_START) {
+    return -1;
+  }
 
-#ifdef SD_CP
-  if(gpio_get(SD_CP_PORT, SD_CP)) {
-    card.error = SD_ERR_NOT_PRESENT;
+  if(sd_transfer(NULL, buf, len)) {
     return -1;
   }
-#endif
+  sd_byte(0xFF);
+  sd_byte(0xFF);              /* read checksum bytes and dispose of */
+  return 0;
+}
 
-  /* make sure the card is de-selected */
-  gpio_set(SD_PORT, SD_CS_PIN);
+/**
+ * sd_write_data - send one data block with the given start token.  The card
+ *                 is left busy programming it, the next command waits.
+ **/
+static int sd_write_data(const uint8_t *buf, uint8_t token) {
+  uint8_t c;
 
-  /* send more than 80 clock pulses */
-  for(i=0;i<20;i++) {
-    spi_xfer(SD_SPI, 0xFF);
+  sd_byte(0xFF);              /* at least one byte between response and data */
+  sd_byte(token);
+  if(sd_transfer(buf, NULL, BLOCK_SIZE)) {
+    return -1;
   }
+  sd_byte(0xFF);
+  sd_byte(0xFF);              /* dummy checksum bytes */
 
-  /* set chip select low again */
-  gpio_clear(SD_PORT, SD_CS_PIN);
+  c = sd_byte(0xFF);          /* data response token */
+  if((c & SD_DATA_RESP_MASK) != SD_DATA_ACCEPTED) {
+    return -1;
+  }
+  return 0;
+}
 
-//  for(i=0;i<1000;i++);
+/**
+ * sd_read_csd - read the CSD register and work out the card size and write
+ *               protection from it.
+ **/
+static int sd_read_csd() {
+  static uint8_t csd[16];     /* filled by DMA */
+  uint32_t c_size;
+  int read_bl_len, c_size_mult;
 
-  /* send CMD0 with the correct (pre-computed) CRC */
-  c = sd_command(CMD0, 0, 0x95);
-  if(c == 0xFF) {
+  if(sd_command(CMD9, 0) != 0 || sd_read_data(csd, 16)) {
+    return -1;
+  }
+
+  /* the CSD structure version is in the top 2 bits */
+  if(csd[0] & 0x40) {
+    c_size = ((uint32_t)(csd[7] & 0x3F) << 16) | (csd[8] << 8) | csd[9];
+    card.size = (c_size + 1) << 10;   /* size is (csize + 1) * 512k */
+  } else {
+    read_bl_len = csd[5] & 0xF;
+    c_size = ((uint32_t)(csd[6] & 0x03) << 10) | (csd[7] << 2) | (csd[8] >> 6);
+    c_size_mult = ((csd[9] & 0x03) << 1) | (csd[10] >> 7);
+    card.size = ((c_size + 1) << (c_size_mult + 2)) << (read_bl_len - 9);
+  }
+  if(csd[14] & 0x30) {
+    card.read_only = 1;       /* permanent or temporary write protection */
+  }
+  return 0;
+}
+
+/**
+ * sd_card_reset - performs a software reset on the card to get it ready for
+ *                 use.
+ **/
+static int sd_card_reset() {
+  uint8_t r[4];
+  uint8_t c = 0xFF;
+  uint32_t start;
+  int i, v2;
+
+  card.card_type = SD_CARD_NONE;
+  card.read_only = 0;
+  card.size = 0;
+  card.error = 0;
+  stream_active = 0;
+  spi_set_clock(sd_bus.spi, SD_SPI_CLK_INIT);
+
+  /* make sure the card is de-selected, then send more than 74 clock pulses */
+  gpio_hi(sd_cs_port, SD_CS_PIN);
+  for(i=0;i<10;i++) {
+    sd_byte(0xFF);
+  }
+
+  sd_select();
+
+  /* CMD0 switches the card to SPI mode; a card which was left in the middle
+     of a transfer may need a couple of tries */
+  for(i=0;i<3 && c != SD_R1_IDLE;i++) {
+    c = sd_command(CMD0, 0);
+  }
+  if(c != SD_R1_IDLE) {
     card.card_type = SD_CARD_ERROR;
     card.error = SD_ERR_NOT_PRESENT;
+    sd_deselect();
     return -1;
   }
-  //usart_dec_u16(c);
-  //usart_puts("\n");
 
   /* send CMD8 to see if this is a mark 2 SD card */
-  c = sd_command(CMD8, 0x000001AA, 0x87);   /* data pattern is used to check voltage levels */
-  if(c == 5) {
-    card.card_type = SD_CARD_SC;
-  } else if(c == 1) {
+  c = sd_command(CMD8, 0x000001AA);   /* data pattern is used to check voltage levels */
+  if(c == (SD_R1_IDLE | SD_R1_ILLEGAL_CMD)) {
+    v2 = 0;
+  } else if(c == SD_R1_IDLE) {
     /* card is type 2 need to check for voltage/speed corruption */
-    if(spi_xfer(SD_SPI, 0xFF) != 0) {
-      card.card_type = SD_CARD_ERROR;
-      return -1;// SD_CARD_ERROR;
+    for(i=0;i<4;i++) {
+      r[i] = sd_byte(0xFF);
     }
-    if(spi_xfer(SD_SPI, 0xFF) != 0) {
-      card.card_type = SD_CARD_ERROR;
-      return -1;// SD_CARD_ERROR;
+    if((r[2] & 0x0F) != 0x01 || r[3] != 0xAA) {
+      goto fail;
     }
-    if(spi_xfer(SD_SPI, 0xFF) != 1) {
-      card.card_type = SD_CARD_ERROR;
-      return -1;// SD_CARD_ERROR;
-    }
-    if(spi_xfer(SD_SPI, 0xFF) != 0xAA) {
-      card.card_type = SD_CARD_ERROR;
-      return -1;// SD_CARD_ERROR;
-    }
-    card.card_type = SD_CARD_HC;                   /* not necessarily but could be, needs further checks */
+    v2 = 1;
   } else {
-    card.card_type = SD_CARD_ERROR;
-    return -1;// SD_CARD_ERROR;                   /* command response was an error. */
+    goto fail;                /* command response was an error. */
   }
 
-  /* send ACMD41 until the card is ready */
-  /* TODO: if ACMD41 fails could be MMC in which case CMD1 should be used instead */
-  c = 1;
-  while(c == 1) {
-                                          /* set bit 30 to indicate we are HCSD capable */
-    c = sd_command(ACMD41, 1 << 30, 1);   /* checksum is a dummy */
+  /* send ACMD41 until the card is ready, with bit 30 set to say we are HCSD
+     capable; it can take up to a second, so don't hammer the bus meanwhile */
+  start = tick;
+  while((c = sd_command(ACMD41, v2 ? (1UL << 30) : 0)) == SD_R1_IDLE) {
+    uint32_t poll = tick;
+    if((tick - start) > SD_INIT_TIMEOUT_MS) {
+      break;
+    }
+    while((tick - poll) < SD_ACMD41_POLL_MS) {
+      SD_SLEEP();
+    }
   }
-
-  /* now run a CSD and get some card details (such as HCSD or not etc.) */
-  c = sd_command(CMD9, 0, 1);             /* "send CSD" command */
-  //usart_hex_u8(c);
-  //usart_puts("\n");
-  /* got the response to the command, make sure it's 0; no error */
   if(c != 0) {
-    card.card_type = SD_CARD_ERROR;
-    return -1;
+    goto fail;
   }
 
-  /* now wait for a start data token (0xFE) */
-  do {
-    c = spi_xfer(SD_SPI, 0xFF);
-  } while(c == 0xFF);
-/*  c = sd_read_byte();
-  usart_hex_u8(c);
-  usart_puts("\n");
-  if(c != 0xFF) {
-    card->card_type = SD_CARD_ERROR;
-    return;
-  }
-  c = sd_read_byte();
-  usart_hex_u8(c);
-  usart_puts("\n");
-  if(c != 0xFE) {
-    card->card_type = SD_CARD_ERROR;
-    return;
-  }*/
-
-  /* Now deal with the actual content of the CSD */
-  c = spi_xfer(SD_SPI, 0xFF);
-  /* contains the card type info in top 2 bits */
-  /* also determines the structure of the rest of the CSD */
-  if(c & 0x40) {
-    card.card_type = SD_CARD_HC;
-    spi_xfer(SD_SPI, 0xFF);   /* this is always 0x0E no need to check */
-    spi_xfer(SD_SPI, 0xFF);   /* this is always 0x00 */
-    spi_xfer(SD_SPI, 0xFF);   /* card speed 0x32 or 0x5A, we don't care */
-    spi_xfer(SD_SPI, 0xFF);   /* card command class, don't care */
-    spi_xfer(SD_SPI, 0xFF);   /* end of class and max block len, don't care */
-    spi_xfer(SD_SPI, 0xFF);   /* DSR bit and zeros, don't care */
-    c = spi_xfer(SD_SPI, 0xFF);   /* 4 zeros and top 4 bits of size */
-    card.size = (c & 0xF) << 16;
-    c = spi_xfer(SD_SPI, 0xFF);   /* next byte of size */
-    card.size += (c << 8);
-    c = spi_xfer(SD_SPI, 0xFF);
-    card.size += c;      /* last byte of size */
-    card.size += 1;      /* size is (csize + 1) * 512 bytes */
-    card.size <<= 10;    /* want it in 512 blocks but was in 512k */
-    spi_xfer(SD_SPI, 0xFF);   /* always 0x7F */
-    spi_xfer(SD_SPI, 0xFF);   /* always 0x80 */
-    spi_xfer(SD_SPI, 0xFF);   /* always 0x0A */
-    spi_xfer(SD_SPI, 0xFF);   /* always 0x40 */
-    c = spi_xfer(SD_SPI, 0xFF);   /* write protect flags */
-    if(c & 0x30) {
-      card.read_only = 1;
+  /* the OCR's CCS bit says whether the card is block addressed */
+  card.card_type = SD_CARD_SC;
+  if(v2) {
+    if(sd_command(CMD58, 0) != 0) {
+      goto fail;
     }
-    spi_xfer(SD_SPI, 0xFF);   /* checksum */
-  } else {
-    card.card_type = SD_CARD_SC;
-    spi_xfer(SD_SPI, 0xFF);   /* read time, don't care */
-    spi_xfer(SD_SPI, 0xFF);   /* more access time */
-    spi_xfer(SD_SPI, 0xFF);   /* speed don't care */
-    spi_xfer(SD_SPI, 0xFF);   /* ccc part 1 */
-    c = spi_xfer(SD_SPI, 0xFF);   /* read block len */
-    i = c & 0xF;
-    c = spi_xfer(SD_SPI, 0xFF);   /* various flags and top 2 bits of C_SIZE */
-    card.size = (c & 0x03) << 10;
-    c = spi_xfer(SD_SPI, 0xFF);   /* middle 8 bits of C_SIZE */
-    card.size += (c << 2);
-    c = spi_xfer(SD_SPI, 0xFF);   /* last two bits and some current info */
-    card.size += ((c & 0xC0) >> 6);
-    c = spi_xfer(SD_SPI, 0xFF);   /* more current info and top 2 bits of size_mult */
-    c = (c << 1) + (spi_xfer(SD_SPI, 0xFF) >> 7);
-    c = 1 << ((c & 0x7) + 2);
-    card.size++;
-    card.size *= c;
-    card.size <<= (i - 9);
-    spi_xfer(SD_SPI, 0xFF);   /* write protect nonsense */
-    spi_xfer(SD_SPI, 0xFF);   /* write info */
-    spi_xfer(SD_SPI, 0xFF);   /* more of the same */
-    c = spi_xfer(SD_SPI, 0xFF);   /* pre-pressed stuff and WP */
-    if(c & 0x30) {
-      card.read_only = 1;
+    for(i=0;i<4;i++) {
+      r[i] = sd_byte(0xFF);
     }
-    spi_xfer(SD_SPI, 0xFF);   /* the checksum */
+    if(r[0] & 0x40) {
+      card.card_type = SD_CARD_HC;
+    }
+  }
+
+  /* now run a CSD and get some card details */
+  if(sd_read_csd()) {
+    goto fail;
   }
 
+  /* byte addressed cards might not default to 512 byte blocks */
+  if(card.card_type == SD_CARD_SC && sd_command(CMD16, BLOCK_SIZE) != 0) {
+    goto fail;
+  }
+
+  sd_deselect();
+  spi_set_clock(sd_bus.spi, SD_SPI_CLK_FAST);
   return 0;
+
+fail:
+  card.card_type = SD_CARD_ERROR;
+  card.error = SD_ERR_NOT_PRESENT;
+  sd_deselect();
+  return -1;
 }
 
 int block_init() {
-  /* need to do the clocks */
-  rcc_peripheral_enable_clock(&SD_SPI_APB_ENR, SD_SPI_APB_ENR_BIT);
-  rcc_peripheral_enable_clock(&SD_IO_APB_ENR, SD_IO_APB_ENR_BIT);
-
-    /* need to do the IO pins */
-  gpio_set_mode(SD_PORT, GPIO_MODE_OUTPUT_50_MHZ,
-                GPIO_CNF_OUTPUT_PUSHPULL, SD_CS_PIN);
-  gpio_set_mode(SD_PORT, GPIO_MODE_OUTPUT_50_MHZ,
-                GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, SD_MOSI_PIN);
-  gpio_set_mode(SD_PORT, GPIO_MODE_OUTPUT_50_MHZ,
-                GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, SD_SCK_PIN);
-  gpio_set_mode(SD_PORT,GPIO_MODE_INPUT,
-                GPIO_CNF_INPUT_FLOAT, SD_MISO_PIN);
-#ifdef SD_WP_PIN
-  gpio_set_mode(SD_WP_PORT, GPIO_MODE_INPUT,
-                GPIO_CNF_INPUT_FLOAT, SD_WP_PIN);
-#endif
-#ifdef SD_CP_PIN
-  gpio_set_mode(SD_CP_PORT, GPIO_MODE_INPUT,
-                GPIO_CNF_INPUT_FLOAT, SD_CP_PIN);
-#endif
+  uint32_t start = timer_micros();
+  int r;
+
+  /* mode 0: the clock idles low and data is sampled on the rising edge */
+  spi_host_init(sd_bus.spi, 0, 0);
+  spi_dma_setup(&sd_bus);
 
-  /* configure the SPI peripheral */
-  spi_set_unidirectional_mode(SD_SPI);                          /* we're the only master */
-  spi_disable_crc(SD_SPI);                                      /* no CRC for this slave */
-  spi_set_dff_8bit(SD_SPI);                                     /* 8-bit dataword-length */
-  spi_set_full_duplex_mode(SD_SPI);                             /* not receive-only */
-  spi_enable_software_slave_management(SD_SPI);                 /* we want to handle the CS signal 
-                                                                   in software */
-  spi_set_nss_high(SD_SPI);
-  spi_set_baudrate_prescaler(SD_SPI, SPI_CR1_BR_FPCLK_DIV_4); /* PCLOCK/256 as clock */
-  spi_set_master_mode(SD_SPI);                                  /* we want to control everything and
-                                                                   generate the clock -> master */
-  spi_set_clock_polarity_0(SD_SPI);                             /* sck idle state high */
-  spi_set_clock_phase_0(SD_SPI);                                /* bit is taken on the second 
-                                                                   (rising edge) of sck */
-  spi_disable_ss_output(SD_SPI);
-  spi_enable(SD_SPI);
-
-  return sd_card_reset();
+  r = sd_card_reset();
+  card.init_us = timer_micros() - start;
+  return r;
+}
+
+int block_halt() {
+  int r = block_stream_stop();
+  if(block_flush_cache()) {
+    r = -1;
+  }
+  return r;
+}
+
+/* start a multi-block read; the card keeps sending blocks until CMD12 */
+int block_stream_start(blockno_t block, blockno_t count) {
+  if(block_stream_stop()) {
+    return -1;
+  }
+  if(count < 2 || block >= card.size) {
+    return 0;                 /* nothing to gain, reads just happen on demand */
+  }
+  if(count > card.size - block) {
+    count = card.size - block;
+  }
+
+  sd_select();
+  if(sd_command(CMD18, sd_addr(block)) != 0) {
+    sd_deselect();
+    return -1;
+  }
+  stream_active = 1;
+  stream_block = block;
+  stream_left = count;
+  return 0;
+}
+
+int block_stream_stop() {
+  int r = 0;
+  if(!stream_active) {
+    return 0;
+  }
+  stream_active = 0;
+
+  /* the card may be part way through the next block, CMD12 cuts it short,
+     then it can be busy for a moment */
+  if(sd_command(CMD12, 0) != 0 || sd_wait_ready(SD_READ_TIMEOUT_MS)) {
+    r = -1;
+  }
+  sd_deselect();
+  return r;
 }
 
 int block_read(blockno_t block, void *buf) {
-  int i;
-  uint16_t c;
-  uint8_t *bp = buf;
-  
-  if(card.card_type == SD_CARD_SC) {
-    block <<= 9;
+  int r;
+
+  if(stream_active) {
+    if(block == stream_block && sd_read_data(buf, BLOCK_SIZE) == 0) {
+      stream_block++;
+      if(--stream_left == 0) {
+        block_stream_stop();
+      }
+      return 0;
+    }
+    /* not the next block of the run, or it failed; read it on its own */
+    block_stream_stop();
+  }
+  if(block >= card.size) {
+    return -1;
   }
 
-  c = sd_command(CMD17, block, 1);
+  sd_select();
+  r = -1;
+  if(sd_command(CMD17, sd_addr(block)) == 0) {
+    r = sd_read_data(buf, BLOCK_SIZE);
+  }
+  sd_deselect();
+  if(r) {
+    card.error = SD_ERR_IO;
+  }
+  return r;
+}
 
-  if(c != 0) {
-    return c;
+int block_write(blockno_t block, void *buf) {
+  int r;
+
+  block_stream_stop();
+  if(block >= card.size) {
+    return -1;
+  }
+
+  sd_select();
+  r = -1;
+  if(sd_command(CMD24, sd_addr(block)) == 0) {
+    r = sd_write_data(buf, SD_TOKEN_START);
+  }
+  sd_deselect();
+  if(r) {
+    card.error = SD_ERR_IO;
+  }
+  return r;
+}
+
+int block_write_blocks(blockno_t block, blockno_t count, void *buf) {
+  const uint8_t *bp = buf;
+  blockno_t i;
+  int r;
+
+  if(count == 1) {
+    return block_write(block, buf);
+  }
+  block_stream_stop();
+  if(block >= card.size || count > card.size - block) {
+    return -1;
+  }
+  if(count == 0) {
+    return 0;
   }
-  
-  do {
-    c = spi_xfer(SD_SPI, 0xFF);
-  } while(c != 0xFE);
 
-  for(i=0;i<512;i++) {
-    *bp++ = spi_xfer(SD_SPI, 0xFF);
+  sd_select();
+  /* telling the card how many blocks are coming lets it erase them in one go;
+     it is only a hint, so a card which doesn't support it is fine */
+  sd_command(ACMD23, count);
+  r = -1;
+  if(sd_command(CMD25, sd_addr(block)) == 0) {
+    r = 0;
+    for(i=0;i<count && !r;i++) {
+      if(i && sd_wait_ready(SD_WRITE_TIMEOUT_MS)) {
+        r = -1;
+      } else {
+        r = sd_write_data(bp + i * BLOCK_SIZE, SD_TOKEN_MULTI);
+      }
+    }
+    /* the stop token ends the run, even after an error; the card is busy
+       programming afterwards, which the next command waits for */
+    if(sd_wait_ready(SD_WRITE_TIMEOUT_MS)) {
+      r = -1;
+    }
+    sd_byte(SD_TOKEN_STOP);
+    sd_byte(0xFF);
   }
-  spi_xfer(SD_SPI, 0xFF);
-  spi_xfer(SD_SPI, 0xFF);   /* read checksum bytes and dispose of */
+  sd_deselect();
+  if(r) {
+    card.error = SD_ERR_IO;
+  }
+  return r;
+}
 
+/* the driver doesn't read the SCR, so it can't tell whether the card knows CMD20; the session
+   is not announced, but its writes still go out as multi-block runs, split at the AU
+   boundaries once block_probe() has found the AU size */
+int block_record_start(blockno_t block) {
+  if(block >= card.size) {
+    return -1;
+  }
+  record_active = 1;
+  record_block = block;
   return 0;
 }
 
-int block_write(blockno_t block, void *buf) {
-  int i;
-  uint16_t c;
+int block_record_write(void *buf, blockno_t count) {
   uint8_t *bp = buf;
-  
-  if(card.card_type == SD_CARD_SC) {
-    block <<= 9;
+  blockno_t n;
+
+  if(!record_active) {
+    return -1;
+  }
+  while(count) {
+    n = count;
+    if(profile.au_blocks && n > profile.au_blocks - record_block % profile.au_blocks) {
+      n = profile.au_blocks - record_block % profile.au_blocks;
+    }
+    if(block_write_blocks(record_block, n, bp)) {
+      return -1;
+    }
+    record_block += n;
+    bp += n * BLOCK_SIZE;
+    count -= n;
   }
+  return 0;
+}
 
-  c = sd_command(CMD24, block, 1);
+int block_record_stop() {
+  record_active = 0;
+  return 0;
+}
 
-  if(c != 0) {
-    return c;
-  }
-  
-  // make sure there's long enough from the command response before the data
-  spi_xfer(SD_SPI, 0xFF);
-  spi_xfer(SD_SPI, 0xFF);
-  
-  //now send the start of block indicator
-  spi_xfer(SD_SPI, 0xFE);
-  
-  // now the data
-  for(i=0;i<512;i++) {
-    spi_xfer(SD_SPI, *bp++);
-  }
-  
-  // finally two dummy checksum bytes
-  spi_xfer(SD_SPI, 0xFF);
-  spi_xfer(SD_SPI, 0xFF);   /* read checksum bytes and dispose of */
-  
-  // get the card response
-  c = spi_xfer(SD_SPI, 0xFF);
-  
-  while(spi_xfer(SD_SPI, 0xFF) != 0xFF) {__asm__("nop");}     // make sure the card is no longer busy
+/* there is no write cache in SPI mode, but the last write may still be
+   programming; wait for the card to finish it */
+int block_flush_cache() {
+  int r;
+  if(stream_active) {
+    return 0;                 /* a stream can only start once writes are done */
+  }
+  sd_select();
+  r = sd_wait_ready(SD_WRITE_TIMEOUT_MS);
+  sd_deselect();
+  return r;
+}
+
+/**
+ * sd_read_status - read the 64 byte SD Status register with ACMD13, and fill
+ *                  in the speed class, UHS grade and AU size from it.
+ **/
+static int sd_read_status() {
+  /* speed class codes in MB/s, AU size codes in KB */
+  static const uint8_t speed_class[5] = {0, 2, 4, 6, 10};
+  static const uint32_t au_kb[16] = {0, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192,
+                                     12288, 16384, 24576, 32768, 65536};
+  uint8_t *status = probe_buf;
+  uint32_t au;
+  int r = -1;
+
+  sd_select();
+  /* the response is R2, so a second status byte follows R1 */
+  if(sd_command(ACMD13, 0) == 0 && sd_byte(0xFF) == 0) {
+    r = sd_read_data(status, 64);
+  }
+  sd_deselect();
+  if(r) {
+    return -1;
+  }
+  if(status[8] < 5) {
+    profile.speed_class = speed_class[status[8]];
+  }
+  profile.uhs_grade = status[14] >> 4;
+  profile.video_class = status[15];
+  /* UHS cards can have AUs too big for the older field */
+  au = status[14] & 0xF;
+  if(au == 0) {
+    au = status[10] >> 4;
+  }
+  profile.au_blocks = au_kb[au] * 2;
+  return 0;
+}
+
+/* time some random reads and a sequential write of the scratch area, which is
+   read first and written back as it was */
+int block_probe(blockno_t scratch, blockno_t count) {
+  uint32_t seed = card.size;
+  uint32_t total = 0;
+  uint32_t start, us;
+  blockno_t i;
 
+  memset(&profile, 0, sizeof(profile));
+  if(card.size == 0 || block_stream_stop()) {
+    return -1;
+  }
+  sd_read_status();           /* older cards don't have one, that's fine */
+
+  /* spread the reads over the whole card, so they don't share an erase block */
+  for(i=0;i<SD_PROBE_READS;i++) {
+    seed = seed * 1664525 + 1013904223;
+    start = timer_micros();
+    if(block_read(seed % card.size, probe_buf)) {
+      return -1;
+    }
+    us = timer_micros() - start;
+    total += us;
+    if(us > profile.read_max_us) {
+      profile.read_max_us = us;
+    }
+  }
+  profile.read_us = total / SD_PROBE_READS;
+
+  if(count > SD_PROBE_BLOCKS) {
+    count = SD_PROBE_BLOCKS;
+  }
+  if(block_get_device_read_only() || scratch >= card.size || count > card.size - scratch) {
+    count = 0;
+  }
+  for(i=0;i<count;i++) {
+    if(block_read(scratch + i, probe_buf + i * BLOCK_SIZE)) {
+      return -1;
+    }
+  }
+  start = timer_micros();
+  for(i=0;i<count;i++) {
+    us = timer_micros();
+    if(block_write(scratch + i, probe_buf + i * BLOCK_SIZE)) {
+      return -1;
+    }
+    us = timer_micros() - us;
+    if(us > profile.write_max_us) {
+      profile.write_max_us = us;
+    }
+  }
+  if(count) {
+    /* include the time the card takes to program the last block */
+    if(block_flush_cache()) {
+      return -1;
+    }
+    profile.write_us = (timer_micros() - start) / count;
+  }
+  profile.probed = 1;
   return 0;
 }
 
+const block_profile *block_get_profile() {
+  return &profile;
+}
+
 blockno_t block_get_volume_size() {
   return card.size;
 }
@@ -367,7 +670,7 @@ int block_get_block_size() {
 
 int block_get_device_read_only() {
 #ifdef SD_WP
-  if(gpio_get(SD_WP_PORT, SD_WP))
+  if(SD_WP_PORT->IDR & (1 << SD_WP))
     return 1;
 #endif
   if(card.read_only) {
@@ -377,14 +680,6 @@ int block_get_device_read_only() {
   }
 }
 
-int block_sync() {
-  return 0;
-}
-
-int block_halt() {
-  return 0;
-}
-
 int block_get_error() {
   return card.error;
 }
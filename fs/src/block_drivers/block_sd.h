@@ -29,6 +29,53 @@
 #ifndef BLOCK_SD_H
 #define BLOCK_SD_H 1
 
+
+#include <stdint.h>
+#include "block.h"
+#include "port/gpio.h"
+#include "port/spi.h"
+#include "port/tim.h"
+
+/**
+ *  Board configuration
+ *
+ *  The card sits on an SPI peripheral, with a GPIO output for chip select.
+ *  The application sets up the pins and peripheral clocks; the defaults are
+ *  SPI1 (PA5/6/7) and PA4, with the DMA1 channels which serve SPI1.
+ */
+#ifndef SD_SPI
+#define SD_SPI          SPI1
+#endif
+#ifndef SD_SPI_DMA
+#define SD_SPI_DMA      DMA1
+#define SD_SPI_DMA_RX   2
+#define SD_SPI_DMA_TX   3
+#define SD_SPI_DMA_REQ  1
+#endif
+#ifndef SD_CS_PORT
+#define SD_CS_PORT      GPIOA
+#define SD_CS_PIN       4
+#endif
+
+/* SPI clocks, from an 80MHz APB2 clock: cards must be identified at 400KHz
+   or less, and default speed cards accept up to 25MHz afterwards. */
+#ifndef SD_SPI_CLK_INIT
+#define SD_SPI_CLK_INIT SPI_CLK_DIV256
+#endif
+#ifndef SD_SPI_CLK_FAST
+#define SD_SPI_CLK_FAST SPI_CLK_DIV4
+#endif
+
+/* Move data blocks with DMA; define as 0 to use a byte-at-a-time loop. */
+#ifndef SD_SPI_DMA_BLOCKS
+#define SD_SPI_DMA_BLOCKS 1
+#endif
+
+/* Low-power wait between ACMD41 polls. */
+#ifndef SD_SLEEP
+#define SD_SLEEP()      __asm__( "WFI" )
+#endif
+
 /**
  *  Platform independent definitions
  */
@@ -48,17 +95,52 @@
 #define CMD9          9
 #define CMD10         10
 #define CMD12         12
+#define CMD13         13
+#define CMD16         16
 #define CMD17         17
 #define CMD18         18
 #define CMD24         24
+#define CMD25         25
+#define CMD55         55
+#define CMD58         58
+#define ACMD13        0x80 + 13
+#define ACMD23        0x80 + 23
 #define ACMD41        0x80 + 41
 
+/* R1 response flags */
+#define SD_R1_IDLE          0x01
+#define SD_R1_ILLEGAL_CMD   0x04
+
+/* Data tokens */
+#define SD_TOKEN_START      0xFE /* Single block read / write, multi-block read */
+#define SD_TOKEN_MULTI      0xFC /* Each block of a multi-block write */
+#define SD_TOKEN_STOP       0xFD /* End of a multi-block write */
+#define SD_DATA_RESP_MASK   0x1F
+#define SD_DATA_ACCEPTED    0x05
+
 /* Error status codes returned in the SD info struct */
 #define SD_ERR_NO_PART      1
 #define SD_ERR_NOT_PRESENT  2
 #define SD_ERR_NO_FAT       3
+#define SD_ERR_IO           4
+
+/* Timeouts: command responses arrive within 8 bytes (Ncr), and the spec's
+   limits for power-up, read access and programming are 1s, 100ms and 250ms */
+#define SD_NCR_BYTES         10
+#define SD_INIT_TIMEOUT_MS   1000
+#define SD_READ_TIMEOUT_MS   100
+#define SD_WRITE_TIMEOUT_MS  250
+#define SD_ACMD41_POLL_MS    1
 
-#define SD_RETRIES 1000
+/* Card profiling: block_probe() times SD_PROBE_READS random reads, then a
+   sequential write of up to SD_PROBE_BLOCKS scratch blocks, which it keeps a
+   copy of to write back. */
+#ifndef SD_PROBE_READS
+#define SD_PROBE_READS       8
+#endif
+#ifndef SD_PROBE_BLOCKS
+#define SD_PROBE_BLOCKS      4
+#endif
 
 /* SD card info struct */
 typedef struct {
@@ -66,6 +148,11 @@ typedef struct {
   uint8_t   read_only;
   uint32_t  size;
   uint8_t   error;
+  uint32_t  init_us;
 } SDCard;
 
+/* The bus and chip select pin which the driver uses; tests can redirect them */
+extern spi_dma_bus sd_bus;
+extern GPIO_TypeDef *sd_cs_port;
+
 #endif /* ifndef BLOCK_SD_H */
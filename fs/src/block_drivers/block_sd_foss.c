@@ -1,15 +1,244 @@
+#include <stddef.h>
+#include <string.h>
+
 #include "block_sd_foss.h"
 
-SDCard card = { 0x00000000, 0x0000, 0x0000, 0x00, 0x00 };
+SDCard card = { 0x00000000, 0x0000, 0x0000, 0x00, 0x00, 0x00, 0x00,
+                0x00000000, 0x00 };
 SDMMC_TypeDef *sdmmc = SDMMC1;
+// Identity of the last initialized card, kept across resets.
+SD_RETAINED SDCardCache card_cache;
+// Buffer for SD 6.0 extension register pages, which are 512 bytes.
+static uint32_t ext_page[ 128 ];
+// Streaming read ring, the next block which it will deliver, and
+// the buffer which `block_read` is currently copying blocks out of.
+static uint32_t stream_bufs[ SD_STREAM_DEPTH * SD_STREAM_BLOCKS * 128 ];
+static sdmmc_stream stream = {
+  stream_bufs, SD_STREAM_DEPTH, SD_STREAM_BLOCKS, 0, 0, 0, 0, 0, 0
+};
+static blockno_t stream_block = 0;
+static uint32_t *stream_buf = NULL;
+static uint32_t stream_buf_blocks = 0;
+static uint32_t stream_buf_pos = 0;
+// Error recovery and latency statistics.
+static SDStats stats;
+// Performance profile, from `block_probe`.
+static block_profile profile;
+// Time spent in each power state, and where the accounting is up
+// to: the `timer_micros` value and the engine's sleep counter then.
+// `energy_depth` counts nested driver calls, so that time is only
+// 'idle' outside of all of them.
+static SDEnergy energy;
+static uint32_t energy_mark = 0;
+static uint32_t energy_slept = 0;
+static int energy_depth = 0;
+// `tick` when the last driver call finished, and how long the card
+// may stay idle before `block_sd_idle` powers it down.
+static uint32_t idle_since = 0;
+static uint32_t power_down_ms = SD_POWER_DOWN_MS;
+// Recording session: whether one is running, and the next block
+// which `block_record_write` writes. While the card is receiving
+// (`SDMMC_STATE_RCV`), its open multi-block write ends at that block.
+static int rec_active = 0;
+static blockno_t rec_block = 0;
+
+static int block_begin( void );
+static int block_end( int err );
+static int block_probe_status( void );
+
+// 'Standard function code' of the performance enhancement extension,
+// and byte offsets in its register.
+#define SD_EXT_SFC_PERF       ( 2 )
+#define SD_PERF_CACHE_SUPPORT ( 4 )
+#define SD_PERF_CACHE_ENABLE  ( 260 )
+#define SD_PERF_CACHE_FLUSH   ( 261 )
+// Bytes in an extension's descriptor in the 'general information'
+// page, up to the end of its first register's address.
+#define SD_EXT_DESC_LEN       ( 48 )
+// Fields of an extension register address.
+#define SD_EXT_FNO( ext )     ( ( ( ext ) >> 18 ) & 0xF )
+#define SD_EXT_PAGE( ext )    ( ( ( ext ) >> 9 ) & 0xFF )
+#define SD_EXT_OFFSET( ext )  ( ( ext ) & 0x1FF )
+// Byte offsets in the SD Status register.
+#define SD_STATUS_SPEED_CLASS ( 8 )
+#define SD_STATUS_AU_SIZE     ( 10 )
+#define SD_STATUS_UHS         ( 14 )
+#define SD_STATUS_VIDEO_CLASS ( 15 )
+
+/** Checksum for the retained card cache. */
+static uint32_t card_cache_check( void ) {
+  const uint32_t *w = ( const uint32_t* )&card_cache;
+  uint32_t check = 0x811C9DC5;
+  for ( unsigned i = 0; i < offsetof( SDCardCache, check ) / 4; ++i ) {
+    check = ( check ^ w[ i ] ) * 0x01000193;
+  }
+  return check;
+}
 
 /**
- * Perform one-time peripheral initialization for the block buffer.
+ * Bring the power state accounting up to date: the time since the
+ * last update goes to 'active' and 'sleep' inside a driver call, or
+ * to 'idle' or 'off' outside of one.
  */
-int block_init() {
-  // Currently, the `port` files initialize the interface and I/O
-  // pins, so this method just sets up the SD card.
+static void block_energy_update( void ) {
+  uint32_t now = timer_micros();
+  uint32_t us = now - energy_mark;
+  uint32_t slept = sdmmc_xfer.sleep_us - energy_slept;
+  energy_mark = now;
+  energy_slept = sdmmc_xfer.sleep_us;
+  if ( energy_depth ) {
+    if ( slept > us ) { slept = us; }
+    energy.sleep_us += slept;
+    energy.active_us += us - slept;
+  }
+  else if ( card.off ) { energy.off_us += us; }
+  else { energy.idle_us += us; }
+}
+
+/**
+ * Switch the card to a 4-bit bus and, if it supports it, 'high-speed'
+ * timing, then raise the clock to match. Returns 1 if the card is in
+ * high-speed mode, 0 if it is at default speed, -1 on an error.
+ */
+static int block_init_bus( void ) {
+  if ( sdmmc_set_bus_width( sdmmc, card.addr, SDMMC_BUS_WIDTH_4b ) ) {
+    return -1;
+  }
+  // The card is identified, so it can run at 'default speed' now.
+  sdmmc_set_clock( sdmmc, SDMMC_CLK_DEFAULT );
+  // Older cards do not support CMD6; they just stay at default speed.
+  if ( sdmmc_set_high_speed( sdmmc ) == 1 ) {
+    sdmmc_set_clock( sdmmc, SDMMC_CLK_HIGH );
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Find the card's performance enhancement extension, and turn on
+ * its write cache if it has one. Only SD 6.0 cards can have a cache,
+ * and they say that they support the extension register commands
+ * (CMD48 / CMD49) in their SCR. Everything else about the extension
+ * is described by the 'general information' page of function 0:
+ * a header, then a linked list of extensions, each with a 'standard
+ * function code' and the address of its register.
+ * Returns the register's address if the cache is now on, else 0.
+ */
+static uint32_t block_init_cache( void ) {
+  const uint8_t *b = ( const uint8_t* )ext_page;
+  if ( !( card_cache.cmds & SDMMC_SCR_CMD48_49 ) ||
+       sdmmc_read_ext_reg( sdmmc, 0, 0, 0, ext_page ) ) {
+    return 0;
+  }
+  // Header: revision (bytes 0-1), length (bytes 2-3), and the
+  // number of extensions (byte 4). The first extension starts at
+  // byte 16.
+  uint32_t len = b[ 2 ] | ( b[ 3 ] << 8 );
+  uint32_t num_ext = b[ 4 ];
+  if ( b[ 0 ] != 0 || b[ 1 ] != 0 || len > 512 ) { return 0; }
+  uint32_t perf_ext = 0;
+  uint32_t pos = 16;
+  for ( uint32_t i = 0; i < num_ext && pos + SD_EXT_DESC_LEN <= len; ++i ) {
+    // Function code (bytes 0-1), the function's name (bytes 2-39),
+    // address of the next extension (bytes 40-41), number of
+    // registers (byte 42), then the first register's address
+    // (bytes 44-47). Little-endian.
+    uint32_t sfc  = b[ pos ] | ( b[ pos + 1 ] << 8 );
+    uint32_t next = b[ pos + 40 ] | ( b[ pos + 41 ] << 8 );
+    if ( sfc == SD_EXT_SFC_PERF && b[ pos + 42 ] == 1 ) {
+      perf_ext = b[ pos + 44 ] | ( b[ pos + 45 ] << 8 ) |
+                 ( b[ pos + 46 ] << 16 ) | ( ( uint32_t )b[ pos + 47 ] << 24 );
+      break;
+    }
+    if ( next <= pos ) { break; }
+    pos = next;
+  }
+  // The cache bytes have to fit in the register's page.
+  uint32_t offset = SD_EXT_OFFSET( perf_ext );
+  if ( !perf_ext || offset + SD_PERF_CACHE_FLUSH >= 512 ) { return 0; }
+  if ( sdmmc_read_ext_reg( sdmmc, SD_EXT_FNO( perf_ext ),
+                           SD_EXT_PAGE( perf_ext ), offset,
+                           ext_page ) ||
+       !( b[ SD_PERF_CACHE_SUPPORT ] & 0x01 ) ||
+       sdmmc_write_ext_reg( sdmmc, SD_EXT_FNO( perf_ext ),
+                            SD_EXT_PAGE( perf_ext ),
+                            offset + SD_PERF_CACHE_ENABLE, 0x01 ) ) {
+    return 0;
+  }
+  return perf_ext;
+}
+
+/**
+ * Warm boot: if the retained cache describes a card which is still
+ * powered and addressed, re-use it instead of identifying it again.
+ * The card keeps its address, bus width and speed until it is reset
+ * or powered off, so this goes straight to the fast bus settings.
+ * Returns 0 if the cached card is still there, -1 otherwise.
+ */
+static int block_init_warm( void ) {
+  if ( card_cache.magic != SD_CACHE_MAGIC ||
+       card_cache.check != card_cache_check() ) {
+    return -1;
+  }
   uint32_t cmd_resp[ 4 ] = { 0, 0, 0, 0 };
+  sdmmc_set_clock( sdmmc, card_cache.high_speed ?
+                          SDMMC_CLK_HIGH : SDMMC_CLK_DEFAULT );
+  // CMD13: does a card still answer at the cached address?
+  // A card which was power-cycled has no address yet, so it stays
+  // silent and the command times out quickly.
+  sdmmc_cmd_write( sdmmc,
+                   SDMMC_CMD_GET_STAT,
+                   ( ( uint32_t )card_cache.addr ) << 16,
+                   SDMMC_RESPONSE_SHORT );
+  int err = sdmmc_cmd_read( sdmmc, SDMMC_RESPONSE_SHORT,
+                            SDMMC_CHECK_CRC, cmd_resp );
+  sdmmc_cmd_done( sdmmc );
+  if ( err ) { return -1; }
+  uint32_t state = ( cmd_resp[ 0 ] >> 9 ) & 0xF;
+  if ( state == SDMMC_STATE_TRAN ) {
+    // Still selected from before the reset. CMD10 is only accepted
+    // in 'standby', so deselect it. (There is no response.)
+    sdmmc_cmd_write( sdmmc, SDMMC_CMD_SEL_DESEL,
+                     0x00000000, SDMMC_RESPONSE_NONE );
+    sdmmc_cmd_done( sdmmc );
+  }
+  else if ( state != SDMMC_STATE_STBY ) { return -1; }
+  // CMD10: make sure that it is the same card, not a different one
+  // which happened to pick the same address.
+  sdmmc_cmd_write( sdmmc,
+                   SDMMC_CMD_GET_CID,
+                   ( ( uint32_t )card_cache.addr ) << 16,
+                   SDMMC_RESPONSE_LONG );
+  err = sdmmc_cmd_read( sdmmc, SDMMC_RESPONSE_LONG,
+                        SDMMC_CHECK_CRC, cmd_resp );
+  sdmmc_cmd_done( sdmmc );
+  if ( err ) { return -1; }
+  for ( int i = 0; i < 4; ++i ) {
+    if ( cmd_resp[ i ] != card_cache.cid[ i ] ) { return -1; }
+  }
+  card.type = card_cache.type;
+  card.addr = card_cache.addr;
+  card.blocks = sdmmc_get_volume_size( sdmmc,
+                                       ( card.type == SD_CARD_HC ) ?
+                                         SDMMC_HC : SDMMC_SC,
+                                       card_cache.csd );
+  if ( sdmmc_select_card( sdmmc, card.addr ) ) { return -1; }
+  // The card is still using a 4-bit bus; match it. Its write cache
+  // also stays on, if it was turned on.
+  sdmmc_set_bus_width( sdmmc, card.addr, SDMMC_BUS_WIDTH_4b );
+  card.cache = ( card_cache.perf_ext != 0 );
+  return 0;
+}
+
+/**
+ * Cold boot: reset the card and run the full identification process.
+ * Returns 0 on success, -1 on an error.
+ */
+static int block_init_cold( void ) {
+  uint32_t cmd_resp[ 4 ] = { 0, 0, 0, 0 };
+  // Identification has to run at <=400KHz, on a 1-bit bus.
+  sdmmc_set_clock( sdmmc, SDMMC_CLK_INIT );
+  sdmmc->CLKCR &= ~( SDMMC_CLKCR_WIDBUS );
 
   // Send CMD0 - no response data is expected, but if the card
   // doesn't respond at all, that's a problem.
@@ -67,8 +296,17 @@ int block_init() {
   // Keep calling ACMD41 until the 'done powering up' bit is set.
   // If I read the OCR register right, that bit prevents the
   // 'standard / high capacity' flag from being set when low.
+  // Cards can take up to a second to power up; poll once per
+  // `SD_ACMD41_POLL_MS` and sleep in between, rather than keeping
+  // the bus busy, and give up if the card never finishes.
+  uint32_t start = tick;
   cmd_resp[ 0 ] = 0x00000000;
   while ( !( cmd_resp[ 0 ] & 0x80000000 ) ) {
+    if ( ( tick - start ) > SD_INIT_TIMEOUT_MS ) {
+      card.type = SD_CARD_ERROR;
+      card.error = SD_ERR_NOT_PRESENT;
+      return -1;
+    }
     // Send CMD55 to indicate that an app command will follow.
     sdmmc_cmd_write( sdmmc,
                      SDMMC_CMD_APP,
@@ -83,6 +321,9 @@ int block_init() {
     sdmmc_cmd_read( sdmmc, SDMMC_RESPONSE_SHORT,
                     SDMMC_NO_CRC, cmd_resp );
     sdmmc_cmd_done( sdmmc );
+    if ( !( cmd_resp[ 0 ] & 0x80000000 ) ) {
+      sdmmc_sleep_ms( SD_ACMD41_POLL_MS );
+    }
   }
   // Once the above loop exits, the first response element holds
   // the card's OCR register and it is done powering up. (I hope.)
@@ -104,86 +345,614 @@ int block_init() {
                    SDMMC_CMD_PUB_CID,
                    0x00000000,
                    SDMMC_RESPONSE_LONG );
-  sdmmc_cmd_read( sdmmc, SDMMC_RESPONSE_LONG,
-                  SDMMC_CHECK_CRC, cmd_resp );
+  if ( sdmmc_cmd_read( sdmmc, SDMMC_RESPONSE_LONG,
+                       SDMMC_CHECK_CRC, card_cache.cid ) ) {
+    sdmmc_cmd_done( sdmmc );
+    return -1;
+  }
   sdmmc_cmd_done( sdmmc );
 
   // CMD3 to get an address that the card will respond to.
-  // TODO: Error-checking?
   sdmmc_cmd_write( sdmmc,
                    SDMMC_CMD_PUB_RCA,
                    0x00000000,
                    SDMMC_RESPONSE_SHORT );
-  sdmmc_cmd_read( sdmmc, SDMMC_RESPONSE_SHORT,
-                  SDMMC_CHECK_CRC, cmd_resp );
+  if ( sdmmc_cmd_read( sdmmc, SDMMC_RESPONSE_SHORT,
+                       SDMMC_CHECK_CRC, cmd_resp ) ) {
+    sdmmc_cmd_done( sdmmc );
+    return -1;
+  }
   sdmmc_cmd_done( sdmmc );
   // Bits 0-15 are status bits, and bits 16-31 are the new address.
   card.addr = cmd_resp[ 0 ] >> 16;
 
   // CMD9 to get the 'card-specific data' registers.
+  // Cards only accept CMD9 in the 'standby' state, so make sure
+  // that the card is not selected. (It isn't yet, during init.)
+  sdmmc_deselect_card( sdmmc );
   sdmmc_cmd_write( sdmmc,
                    SDMMC_CMD_GET_CSD,
                    ( ( uint32_t )card.addr ) << 16,
                    SDMMC_RESPONSE_LONG );
   sdmmc_cmd_read( sdmmc, SDMMC_RESPONSE_LONG,
-                  SDMMC_CHECK_CRC, cmd_resp );
+                  SDMMC_CHECK_CRC, card_cache.csd );
   sdmmc_cmd_done( sdmmc );
 
+  // Select the card. It stays in the 'transfer' state from now on,
+  // so reads and writes do not need to select it each time.
+  if ( sdmmc_select_card( sdmmc, card.addr ) ) {
+    card.type = SD_CARD_ERROR;
+    return -1;
+  }
+
   // Find the card's storage capacity from its CSD registers.
   if ( card.type == SD_CARD_HC ) {
     // High-capacity card: get the card's capacity in 512B blocks.
-    card.blocks = sdmmc_get_volume_size( sdmmc, SDMMC_HC, cmd_resp );
+    card.blocks = sdmmc_get_volume_size( sdmmc, SDMMC_HC,
+                                         card_cache.csd );
   }
   else {
     // Standard-capacity card.
-    card.blocks = sdmmc_get_volume_size( sdmmc, SDMMC_SC, cmd_resp );
+    card.blocks = sdmmc_get_volume_size( sdmmc, SDMMC_SC,
+                                         card_cache.csd );
     // Set block size to 512 bytes. High-capacity cards
     // do not need this command, since their block size is fixed.
     sdmmc_set_block_len( sdmmc, 512 );
   }
 
-  // Set the bus width to 4 bits.
-  //sdmmc_set_bus_width( sdmmc, card.addr, SDMMC_BUS_WIDTH_4b );
+  // Go straight to a 4-bit bus and the fastest supported clock.
+  int high_speed = block_init_bus();
+  if ( high_speed < 0 ) { return -1; }
+  // The SCR says which optional commands the card supports.
+  card_cache.cmds = 0;
+  if ( sdmmc_read_scr( sdmmc, card.addr, ext_page ) == 0 ) {
+    card_cache.cmds = ( ( const uint8_t* )ext_page )[ 3 ];
+  }
+  // Turn on the card's write cache, if it has one.
+  card_cache.perf_ext = SD_WRITE_CACHE ? block_init_cache() : 0;
+  card.cache = ( card_cache.perf_ext != 0 );
 
-  // Done; return 0 to indicate success.
+  // Remember the card, so that a warm reset can skip all of this.
+  card_cache.type = card.type;
+  card_cache.addr = card.addr;
+  card_cache.high_speed = ( uint32_t )high_speed;
+  card_cache.magic = SD_CACHE_MAGIC;
+  card_cache.check = card_cache_check();
   return 0;
 }
 
 /**
- * Shut down the SD card interface.
- * TODO: Error checking.
+ * Perform one-time peripheral initialization for the block buffer.
+ * After a warm reset, this re-uses the card which was initialized
+ * before the reset if it is still there; otherwise it runs the full
+ * identification process. `card.init_us` reports how long it took.
+ */
+int block_init() {
+  // Currently, the `port` files initialize the interface and I/O
+  // pins, so this method just sets up the SD card.
+  uint32_t start = timer_micros();
+  card.error = 0;
+  card.cache = 0;
+  card.off = 0;
+  rec_active = 0;
+  block_begin();
+  // `sdmmc_setup` forgot about any stream which was running.
+  stream.active = 0;
+  stream_buf = NULL;
+  card.warm = ( block_init_warm() == 0 );
+  int err = 0;
+  if ( !card.warm ) {
+    // This may be another card, which has not been probed yet.
+    memset( &profile, 0, sizeof( profile ) );
+    card_cache.magic = 0x00000000;
+    err = block_init_cold();
+  }
+  card.init_us = timer_micros() - start;
+  return block_end( err );
+}
+
+/**
+ * Shut down the SD card interface. The card's write cache is lost
+ * when it is reset, so it is written back first; if that fails, the
+ * card is left as it is, so that nothing in the cache is thrown
+ * away. Returns 0 on success, -1 if the cache could not be flushed.
  */
 int block_halt() {
+  if ( card.off ) { return 0; }
+  block_begin();
+  block_stream_stop();
+  if ( block_flush_cache() ) { return block_end( -1 ); }
+  card.cache = 0;
+  // Return the card to the 'standby' state.
+  sdmmc_deselect_card( sdmmc );
   // Send CMD15 to put the card into an inactive state.
   sdmmc_cmd_write( sdmmc,
                    SDMMC_CMD_GO_IDLE,
                    ( ( uint32_t )card.addr ) << 16,
                    SDMMC_RESPONSE_NONE );
   sdmmc_cmd_done( sdmmc );
+  // The card has lost its address, so the next boot must be cold.
+  card_cache.magic = 0x00000000;
   // Done; return 0 to indicate success.
+  return block_end( 0 );
+}
+
+/**
+ * Start reading a run of blocks in the background, so that
+ * `block_read` calls for them in order do not wait for the card.
+ * Nothing happens if the run is already being streamed, or if it is
+ * too short to be worth it. Returns 0 on success, -1 on an error.
+ */
+int block_stream_start( blockno_t block, blockno_t count ) {
+  if ( stream.active && block == stream_block ) { return 0; }
+  if ( block_begin() || block_stream_stop() ) { return block_end( -1 ); }
+  if ( count < 2 || block >= card.blocks ) { return block_end( 0 ); }
+  if ( count > card.blocks - block ) { count = card.blocks - block; }
+  if ( sdmmc_stream_start( sdmmc,
+                           ( card.type == SD_CARD_HC ) ?
+                             SDMMC_HC : SDMMC_SC,
+                           card.addr, &stream, block, count ) ) {
+    return block_end( -1 );
+  }
+  stream_block = block;
+  stream_buf = NULL;
+  return block_end( 0 );
+}
+
+/**
+ * Stop a streaming read, if one is running. If the card does not
+ * stop cleanly, it may still be sending, so bring it back to the
+ * 'transfer' state. Returns 0 on success, -1 if that failed too.
+ */
+int block_stream_stop() {
+  stream_buf = NULL;
+  if ( sdmmc_stream_stop( sdmmc, &stream ) == 0 ) { return 0; }
+  ++stats.recoveries;
+  return sdmmc_recover( sdmmc, card.addr );
+}
+
+/** Copy the next block of a streaming read into a buffer. */
+static int block_stream_read( void *buf ) {
+  if ( !stream_buf || stream_buf_pos == stream_buf_blocks ) {
+    if ( stream_buf ) { sdmmc_stream_release( sdmmc, &stream ); }
+    stream_buf = sdmmc_stream_next( sdmmc, &stream, &stream_buf_blocks );
+    stream_buf_pos = 0;
+    if ( !stream_buf ) { return -1; }
+  }
+  memcpy( buf, &stream_buf[ stream_buf_pos * 128 ], 512 );
+  ++stream_buf_pos;
+  ++stream_block;
   return 0;
 }
 
-/** Read a block from the current SD card into a given buffer. */
-int block_read( blockno_t block, void *buf ) {
-  sdmmc_read_block( sdmmc,
-                    ( card.type == SD_CARD_HC ) ? SDMMC_HC : SDMMC_SC,
-                    card.addr,
-                    block,
-                    ( uint32_t* )buf );
+/**
+ * Last resort after repeated failures: reset the card and run the
+ * full identification process again. Anything in the card's write
+ * cache is lost, so if it was on, `SD_ERR_CACHE_LOST` is latched
+ * for the next `block_flush_cache` to report. Fails if a different
+ * card answers afterwards. Returns 0 on success, -1 on an error.
+ */
+static int block_reinit( void ) {
+  uint32_t cid[ 4 ];
+  if ( card.cache ) { card.error = SD_ERR_CACHE_LOST; }
+  memcpy( cid, card_cache.cid, sizeof( cid ) );
+  card_cache.magic = 0x00000000;
+  stream.active = 0;
+  stream_buf = NULL;
+  if ( block_init_cold() ) { return -1; }
+  if ( memcmp( cid, card_cache.cid, sizeof( cid ) ) ) {
+    card_cache.magic = 0x00000000;
+    card.error = SD_ERR_NOT_PRESENT;
+    return -1;
+  }
   return 0;
 }
 
+/**
+ * Power the card back up after `block_sd_idle` powered it down, and
+ * identify it again. Fails if a different card answers.
+ * Returns 0 on success, -1 on an error.
+ */
+static int block_power_up( void ) {
+  SD_POWER( 1 );
+  if ( SD_POWER_UP_MS ) { sdmmc_sleep_ms( SD_POWER_UP_MS ); }
+  // `sdmmc_setup` goes back to polled waits; keep the old mode.
+  int wait_mode = sdmmc_xfer.wait_mode;
+  sdmmc_setup( sdmmc );
+  sdmmc_irq_setup( sdmmc, wait_mode );
+  card.off = 0;
+  ++energy.power_ups;
+  return block_reinit();
+}
+
+/**
+ * Start a driver call which uses the card: the time until the
+ * matching `block_end` counts as 'active', and a powered-down card
+ * is powered up. Returns 0 if the card is ready, -1 if it is not;
+ * `block_end` must be called either way.
+ */
+static int block_begin( void ) {
+  block_energy_update();
+  ++energy_depth;
+  if ( card.off && block_power_up() ) { return -1; }
+  return 0;
+}
+
+/** Finish a driver call started by `block_begin`, and return `err`. */
+static int block_end( int err ) {
+  block_energy_update();
+  --energy_depth;
+  idle_since = tick;
+  return err;
+}
+
+/** One attempt at reading or writing a single block. */
+static int block_xfer( int write, blockno_t block, void *buf ) {
+  uint32_t type = ( card.type == SD_CARD_HC ) ? SDMMC_HC : SDMMC_SC;
+  if ( write ) {
+    return sdmmc_write_block( sdmmc, type, card.addr, block,
+                              ( uint32_t* )buf );
+  }
+  return sdmmc_read_block( sdmmc, type, card.addr, block,
+                           ( uint32_t* )buf );
+}
+
+/**
+ * Read or write a single block, and re-issue the command if it
+ * fails. A CRC error or timeout usually leaves the card in the
+ * middle of a transfer, so it is stopped and brought back to the
+ * 'transfer' state first. Retries after the first one back off a
+ * little longer each time, and the last one re-initializes the card.
+ * Returns 0 on success, -1 if every attempt failed.
+ */
+static int block_xfer_retry( int write, blockno_t block, void *buf ) {
+  // Retrying a block which is not on the card will not help.
+  if ( block >= card.blocks ) { return -1; }
+  int err = block_xfer( write, block, buf );
+  for ( int retry = 1; err && retry <= SD_RETRIES; ++retry ) {
+    ++stats.retries;
+    if ( retry > 1 ) {
+      sdmmc_sleep_ms( ( uint32_t )SD_RETRY_BACKOFF_MS << ( retry - 2 ) );
+    }
+    if ( retry < SD_RETRIES && sdmmc_recover( sdmmc, card.addr ) == 0 ) {
+      ++stats.recoveries;
+    }
+    else {
+      ++stats.reinits;
+      if ( block_reinit() ) { break; }
+    }
+    err = block_xfer( write, block, buf );
+  }
+  if ( err ) {
+    ++stats.failures;
+    if ( !card.error ) { card.error = SD_ERR_IO; }
+  }
+  return err;
+}
+
+/** Count a finished read or write, and how long it took. */
+static void block_stat( int write, uint32_t start ) {
+  uint32_t us = timer_micros() - start;
+  int bucket = 0;
+  while ( bucket < SD_LATENCY_BUCKETS - 1 && ( us >> ( bucket + 1 ) ) ) {
+    ++bucket;
+  }
+  ++stats.latency[ bucket ];
+  if ( write ) {
+    ++stats.writes;
+    if ( us > stats.max_write_us ) { stats.max_write_us = us; }
+  }
+  else {
+    ++stats.reads;
+    if ( us > stats.max_read_us ) { stats.max_read_us = us; }
+  }
+}
+
+/**
+ * Read a block from the current SD card into a given buffer.
+ * The next block of a streaming read comes from its ring of
+ * buffers; any other block stops the stream first.
+ */
+int block_read( blockno_t block, void *buf ) {
+  uint32_t start = timer_micros();
+  if ( block_begin() ) { return block_end( -1 ); }
+  if ( stream.active && block == stream_block &&
+       block_stream_read( buf ) == 0 ) {
+    block_stat( 0, start );
+    return block_end( 0 );
+  }
+  // If the stream broke, this re-reads the block on its own.
+  if ( stream.active ) { block_stream_stop(); }
+  int err = block_xfer_retry( 0, block, buf );
+  block_stat( 0, start );
+  return block_end( err );
+}
+
 /** Write a block of data to the current SD card from a buffer. */
 int block_write( blockno_t block, void *buf ) {
-  sdmmc_write_block( sdmmc,
-                     ( card.type == SD_CARD_HC ) ? SDMMC_HC : SDMMC_SC,
-                     card.addr,
-                     block,
-                     ( uint32_t* )buf );
+  uint32_t start = timer_micros();
+  if ( block_begin() ) { return block_end( -1 ); }
+  block_stream_stop();
+  int err = block_xfer_retry( 1, block, buf );
+  block_stat( 1, start );
+  return block_end( err );
+}
+
+/**
+ * Send a run of blocks through a multi-block write: the open one, if
+ * the card is receiving, or a new one at `block`. `close` ends the
+ * write afterwards. If any of that fails, the card is brought back
+ * to the 'transfer' state and the run is written one block at a
+ * time instead, with the usual retries.
+ * Returns 0 on success, -1 on an error.
+ */
+static int block_write_run( blockno_t block, blockno_t count,
+                            void *buf, int close ) {
+  uint32_t type = ( card.type == SD_CARD_HC ) ? SDMMC_HC : SDMMC_SC;
+  if ( ( sdmmc_card_state() == SDMMC_STATE_RCV ||
+         sdmmc_write_start( sdmmc, type, card.addr, block ) == 0 ) &&
+       sdmmc_write_next( sdmmc, ( uint32_t* )buf, count ) == 0 &&
+       ( !close || sdmmc_write_stop( sdmmc ) == 0 ) ) {
+    return 0;
+  }
+  ++stats.retries;
+  if ( sdmmc_recover( sdmmc, card.addr ) == 0 ) { ++stats.recoveries; }
+  for ( blockno_t i = 0; i < count; ++i ) {
+    if ( block_xfer_retry( 1, block + i,
+                           ( uint8_t* )buf + i * BLOCK_SIZE ) ) {
+      return -1;
+    }
+  }
   return 0;
 }
 
+/**
+ * Write a run of blocks with one multi-block command, which lets the
+ * card program each block while the next one arrives.
+ */
+int block_write_blocks( blockno_t block, blockno_t count, void *buf ) {
+  uint32_t start = timer_micros();
+  if ( block_begin() ) { return block_end( -1 ); }
+  if ( block >= card.blocks || count > card.blocks - block ) {
+    return block_end( -1 );
+  }
+  if ( count == 0 ) { return block_end( 0 ); }
+  block_stream_stop();
+  // A recording's open write is somewhere else; finish it first.
+  if ( sdmmc_write_stop( sdmmc ) &&
+       sdmmc_recover( sdmmc, card.addr ) == 0 ) {
+    ++stats.recoveries;
+  }
+  int err = block_write_run( block, count, buf, 1 );
+  block_stat( 1, start );
+  return block_end( err );
+}
+
+/**
+ * Announce a recording with CMD20, if the card supports it. A card
+ * which refuses still takes the writes, just without its Speed Class
+ * promise, so that is only an error if the card stops answering.
+ */
+static int block_record_announce( void ) {
+  if ( !( card_cache.cmds & SDMMC_SCR_CMD20 ) ||
+       sdmmc_speed_class_control( sdmmc, card.addr,
+                                  SDMMC_SCC_START_REC ) == 0 ) {
+    return 0;
+  }
+  ++stats.recoveries;
+  return sdmmc_recover( sdmmc, card.addr );
+}
+
+/**
+ * Start a recording session at `block`, or move the running one
+ * there: finish the write to the old position, make sure that the
+ * AU size is known, and announce the recording to the card.
+ * Returns 0 on success, -1 on an error.
+ */
+int block_record_start( blockno_t block ) {
+  if ( block_begin() ) { return block_end( -1 ); }
+  if ( block >= card.blocks || card.read_only ) { return block_end( -1 ); }
+  block_stream_stop();
+  if ( sdmmc_write_stop( sdmmc ) && sdmmc_recover( sdmmc, card.addr ) ) {
+    return block_end( -1 );
+  }
+  // Without a probe, the AU size comes straight from the card. Old
+  // cards have no SD Status register; they get one long write.
+  if ( !profile.au_blocks && block_probe_status() &&
+       sdmmc_recover( sdmmc, card.addr ) ) {
+    return block_end( -1 );
+  }
+  rec_block = block;
+  rec_active = 1;
+  return block_end( block_record_announce() );
+}
+
+/**
+ * Write the next blocks of the recording session. They go into one
+ * open multi-block write, which is only closed at the end of each
+ * AU, so that the card sees whole AUs written in order even when
+ * they arrive a few blocks at a time. Anything else which uses the
+ * card closes the write, and the next call opens a new one.
+ * Returns 0 on success, -1 on an error.
+ */
+int block_record_write( void *buf, blockno_t count ) {
+  uint32_t start = timer_micros();
+  if ( !rec_active ) { return -1; }
+  if ( block_begin() ) { return block_end( -1 ); }
+  if ( count > card.blocks - rec_block ) { return block_end( -1 ); }
+  block_stream_stop();
+  uint32_t au = profile.au_blocks;
+  uint8_t *b = ( uint8_t* )buf;
+  int err = 0;
+  while ( !err && count ) {
+    blockno_t n = count;
+    if ( au && n > au - rec_block % au ) { n = au - rec_block % au; }
+    err = block_write_run( rec_block, n, b,
+                           au && ( rec_block + n ) % au == 0 );
+    if ( !err ) {
+      rec_block += n;
+      b += n * BLOCK_SIZE;
+      count -= n;
+    }
+  }
+  block_stat( 1, start );
+  return block_end( err );
+}
+
+/**
+ * End the recording session. The card programs the last block of
+ * its open write, if there is one, like a written-behind block.
+ * Returns 0 on success, -1 on an error.
+ */
+int block_record_stop() {
+  rec_active = 0;
+  if ( sdmmc_card_state() != SDMMC_STATE_RCV ) { return 0; }
+  if ( block_begin() ) { return block_end( -1 ); }
+  int err = 0;
+  if ( sdmmc_write_stop( sdmmc ) ) {
+    ++stats.recoveries;
+    err = sdmmc_recover( sdmmc, card.addr );
+  }
+  return block_end( err );
+}
+
+/**
+ * Write back the card's write cache, so that every block written
+ * so far survives a power loss. The card clears the 'flush' bit once
+ * it is done, which may take longer than the busy signal lasts, so
+ * poll it until then. An open multi-block write is finished first;
+ * otherwise, this does nothing if the cache is not on. It fails
+ * while a lost cache (`SD_ERR_CACHE_LOST`) is not acknowledged.
+ * Returns 0 on success, -1 on an error or timeout.
+ */
+int block_flush_cache() {
+  // Blocks which were in the cache when the card was reset are gone.
+  if ( card.error == SD_ERR_CACHE_LOST ) { return -1; }
+  if ( !card.cache && sdmmc_card_state() != SDMMC_STATE_RCV ) {
+    return 0;
+  }
+  if ( block_begin() || block_stream_stop() ||
+       sdmmc_card_wait_ready( sdmmc ) ) {
+    return block_end( -1 );
+  }
+  if ( !card.cache ) { return block_end( 0 ); }
+  uint32_t fno = SD_EXT_FNO( card_cache.perf_ext );
+  uint32_t page = SD_EXT_PAGE( card_cache.perf_ext );
+  uint32_t offset = SD_EXT_OFFSET( card_cache.perf_ext );
+  if ( sdmmc_write_ext_reg( sdmmc, fno, page,
+                            offset + SD_PERF_CACHE_FLUSH, 0x01 ) ) {
+    return block_end( -1 );
+  }
+  uint32_t start = tick;
+  while ( ( tick - start ) <= SD_FLUSH_TIMEOUT_MS ) {
+    if ( sdmmc_read_ext_reg( sdmmc, fno, page, offset, ext_page ) ) {
+      return block_end( -1 );
+    }
+    if ( !( ( ( uint8_t* )ext_page )[ SD_PERF_CACHE_FLUSH ] & 0x01 ) ) {
+      return block_end( 0 );
+    }
+    sdmmc_sleep_ms( 1 );
+  }
+  return block_end( -1 );
+}
+
+/**
+ * Fill in the profile from the card's SD Status register: its speed
+ * class, UHS speed grade, video speed class, and allocation unit
+ * size. UHS cards can have AUs which are too large for the older
+ * field, so they report them in a second one.
+ * Returns 0 on success, -1 on an error.
+ */
+static int block_probe_status( void ) {
+  // Speed class codes, in MB/s, and AU size codes, in KB.
+  static const uint8_t speed_class[ 5 ] = { 0, 2, 4, 6, 10 };
+  static const uint32_t au_kb[ 16 ] = {
+    0, 16, 32, 64, 128, 256, 512, 1024,
+    2048, 4096, 8192, 12288, 16384, 24576, 32768, 65536
+  };
+  const uint8_t *b = ( const uint8_t* )ext_page;
+  if ( sdmmc_read_sd_status( sdmmc, card.addr, ext_page ) ) { return -1; }
+  if ( b[ SD_STATUS_SPEED_CLASS ] < 5 ) {
+    profile.speed_class = speed_class[ b[ SD_STATUS_SPEED_CLASS ] ];
+  }
+  profile.uhs_grade = b[ SD_STATUS_UHS ] >> 4;
+  profile.video_class = b[ SD_STATUS_VIDEO_CLASS ];
+  uint32_t au = b[ SD_STATUS_UHS ] & 0xF;
+  if ( !au ) { au = b[ SD_STATUS_AU_SIZE ] >> 4; }
+  profile.au_blocks = au_kb[ au ] * 2;
+  return 0;
+}
+
+/**
+ * Measure the card: read what it says about itself from its SD
+ * Status register, then time a few random reads, and a sequential
+ * write of up to `SD_PROBE_BLOCKS` blocks of the scratch area. The
+ * write includes the time the card takes to finish programming, and
+ * to write back its cache if it has one, so it is what a flushed
+ * commit costs. Older cards and MMC cards may not have an SD Status
+ * register; their class and AU size stay 'unknown'.
+ * Returns 0 on success, -1 on an error.
+ */
+int block_probe( blockno_t scratch, blockno_t count ) {
+  memset( &profile, 0, sizeof( profile ) );
+  if ( !card.blocks ) { return -1; }
+  if ( block_begin() || block_stream_stop() ) { return block_end( -1 ); }
+  if ( block_probe_status() && sdmmc_recover( sdmmc, card.addr ) ) {
+    return block_end( -1 );
+  }
+
+  // Random reads, spread over the whole card by a simple LCG so
+  // that they do not all land in one erase block.
+  uint32_t seed = card.blocks;
+  uint32_t total = 0;
+  for ( int i = 0; i < SD_PROBE_READS; ++i ) {
+    seed = seed * 1664525 + 1013904223;
+    uint32_t start = timer_micros();
+    if ( block_xfer_retry( 0, seed % card.blocks, stream_bufs ) ) {
+      return block_end( -1 );
+    }
+    uint32_t us = timer_micros() - start;
+    total += us;
+    if ( us > profile.read_max_us ) { profile.read_max_us = us; }
+  }
+  profile.read_us = total / SD_PROBE_READS;
+
+  // Sequential write: read the scratch blocks, then write them back.
+  if ( count > SD_PROBE_BLOCKS ) { count = SD_PROBE_BLOCKS; }
+  if ( count > SD_STREAM_DEPTH * SD_STREAM_BLOCKS ) {
+    count = SD_STREAM_DEPTH * SD_STREAM_BLOCKS;
+  }
+  if ( card.read_only || scratch >= card.blocks ||
+       count > card.blocks - scratch ) {
+    count = 0;
+  }
+  for ( blockno_t i = 0; i < count; ++i ) {
+    if ( block_xfer_retry( 0, scratch + i, &stream_bufs[ i * 128 ] ) ) {
+      return block_end( -1 );
+    }
+  }
+  uint32_t start = timer_micros();
+  for ( blockno_t i = 0; i < count; ++i ) {
+    uint32_t block_start = timer_micros();
+    if ( block_xfer_retry( 1, scratch + i, &stream_bufs[ i * 128 ] ) ) {
+      return block_end( -1 );
+    }
+    uint32_t us = timer_micros() - block_start;
+    if ( us > profile.write_max_us ) { profile.write_max_us = us; }
+  }
+  if ( count ) {
+    if ( sdmmc_card_wait_ready( sdmmc ) || block_flush_cache() ) {
+      return block_end( -1 );
+    }
+    profile.write_us = ( timer_micros() - start ) / count;
+  }
+  profile.probed = 1;
+  return block_end( 0 );
+}
+
+/** Get the card's performance profile. */
+const block_profile *block_get_profile() { return &profile; }
+
 /**
  * Get the storage capacity of the currently-connected SD card. This
  * returns the number of 512-byte blocks, not the number of bytes.
@@ -203,3 +972,50 @@ int block_get_device_read_only() { return card.read_only; }
 
 /** Get the current error status of the connected SD card. */
 int block_get_error() { return card.error; }
+
+/** Acknowledge an error, such as a lost write cache. */
+void block_sd_clear_error( void ) { card.error = 0; }
+
+/** Get the SD card's error recovery and latency statistics. */
+const SDStats *block_sd_get_stats( void ) { return &stats; }
+
+/** Clear the SD card's error recovery and latency statistics. */
+void block_sd_reset_stats( void ) { memset( &stats, 0, sizeof( stats ) ); }
+
+/** Get the time spent in each power state, up to now. */
+const SDEnergy *block_sd_get_energy( void ) {
+  block_energy_update();
+  return &energy;
+}
+
+/** Start counting the time spent in each power state from zero. */
+void block_sd_reset_energy( void ) {
+  block_energy_update();
+  memset( &energy, 0, sizeof( energy ) );
+}
+
+/**
+ * Power the card down once it has been idle for `power_down_ms`:
+ * write back its cache, reset it to the 'idle' state, and turn off
+ * the peripheral and (if the board can) the card's supply. A card in
+ * the 'idle' state draws much less than one which is selected, even
+ * if it stays powered. The next driver call powers it back up.
+ * Returns 1 if the card is powered down, 0 if not.
+ */
+int block_sd_idle( void ) {
+  if ( card.off ) { return 1; }
+  if ( !power_down_ms || !card.blocks || energy_depth ||
+       ( tick - idle_since ) < power_down_ms ) {
+    return 0;
+  }
+  // A card whose cache could not be written back stays powered.
+  if ( block_halt() ) { return 0; }
+  sdmmc_power_off( sdmmc );
+  SD_POWER( 0 );
+  block_energy_update();
+  card.off = 1;
+  return 1;
+}
+
+/** Set how long the card may stay idle before it is powered down. */
+void block_sd_set_power_down( uint32_t idle_ms ) { power_down_ms = idle_ms; }
@@ -47,11 +47,108 @@
 /* Error status codes returned in the SD info struct */
 #define SD_ERR_NO_PART      1
 #define SD_ERR_NOT_PRESENT  2
+#define SD_ERR_IO           3    /* A transfer failed after every retry */
+#define SD_ERR_CACHE_LOST   4    /* The card was reset with its write cache on; see below */
+
+/* Card initialization limits */
+#define SD_INIT_TIMEOUT_MS   1000 /* Max time for ACMD41 power-up (per spec) */
+#define SD_ACMD41_POLL_MS    1    /* Min time between ACMD41 polls */
+
+/*
+ * SD 6.0 cards can have a volatile write cache, which makes writes
+ * much faster but loses them on power loss until it is flushed.
+ * `block_init` turns it on if the card has one, and
+ * `block_flush_cache` writes it back. Define `SD_WRITE_CACHE` as 0
+ * to leave it off.
+ */
+#ifndef SD_WRITE_CACHE
+#define SD_WRITE_CACHE       1
+#endif
+#define SD_FLUSH_TIMEOUT_MS  1000 /* Max time for a cache flush (per spec) */
+
+/*
+ * Streaming reads: `block_stream_start` reads a run of blocks with
+ * one multi-block command, into a ring of `SD_STREAM_DEPTH` buffers
+ * of `SD_STREAM_BLOCKS` blocks each. `block_read` serves the run's
+ * blocks from the ring while the next buffer is still arriving.
+ */
+#ifndef SD_STREAM_DEPTH
+#define SD_STREAM_DEPTH      2
+#endif
+#ifndef SD_STREAM_BLOCKS
+#define SD_STREAM_BLOCKS     8
+#endif
+
+/*
+ * Error recovery: a failed read or write is re-issued up to
+ * `SD_RETRIES` times. Before each retry the card is brought back to
+ * the 'transfer' state; from the second retry on, the driver also
+ * backs off for `SD_RETRY_BACKOFF_MS`, doubling each time. The last
+ * retry follows a full re-initialization of the card, which is also
+ * used whenever the card stops answering.
+ */
+#ifndef SD_RETRIES
+#define SD_RETRIES           3
+#endif
+#ifndef SD_RETRY_BACKOFF_MS
+#define SD_RETRY_BACKOFF_MS  1
+#endif
+
+/*
+ * Card profiling: `block_probe` times `SD_PROBE_READS` single-block
+ * reads spread over the card, then a sequential write of up to
+ * `SD_PROBE_BLOCKS` blocks of the scratch area. The write puts back
+ * what the blocks held, which is read into the streaming read ring
+ * first, so `SD_PROBE_BLOCKS` is also limited by the ring's size.
+ */
+#ifndef SD_PROBE_READS
+#define SD_PROBE_READS       8
+#endif
+#ifndef SD_PROBE_BLOCKS
+#define SD_PROBE_BLOCKS      8
+#endif
+
+/*
+ * Power saving: once the card has been idle for `SD_POWER_DOWN_MS`,
+ * `block_sd_idle` writes back its cache, resets it to the 'idle'
+ * state and turns off the SDMMC peripheral; the next access brings
+ * it back with a full identification. Boards which can switch the
+ * card's supply define `SD_POWER( on )` to do it, and
+ * `SD_POWER_UP_MS` for the supply to settle. 0 means never.
+ */
+#ifndef SD_POWER_DOWN_MS
+#define SD_POWER_DOWN_MS     0
+#endif
+#ifndef SD_POWER
+#define SD_POWER( on )
+#endif
+#ifndef SD_POWER_UP_MS
+#define SD_POWER_UP_MS       0
+#endif
+
+/* Latency histogram buckets: bucket N counts 2^N to 2^(N+1)-1 us. */
+#define SD_LATENCY_BUCKETS   16
+
+/*
+ * Memory which survives a reset, for the card identity cache. The
+ * application's linker script must place this section in RAM which
+ * the startup code does not clear, like SRAM2 (which is also kept
+ * in Standby mode if `PWR_CR3_RRS` is set). Define `SD_RETAINED`
+ * as empty to disable warm boots.
+ */
+#ifndef SD_RETAINED
+#define SD_RETAINED __attribute__( ( section( ".noinit" ) ) )
+#endif
+#define SD_CACHE_MAGIC 0x53444332 /* 'SDC2' */
 
 /*
  * SD card info struct
  * Note: the `blocks` value represents the card's capacity in
  * 512-byte blocks. To get the capacity in bytes, multiply by 512.
+ * `init_us` is how long the last `block_init` took, and `warm`
+ * is set if it re-used a card which was already identified.
+ * `cache` is set if the card's write cache is enabled, and `off`
+ * while the card is powered down by `block_sd_idle`.
  */
 typedef struct {
   uint32_t  blocks;
@@ -59,6 +156,90 @@ typedef struct {
   uint16_t  addr;
   uint8_t   error;
   uint8_t   read_only;
+  uint8_t   warm;
+  uint8_t   cache;
+  uint32_t  init_us;
+  uint8_t   off;
 } SDCard;
 
+/*
+ * Error recovery and latency statistics, since the last
+ * `block_sd_reset_stats`. Latencies include retries, so the
+ * histogram's tail shows what a marginal card costs.
+ */
+typedef struct {
+  uint32_t  reads;
+  uint32_t  writes;
+  /* Transfers which were re-issued, and how they were recovered. */
+  uint32_t  retries;
+  uint32_t  recoveries;
+  uint32_t  reinits;
+  /* Transfers which still failed after `SD_RETRIES` retries. */
+  uint32_t  failures;
+  uint32_t  max_read_us;
+  uint32_t  max_write_us;
+  uint32_t  latency[ SD_LATENCY_BUCKETS ];
+} SDStats;
+
+/*
+ * Where the time went since the last `block_sd_reset_energy`, in
+ * microseconds: in a driver call with the core awake (`active`) or
+ * asleep waiting on the card (`sleep`), and between calls with the
+ * card powered (`idle`) or powered down (`off`). Multiplying each by
+ * the board's current draw in that state gives the energy used, so
+ * resetting before a transaction and reading after its commit gives
+ * the energy per commit.
+ */
+typedef struct {
+  uint32_t  active_us;
+  uint32_t  sleep_us;
+  uint32_t  idle_us;
+  uint32_t  off_us;
+  uint32_t  power_ups;
+} SDEnergy;
+
+/*
+ * Identity of the last card which finished initialization, kept in
+ * retained memory. After a reset which did not power the card off,
+ * `block_init` checks that the same card still answers at the same
+ * address, and skips the slow identification process if it does.
+ */
+typedef struct {
+  uint32_t  magic;
+  uint32_t  cid[ 4 ];
+  uint32_t  csd[ 4 ];
+  uint16_t  type;
+  uint16_t  addr;
+  uint32_t  high_speed;
+  /* Performance extension register address, if the cache is on. */
+  uint32_t  perf_ext;
+  /* 'CMD_SUPPORT' bits of the card's SCR (`SDMMC_SCR_*`). */
+  uint32_t  cmds;
+  uint32_t  check;
+} SDCardCache;
+
+/* Error recovery and latency statistics for the SD card. */
+const SDStats *block_sd_get_stats( void );
+void block_sd_reset_stats( void );
+/* Time spent in each power state; see `SDEnergy`. */
+const SDEnergy *block_sd_get_energy( void );
+void block_sd_reset_energy( void );
+/*
+ * Power the card down if it has been idle for long enough. Call it
+ * when the application has nothing else to do, e.g. before it
+ * sleeps. Returns 1 if the card is powered down, 0 if not.
+ */
+int block_sd_idle( void );
+/* Change the idle time before a power down, in ms; 0 means never. */
+void block_sd_set_power_down( uint32_t idle_ms );
+/*
+ * A retry which has to re-initialize the card throws away anything
+ * in its write cache, which may hold blocks whose writes returned
+ * success. If the cache was on, `SD_ERR_CACHE_LOST` is set, and
+ * `block_flush_cache` fails until the caller has dealt with the
+ * loss (e.g. by rolling back to its last checkpoint) and called
+ * this, which clears the error.
+ */
+void block_sd_clear_error( void );
+
 #endif
@@ -43,12 +43,29 @@
 #define GRISTLE_TIME time(NULL)
 #endif
 
-#ifndef GRISTLE_SYSLOCK
-#define GRISTLE_SYSLOCK 1
+/* sectors a recording file reserves at once, and lines them up with, when the block driver
+ * doesn't know the medium's allocation unit size (4MB is typical for SD cards) */
+#ifndef GRISTLE_RECORD_RUN
+#define GRISTLE_RECORD_RUN 8192
 #endif
 
-#ifndef GRISTLE_SYSUNLOCK
-#define GRISTLE_SYSUNLOCK
+/* bytes a recording file writes between updates of its directory entry, 0 to only update it
+ * on fat_fsync() and fat_close() */
+#ifndef GRISTLE_RECORD_CHECKPOINT
+#define GRISTLE_RECORD_CHECKPOINT (1024L * 1024L)
+#endif
+
+/* clusters a growing file reserves at once, at least, so that files written at the same time
+ * don't end up interleaved.  The ones it doesn't use are given back when it's closed. */
+#ifndef GRISTLE_ALLOC_AHEAD
+#define GRISTLE_ALLOC_AHEAD 8
+#endif
+
+/* FAT sectors searched for the free run which best fits an allocation, when there isn't room
+ * after the file's last cluster.  They go through the metadata cache, so this shouldn't be more
+ * than GRISTLE_META_SECTORS. */
+#ifndef GRISTLE_ALLOC_WINDOW
+#define GRISTLE_ALLOC_WINDOW 2
 #endif
 
 /**
@@ -56,13 +73,77 @@
  * These take the place of a real operating system.
  **/
 
-struct fat_info fatfs;
 FileS file_num[MAX_OPEN_FILES];
+/* which file numbers are taken.  A file's flags are its own, changed under its lock, so looking for
+ * a free number uses these, which only change under the shared lock */
+static uint8_t fat_file_used[MAX_OPEN_FILES];
 // uint32_t available_files;
 
+/* the lock for everything files share, see GRISTLE_LOCK_T.  The calls which use it take it, and
+ * so does the code which allocates clusters and reads the volume's structure, so that it doesn't
+ * rely on its callers.  Taking it always succeeds.  Calls which open files of their own, like
+ * fat_mkdir(), only hold this one and use the *_unlocked() functions on them, so nothing waits
+ * for a file's lock while holding it. */
+static GRISTLE_LOCK_T fat_sys_lock;
+static uint8_t fat_locks_made = 0;
+
+#define GRISTLE_SYSLOCK (GRISTLE_LOCK(fat_sys_lock), 1)
+#define GRISTLE_SYSUNLOCK GRISTLE_UNLOCK(fat_sys_lock)
+
+#ifdef GRISTLE_PTHREADS
+static void fat_pthread_init(pthread_mutex_t *m) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(m, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+#endif
+
+/* make the locks, the first time a volume is mounted */
+static void fat_make_locks() {
+  int i;
+  if(fat_locks_made) {
+    return;
+  }
+  GRISTLE_LOCK_INIT(fat_sys_lock);
+  for(i=0;i<MAX_OPEN_FILES;i++) {
+    GRISTLE_LOCK_INIT(file_num[i].lock);
+  }
+  fat_locks_made = 1;
+}
+
+/* take an open file's lock, and the shared one as well if sys is set, for a call which takes a
+ * file number.  Returns -1 with EBADF if it isn't the number of an open file. */
+static int fat_lock(int fd, int sys, int *rerrno) {
+  if((fd < 0) || (fd >= MAX_OPEN_FILES)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  GRISTLE_LOCK(file_num[fd].lock);
+  if(!(file_num[fd].flags & FAT_FLAG_OPEN)) {
+    GRISTLE_UNLOCK(file_num[fd].lock);
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(sys) {
+    GRISTLE_LOCK(fat_sys_lock);
+  }
+  return 0;
+}
+
+static void fat_unlock(int fd, int sys) {
+  if(sys) {
+    GRISTLE_UNLOCK(fat_sys_lock);
+  }
+  GRISTLE_UNLOCK(file_num[fd].lock);
+}
+
 // there's a circular dependency between the two flush functions in certain cases,
 // so we need to prototype one here
 int fat_flush_fileinfo(int fd);
+// closing and appending seek with the locks they already hold
+static int fat_lseek_unlocked(int fd, int ptr, int dir, int *rerrno);
 
 /**
  * Name/Time formatting, doesn't read/write disc
@@ -82,16 +163,17 @@ time_t fat_to_unix_time(uint16_t fat_time) {
   return mktime(&time_str);
 }
 
+/* gmtime_r() rather than gmtime(), whose buffer other threads' calls would share */
 uint16_t fat_from_unix_time(time_t seconds) {
-  struct tm *time_str;
+  struct tm time_str;
   uint16_t fat_time;
-  time_str = gmtime(&seconds);
+  gmtime_r(&seconds, &time_str);
   
   fat_time = 0;
   
-  fat_time += time_str->tm_hour << 11;
-  fat_time += time_str->tm_min << 5;
-  fat_time += time_str->tm_sec >> 1;
+  fat_time += time_str.tm_hour << 11;
+  fat_time += time_str.tm_min << 5;
+  fat_time += time_str.tm_sec >> 1;
   return fat_time;
 }
 
@@ -110,16 +192,16 @@ time_t fat_to_unix_date(uint16_t fat_date) {
 }
 
 uint16_t fat_from_unix_date(time_t seconds) {
-  struct tm *time_str;
+  struct tm time_str;
   uint16_t fat_date;
   
-  time_str = gmtime(&seconds);
+  gmtime_r(&seconds, &time_str);
   
   fat_date = 0;
   
-  fat_date += (time_str->tm_year - 80) << 9;
-  fat_date += (time_str->tm_mon + 1) << 5;
-  fat_date += time_str->tm_mday;
+  fat_date += (time_str.tm_year - 80) << 9;
+  fat_date += (time_str.tm_mon + 1) << 5;
+  fat_date += time_str.tm_mday;
   
   return fat_date;
 }
@@ -164,18 +246,31 @@ int fat_update_mtime(int fd) {
 }
 
 /* fat_get_next_file - returns the next free file descriptor or -1 if none */
-int8_t fat_get_next_file() {
+int8_t fat_get_next_file(struct fat_volume *vol) {
   int j;
 
   for(j=0;j<MAX_OPEN_FILES;j++) {
-    if((file_num[j].flags & FAT_FLAG_OPEN) == 0) {
+    if(!fat_file_used[j]) {
+      fat_file_used[j] = 1;
       file_num[j].flags = FAT_FLAG_OPEN;
+      file_num[j].vol = vol;
+      file_num[j].run_start = 0;
+      file_num[j].run_end = 0;
+      file_num[j].write_end = 0;
+      file_num[j].buffer = file_num[j].window;
+      file_num[j].win_count = 0;
       return j;
     }
   }
   return -1;
 }
 
+/* give a file number back, with the shared lock held */
+static void fat_put_file(int fd) {
+  file_num[fd].flags = 0;
+  fat_file_used[fd] = 0;
+}
+
 /*
   doschar - returns a dos file entry compatible version of character c
             0 indicates c was 0 (i.e. end of string)
@@ -230,6 +325,8 @@ int make_dos_name(char *dosname, const char *path, int *path_pointer) {
         if((path[*path_pointer] == 0) || (doschar(path[*path_pointer]) == '/')) {
           *(dosname + i) = '.';
           c = doschar(*(path + (*path_pointer)++));
+        } else {
+          *(dosname + i) = ' ';     /* a one letter name, e.g. A.TXT */
         }
       } else {
         *(dosname + i) = ' ';
@@ -380,48 +477,651 @@ int str_to_fatname(char *url, char *dosname) {
 }
 
 /* low level file-system operations */
-int fat_get_free_cluster() {
+/* one past the last cluster the FAT has an entry for, which may be less than the FAT has room
+ * for */
+static uint32_t fat_cluster_end(struct fat_volume *vol) {
+  uint32_t end = (vol->part_start + vol->total_sectors - vol->cluster0) / vol->sectors_per_cluster;
+  if(end > vol->sectors_per_fat * (512 / vol->fat_entry_len)) {
+    end = vol->sectors_per_fat * (512 / vol->fat_entry_len);
+  }
+  return end;
+}
+
+/* FAT and directory sectors go through a small write-back cache shared by all files, so that
+ * following a chain, allocating clusters and updating directory entries neither go to the medium
+ * every time nor borrow a file's buffer, which would then have to be read again.  Changed sectors
+ * are written when they are evicted and by fat_meta_flush(). */
+static void fat_meta_init(struct fat_volume *vol) {
+  int i;
+  for(i=0;i<GRISTLE_META_SECTORS;i++) {
+    vol->meta[i].sector = MAX_BLOCK;
+    vol->meta[i].used = 0;
+    vol->meta[i].dirty = 0;
+  }
+  vol->meta_clock = 0;
+}
+
+/* the cached copy of a sector, or NULL if it isn't cached */
+static fat_meta_sector *fat_meta_find(struct fat_volume *vol, blockno_t sector) {
+  int i;
+  for(i=0;i<GRISTLE_META_SECTORS;i++) {
+    if(vol->meta[i].sector == sector) {
+      return &vol->meta[i];
+    }
+  }
+  return NULL;
+}
+
+/* get a sector into the cache, in place of the least recently used one.  If read is 0 the sector
+ * is about to be overwritten, so it isn't read, it starts out zeroed and dirty instead.  Returns
+ * NULL on a read error, or if the sector it replaces couldn't be written. */
+static fat_meta_sector *fat_meta_get(struct fat_volume *vol, blockno_t sector, int read) {
+  fat_meta_sector *m;
+  int i;
+
+  m = fat_meta_find(vol, sector);
+  if(m == NULL) {
+    m = &vol->meta[0];
+    for(i=1;i<GRISTLE_META_SECTORS;i++) {
+      if(vol->meta[i].used < m->used) {
+        m = &vol->meta[i];
+      }
+    }
+    if(m->dirty) {
+      if(block_write(m->sector, m->data)) {
+        return NULL;
+      }
+      m->dirty = 0;
+    }
+    m->sector = MAX_BLOCK;
+    if(read) {
+      if(block_read(sector, m->data)) {
+        return NULL;
+      }
+    } else {
+      memset(m->data, 0, 512);
+      m->dirty = 1;
+    }
+    m->sector = sector;
+  } else if(!read) {
+    memset(m->data, 0, 512);
+    m->dirty = 1;
+  }
+  m->used = ++vol->meta_clock;
+  return m;
+}
+
+/* write every changed sector in the cache back to the medium */
+static int fat_meta_flush(struct fat_volume *vol) {
+  int i;
+  int r = 0;
+  for(i=0;i<GRISTLE_META_SECTORS;i++) {
+    if(vol->meta[i].dirty) {
+      if(block_write(vol->meta[i].sector, vol->meta[i].data)) {
+        r = -1;
+      } else {
+        vol->meta[i].dirty = 0;
+      }
+    }
+  }
+  return r;
+}
+
+/* directory entries looked up by name are remembered, as are names which weren't found, in a
+ * small cache shared by all files.  Entries are keyed by the directory they are in and their
+ * name, one path element at a time, so a path only reads the directories the cache misses on.
+ * Whatever changes an entry updates its copy here, see fat_dentry_put() and fat_dentry_forget() */
+static void fat_dentry_init(struct fat_volume *vol) {
+  int i;
+  for(i=0;i<GRISTLE_DENTRIES;i++) {
+    vol->dentries[i].parent = 0;
+    vol->dentries[i].used = 0;
+  }
+  vol->dentry_clock = 0;
+}
+
+/* the cached entry for a name in a directory, or NULL if it isn't cached.  An entry with a
+ * sector of 0 says the directory has no such name */
+static fat_dentry *fat_dentry_find(struct fat_volume *vol, uint32_t parent, const char *name) {
+  int i;
+  for(i=0;i<GRISTLE_DENTRIES;i++) {
+    if((vol->dentries[i].parent == parent) && (memcmp(vol->dentries[i].name, name, 11) == 0)) {
+      vol->dentries[i].used = ++vol->dentry_clock;
+      return &vol->dentries[i];
+    }
+  }
+  return NULL;
+}
+
+/* remember the entry for a name in a directory, in place of the least recently used one.  A
+ * sector of 0 (and no entry) remembers that the name isn't there */
+static void fat_dentry_put(struct fat_volume *vol, uint32_t parent, const char *name,
+                           blockno_t sector, uint8_t number, const void *entry) {
+  fat_dentry *d;
+  int i;
+
+  if((d = fat_dentry_find(vol, parent, name)) == NULL) {
+    d = &vol->dentries[0];
+    for(i=1;i<GRISTLE_DENTRIES;i++) {
+      if(vol->dentries[i].used < d->used) {
+        d = &vol->dentries[i];
+      }
+    }
+    d->parent = parent;
+    memcpy(d->name, name, 11);
+    d->used = ++vol->dentry_clock;
+  }
+  d->sector = sector;
+  d->number = number;
+  if(entry) {
+    memcpy(d->entry, entry, 32);
+  }
+}
+
+#ifndef GRISTLE_RO
+/* forget what is cached about a directory's entries, when it is written other than through
+ * fat_flush_fileinfo() and fat_delete(), or when its clusters go to another directory */
+static void fat_dentry_forget(struct fat_volume *vol, uint32_t parent) {
+  int i;
+  for(i=0;i<GRISTLE_DENTRIES;i++) {
+    if(vol->dentries[i].parent == parent) {
+      vol->dentries[i].parent = 0;
+      vol->dentries[i].used = 0;
+    }
+  }
+}
+#endif
+
+/* read a cluster's entry in the FAT */
+static int fat_get_entry(struct fat_volume *vol, uint32_t cluster, uint32_t *entry) {
+  fat_meta_sector *m;
+  m = fat_meta_get(vol, vol->active_fat_start + (cluster * vol->fat_entry_len) / 512, 1);
+  if(m == NULL) {
+    return -1;
+  }
+  *entry = 0;
+  memcpy(entry, &m->data[(cluster * vol->fat_entry_len) & 0x1ff], vol->fat_entry_len);
+  return 0;
+}
+
+/* change a cluster's entry in the FAT */
+static int fat_set_entry(struct fat_volume *vol, uint32_t cluster, uint32_t entry) {
+  fat_meta_sector *m;
+  m = fat_meta_get(vol, vol->active_fat_start + (cluster * vol->fat_entry_len) / 512, 1);
+  if(m == NULL) {
+    return -1;
+  }
+  memcpy(&m->data[(cluster * vol->fat_entry_len) & 0x1ff], &entry, vol->fat_entry_len);
+  m->dirty = 1;
+  return 0;
+}
+
+#if GRISTLE_DIR_INDEX_SLOTS > 0
+/* directories with many entries can have an index of their names' hashes, giving the sector each
+ * one is in, so a lookup reads that sector rather than every one before it.  Hashes 0 and 1 mark
+ * empty slots and deleted names, and collisions go in the next free slot along.  The index also
+ * remembers the sector the directory ends in, so that fat_dir_slot() starts there. */
+static void fat_dindex_init(struct fat_volume *vol) {
+  int i;
+  for(i=0;i<GRISTLE_DIR_INDEXES;i++) {
+    vol->dindex[i].parent = 0;
+    vol->dindex[i].used = 0;
+  }
+  vol->dindex_clock = 0;
+}
+
+static uint16_t fat_dindex_hash(const char *name) {
+  uint32_t h = 2166136261UL;
+  int i;
+  for(i=0;i<11;i++) {
+    h = (h ^ (uint8_t)name[i]) * 16777619UL;
+  }
+  h = (h ^ (h >> 16)) & 0xffff;
+  return (h < 2) ? h + 2 : h;
+}
+
+/* the index of a directory, or NULL if it hasn't got one */
+static fat_dir_index *fat_dindex_find(struct fat_volume *vol, uint32_t parent) {
+  int i;
+  for(i=0;i<GRISTLE_DIR_INDEXES;i++) {
+    if(vol->dindex[i].parent == parent) {
+      vol->dindex[i].used = ++vol->dindex_clock;
+      return &vol->dindex[i];
+    }
+  }
+  return NULL;
+}
+
+/* add a name in the given sector to an index, or give up on it if it's getting too full */
+static void fat_dindex_insert(fat_dir_index *x, const char *name, blockno_t sector) {
+  uint16_t h = fat_dindex_hash(name);
+  uint32_t j = h % GRISTLE_DIR_INDEX_SLOTS;
+
+  if(x->full) {
+    return;
+  }
+  while(x->hash[j] > 1) {
+    j = (j + 1) % GRISTLE_DIR_INDEX_SLOTS;
+  }
+  if(x->hash[j] == 0) {
+    if(x->count + 1 > (GRISTLE_DIR_INDEX_SLOTS / 4) * 3) {
+      x->full = 1;
+      return;
+    }
+    x->count++;
+  }
+  x->hash[j] = h;
+  x->sector[j] = sector;
+}
+
+/* build a directory's index by reading it through the metadata cache, in place of the least
+ * recently used index.  Returns NULL on a read error. */
+static fat_dir_index *fat_dindex_build(struct fat_volume *vol, uint32_t parent) {
+  fat_dir_index *x;
+  fat_meta_sector *m;
+  blockno_t s;
+  uint32_t cluster = parent;
+  uint32_t count;
+  uint32_t next;
+  int i;
+
+  x = &vol->dindex[0];
+  for(i=1;i<GRISTLE_DIR_INDEXES;i++) {
+    if(vol->dindex[i].used < x->used) {
+      x = &vol->dindex[i];
+    }
+  }
+  x->parent = 0;
+  x->full = 0;
+  x->count = 0;
+  memset(x->hash, 0, sizeof(x->hash));
+  while(1) {
+    if(cluster == 1) {
+      s = vol->root_start;
+      count = vol->root_len;
+    } else {
+      s = cluster * vol->sectors_per_cluster + vol->cluster0;
+      count = vol->sectors_per_cluster;
+    }
+    for(;count>0;count--,s++) {
+      if((m = fat_meta_get(vol, s, 1)) == NULL) {
+        return NULL;
+      }
+      x->end_cluster = cluster;
+      x->end_sector = s;
+      for(i=0;i<16;i++) {
+        if(m->data[i * 32] == 0) {
+          break;
+        }
+        if((m->data[i * 32] != 0xe5) && (m->data[i * 32 + 11] != 0x0f)) {
+          fat_dindex_insert(x, (char *)&m->data[i * 32], s);
+        }
+      }
+      if(i < 16) {
+        break;
+      }
+    }
+    /* the end of the directory, or of the fixed FAT16 root directory, which has no end marker
+     * when it is full */
+    if((count > 0) || (cluster == 1)) {
+      break;
+    }
+    if(fat_get_entry(vol, cluster, &next) || (next < 2)) {
+      return NULL;
+    }
+    if(next >= vol->end_cluster_marker) {
+      break;
+    }
+    cluster = next;
+  }
+  x->parent = parent;
+  x->used = ++vol->dindex_clock;
+  return x;
+}
+
+/* look a name up in a directory's index, building the index first if there isn't one.  Returns 1
+ * and where the entry is, and a copy of it, if the name is there, 0 if it isn't, or -1 if the
+ * index can't tell and the directory has to be searched. */
+static int fat_dindex_lookup(struct fat_volume *vol, uint32_t parent, const char *name,
+                             blockno_t *sector, uint8_t *number, void *entry) {
+  fat_dir_index *x;
+  fat_meta_sector *m;
+  uint16_t h = fat_dindex_hash(name);
+  uint32_t j = h % GRISTLE_DIR_INDEX_SLOTS;
+  int i;
+
+  if(((x = fat_dindex_find(vol, parent)) == NULL) &&
+     ((x = fat_dindex_build(vol, parent)) == NULL)) {
+    return -1;
+  }
+  if(x->full) {
+    return -1;
+  }
+  while(x->hash[j] != 0) {
+    if(x->hash[j] == h) {
+      if((m = fat_meta_get(vol, x->sector[j], 1)) == NULL) {
+        return -1;
+      }
+      for(i=0;(i<16)&&(m->data[i * 32]!=0);i++) {
+        if(memcmp(&m->data[i * 32], name, 11) == 0) {
+          *sector = x->sector[j];
+          *number = i;
+          memcpy(entry, &m->data[i * 32], 32);
+          return 1;
+        }
+      }
+    }
+    j = (j + 1) % GRISTLE_DIR_INDEX_SLOTS;
+  }
+  return 0;
+}
+
+#ifndef GRISTLE_RO
+/* a new entry has been made in a directory */
+static void fat_dindex_add(struct fat_volume *vol, uint32_t parent, const char *name,
+                           blockno_t sector) {
+  fat_dir_index *x;
+  if((x = fat_dindex_find(vol, parent)) != NULL) {
+    fat_dindex_insert(x, name, sector);
+  }
+}
+
+/* an entry in a directory has been deleted.  Another name with the same hash in the same sector
+ * may have its slot marked instead, which is just as good, as lookups search the whole sector */
+static void fat_dindex_remove(struct fat_volume *vol, uint32_t parent, const char *name,
+                              blockno_t sector) {
+  fat_dir_index *x;
+  uint16_t h = fat_dindex_hash(name);
+  uint32_t j = h % GRISTLE_DIR_INDEX_SLOTS;
+  if(((x = fat_dindex_find(vol, parent)) == NULL) || x->full) {
+    return;
+  }
+  while(x->hash[j] != 0) {
+    if((x->hash[j] == h) && (x->sector[j] == sector)) {
+      x->hash[j] = 1;
+      return;
+    }
+    j = (j + 1) % GRISTLE_DIR_INDEX_SLOTS;
+  }
+}
+
+/* drop a directory's index, when it is written other than through fat_dir_slot() and
+ * fat_delete(), or its clusters go to another directory */
+static void fat_dindex_forget(struct fat_volume *vol, uint32_t parent) {
+  fat_dir_index *x;
+  if((x = fat_dindex_find(vol, parent)) != NULL) {
+    x->parent = 0;
+    x->used = 0;
+  }
+}
+#endif
+#else
+/* without name indexes directories are always searched */
+static void fat_dindex_init(struct fat_volume *vol __attribute__((__unused__))) {
+}
+
+static int fat_dindex_lookup(struct fat_volume *vol __attribute__((__unused__)),
+                             uint32_t parent __attribute__((__unused__)),
+                             const char *name __attribute__((__unused__)),
+                             blockno_t *sector __attribute__((__unused__)),
+                             uint8_t *number __attribute__((__unused__)),
+                             void *entry __attribute__((__unused__))) {
+  return -1;
+}
+
+#ifndef GRISTLE_RO
+static void fat_dindex_add(struct fat_volume *vol __attribute__((__unused__)),
+                           uint32_t parent __attribute__((__unused__)),
+                           const char *name __attribute__((__unused__)),
+                           blockno_t sector __attribute__((__unused__))) {
+}
+
+static void fat_dindex_remove(struct fat_volume *vol __attribute__((__unused__)),
+                              uint32_t parent __attribute__((__unused__)),
+                              const char *name __attribute__((__unused__)),
+                              blockno_t sector __attribute__((__unused__))) {
+}
+
+static void fat_dindex_forget(struct fat_volume *vol __attribute__((__unused__)),
+                              uint32_t parent __attribute__((__unused__))) {
+}
+#endif
+#endif
+
+/* note that a file's n'th cluster is the given one.  The extent list covers the file from its
+ * start without gaps, so it can only grow at its end, and a full list stops growing */
+static void fat_extent_add(int fd, uint32_t n, uint32_t cluster) {
+  fat_extent *e;
+  uint32_t known = 0;
+  if(file_num[fd].extent_count > 0) {
+    e = &file_num[fd].extents[file_num[fd].extent_count - 1];
+    known = e->file_cluster + e->length;
+    if((n == known) && (cluster == e->cluster + e->length)) {
+      e->length++;
+      return;
+    }
+  }
+  if((n != known) || (file_num[fd].extent_count == GRISTLE_EXTENTS)) {
+    return;
+  }
+  e = &file_num[fd].extents[file_num[fd].extent_count++];
+  e->file_cluster = n;
+  e->cluster = cluster;
+  e->length = 1;
+}
+
+#ifndef GRISTLE_RO
+/* forget where a file's clusters are from the n'th on, because they have been freed */
+static void fat_extent_cut(int fd, uint32_t n) {
+  fat_extent *e;
+  while(file_num[fd].extent_count > 0) {
+    e = &file_num[fd].extents[file_num[fd].extent_count - 1];
+    if(e->file_cluster < n) {
+      if(e->file_cluster + e->length > n) {
+        e->length = n - e->file_cluster;
+      }
+      break;
+    }
+    file_num[fd].extent_count--;
+  }
+}
+#endif
+
+/* the free map starts out with every bit set, i.e. every FAT sector may have a free entry, and
+ * bits are cleared as allocation finds sectors full, so it is built up as the volume is used
+ * rather than by reading the whole FAT at mount */
+static void fat_map_init(struct fat_volume *vol) {
+  vol->map_shift = 0;
+  while(((vol->sectors_per_fat - 1) >> vol->map_shift) >= GRISTLE_FREE_MAP_BYTES * 8) {
+    vol->map_shift++;
+  }
+  memset(vol->free_map, 0xff, sizeof(vol->free_map));
+}
+
+/* non zero if the FAT sector (counted from the start of the FAT) may have a free entry */
+static int fat_map_free(struct fat_volume *vol, uint32_t sector) {
+  uint32_t bit = sector >> vol->map_shift;
+  return (vol->free_map[bit / 32] >> (bit % 32)) & 1;
+}
+
+static void fat_map_set(struct fat_volume *vol, uint32_t sector, int free) {
+  uint32_t bit = sector >> vol->map_shift;
+  if(free) {
+    vol->free_map[bit / 32] |= (1UL << (bit % 32));
+  } else {
+    vol->free_map[bit / 32] &= ~(1UL << (bit % 32));
+  }
+}
+
+/* keep the free count and the allocation hint up to date when count clusters ending with last
+ * have been allocated */
+static void fat_info_allocated(struct fat_volume *vol, uint32_t last, uint32_t count) {
+  vol->last_allocated = last;
+  if(vol->free_count != 0xFFFFFFFF) {
+    vol->free_count = (vol->free_count > count) ? vol->free_count - count : 0;
+  }
+  vol->info_dirty = 1;
+}
+
+/* FAT32 volumes keep a count of their free clusters, and the last cluster allocated, in their
+ * FSInfo sector, so that they don't have to be found by reading the FAT.  Both are only hints,
+ * and may be out of date if the volume wasn't unmounted cleanly, so they are checked here, and
+ * they are only written back by fat_fsync() and fat_umount() */
+static void fat_info_load(struct fat_volume *vol) {
+  uint32_t v;
+  vol->free_count = 0xFFFFFFFF;
+  vol->last_allocated = 1;
+  vol->info_dirty = 0;
+  if(vol->fs_info == 0) {
+    return;
+  }
+  if(block_read(vol->fs_info, vol->sysbuf)) {
+    vol->fs_info = 0;
+    return;
+  }
+  memcpy(&v, &vol->sysbuf[FS_INFO_SIG1], 4);
+  if(v != FS_INFO_LEAD) {
+    vol->fs_info = 0;
+    return;
+  }
+  memcpy(&v, &vol->sysbuf[FS_INFO_SIG2], 4);
+  if(v != FS_INFO_STRUCT) {
+    vol->fs_info = 0;
+    return;
+  }
+  memcpy(&v, &vol->sysbuf[FS_INFO_SIG3], 4);
+  if(v != FS_INFO_TRAIL) {
+    vol->fs_info = 0;
+    return;
+  }
+  memcpy(&v, &vol->sysbuf[FREE_CLUSTERS], 4);
+  if(v <= fat_cluster_end(vol) - 2) {
+    vol->free_count = v;
+  }
+  memcpy(&v, &vol->sysbuf[LAST_ALLOCATED], 4);
+  if((v >= 2) && (v < fat_cluster_end(vol))) {
+    vol->last_allocated = v;
+  }
+}
+
+/* write the free count and the allocation hint back to the FSInfo sector, if they changed */
+static int fat_info_flush(struct fat_volume *vol) {
+  int r = 0;
+  if((vol->fs_info == 0) || !vol->info_dirty || vol->read_only) {
+    return 0;
+  }
+  if(GRISTLE_SYSLOCK) {
+    if(block_read(vol->fs_info, vol->sysbuf)) {
+      r = -1;
+    } else {
+      memcpy(&vol->sysbuf[FREE_CLUSTERS], &vol->free_count, 4);
+      memcpy(&vol->sysbuf[LAST_ALLOCATED], &vol->last_allocated, 4);
+      if(block_write(vol->fs_info, vol->sysbuf)) {
+        r = -1;
+      } else {
+        vol->info_dirty = 0;
+      }
+    }
+    GRISTLE_SYSUNLOCK;
+  } else {
+    return -1;
+  }
+  return r;
+}
+
+/* find the first FAT sector (counted from the start of the FAT) from the given one on, wrapping
+ * around, which has a free entry.  Groups of sectors the free map says are full are skipped, and
+ * groups found full on the way are marked in it.  Returns sectors_per_fat if there isn't one, or
+ * 0xFFFFFFFF on a read error */
+static uint32_t fat_free_sector(struct fat_volume *vol, uint32_t first) {
+  uint32_t i;
+  uint32_t j;
+  uint32_t c;
+  uint32_t k;
+  uint32_t e;
+  uint32_t end = fat_cluster_end(vol);
+  uint32_t group = (1UL << vol->map_shift) - 1;
+
+  /* start from the beginning of the group, so that a group is only marked once it's all read */
+  first &= ~group;
+  if(first >= vol->sectors_per_fat) {
+    first = 0;
+  }
+  for(k=0;k<vol->sectors_per_fat;k++) {
+    i = first + k;
+    if(i >= vol->sectors_per_fat) {
+      i -= vol->sectors_per_fat;
+    }
+    if(!fat_map_free(vol, i)) {
+      /* nothing free in this sector's group, skip the rest of it */
+      if((i | group) < vol->sectors_per_fat) {
+        k += group - (i & group);
+      } else {
+        k += vol->sectors_per_fat - 1 - i;
+      }
+      continue;
+    }
+    for(j=0;j<(512/vol->fat_entry_len);j++) {
+      c = i * (512 / vol->fat_entry_len) + j;
+      if(c >= end) {
+        break;
+      }
+      if(c < 2) {
+        continue;
+      }
+      if(fat_get_entry(vol, c, &e)) {
+        return 0xFFFFFFFF;
+      }
+      if(e == 0) {
+        return i;
+      }
+    }
+    /* the whole group has been read since the scan started at the beginning of it, and it is
+     * full */
+    if((((i + 1) & group) == 0) || (i + 1 == vol->sectors_per_fat)) {
+      fat_map_set(vol, i, 0);
+    }
+  }
+  return vol->sectors_per_fat;
+}
+
+int fat_get_free_cluster(struct fat_volume *vol) {
 #ifdef TRACE
   printf("fat_get_free_cluster\n");
 #endif
-  blockno_t i;
-  int j;
+  uint32_t i;
+  uint32_t c;
   uint32_t e;
-  
+  uint32_t end;
+
   if(GRISTLE_SYSLOCK) {
-    for(i=fatfs.active_fat_start;i<fatfs.active_fat_start + fatfs.sectors_per_fat;i++) {
-      if(block_read(i, fatfs.sysbuf)) {
+    end = fat_cluster_end(vol);
+    /* start from the sector the last allocation was in */
+    i = fat_free_sector(vol, ((vol->last_allocated + 1) * vol->fat_entry_len) / 512);
+    if(i == 0xFFFFFFFF) {
+      GRISTLE_SYSUNLOCK;
+      return i;
+    }
+    for(c=i*(512/vol->fat_entry_len);(i<vol->sectors_per_fat)&&(c<end);c++) {
+      if(c < 2) {
+        continue;
+      }
+      if(fat_get_entry(vol, c, &e)) {
+        GRISTLE_SYSUNLOCK;
         return 0xFFFFFFFF;
       }
-      for(j=0;j<(512/fatfs.fat_entry_len);j++) {
-        e = fatfs.sysbuf[j*fatfs.fat_entry_len];
-        e += fatfs.sysbuf[j*fatfs.fat_entry_len+1] << 8;
-        if(fatfs.type == PART_TYPE_FAT32) {
-          e += fatfs.sysbuf[j*fatfs.fat_entry_len+2] << 16;
-          e += fatfs.sysbuf[j*fatfs.fat_entry_len+3] << 24;
+      if(e == 0) {
+        /* this is a free cluster, mark it as the end of the chain */
+        if(fat_set_entry(vol, c, 0x0FFFFFF8)) {
+          GRISTLE_SYSUNLOCK;
+          return 0xFFFFFFFF;
         }
-        if(e == 0) {
-          /* this is a free cluster */
-          /* first, mark it as the end of the chain */
-          if(fatfs.type == PART_TYPE_FAT16) {
-            fatfs.sysbuf[j*fatfs.fat_entry_len] = 0xF8;
-            fatfs.sysbuf[j*fatfs.fat_entry_len+1] = 0xFF;
-          } else {
-            fatfs.sysbuf[j*fatfs.fat_entry_len] = 0xF8;
-            fatfs.sysbuf[j*fatfs.fat_entry_len+1] = 0xFF;
-            fatfs.sysbuf[j*fatfs.fat_entry_len+2] = 0xFF;
-            fatfs.sysbuf[j*fatfs.fat_entry_len+3] = 0x0F;
-          }
-          if(block_write(i, fatfs.sysbuf)) {
-            GRISTLE_SYSUNLOCK;
-            return 0xFFFFFFFF;
-          }
   #ifdef TRACE
-    printf("fat_get_free_cluster returning %d\n", ((i - fatfs.active_fat_start) * (512 / fatfs.fat_entry_len)) + j);
+    printf("fat_get_free_cluster returning %d\n", c);
   #endif
-          GRISTLE_SYSUNLOCK;
-          return ((i - fatfs.active_fat_start) * (512 / fatfs.fat_entry_len)) + j;
-        }
+        fat_info_allocated(vol, c, 1);
+        GRISTLE_SYSUNLOCK;
+        return c;
       }
     }
     GRISTLE_SYSUNLOCK;
@@ -433,40 +1133,29 @@ int fat_get_free_cluster() {
  * fat_free_clusters - starts at given cluster and marks all as free until an
  *                     end of chain marker is found
  */
-int fat_free_clusters(uint32_t cluster) {
-  int estart;
+int fat_free_clusters(struct fat_volume *vol, uint32_t cluster) {
   uint32_t j;
-  blockno_t current_block = MAX_BLOCK;
   
+  /* an empty file has no chain to free, and clusters 0 and 1 aren't real ones */
+  if(cluster < 2) {
+    return 0;
+  }
   if(GRISTLE_SYSLOCK) {
     while(1) {
-      if(fatfs.active_fat_start + ((cluster * fatfs.fat_entry_len) / 512) != current_block) {
-        if(current_block != MAX_BLOCK) {
-          block_write(current_block, fatfs.sysbuf);
-        }
-        if(block_read(fatfs.active_fat_start + ((cluster * fatfs.fat_entry_len) / 512), fatfs.sysbuf)) {
-          GRISTLE_SYSUNLOCK;
-          return -1;
-        }
-        current_block = fatfs.active_fat_start + ((cluster * fatfs.fat_entry_len)/512);
-      }
-      estart = (cluster * fatfs.fat_entry_len) & 0x1ff;
-      j = fatfs.sysbuf[estart];
-      fatfs.sysbuf[estart] = 0;
-      j += fatfs.sysbuf[estart + 1] << 8;
-      fatfs.sysbuf[estart+1] = 0;
-      if(fatfs.type == PART_TYPE_FAT32) {
-        j += fatfs.sysbuf[estart + 2] << 16;
-        fatfs.sysbuf[estart+2] = 0;
-        j += fatfs.sysbuf[estart + 3] << 24;
-        fatfs.sysbuf[estart+3] = 0;
+      if(fat_get_entry(vol, cluster, &j) || fat_set_entry(vol, cluster, 0)) {
+        GRISTLE_SYSUNLOCK;
+        return -1;
+      }
+      fat_map_set(vol, (cluster * vol->fat_entry_len) / 512, 1);
+      if((j != 0) && (vol->free_count != 0xFFFFFFFF)) {
+        vol->free_count++;
       }
+      vol->info_dirty = 1;
       cluster = j;
-      if(cluster >= fatfs.end_cluster_marker) {
+      if((cluster >= vol->end_cluster_marker) || (cluster < 2)) {
         break;
       }
     }
-    block_write(current_block, fatfs.sysbuf);
   } else {
     // failed to get mutex
     return -1;
@@ -475,11 +1164,343 @@ int fat_free_clusters(uint32_t cluster) {
   return 0;
 }
 
-/* write a sector back to disc */
+#ifndef GRISTLE_RO
+/* look for count free clusters in a row between two clusters, the first of which must start on
+ * a multiple of align sectors.  Returns the first cluster of the run, 0 if there isn't one or
+ * 0xFFFFFFFF on a read error */
+static uint32_t fat_find_run(struct fat_volume *vol, uint32_t from, uint32_t to, uint32_t count,
+                             uint32_t align) {
+  blockno_t current_block = MAX_BLOCK;
+  blockno_t b;
+  uint32_t c, e;
+  uint32_t first = 0;
+  uint32_t run = 0;
+
+  for(c=from;c<to;c++) {
+    if((run == 0) && ((vol->cluster0 + c * vol->sectors_per_cluster) % align)) {
+      continue;
+    }
+    b = vol->active_fat_start + ((c * vol->fat_entry_len) / 512);
+    if(b != current_block) {
+      if(!fat_map_free(vol, b - vol->active_fat_start)) {
+        /* nothing free in this sector's group, carry on after it */
+        run = 0;
+        c = ((((b - vol->active_fat_start) | ((1UL << vol->map_shift) - 1)) + 1) *
+             (512 / vol->fat_entry_len)) - 1;
+        continue;
+      }
+      current_block = b;
+    }
+    if(fat_get_entry(vol, c, &e)) {
+      return 0xFFFFFFFF;
+    }
+    if(e != 0) {
+      run = 0;
+      continue;
+    }
+    if(run == 0) {
+      first = c;
+    }
+    if(++run == count) {
+      return first;
+    }
+  }
+  return 0;
+}
+
+/* chain count clusters from first on together, in order, with an end of chain marker in the
+ * last one */
+static int fat_chain_run(struct fat_volume *vol, uint32_t first, uint32_t count) {
+  uint32_t c, value;
+
+  for(c=first;c<first + count;c++) {
+    if(c + 1 < first + count) {
+      value = c + 1;
+    } else {
+      value = 0x0FFFFFF8;
+    }
+    if(fat_set_entry(vol, c, value)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* allocate up to count free clusters in a row, chained together, and say how many in *got.  The
+ * clusters straight after goal come first, so that a growing file stays in one piece.  Failing
+ * that, it looks at the GRISTLE_ALLOC_WINDOW FAT sectors from the first one with a free entry
+ * after the last allocation, and takes the smallest free run there which is long enough, or the
+ * longest one if none is.  Returns the first cluster, 0 if the volume is full or 0xFFFFFFFF on
+ * a read error */
+static uint32_t fat_alloc_run(struct fat_volume *vol, uint32_t goal, uint32_t count,
+                              uint32_t *got) {
+  uint32_t c, e, i, end, stop;
+  uint32_t best = 0;
+  uint32_t best_len = 0;
+  uint32_t first = 0;
+  uint32_t run = 0;
+
+  end = fat_cluster_end(vol);
+  if((goal >= 2) && (goal < end)) {
+    while((best_len < count) && (goal + best_len < end)) {
+      if(fat_get_entry(vol, goal + best_len, &e)) {
+        return 0xFFFFFFFF;
+      }
+      if(e != 0) {
+        break;
+      }
+      best_len++;
+    }
+    best = goal;
+  }
+  if(best_len == 0) {
+    i = fat_free_sector(vol, ((vol->last_allocated + 1) * vol->fat_entry_len) / 512);
+    if(i == 0xFFFFFFFF) {
+      return i;
+    }
+    if(i == vol->sectors_per_fat) {
+      return 0;
+    }
+    c = i * (512 / vol->fat_entry_len);
+    stop = (i + GRISTLE_ALLOC_WINDOW) * (512 / vol->fat_entry_len);
+    if(stop > end) {
+      stop = end;
+    }
+    for(;c<stop;c++) {
+      if(c < 2) {
+        continue;
+      }
+      if(fat_get_entry(vol, c, &e)) {
+        return 0xFFFFFFFF;
+      }
+      if(e == 0) {
+        if(run++ == 0) {
+          first = c;
+        }
+        if(c + 1 < stop) {
+          continue;
+        }
+      }
+      if(run == 0) {
+        continue;
+      }
+      /* a run which is long enough beats one which isn't, then shorter beats longer */
+      if((best_len == 0) ||
+         ((run >= count) && ((best_len < count) || (run < best_len))) ||
+         ((run < count) && (best_len < count) && (run > best_len))) {
+        best = first;
+        best_len = run;
+      }
+      if(run == count) {
+        break;
+      }
+      run = 0;
+    }
+    if(best_len > count) {
+      best_len = count;
+    }
+  }
+  if(best_len == 0) {
+    return 0;
+  }
+  if(fat_chain_run(vol, best, best_len)) {
+    return 0xFFFFFFFF;
+  }
+  fat_info_allocated(vol, best + best_len - 1, best_len);
+  *got = best_len;
+  return best;
+}
+
+/* get a new cluster for a file, the n'th one counted from its start.  A recording file reserves
+ * a whole allocation unit of clusters at once, chained together, so that the card sees the file
+ * written one whole AU after another and the file doesn't need the FAT again until it reaches
+ * the end of the run.  Other files reserve as many as the write in progress needs, and at least
+ * GRISTLE_ALLOC_AHEAD, after their last cluster if they are free.  Either way the file's clusters
+ * stay in one piece where they can, and the ones it doesn't use are given back on fat_close(). */
+static uint32_t fat_alloc_cluster(int fd, uint32_t n) {
+  struct fat_volume *vol = file_num[fd].vol;
+  const block_profile *profile;
+  uint32_t align, count, end, k, start, need;
+  uint32_t got = 0;
+  uint32_t bytes = vol->sectors_per_cluster * 512;
+
+  if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
+    return fat_get_free_cluster(vol);
+  }
+  k = 0;
+  if(file_num[fd].flags & FAT_FLAG_RECORD) {
+    profile = block_get_profile();
+    align = profile->au_blocks ? profile->au_blocks : GRISTLE_RECORD_RUN;
+    count = align / vol->sectors_per_cluster;
+    if(count == 0) {
+      count = 1;
+    }
+  } else {
+    align = 1;
+    count = GRISTLE_ALLOC_AHEAD;
+    need = (file_num[fd].write_end + bytes - 1) / bytes;
+    if(need > n + count) {
+      count = need - n;
+    }
+    if(count == 0) {
+      count = 1;
+    }
+  }
+  if(GRISTLE_SYSLOCK) {
+    if(file_num[fd].flags & FAT_FLAG_RECORD) {
+      /* the AU after the file's last run is the likeliest to be free, or failing that the space
+       * after the volume's last allocation, so start there */
+      end = fat_cluster_end(vol);
+      start = (file_num[fd].run_end > 2) ? file_num[fd].run_end : vol->last_allocated + 1;
+      if(start > 2) {
+        k = fat_find_run(vol, start, end, count, align);
+      }
+      if(k == 0) {
+        k = fat_find_run(vol, 2, end, count, align);
+      }
+      if((k != 0) && (k != 0xFFFFFFFF)) {
+        if(fat_chain_run(vol, k, count)) {
+          k = 0xFFFFFFFF;
+        } else {
+          fat_info_allocated(vol, k + count - 1, count);
+          got = count;
+        }
+      }
+    }
+    if(k == 0) {
+      /* no whole AU is free, so a recording file makes do with what's left */
+      k = fat_alloc_run(vol, (n > 0) ? file_num[fd].cluster + 1 : 0, count, &got);
+    }
+    GRISTLE_SYSUNLOCK;
+  }
+  if((k != 0) && (k != 0xFFFFFFFF)) {
+    file_num[fd].run_start = k;
+    file_num[fd].run_end = k + got;
+  }
+  return k;
+}
+
+/* the next cluster of a file which is in its reserved run, so it is already chained on, or 0 */
+static uint32_t fat_run_next(int fd) {
+  if((file_num[fd].cluster >= file_num[fd].run_start) &&
+     (file_num[fd].cluster + 1 < file_num[fd].run_end)) {
+    return file_num[fd].cluster + 1;
+  }
+  return 0;
+}
+
+/* update the directory entry of a file which is growing.  Other files do it in the metadata
+ * cache whenever they get a new cluster, recording files only when they pass a checkpoint, but
+ * then they write it and the FAT out, so that a power cut loses at most a checkpoint's worth */
+static void fat_checkpoint(int fd) {
+  struct fat_volume *vol = file_num[fd].vol;
+  uint32_t pos;
+  if(!(file_num[fd].flags & FAT_FLAG_RECORD)) {
+    fat_flush_fileinfo(fd);
+    return;
+  }
+  if(GRISTLE_RECORD_CHECKPOINT == 0) {
+    return;
+  }
+  pos = (file_num[fd].file_sector + 1) * 512;
+  if((pos / GRISTLE_RECORD_CHECKPOINT) != ((pos - 512) / GRISTLE_RECORD_CHECKPOINT)) {
+    fat_flush_fileinfo(fd);
+    fat_meta_flush(vol);
+  }
+}
+
+/* give back the clusters of a file's run which it didn't use, when it is closed.  That needs the
+ * file at its end, as an append leaves it, so it is moved there if it isn't */
+static int fat_run_trim(int fd) {
+  struct fat_volume *vol = file_num[fd].vol;
+  uint32_t next;
+  int rerrno;
+  int r = 0;
+  if(file_num[fd].run_end == 0) {
+    return 0;
+  }
+  if((file_num[fd].file_sector * 512 + file_num[fd].cursor != file_num[fd].size) &&
+     (fat_lseek_unlocked(fd, 0, SEEK_END, &rerrno) < 0)) {
+    return -1;
+  }
+  next = fat_run_next(fd);
+  if((next == 0) || (file_num[fd].cursor == 0)) {
+    return 0;
+  }
+  if(GRISTLE_SYSLOCK) {
+    r = fat_chain_run(vol, file_num[fd].cluster, 1);
+    GRISTLE_SYSUNLOCK;
+  }
+  if(r == 0) {
+    r = fat_free_clusters(vol, next);
+  }
+  fat_extent_cut(fd, file_num[fd].file_sector / vol->sectors_per_cluster + 1);
+  file_num[fd].run_end = next;
+  return r;
+}
+
+/* the block after the last one a recording file wrote, a recording session only has to be
+ * moved when a file's next sector isn't this one */
+static blockno_t fat_record_next = 0;
+
+/* write the changed sectors of a file's window, in one go.  Recording files go through the block
+ * driver's recording session so that a long append reaches the card as one multi-block write */
+static int fat_write_window(int fd) {
+  struct fat_volume *vol = file_num[fd].vol;
+  fat_meta_sector *m;
+  blockno_t first = file_num[fd].win_sector + file_num[fd].dirty_lo;
+  blockno_t count = file_num[fd].dirty_hi - file_num[fd].dirty_lo;
+  uint8_t *data = file_num[fd].window + file_num[fd].dirty_lo * 512;
+  blockno_t i;
+  /* a directory written as a file may have sectors in the metadata cache, which must match */
+  for(i=0;i<count;i++) {
+    if((m = fat_meta_find(vol, first + i))) {
+      memcpy(m->data, data + i * 512, 512);
+      m->dirty = 0;
+    }
+  }
+  if(!(file_num[fd].flags & FAT_FLAG_RECORD)) {
+    if(count == 1) {
+      return block_write(first, data);
+    }
+    return block_write_blocks(first, count, data);
+  }
+  if(first != fat_record_next) {
+    if(block_record_start(first)) {
+      fat_record_next = 0;
+      return -1;
+    }
+  }
+  if(block_record_write(data, count)) {
+    fat_record_next = 0;
+    return -1;
+  }
+  fat_record_next = first + count;
+  return 0;
+}
+#endif
+
+/* note that the current sector has changed, the window only writes back the sectors from the
+ * first to the last changed one */
+static void fat_mark_dirty(int fd) {
+  uint8_t n = (file_num[fd].buffer - file_num[fd].window) / 512;
+  if(!(file_num[fd].flags & FAT_FLAG_DIRTY)) {
+    file_num[fd].dirty_lo = n;
+    file_num[fd].dirty_hi = n + 1;
+    file_num[fd].flags |= FAT_FLAG_DIRTY;
+  } else if(n < file_num[fd].dirty_lo) {
+    file_num[fd].dirty_lo = n;
+  } else if(n >= file_num[fd].dirty_hi) {
+    file_num[fd].dirty_hi = n + 1;
+  }
+}
+
+/* write the changed sectors of the buffer back to disc */
 int fat_flush(int fd) {
 #ifdef GRISTLE_RO
     (void)fd;
 #else
+  struct fat_volume *vol = file_num[fd].vol;
   uint32_t cluster;
 #ifdef TRACE
   printf("fat_flush\n");
@@ -489,7 +1510,7 @@ int fat_flush(int fd) {
     if(file_num[fd].sector == 0) {
       /* this is a new file that's never been saved before, it needs a new cluster
        * assigned to it, the data stored, then the meta info flushed */
-      cluster = fat_get_free_cluster();
+      cluster = fat_alloc_cluster(fd, 0);
       if(cluster == 0xFFFFFFFF) {
         return -1;
       } else if(cluster == 0) {
@@ -497,13 +1518,17 @@ int fat_flush(int fd) {
       } else {
 //         file_num[fd].cluster = cluster;
         file_num[fd].full_first_cluster = cluster;
+        file_num[fd].extent_count = 0;
+        fat_extent_add(fd, 0, cluster);
         file_num[fd].flags |= FAT_FLAG_FS_DIRTY;
-        file_num[fd].sector = cluster * fatfs.sectors_per_cluster + fatfs.cluster0;
-        file_num[fd].sectors_left = fatfs.sectors_per_cluster - 1;
+        file_num[fd].sector = cluster * vol->sectors_per_cluster + vol->cluster0;
+        file_num[fd].sectors_left = vol->sectors_per_cluster - 1;
         file_num[fd].cluster = cluster;
-        //         file_num[fd].sector = cluster * fatfs.sectors_per_cluster + fatfs.cluster0;
+        //         file_num[fd].sector = cluster * vol->sectors_per_cluster + vol->cluster0;
+        file_num[fd].win_sector = file_num[fd].sector;
+        file_num[fd].win_count = 1;
       }
-      if(block_write(file_num[fd].sector, file_num[fd].buffer)) {
+      if(fat_write_window(fd)) {
         /* write failed, don't clear the dirty flag */
         return -1;
       }
@@ -513,7 +1538,7 @@ int fat_flush(int fd) {
 //   block_pc_snapshot_all("writenfs.img");
 //       exit(-9);
     } else {
-      if(block_write(file_num[fd].sector, file_num[fd].buffer)) {
+      if(fat_write_window(fd)) {
         /* write failed, don't clear the dirty flag */
         return -1;
       }
@@ -524,32 +1549,123 @@ int fat_flush(int fd) {
   return 0;
 }
 
+/* is a sector in the file's window */
+static int fat_in_window(int fd, blockno_t sector) {
+  return (file_num[fd].win_count > 0) && (sector >= file_num[fd].win_sector) &&
+         (sector < file_num[fd].win_sector + file_num[fd].win_count);
+}
+
+/* moving a file on to its next sector only changes the file's own state if the sector is in its
+ * window already, anything else may go to the medium and needs the shared lock */
+static int fat_next_in_window(int fd) {
+  return (file_num[fd].sectors_left > 0) && fat_in_window(fd, file_num[fd].sector + 1);
+}
+
+/* make the file's current sector available in its buffer.  If it isn't in the window already,
+ * the window is written back if it changed, then moved to the sectors around the current one,
+ * lined up with the start of the cluster and not past its end, and read in one multi-block read.
+ * Sectors past the end of a file have nothing to read, which saves an append reading what it is
+ * about to overwrite, and a recording file interrupting the multi-block write its sectors go out
+ * in.  A directory's sector may be in the metadata cache, with changes which aren't written yet.
+ * A window which only had a new file's first sector keeps it. */
+static int fat_load_sector(int fd) {
+  struct fat_volume *vol = file_num[fd].vol;
+  fat_meta_sector *m;
+  blockno_t first, start;
+  uint32_t len, count, keep, reads, i;
+  if(!fat_in_window(fd, file_num[fd].sector)) {
+    if(fat_flush(fd)) {
+      return -1;
+    }
+    if(file_num[fd].cluster == 1) {
+      first = vol->root_start;
+      len = vol->root_len;
+    } else {
+      first = file_num[fd].cluster * vol->sectors_per_cluster + vol->cluster0;
+      len = vol->sectors_per_cluster;
+    }
+    start = file_num[fd].sector - (file_num[fd].sector - first) % GRISTLE_BUFFER_SECTORS;
+    count = first + len - start;
+    if(count > GRISTLE_BUFFER_SECTORS) {
+      count = GRISTLE_BUFFER_SECTORS;
+    }
+    keep = 0;
+    if((file_num[fd].win_count > 0) && (file_num[fd].win_sector == start)) {
+      keep = file_num[fd].win_count;
+    }
+    reads = count;
+    if(!(file_num[fd].attributes & FAT_ATT_SUBDIR)) {
+      /* the sectors holding the end of the file and before it */
+      i = file_num[fd].file_sector - (file_num[fd].sector - start);
+      if(i * 512 >= file_num[fd].size) {
+        reads = 0;
+      } else if((file_num[fd].size - i * 512 + 511) / 512 < reads) {
+        reads = (file_num[fd].size - i * 512 + 511) / 512;
+      }
+    }
+    if(reads < keep) {
+      reads = keep;
+    }
+    file_num[fd].win_sector = start;
+    file_num[fd].win_count = 0;
+    if(reads > keep + 1) {
+      block_stream_start(start + keep, reads - keep);
+    }
+    for(i=keep;i<reads;i++) {
+      if((m = fat_meta_find(vol, start + i))) {
+        memcpy(file_num[fd].window + i * 512, m->data, 512);
+      } else if(block_read(start + i, file_num[fd].window + i * 512)) {
+        return -1;
+      }
+    }
+    if(count > reads) {
+      memset(file_num[fd].window + reads * 512, 0, (count - reads) * 512);
+    }
+    file_num[fd].win_count = count;
+  }
+  file_num[fd].buffer = file_num[fd].window + (file_num[fd].sector - file_num[fd].win_sector) * 512;
+  return 0;
+}
+
+/* set up the buffer of a file which has no clusters yet, it gets one when it is first written */
+static void fat_empty_window(int fd) {
+  file_num[fd].sector = 0;
+  file_num[fd].cluster = 0;
+  file_num[fd].sectors_left = 0;
+  file_num[fd].cursor = 0;
+  file_num[fd].buffer = file_num[fd].window;
+  file_num[fd].win_sector = 0;
+  file_num[fd].win_count = 1;
+  memset(file_num[fd].window, 0, 512);
+}
+
 /* get the first sector of a given cluster */
 int fat_select_cluster(int fd, uint32_t cluster) {
+  struct fat_volume *vol = file_num[fd].vol;
 #ifdef TRACE
   printf("fat_select_cluster\n");
 #endif
 //   printf("%d: select cluster %d\n  sector=%d\n", fd, cluster, file_num[fd].sector);
   if(cluster == 1) {
     // this is an edge case for the fixed root directory on FAT16
-    file_num[fd].sector = fatfs.root_start;
-    file_num[fd].sectors_left = fatfs.root_len;
+    file_num[fd].sector = vol->root_start;
+    file_num[fd].sectors_left = vol->root_len;
     file_num[fd].cluster = 1;
     file_num[fd].cursor = 0;
   } else {
-    file_num[fd].sector = cluster * fatfs.sectors_per_cluster + fatfs.cluster0;
-    file_num[fd].sectors_left = fatfs.sectors_per_cluster - 1;
+    file_num[fd].sector = cluster * vol->sectors_per_cluster + vol->cluster0;
+    file_num[fd].sectors_left = vol->sectors_per_cluster - 1;
     file_num[fd].cluster = cluster;
     file_num[fd].cursor = 0;
   }
-//   printf("  sector=%d=%d * %d + %d\n", file_num[fd].sector, cluster, fatfs.sectors_per_cluster, fatfs.cluster0);
+//   printf("  sector=%d=%d * %d + %d\n", file_num[fd].sector, cluster, vol->sectors_per_cluster, vol->cluster0);
 
-  return block_read(file_num[fd].sector, file_num[fd].buffer);
+  return fat_load_sector(fd);
 }
 
 /* get the next cluster in the current file */
 int fat_next_cluster(int fd, int *rerrno) {
-  uint32_t i;
+  struct fat_volume *vol = file_num[fd].vol;
   uint32_t j;
   uint32_t k;
 #ifdef TRACE
@@ -568,29 +1684,31 @@ int fat_next_cluster(int fd, int *rerrno) {
     (*rerrno) = 0;
     return -1;
   }
-  i = file_num[fd].cluster;
-  i = i * fatfs.fat_entry_len;     /* either 2 bytes for FAT16 or 4 for FAT32 */
-  j = (i / 512) + fatfs.active_fat_start; /* get the sector number we want */
-  if(block_read(j, file_num[fd].buffer)) {
+#ifndef GRISTLE_RO
+  /* the run a recording file reserved is already chained, so there's no need to read the FAT */
+  k = fat_run_next(fd);
+  if(k != 0) {
+    fat_checkpoint(fd);
+    return k;
+  }
+#endif
+  if(fat_get_entry(vol, file_num[fd].cluster, &j)) {
     (*rerrno) = EIO;
     return -1;
   }
-  i = i & 0x1FF;
-  j = file_num[fd].buffer[i++];
-  j += (file_num[fd].buffer[i++] << 8);
-  if(fatfs.type == PART_TYPE_FAT32) {
-    j += file_num[fd].buffer[i++] << 16;
-    j += file_num[fd].buffer[i++] << 24;
-  }
   if(j < 2) {
     file_num[fd].error = FAT_ERROR_CLUSTER;
     (*rerrno) = EIO;
     return -1;
-  } else if(j >= fatfs.end_cluster_marker) {
+  } else if(j >= vol->end_cluster_marker) {
     if(file_num[fd].flags & FAT_FLAG_WRITE) {
       /* opened for writing, we can extend the file */
       /* find the first available cluster */
-      k = fat_get_free_cluster(fd);
+#ifdef GRISTLE_RO
+      k = fat_get_free_cluster(vol);
+#else
+      k = fat_alloc_cluster(fd, file_num[fd].file_sector / vol->sectors_per_cluster + 1);
+#endif
 //       printf("get free cluster = %u\n", k);
       if(k == 0) {
         (*rerrno) = ENOSPC;
@@ -600,26 +1718,18 @@ int fat_next_cluster(int fd, int *rerrno) {
         (*rerrno) = EIO;
         return -1;
       }
-      i = file_num[fd].cluster;
-      i = i * fatfs.fat_entry_len;
-      j = (i/512) + fatfs.active_fat_start;
-      if(block_read(j, file_num[fd].buffer)) {
-        (*rerrno) = EIO;
-        return -1;
-      }
       /* update the pointer to the new end of chain */
-      if(fatfs.type == PART_TYPE_FAT16) {
-        memcpy(&file_num[fd].buffer[i & 0x1FF], &k, 2);
-      } else {
-        memcpy(&file_num[fd].buffer[i & 0x1FF], &k, 4);
-      }
-      if(block_write(j, file_num[fd].buffer)) {
+      if(fat_set_entry(vol, file_num[fd].cluster, k)) {
         (*rerrno) = EIO;
         return -1;
       }
       /* periodically update the directory entry so that the file size gets flushed
        * when more clusters are added to the file */
+#ifdef GRISTLE_RO
       fat_flush_fileinfo(fd);
+#else
+      fat_checkpoint(fd);
+#endif
       j = k;
     } else {
       /* end of the file cluster chain reached */
@@ -633,14 +1743,17 @@ int fat_next_cluster(int fd, int *rerrno) {
 
 /* get the next sector in the current file. */
 int fat_next_sector(int fd) {
+  struct fat_volume *vol = file_num[fd].vol;
   int c;
   int rerrno;
 #ifdef TRACE
   printf("fat_next_sector(%d)\n", fd);
 #endif
-  /* if the current sector was written write to disc */
-  if(fat_flush(fd)) {
-    return -1;
+  /* if the current sector was written and the next one isn't in the window, write to disc */
+  if((file_num[fd].sectors_left == 0) || !fat_in_window(fd, file_num[fd].sector + 1)) {
+    if(fat_flush(fd)) {
+      return -1;
+    }
   }
   /* see if we need another cluster */
 //   printf("%d sectors_left: %d\n", fd, file_num[fd].sectors_left);
@@ -648,13 +1761,15 @@ int fat_next_sector(int fd) {
     file_num[fd].sectors_left--;
     file_num[fd].file_sector++;
     file_num[fd].cursor = 0;
-    return block_read(++file_num[fd].sector, file_num[fd].buffer);
+    file_num[fd].sector++;
+    return fat_load_sector(fd);
   } else {
 //     printf("At cluster %d\n", file_num[fd].cluster);
     c = fat_next_cluster(fd, &rerrno);
 //     printf("Next cluster %d\n", c);
     if(c > -1) {
       file_num[fd].file_sector++;
+      fat_extent_add(fd, file_num[fd].file_sector / vol->sectors_per_cluster, c);
       return fat_select_cluster(fd, c);
     } else {
       return -1;
@@ -662,24 +1777,105 @@ int fat_next_sector(int fd) {
   }
 }
 
+#ifndef GRISTLE_RO
+/* find the first free entry in a directory, i.e. the one which ends it.  A full directory gets
+ * another cluster, cleared because an entry starting with 0 is the end of a directory, except for
+ * FAT16's root directory which can't grow. */
+static int fat_dir_slot(struct fat_volume *vol, uint32_t cluster, uint32_t *sector,
+                        uint8_t *number) {
+  fat_meta_sector *m;
+  blockno_t s;
+  blockno_t start = 0;
+  uint32_t count;
+  uint32_t next;
+  int i;
+#if GRISTLE_DIR_INDEX_SLOTS > 0
+  fat_dir_index *x;
+
+  /* a directory with an index knows which sector it ends in */
+  if((x = fat_dindex_find(vol, cluster)) != NULL) {
+    cluster = x->end_cluster;
+    start = x->end_sector;
+  }
+#endif
+
+  while(1) {
+    if(cluster == 1) {
+      s = vol->root_start;
+      count = vol->root_len;
+    } else {
+      s = cluster * vol->sectors_per_cluster + vol->cluster0;
+      count = vol->sectors_per_cluster;
+    }
+    if((start > s) && (start < s + count)) {
+      count -= start - s;
+      s = start;
+    }
+    for(;count>0;count--,s++) {
+      if((m = fat_meta_get(vol, s, 1)) == NULL) {
+        return -1;
+      }
+      for(i=0;i<16;i++) {
+        if(m->data[i * 32] == 0) {
+          *sector = s;
+          *number = i;
+#if GRISTLE_DIR_INDEX_SLOTS > 0
+          if(x != NULL) {
+            x->end_cluster = cluster;
+            x->end_sector = s;
+          }
+#endif
+          return 0;
+        }
+      }
+    }
+    if(cluster == 1) {
+      return -1;
+    }
+    if(fat_get_entry(vol, cluster, &next) || (next < 2)) {
+      return -1;
+    }
+    if(next >= vol->end_cluster_marker) {
+      break;
+    }
+    cluster = next;
+  }
+  next = fat_get_free_cluster(vol);
+  if((next == 0) || (next == 0xFFFFFFFF) || fat_set_entry(vol, cluster, next)) {
+    return -1;
+  }
+  /* clear it from the end, so the sector the new entry goes in is the one left in the cache */
+  s = next * vol->sectors_per_cluster + vol->cluster0;
+  for(i=vol->sectors_per_cluster-1;i>=0;i--) {
+    if(fat_meta_get(vol, s + i, 0) == NULL) {
+      return -1;
+    }
+  }
+  *sector = s;
+  *number = 0;
+#if GRISTLE_DIR_INDEX_SLOTS > 0
+  if(x != NULL) {
+    x->end_cluster = next;
+    x->end_sector = s;
+  }
+#endif
+  return 0;
+}
+#endif
+
 /* Function to save file meta-info, (size modified date etc.) */
 int fat_flush_fileinfo(int fd) {
 #ifdef GRISTLE_RO
     (void)fd;
 #else
+  struct fat_volume *vol = file_num[fd].vol;
   direntS de;
-  direntS *de2;
-  int i;
-  uint32_t temp_sectors_left;
-  uint32_t temp_file_sector;
-  uint32_t temp_cluster;
-  uint32_t temp_sector;
-  uint32_t temp_cursor;
+  fat_meta_sector *m;
 #ifdef TRACE
   printf("fat_flush_fileinfo(%d)\n", fd);
 #endif
   
-  if(file_num[fd].full_first_cluster == fatfs.root_cluster) {
+  if(file_num[fd].full_first_cluster == vol->root_cluster) {
     // do nothing to try and update meta info on the root directory
     return 0;
   }
@@ -687,7 +1883,9 @@ int fat_flush_fileinfo(int fd) {
   if((file_num[fd].entry_sector == 0) && (!(file_num[fd].flags & FAT_FLAG_WRITE))) {
     return 0;
   }
-  if(file_num[fd].full_first_cluster == 0) {
+  // a new file which hasn't been written to has no entry yet, an emptied one still needs its
+  // entry updated
+  if((file_num[fd].full_first_cluster == 0) && (file_num[fd].entry_sector == 0)) {
 //     printf("Bad first cluster!\r\n");
 //     printf("  %s\r\n", file_num[fd].filename);
     return 0;
@@ -695,6 +1893,7 @@ int fat_flush_fileinfo(int fd) {
   memcpy(de.filename, file_num[fd].filename, 8);
   memcpy(de.extension, file_num[fd].extension, 3);
   de.attributes = file_num[fd].attributes;
+  de.reserved = 0;
   /* fine resolution = 10ms, only using unix time stamp so save
    * the unit second, create_time only saves in 2s resolution */
   de.create_time_fine = (file_num[fd].created & 1) * 100;
@@ -711,60 +1910,24 @@ int fat_flush_fileinfo(int fd) {
   if(fat_flush(fd)) {
     return -1;
   }
+  /* a new file that's never been written to disc needs an entry in its parent directory.  The
+   * directory is read through the metadata cache, so the file's own buffer and position stay as
+   * they are */
   if(file_num[fd].entry_sector == 0) {
-    /* this is a new file that's never been written to disc */
-    // save the tracking info for this file, we'll need to seek through the parent with
-    // this file descriptor
-    temp_sectors_left = file_num[fd].sectors_left;
-    temp_file_sector = file_num[fd].file_sector;
-    temp_cursor = file_num[fd].cursor;
-    temp_sector = file_num[fd].sector;
-    temp_cluster = file_num[fd].cluster;
-    fat_select_cluster(fd, file_num[fd].parent_cluster);
-    
-    // find the first empty file location in the directory
-    while(1) {
-      // 16 entries per disc block
-      for(i=0;i<16;i++) {
-        de2 = (direntS *)(file_num[fd].buffer + i * 32);
-        if(de2->filename[0] == 0) {
-          // this is an empty entry
-          break;
-        }
-      }
-      if(i < 16) {
-        // we found an empty in this block
-        break;
-      }
-      fat_next_sector(fd);
-    }
-    
-    // save the entry_sector and entry_number
-    file_num[fd].entry_sector = file_num[fd].sector;
-    file_num[fd].entry_number = i;
-    
-    // restore the file tracking info
-    file_num[fd].sectors_left = temp_sectors_left;
-    file_num[fd].file_sector = temp_file_sector;
-    file_num[fd].cursor = temp_cursor;
-    file_num[fd].sector = temp_sector;
-    file_num[fd].cluster = temp_cluster;
-  } else {
-    /* read the directory entry for this file */
-    if(block_read(file_num[fd].entry_sector, file_num[fd].buffer)) {
+    if(fat_dir_slot(vol, file_num[fd].parent_cluster, &file_num[fd].entry_sector,
+                    &file_num[fd].entry_number)) {
       return -1;
     }
+    fat_dindex_add(vol, file_num[fd].parent_cluster, de.filename, file_num[fd].entry_sector);
   }
-  /* copy the new entry over the old */
-  memcpy(&file_num[fd].buffer[file_num[fd].entry_number * 32], &de, 32);
-  /* write the modified directory entry back to disc */
-  if(block_write(file_num[fd].entry_sector, file_num[fd].buffer)) {
-    return -1;
-  }
-  /* fetch the sector that was expected back into the buffer */
-  if(block_read(file_num[fd].sector, file_num[fd].buffer)) {
+  /* copy the new entry over the old, it is written back with the rest of the cache */
+  if((m = fat_meta_get(vol, file_num[fd].entry_sector, 1)) == NULL) {
     return -1;
   }
+  memcpy(&m->data[file_num[fd].entry_number * 32], &de, 32);
+  m->dirty = 1;
+  fat_dentry_put(vol, file_num[fd].parent_cluster, de.filename, file_num[fd].entry_sector,
+                 file_num[fd].entry_number, &de);
 #endif
   /* mark the filesystem as consistent now */
   file_num[fd].flags &= ~FAT_FLAG_FS_DIRTY;
@@ -772,14 +1935,22 @@ int fat_flush_fileinfo(int fd) {
 }
 
 int fat_lookup_path(int fd, const char *path, int *rerrno) {
+  struct fat_volume *vol = file_num[fd].vol;
   char dosname[12];
   char dosname2[13];
   char isdir;
   int i;
   int path_pointer = 0;
   direntS *de;
+  fat_dentry *cached;
+  uint32_t parent;
+  blockno_t entry_sector;
+  uint8_t number = 0;
+  uint8_t entry[32];
+  int found;
   char local_path[100];
   char *elements[20];
+  char *save;           /* strtok_r()'s place, strtok() keeps it where other threads share it */
   int levels = 0;
   int depth = 0;
   
@@ -801,9 +1972,9 @@ int fat_lookup_path(int fd, const char *path, int *rerrno) {
 //   }
   strcpy(local_path, path);
   
-  if((elements[levels] = strtok(local_path, "/"))) {
+  if((elements[levels] = strtok_r(local_path, "/", &save))) {
     while(++levels < 20) {
-      if(!(elements[levels] = strtok(NULL, "/"))) {
+      if(!(elements[levels] = strtok_r(NULL, "/", &save))) {
         break;
       }
     }
@@ -814,14 +1985,11 @@ int fat_lookup_path(int fd, const char *path, int *rerrno) {
 //     printf("\t%s\n", elements[i]);
 //   }
 //   printf("\t--------------\n");
-  /* select root directory */
-  fat_select_cluster(fd, fatfs.root_cluster);
-
   path_pointer++;
 
   if(levels == 0) {
     /* user selected the root directory to open. */
-    file_num[fd].full_first_cluster = fatfs.root_cluster;
+    file_num[fd].full_first_cluster = vol->root_cluster;
     file_num[fd].entry_sector = 0;
     file_num[fd].entry_number = 0;
     file_num[fd].file_sector = 0;
@@ -830,11 +1998,13 @@ int fat_lookup_path(int fd, const char *path, int *rerrno) {
     file_num[fd].accessed = 0;
     file_num[fd].modified = 0;
     file_num[fd].created = 0;
+    file_num[fd].extent_count = 0;
     fat_select_cluster(fd, file_num[fd].full_first_cluster);
     return 0;
   }
 
-  file_num[fd].parent_cluster = fatfs.root_cluster;
+  parent = vol->root_cluster;
+  file_num[fd].parent_cluster = parent;
   while(1) {
     if(depth > levels) {
 //       printf("Serious filesystem error\r\n");
@@ -859,64 +2029,81 @@ int fat_lookup_path(int fd, const char *path, int *rerrno) {
 //     path_pointer += r;
 //     printf("\"%s\" depth=%d, levels=%d\r\n", dosname, depth, levels);
     depth ++;
-    while(1) {
-//       printf("looping [s:%d/%d c:%d]\r\n", file_num[fd].sectors_left, fatfs.sectors_per_cluster, file_num[fd].cluster);
-      for(i=0;i<16;i++) {
-        if(*(char *)(file_num[fd].buffer + (i * 32)) == 0) {
-          memcpy(file_num[fd].filename, dosname, 8);
-          memcpy(file_num[fd].extension, dosname+8, 3);
-          if(depth < levels) {
-            *rerrno = GRISTLE_BAD_PATH;
-          } else {
-            *rerrno = ENOENT;
+    /* the directory is only read if the cache doesn't know the name */
+    if((cached = fat_dentry_find(vol, parent, dosname)) != NULL) {
+      entry_sector = cached->sector;
+      i = cached->number;
+      de = (direntS *)cached->entry;
+    } else if((found = fat_dindex_lookup(vol, parent, dosname, &entry_sector, &number,
+                                         entry)) >= 0) {
+      /* the directory's name index knows which sector the name is in, or that it isn't there */
+      if(found == 0) {
+        entry_sector = 0;
+      }
+      i = number;
+      de = (direntS *)entry;
+      fat_dentry_put(vol, parent, dosname, entry_sector, i, found ? de : NULL);
+    } else {
+      /* the file is the directory while it is searched, so all its sectors get read */
+      file_num[fd].error = 0;
+      file_num[fd].attributes = FAT_ATT_SUBDIR;
+      if(fat_select_cluster(fd, parent)) {
+        (*rerrno) = EIO;
+        return -1;
+      }
+      entry_sector = 0;
+      while(1) {
+//       printf("looping [s:%d/%d c:%d]\r\n", file_num[fd].sectors_left, vol->sectors_per_cluster, file_num[fd].cluster);
+        for(i=0;i<16;i++) {
+          if(*(char *)(file_num[fd].buffer + (i * 32)) == 0) {
+            break;
           }
-          return -1;
+          if(strncmp(dosname, (char *)(file_num[fd].buffer + (i * 32)), 11) == 0) {
+            entry_sector = file_num[fd].sector;
+            break;
+          }
+//         file_num[fd].buffer[i * 32 + 11] = 0;
+//         printf("%s %d\r\n", (char *)(file_num[fd].buffer + (i * 32)), i);
         }
-        if(strncmp(dosname, (char *)(file_num[fd].buffer + (i * 32)), 11) == 0) {
+        if(i < 16) {
           break;
         }
-//         file_num[fd].buffer[i * 32 + 11] = 0;
-//         printf("%s %d\r\n", (char *)(file_num[fd].buffer + (i * 32)), i);
-      }
-      if(i == 16) {
         if(fat_next_sector(fd) != 0) {
-          memcpy(file_num[fd].filename, dosname, 8);
-          memcpy(file_num[fd].extension, dosname+8, 3);
-          if(depth < levels) {
-            (*rerrno) = GRISTLE_BAD_PATH;
-          } else {
-            (*rerrno) = ENOENT;
-          }
-          return -1;
+          break;
         }
+      }
+      de = (direntS *)(file_num[fd].buffer + (i * 32));
+      /* only remember that the name isn't there if the end of the directory was reached, not on
+       * a read error */
+      if((entry_sector != 0) || (i < 16) || (file_num[fd].error == FAT_END_OF_FILE)) {
+        fat_dentry_put(vol, parent, dosname, entry_sector, i, (entry_sector == 0) ? NULL : de);
+      }
+    }
+    if(entry_sector == 0) {
+      memcpy(file_num[fd].filename, dosname, 8);
+      memcpy(file_num[fd].extension, dosname+8, 3);
+      if(depth < levels) {
+        (*rerrno) = GRISTLE_BAD_PATH;
       } else {
-        break;
+        (*rerrno) = ENOENT;
       }
+      return -1;
     }
 //     printf("got here %d\r\n", i);
-    de = (direntS *)(file_num[fd].buffer + (i * 32));
 //     iprintf("%s\r\n", de->filename);
     isdir = de->attributes & 0x10;
     /* if dir, and there are more path elements, select */
     if(isdir && (depth < levels)) {
 //       depth++;
-      if(fatfs.type == PART_TYPE_FAT16) {
-        if(de->first_cluster == 0) {
-          file_num[fd].parent_cluster = fatfs.root_cluster;
-          fat_select_cluster(fd, fatfs.root_cluster);
-        } else {
-          file_num[fd].parent_cluster = de->first_cluster;
-          fat_select_cluster(fd, de->first_cluster);
-        }
+      if(vol->type == PART_TYPE_FAT16) {
+        parent = de->first_cluster;
       } else {
-        if(de->first_cluster + (de->high_first_cluster << 16) == 0) {
-          file_num[fd].parent_cluster = fatfs.root_cluster;
-          fat_select_cluster(fd, fatfs.root_cluster);
-        } else {
-          file_num[fd].parent_cluster = de->first_cluster + (de->high_first_cluster << 16);
-          fat_select_cluster(fd, de->first_cluster + (de->high_first_cluster << 16));
-        }
+        parent = de->first_cluster + (de->high_first_cluster << 16);
+      }
+      if(parent == 0) {
+        parent = vol->root_cluster;
       }
+      file_num[fd].parent_cluster = parent;
     } else if((depth < levels)) {
       /* path end not reached but this is not a directory */
       (*rerrno) = ENOTDIR;
@@ -929,25 +2116,32 @@ int fat_lookup_path(int fd, const char *path, int *rerrno) {
       memcpy(file_num[fd].extension, de->extension, 3);
       file_num[fd].attributes = de->attributes;
       file_num[fd].size = de->size;
-      if(fatfs.type == PART_TYPE_FAT16) {
+      if(vol->type == PART_TYPE_FAT16) {
         file_num[fd].full_first_cluster = de->first_cluster;
       } else {
         file_num[fd].full_first_cluster = de->first_cluster + (de->high_first_cluster << 16);
       }
 
       /* this following special case occurs when a subdirectory's .. entry is opened. */
-      if(file_num[fd].full_first_cluster == 0) {
-        file_num[fd].full_first_cluster = fatfs.root_cluster;
+      if((file_num[fd].full_first_cluster == 0) && (file_num[fd].attributes & FAT_ATT_SUBDIR)) {
+        file_num[fd].full_first_cluster = vol->root_cluster;
       }
 
-      file_num[fd].entry_sector = file_num[fd].sector;
+      file_num[fd].entry_sector = entry_sector;
       file_num[fd].entry_number = i;
       file_num[fd].file_sector = 0;
+      file_num[fd].extent_count = 0;
       
       file_num[fd].created = fat_to_unix_date(de->create_date) + fat_to_unix_time(de->create_time) + de->create_time_fine;
-      file_num[fd].modified = fat_to_unix_date(de->modified_date) + fat_to_unix_time(de->modified_date);
+      file_num[fd].modified = fat_to_unix_date(de->modified_date) + fat_to_unix_time(de->modified_time);
       file_num[fd].accessed = fat_to_unix_date(de->access_date);
-      fat_select_cluster(fd, file_num[fd].full_first_cluster);
+      if(file_num[fd].full_first_cluster == 0) {
+        /* an empty file has no clusters yet, it gets one when it is first written, like a new
+         * file */
+        fat_empty_window(fd);
+      } else {
+        fat_select_cluster(fd, file_num[fd].full_first_cluster);
+      }
       break;
     }
   }
@@ -955,15 +2149,15 @@ int fat_lookup_path(int fd, const char *path, int *rerrno) {
   return 0;
 }
 
-int fat_mount_fat16(blockno_t start, blockno_t volume_size) {
+int fat_mount_fat16(struct fat_volume *vol, blockno_t start, blockno_t volume_size) {
   blockno_t i;
   boot_sector_fat16 *boot16;
   
   if(GRISTLE_SYSLOCK) {
-    fatfs.read_only = block_get_device_read_only();
-    block_read(start, fatfs.sysbuf);
+    vol->read_only = block_get_device_read_only();
+    block_read(start, vol->sysbuf);
     
-    boot16 = (boot_sector_fat16 *)fatfs.sysbuf;
+    boot16 = (boot_sector_fat16 *)vol->sysbuf;
     // now validate all fields and reject the block device if anything fails
     
     // could check the volume name is all printable characters
@@ -1049,20 +2243,20 @@ int fat_mount_fat16(blockno_t start, blockno_t volume_size) {
       }
     }
     
-    fatfs.sectors_per_cluster = boot16->cluster_size;
-    fatfs.root_len = (boot16->root_entries * 32) / 512;
+    vol->sectors_per_cluster = boot16->cluster_size;
+    vol->root_len = (boot16->root_entries * 32) / 512;
     i = start;
     i += boot16->reserved_sectors;
-    fatfs.active_fat_start = i;
-    fatfs.sectors_per_fat = boot16->sectors_per_fat;
+    vol->active_fat_start = i;
+    vol->sectors_per_fat = boot16->sectors_per_fat;
     i += (boot16->sectors_per_fat * boot16->num_fats);
-    fatfs.root_start = i;
+    vol->root_start = i;
     i += (boot16->root_entries * 32) / 512;
     i -= (boot16->cluster_size * 2);
-    fatfs.cluster0 = i;
+    vol->cluster0 = i;
     
     // check the calculated values are within the volume 
-    if(fatfs.root_start > (start + volume_size)) {
+    if(vol->root_start > (start + volume_size)) {
 #ifdef FAT_DEBUG
       printf("Root start is beyond the end of the volume.\r\n");
 #endif
@@ -1071,17 +2265,18 @@ int fat_mount_fat16(blockno_t start, blockno_t volume_size) {
     }
     
     if(boot16->total_sectors == 0) {
-      fatfs.total_sectors = boot16->big_total_sectors;
+      vol->total_sectors = boot16->big_total_sectors;
     } else {
-      fatfs.total_sectors = boot16->total_sectors;
+      vol->total_sectors = boot16->total_sectors;
     }
     
     // validated a FAT16 volume boot record, setup the FAT16 abstraction values
-    fatfs.type = PART_TYPE_FAT16;
-    fatfs.fat_entry_len = 2;
-    fatfs.end_cluster_marker = 0xFFF0;
-    fatfs.part_start = start;
-    fatfs.root_cluster = 1;
+    vol->type = PART_TYPE_FAT16;
+    vol->fat_entry_len = 2;
+    vol->end_cluster_marker = 0xFFF0;
+    vol->part_start = start;
+    vol->root_cluster = 1;
+    vol->fs_info = 0;
 
   } else {
     return -1;
@@ -1090,16 +2285,16 @@ int fat_mount_fat16(blockno_t start, blockno_t volume_size) {
   return 0;
 }
 
-int fat_mount_fat32(blockno_t start, blockno_t volume_size) {
+int fat_mount_fat32(struct fat_volume *vol, blockno_t start, blockno_t volume_size) {
   blockno_t i;
   boot_sector_fat32 *boot32;
   
   if(GRISTLE_SYSLOCK) {
     
-    fatfs.read_only = block_get_device_read_only();
-    block_read(start, fatfs.sysbuf);
+    vol->read_only = block_get_device_read_only();
+    block_read(start, vol->sysbuf);
     
-    boot32 = (boot_sector_fat32 *)fatfs.sysbuf;
+    boot32 = (boot_sector_fat32 *)vol->sysbuf;
     // now validate all fields and reject the block device if anything fails
     
     // could check the volume name is all printable characters
@@ -1185,28 +2380,33 @@ int fat_mount_fat32(blockno_t start, blockno_t volume_size) {
       }
     }
     
-    boot32 = (boot_sector_fat32 *)fatfs.sysbuf;
-    fatfs.sectors_per_cluster = boot32->cluster_size;
+    boot32 = (boot_sector_fat32 *)vol->sysbuf;
+    vol->sectors_per_cluster = boot32->cluster_size;
     i = start;
     i += boot32->reserved_sectors;
-    fatfs.active_fat_start = i;
-    fatfs.sectors_per_fat = boot32->sectors_per_fat;
+    vol->active_fat_start = i;
+    vol->sectors_per_fat = boot32->sectors_per_fat;
     i += boot32->sectors_per_fat * boot32->num_fats;
     i -= boot32->cluster_size * 2;
-    fatfs.cluster0 = i;
-    fatfs.root_cluster = boot32->root_start;
+    vol->cluster0 = i;
+    vol->root_cluster = boot32->root_start;
 
     if(boot32->total_sectors == 0) {
-      fatfs.total_sectors = boot32->big_total_sectors;
+      vol->total_sectors = boot32->big_total_sectors;
     } else {
-      fatfs.total_sectors = boot32->total_sectors;
+      vol->total_sectors = boot32->total_sectors;
     }
     
     // validated a FAT32 volume boot record, setup the FAT32 abstraction values
-    fatfs.type = PART_TYPE_FAT32;
-    fatfs.fat_entry_len = 4;
-    fatfs.end_cluster_marker = 0xFFFFFF0;
-    fatfs.part_start = start;
+    vol->type = PART_TYPE_FAT32;
+    vol->fat_entry_len = 4;
+    vol->end_cluster_marker = 0xFFFFFF0;
+    vol->part_start = start;
+    // the FSInfo sector is in the reserved area, 0 or 0xFFFF mean there isn't one
+    vol->fs_info = 0;
+    if((boot32->fs_info_start > 0) && (boot32->fs_info_start < boot32->reserved_sectors)) {
+      vol->fs_info = start + boot32->fs_info_start;
+    }
   } else {
     // failed to get mutex
     return -1;
@@ -1219,39 +2419,121 @@ int fat_mount_fat32(blockno_t start, blockno_t volume_size) {
  * callable file access routines
  */
 
+#ifdef GRISTLE_PROBE
+/* measure the medium, so the layers above can pick their policies from block_get_profile().
+ * The blocks between the partition table and the partition aren't used by the filesystem
+ * (cards formatted to the SD association's layout have several MB there), so they are the
+ * scratch area for the write test, which puts back what was there anyway. */
+void fat_probe(struct fat_volume *vol, blockno_t part_start) {
+  blockno_t scratch = 0;
+  if((part_start > 1) && !vol->read_only) {
+    scratch = part_start - 1;
+  }
+  block_probe(1, scratch);
+}
+#endif
+
 /**
  * \brief Attempts to mount a partition starting at the addressed block.
  * 
+ * If Gristle is built with GRISTLE_PROBE defined, a successful mount also runs block_probe().
  **/
-int fat_mount(blockno_t part_start, blockno_t volume_size, uint8_t filesystem_hint) {
+int fat_mount(struct fat_volume *vol, blockno_t part_start, blockno_t volume_size,
+              uint8_t filesystem_hint) {
+  int r;
+  fat_make_locks();
+  GRISTLE_LOCK(fat_sys_lock);
   if(filesystem_hint == PART_TYPE_FAT16) {
-    // try FAT16 first
-    if(fat_mount_fat16(part_start, volume_size) == 0) {
-      return 0;
-    } else {
-      // try FAT32 as a fallback
-      if(fat_mount_fat32(part_start, volume_size) == 0) {
-        return 0;
-      }
+    // try FAT16 first, FAT32 as a fallback
+    r = fat_mount_fat16(vol, part_start, volume_size);
+    if(r) {
+      r = fat_mount_fat32(vol, part_start, volume_size);
     }
   } else {
-    if(fat_mount_fat32(part_start, volume_size) == 0) {
-      return 0;
-    } else {
-      if(fat_mount_fat16(part_start, volume_size) == 0) {
-        return 0;
+    r = fat_mount_fat32(vol, part_start, volume_size);
+    if(r) {
+      r = fat_mount_fat16(vol, part_start, volume_size);
+    }
+  }
+  if(r) {
+    GRISTLE_UNLOCK(fat_sys_lock);
+    return -1;            // no FAT type working
+  }
+  fat_meta_init(vol);
+  fat_dentry_init(vol);
+  fat_dindex_init(vol);
+  fat_map_init(vol);
+  fat_info_load(vol);
+#ifdef GRISTLE_PROBE
+  /* volumes on the same card share its profile */
+  if(!block_get_profile()->probed) {
+    fat_probe(vol, part_start);
+  }
+#endif
+  GRISTLE_UNLOCK(fat_sys_lock);
+  return 0;
+}
+
+int fat_umount(struct fat_volume *vol) {
+  int r = 0;
+  GRISTLE_LOCK(fat_sys_lock);
+  if(fat_meta_flush(vol) || fat_info_flush(vol) || block_flush_cache()) {
+    r = -1;
+  }
+  GRISTLE_UNLOCK(fat_sys_lock);
+  return r;
+}
+
+uint32_t fat_get_free_count(struct fat_volume *vol) {
+  uint32_t i, c, e, end, count;
+  int j;
+  fat_meta_sector *m;
+  count = 0;
+  if(GRISTLE_SYSLOCK) {
+    if(vol->free_count != 0xFFFFFFFF) {
+      count = vol->free_count;
+      GRISTLE_SYSUNLOCK;
+      return count;
+    }
+    end = fat_cluster_end(vol);
+    for(i=0;i<vol->sectors_per_fat;i++) {
+      if(!fat_map_free(vol, i)) {
+        continue;
+      }
+      if((m = fat_meta_get(vol, vol->active_fat_start + i, 1)) == NULL) {
+        GRISTLE_SYSUNLOCK;
+        return 0xFFFFFFFF;
+      }
+      for(j=0;j<(512/vol->fat_entry_len);j++) {
+        c = i * (512 / vol->fat_entry_len) + j;
+        if(c >= end) {
+          break;
+        }
+        e = m->data[j*vol->fat_entry_len];
+        e += m->data[j*vol->fat_entry_len+1] << 8;
+        if(vol->type == PART_TYPE_FAT32) {
+          e += m->data[j*vol->fat_entry_len+2] << 16;
+          e += m->data[j*vol->fat_entry_len+3] << 24;
+        }
+        if(e == 0) {
+          count++;
+        }
       }
     }
+    vol->free_count = count;
+    vol->info_dirty = 1;
+    GRISTLE_SYSUNLOCK;
   }
-  return -1;            // no FAT type working
+  return count;
 }
 
-int fat_open(const char *name, int flags, int mode, int *rerrno) {
+static int fat_open_unlocked(struct fat_volume *vol, const char *name, int flags, int mode,
+                             int *rerrno) {
   int i;
   int8_t fd;
   
 //   printf("fat_open(%s, %x)\n", name, flags);
-  fd = fat_get_next_file();
+  fd = fat_get_next_file(vol);
   if(fd < 0) {
     (*rerrno) = ENFILE;
     return -1;   /* too many open files */
@@ -1276,22 +2558,19 @@ int fat_open(const char *name, int flags, int mode, int *rerrno) {
     /* file doesn't exist */
     if((flags & (O_CREAT)) == 0) {
       /* tried to open a non-existent file with no create */
-      file_num[fd].flags = 0;
+      fat_put_file(fd);
       (*rerrno) = ENOENT;
       return -1;
     } else {
       /* opening a new file for writing */
       /* only create files in directories that aren't read only */
-      if(fatfs.read_only) {
-        file_num[fd].flags = 0;
+      if(vol->read_only) {
+        fat_put_file(fd);
         (*rerrno) = EROFS;
         return -1;
       }
       /* create an empty file structure ready for use */
-      file_num[fd].sector = 0;
-      file_num[fd].cluster = 0;
-      file_num[fd].sectors_left = 0;
-      file_num[fd].cursor = 0;
+      fat_empty_window(fd);
       file_num[fd].error = 0;
       if(mode & S_IWUSR) {
         file_num[fd].attributes = FAT_ATT_ARC;
@@ -1303,12 +2582,11 @@ int fat_open(const char *name, int flags, int mode, int *rerrno) {
       file_num[fd].entry_sector = 0;
       file_num[fd].entry_number = 0;
       file_num[fd].file_sector = 0;
+      file_num[fd].extent_count = 0;
       file_num[fd].created = GRISTLE_TIME;
       file_num[fd].modified = 0;
       file_num[fd].accessed = 0;
       
-      memset(file_num[fd].buffer, 0, 512);
-      
       // need to make sure we don't set the file system as dirty until we've actually
       // written to the file.
       //file_num[fd].flags |= FAT_FLAG_FS_DIRTY;
@@ -1319,14 +2597,14 @@ int fat_open(const char *name, int flags, int mode, int *rerrno) {
       /* if a parent folder of the requested file does not exist we can't create the file
        * so a different response is given from the lookup path, but the POSIX standard
        * still requires ENOENT returned. */
-      file_num[fd].flags = 0;
+      fat_put_file(fd);
       (*rerrno) = ENOENT;
       return -1;
   } else if(i == 0) {
     /* file does exist */
     if((flags & O_CREAT) && (flags & O_EXCL)) {
       /* tried to force creation of an existing file */
-      file_num[fd].flags = 0;
+      fat_put_file(fd);
       (*rerrno) = EEXIST;
       return -1;
     } else {
@@ -1336,15 +2614,15 @@ int fat_open(const char *name, int flags, int mode, int *rerrno) {
         return fd;
       } else {
         /* file opened for write access, check permissions */
-        if(fatfs.read_only) {
+        if(vol->read_only) {
           /* requested write on read only filesystem */
-          file_num[fd].flags = 0;
+          fat_put_file(fd);
           (*rerrno) = EROFS;
           return -1;
         }
         if(file_num[fd].attributes & FAT_ATT_RO) {
           /* The file is read-only refuse permission */
-          file_num[fd].flags = 0;
+          fat_put_file(fd);
           (*rerrno) = EACCES;
           return -1;
         }
@@ -1355,20 +2633,19 @@ int fat_open(const char *name, int flags, int mode, int *rerrno) {
             file_num[fd].file_sector = 0;
             return fd;
           } else {
-            file_num[fd].flags = 0;
+            fat_put_file(fd);
             (*rerrno) = EISDIR;
             return -1;
           }
         }
         if(flags & O_TRUNC) {
           /* Need to truncate the file to zero length */
-          fat_free_clusters(file_num[fd].full_first_cluster);
+          fat_free_clusters(vol, file_num[fd].full_first_cluster);
           file_num[fd].size = 0;
           file_num[fd].full_first_cluster = 0;
-          file_num[fd].sector = 0;
-          file_num[fd].cluster = 0;
-          file_num[fd].sectors_left = 0;
+          fat_empty_window(fd);
           file_num[fd].file_sector = 0;
+          file_num[fd].extent_count = 0;
           file_num[fd].created = GRISTLE_TIME;
           file_num[fd].modified = GRISTLE_TIME;
           file_num[fd].flags |= FAT_FLAG_FS_DIRTY;
@@ -1378,12 +2655,76 @@ int fat_open(const char *name, int flags, int mode, int *rerrno) {
       }
     }
   } else {
-    file_num[fd].flags = 0;
+    fat_put_file(fd);
+    return -1;
+  }
+}
+
+int fat_open(struct fat_volume *vol, const char *name, int flags, int mode, int *rerrno) {
+  int r;
+  GRISTLE_LOCK(fat_sys_lock);
+  r = fat_open_unlocked(vol, name, flags, mode, rerrno);
+  GRISTLE_UNLOCK(fat_sys_lock);
+  return r;
+}
+
+static int fat_close_unlocked(int fd, int *rerrno) {
+  struct fat_volume *vol;
+  (*rerrno) = 0;
+  if(fd >= MAX_OPEN_FILES) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(!(file_num[fd].flags & FAT_FLAG_OPEN)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  vol = file_num[fd].vol;
+  if(file_num[fd].flags & FAT_FLAG_DIRTY) {
+    if(fat_flush(fd)) {
+      (*rerrno) = EIO;
+      return -1;
+    }
+  }
+  if(file_num[fd].flags & FAT_FLAG_FS_DIRTY) {
+    if(fat_flush_fileinfo(fd)) {
+      (*rerrno) = EIO;
+      return -1;
+    }
+  }
+#ifndef GRISTLE_RO
+  if(file_num[fd].flags & FAT_FLAG_RECORD) {
+    fat_record_next = 0;
+    if(block_record_stop()) {
+      (*rerrno) = EIO;
+      return -1;
+    }
+  }
+  if(fat_run_trim(fd)) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+#endif
+  if(fat_meta_flush(vol)) {
+    (*rerrno) = EIO;
     return -1;
   }
+  fat_put_file(fd);
+  return 0;
 }
 
 int fat_close(int fd, int *rerrno) {
+  int r;
+  if(fat_lock(fd, 1, rerrno)) {
+    return -1;
+  }
+  r = fat_close_unlocked(fd, rerrno);
+  fat_unlock(fd, 1);
+  return r;
+}
+
+static int fat_fsync_unlocked(int fd, int *rerrno) {
+  struct fat_volume *vol;
   (*rerrno) = 0;
   if(fd >= MAX_OPEN_FILES) {
     (*rerrno) = EBADF;
@@ -1393,6 +2734,7 @@ int fat_close(int fd, int *rerrno) {
     (*rerrno) = EBADF;
     return -1;
   }
+  vol = file_num[fd].vol;
   if(file_num[fd].flags & FAT_FLAG_DIRTY) {
     if(fat_flush(fd)) {
       (*rerrno) = EIO;
@@ -1405,25 +2747,106 @@ int fat_close(int fd, int *rerrno) {
       return -1;
     }
   }
-  file_num[fd].flags = 0;
+  if(fat_meta_flush(vol) || fat_info_flush(vol)) {
+    (*rerrno) = EIO;
+    return -1;
+  }
+  /* the blocks are written, now make sure they survive a power cut */
+  if(block_flush_cache()) {
+    (*rerrno) = EIO;
+    return -1;
+  }
   return 0;
 }
 
-int fat_read(int fd, void *buffer, size_t count, int *rerrno) {
-  uint32_t i=0;
-  uint8_t *bt = (uint8_t *)buffer;
-  /* make sure this is an open file and it can be read */
+int fat_fsync(int fd, int *rerrno) {
+  int r;
+  if(fat_lock(fd, 1, rerrno)) {
+    return -1;
+  }
+  r = fat_fsync_unlocked(fd, rerrno);
+  fat_unlock(fd, 1);
+  return r;
+}
+
+static int fat_record_unlocked(int fd, int *rerrno) {
   (*rerrno) = 0;
   if(fd >= MAX_OPEN_FILES) {
     (*rerrno) = EBADF;
     return -1;
   }
-  if((~file_num[fd].flags) & (FAT_FLAG_OPEN | FAT_FLAG_READ)) {
+  if((~file_num[fd].flags) & (FAT_FLAG_OPEN | FAT_FLAG_WRITE)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+#ifdef GRISTLE_RO
+  (*rerrno) = EROFS;
+  return -1;
+#else
+  if(block_get_device_read_only()) {
+    (*rerrno) = EROFS;
+    return -1;
+  }
+  file_num[fd].flags |= FAT_FLAG_RECORD;
+  return 0;
+#endif
+}
+
+int fat_record(int fd, int *rerrno) {
+  int r;
+  if(fat_lock(fd, 0, rerrno)) {
+    return -1;
+  }
+  r = fat_record_unlocked(fd, rerrno);
+  fat_unlock(fd, 0);
+  return r;
+}
+
+/* if a read still needs more than one sector from the current cluster, ask the block driver
+ * to stream them so it doesn't wait for the medium on every sector */
+void fat_read_ahead(int fd, size_t remaining) {
+  uint32_t sectors;
+  uint32_t position;
+  if(fat_in_window(fd, file_num[fd].sector + 1)) {
+    /* the next sector is read already */
+    return;
+  }
+  if(file_num[fd].flags & FAT_FLAG_DIRTY) {
+    /* the buffer gets written back first, which would stop the stream anyway */
+    return;
+  }
+  if(!(file_num[fd].attributes & FAT_ATT_SUBDIR)) {
+    position = file_num[fd].file_sector * 512 + file_num[fd].cursor;
+    if(position >= file_num[fd].size) {
+      return;
+    }
+    if(remaining > file_num[fd].size - position) {
+      remaining = file_num[fd].size - position;
+    }
+  }
+  sectors = (remaining + 511) / 512;
+  if(sectors > file_num[fd].sectors_left) {
+    sectors = file_num[fd].sectors_left;
+  }
+  if(sectors > 1) {
+    block_stream_start(file_num[fd].sector + 1, sectors);
+  }
+}
+
+/* the file's lock is held, or the shared one by a call which opened the file itself */
+static int fat_read_unlocked(int fd, void *buffer, size_t count, int *rerrno) {
+  uint32_t i=0;
+  uint8_t *bt = (uint8_t *)buffer;
+  int r;
+  /* make sure the file can be read */
+  (*rerrno) = 0;
+  if(!(file_num[fd].flags & FAT_FLAG_READ)) {
     (*rerrno) = EBADF;
     return -1;
   }
   
-  /* copy some bytes to the buffer requested */
+  /* copy some bytes to the buffer requested.  Only moving to the next sector needs the shared
+   * lock, the file's buffer is its own */
   while(i < count) {
     if(!(file_num[fd].attributes & FAT_ATT_SUBDIR)) {
       // only check length on regular files, directories don't have a length
@@ -1432,7 +2855,15 @@ int fat_read(int fd, void *buffer, size_t count, int *rerrno) {
       }
     }
     if(file_num[fd].cursor == 512) {
-      if(fat_next_sector(fd)) {
+      if(fat_next_in_window(fd)) {
+        r = fat_next_sector(fd);
+      } else {
+        GRISTLE_LOCK(fat_sys_lock);
+        fat_read_ahead(fd, count - i);
+        r = fat_next_sector(fd);
+        GRISTLE_UNLOCK(fat_sys_lock);
+      }
+      if(r) {
         break;
       }
     }
@@ -1446,27 +2877,51 @@ int fat_read(int fd, void *buffer, size_t count, int *rerrno) {
   return i;
 }
 
-int fat_write(int fd, const void *buffer, size_t count, int *rerrno) {
+int fat_read(int fd, void *buffer, size_t count, int *rerrno) {
+  int r;
+  if(fat_lock(fd, 0, rerrno)) {
+    return -1;
+  }
+  r = fat_read_unlocked(fd, buffer, count, rerrno);
+  fat_unlock(fd, 0);
+  return r;
+}
+
+/* the file's lock is held, or the shared one by a call which opened the file itself */
+static int fat_write_unlocked(int fd, const void *buffer, size_t count, int *rerrno) {
   uint32_t i=0;
+  int marked = 0;
   uint8_t *bt = (uint8_t *)buffer;
+  int r;
   (*rerrno) = 0;
-  if(fd >= MAX_OPEN_FILES) {
-    (*rerrno) = EBADF;
-    return -1;
-  }
-  if((~file_num[fd].flags) & (FAT_FLAG_OPEN | FAT_FLAG_WRITE)) {
+  if(!(file_num[fd].flags & FAT_FLAG_WRITE)) {
     (*rerrno) = EBADF;
     return -1;
   }
-  if(file_num[fd].flags & FAT_FLAG_APPEND) {
-    fat_lseek(fd, 0, SEEK_END, rerrno);
+  /* seeking flushes the current sector, so only do it if the file isn't at its end already */
+  if((file_num[fd].flags & FAT_FLAG_APPEND) &&
+     (file_num[fd].file_sector * 512 + file_num[fd].cursor != file_num[fd].size)) {
+    GRISTLE_LOCK(fat_sys_lock);
+    fat_lseek_unlocked(fd, 0, SEEK_END, rerrno);
+    GRISTLE_UNLOCK(fat_sys_lock);
   }
+  /* so that a file which grows gets the clusters for the whole write in one run */
+  file_num[fd].write_end = file_num[fd].file_sector * 512 + file_num[fd].cursor + count;
   while(i < count) {
     if(file_num[fd].cursor == 512) {
-      if(fat_next_sector(fd)) {
+      if(fat_next_in_window(fd)) {
+        r = fat_next_sector(fd);
+      } else {
+        GRISTLE_LOCK(fat_sys_lock);
+        r = fat_next_sector(fd);
+        GRISTLE_UNLOCK(fat_sys_lock);
+      }
+      if(r) {
+        file_num[fd].write_end = 0;
         (*rerrno) = EIO;
         return -1;
       }
+      marked = 0;
     }
     if(!(file_num[fd].attributes & FAT_ATT_SUBDIR)) {
       if(((file_num[fd].cursor + file_num[fd].file_sector * 512)) == file_num[fd].size) {
@@ -1476,16 +2931,31 @@ int fat_write(int fd, const void *buffer, size_t count, int *rerrno) {
     }
     file_num[fd].buffer[file_num[fd].cursor] = *bt++;
     file_num[fd].cursor++;
-    file_num[fd].flags |= FAT_FLAG_DIRTY;
+    if(!marked) {
+      fat_mark_dirty(fd);
+      marked = 1;
+    }
     i++;
   }
+  file_num[fd].write_end = 0;
   if(i > 0) {
     fat_update_mtime(fd);
   }
   return i;
 }
 
-int fat_fstat(int fd, struct stat *st, int *rerrno) {
+int fat_write(int fd, const void *buffer, size_t count, int *rerrno) {
+  int r;
+  if(fat_lock(fd, 0, rerrno)) {
+    return -1;
+  }
+  r = fat_write_unlocked(fd, buffer, count, rerrno);
+  fat_unlock(fd, 0);
+  return r;
+}
+
+static int fat_fstat_unlocked(int fd, struct stat *st, int *rerrno) {
+  struct fat_volume *vol;
   (*rerrno) = 0;
   if(fd >= MAX_OPEN_FILES) {
     (*rerrno) = EBADF;
@@ -1495,6 +2965,7 @@ int fat_fstat(int fd, struct stat *st, int *rerrno) {
     (*rerrno) = EBADF;
     return -1;
   }
+  vol = file_num[fd].vol;
   st->st_dev = 0;
   st->st_ino = 0;
   if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
@@ -1511,17 +2982,143 @@ int fat_fstat(int fd, struct stat *st, int *rerrno) {
   st->st_atime = file_num[fd].accessed;
   st->st_mtime = file_num[fd].modified;
   st->st_ctime = file_num[fd].created;
-  st->st_blksize = 512;
+  st->st_blksize = 512 * ((GRISTLE_BUFFER_SECTORS < vol->sectors_per_cluster) ?
+                          GRISTLE_BUFFER_SECTORS : vol->sectors_per_cluster);
   st->st_blocks = 1;  /* number of blocks allocated for this object */
   return 0; 
 }
 
-int fat_lseek(int fd, int ptr, int dir, int *rerrno) {
+int fat_fstat(int fd, struct stat *st, int *rerrno) {
+  int r;
+  if(fat_lock(fd, 0, rerrno)) {
+    return -1;
+  }
+  r = fat_fstat_unlocked(fd, st, rerrno);
+  fat_unlock(fd, 0);
+  return r;
+}
+
+static int fat_get_fragments_unlocked(int fd, int *rerrno) {
+  struct fat_volume *vol;
+  uint32_t c, next, n, clusters;
+  uint32_t bytes;
+  int pieces = 1;
+  (*rerrno) = 0;
+  if(fd >= MAX_OPEN_FILES) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  if(!(file_num[fd].flags & FAT_FLAG_OPEN)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  vol = file_num[fd].vol;
+  bytes = vol->sectors_per_cluster * 512;
+  c = file_num[fd].full_first_cluster;
+  if(c == 1) {
+    /* the FAT16 root directory is in one piece of its own */
+    return 1;
+  }
+  if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
+    clusters = 0xFFFFFFFF;
+  } else {
+    clusters = (file_num[fd].size + bytes - 1) / bytes;
+  }
+  if((c < 2) || (clusters == 0)) {
+    return 0;
+  }
+  if(GRISTLE_SYSLOCK) {
+    for(n=1;n<clusters;n++) {
+      if(fat_get_entry(vol, c, &next)) {
+        GRISTLE_SYSUNLOCK;
+        (*rerrno) = EIO;
+        return -1;
+      }
+      if((next < 2) || (next >= vol->end_cluster_marker)) {
+        break;
+      }
+      if(next != c + 1) {
+        pieces++;
+      }
+      c = next;
+    }
+    GRISTLE_SYSUNLOCK;
+  }
+  return pieces;
+}
+
+int fat_get_fragments(int fd, int *rerrno) {
+  int r;
+  if(fat_lock(fd, 1, rerrno)) {
+    return -1;
+  }
+  r = fat_get_fragments_unlocked(fd, rerrno);
+  fat_unlock(fd, 1);
+  return r;
+}
+
+/* find where a file's n'th cluster is, and make it the file's current cluster.  It comes from the
+ * extent list if it is there, otherwise the chain is followed from the furthest cluster known,
+ * filling the list in on the way.  Returns -1 if the chain is shorter, or on a read error. */
+static int fat_find_cluster(int fd, uint32_t n, int *rerrno) {
+  struct fat_volume *vol = file_num[fd].vol;
+  fat_extent *e;
+  uint32_t lo, hi, mid, i, c;
+  int next;
+
+  /* the last extent starting at or before n */
+  lo = 0;
+  hi = file_num[fd].extent_count;
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if(file_num[fd].extents[mid].file_cluster <= n) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if(lo > 0) {
+    e = &file_num[fd].extents[lo - 1];
+    if(n < e->file_cluster + e->length) {
+      file_num[fd].cluster = e->cluster + (n - e->file_cluster);
+      return 0;
+    }
+    /* n is past the end of the list */
+    i = e->file_cluster + e->length - 1;
+    c = e->cluster + e->length - 1;
+  } else {
+    i = 0;
+    c = file_num[fd].full_first_cluster;
+    if(c < 2) {
+      return -1;
+    }
+    fat_extent_add(fd, 0, c);
+  }
+  /* the current cluster may be further on, if the list is full */
+  if((file_num[fd].sector != 0) && (file_num[fd].file_sector / vol->sectors_per_cluster > i) &&
+     (file_num[fd].file_sector / vol->sectors_per_cluster <= n)) {
+    i = file_num[fd].file_sector / vol->sectors_per_cluster;
+    c = file_num[fd].cluster;
+  }
+  file_num[fd].cluster = c;
+  while(i < n) {
+    next = fat_next_cluster(fd, rerrno);
+    if(next < 0) {
+      return -1;
+    }
+    i++;
+    file_num[fd].cluster = next;
+    fat_extent_add(fd, i, next);
+  }
+  return 0;
+}
+
+static int fat_lseek_unlocked(int fd, int ptr, int dir, int *rerrno) {
+  struct fat_volume *vol;
   unsigned int new_pos;
-  unsigned int old_pos;
-  int new_sec;
-  int i;
-  int file_cluster;
+  uint32_t new_sec;
+  uint16_t new_cursor;
+  uint32_t cluster;
   (*rerrno) = 0;
 
   if(fd >= MAX_OPEN_FILES) {
@@ -1532,81 +3129,82 @@ int fat_lseek(int fd, int ptr, int dir, int *rerrno) {
     (*rerrno) = EBADF;
     return ptr-1;    /* tried to seek on a file that's not open */
   }
+  vol = file_num[fd].vol;
   
-  fat_flush(fd);
-  old_pos = file_num[fd].file_sector * 512 + file_num[fd].cursor;
+  /* the window is written back when the file moves out of it, see fat_load_sector() */
   if(dir == SEEK_SET) {
     new_pos = ptr;
-//     iprintf("lseek(%d, %d, SEEK_SET) old_pos = %d, new_pos = %d\r\n", fd, ptr, old_pos, new_pos);
   } else if(dir == SEEK_CUR) {
     new_pos = file_num[fd].file_sector * 512 + file_num[fd].cursor + ptr;
-//     iprintf("lseek(%d, %d, SEEK_CUR) old_pos = %d, new_pos = %d\r\n", fd, ptr, old_pos, new_pos);
   } else {
     new_pos = file_num[fd].size + ptr;
-//     iprintf("lseek(%d, %d, SEEK_END) old_pos = %d, new_pos = %d\r\n", fd, ptr, old_pos, new_pos);
   }
 
-//   iprintf("Seeking in %d byte file.\r\n", file_num[fd].size);
   // directories have zero length so can't do a length check on them.
   if((new_pos > file_num[fd].size) && (!(file_num[fd].attributes & FAT_ATT_SUBDIR))) {
 //     iprintf("seek beyond file.\r\n");
     return ptr-1; /* tried to seek outside a file */
   }
-  // bodge to deal with case where the cursor has just rolled off the sector but we haven't used
-  // the next sector so it isn't loaded yet
-  // has to be done after new_pos is calculated in case it is dependent on the current position
-  if(file_num[fd].cursor == 512) {
-    fat_next_sector(fd);
-  }
-  // optimisation cases
-  if((old_pos/512) == (new_pos/512)) {
-    // case 1: seeking within a disk block
-//     printf("Case 1\n");
-    file_num[fd].cursor = new_pos & 0x1ff;
+  new_sec = new_pos / 512;
+  new_cursor = new_pos & 0x1ff;
+  // the end of a file which fills its last sector is left at the end of that sector, as writing
+  // leaves it, because the sector after it may not be allocated
+  if((new_cursor == 0) && (new_sec > 0) && (new_pos == file_num[fd].size) &&
+     (!(file_num[fd].attributes & FAT_ATT_SUBDIR))) {
+    new_sec--;
+    new_cursor = 512;
+  }
+  if(new_sec == file_num[fd].file_sector) {
+    // case 1: seeking within the disk block which is loaded
+    file_num[fd].cursor = new_cursor;
     return new_pos;
-  } else if((new_pos / (fatfs.sectors_per_cluster * 512)) == (old_pos / (fatfs.sectors_per_cluster * 512))) {
+  }
+  if(file_num[fd].cluster == 1) {
+    // FAT16's root directory isn't a chain, it's a fixed run of sectors
+    if(new_sec >= vol->root_len) {
+      return ptr-1;
+    }
+    file_num[fd].sector = vol->root_start + new_sec;
+    file_num[fd].sectors_left = vol->root_len - new_sec - 1;
+  } else if((new_sec / vol->sectors_per_cluster) ==
+            (file_num[fd].file_sector / vol->sectors_per_cluster)) {
     // case 2: seeking within the cluster, just need to hop forward/back some sectors
-//     printf("%d sector: %d, cursor %d, file_sector: %d, first_sector: %d, sec/clus: %d\n", fd, file_num[fd].sector, file_num[fd].cursor, file_num[fd].file_sector, file_num[fd].full_first_cluster * fatfs.sectors_per_cluster + fatfs.cluster0, fatfs.sectors_per_cluster);
-//     printf("Case 2\n");
-    file_num[fd].file_sector = new_pos / 512;
-    file_num[fd].sector = file_num[fd].sector + (new_pos/512) - (old_pos/512);
-    file_num[fd].sectors_left = file_num[fd].sectors_left - (new_pos/512) + (old_pos/512);
-    file_num[fd].cursor = new_pos & 0x1ff;
-//     printf("%d sector: %d, cursor %d, file_sector: %d, first_sector: %d, sec/clus: %d\n", fd, file_num[fd].sector, file_num[fd].cursor, file_num[fd].file_sector, file_num[fd].full_first_cluster * fatfs.sectors_per_cluster + fatfs.cluster0, fatfs.sectors_per_cluster);
-    if(block_read(file_num[fd].sector, file_num[fd].buffer)) {
-//       iprintf("Bad block read.\r\n");
-      return ptr - 1;
+    file_num[fd].sector = file_num[fd].sector + new_sec - file_num[fd].file_sector;
+    file_num[fd].sectors_left = vol->sectors_per_cluster - 1 - (new_sec % vol->sectors_per_cluster);
+  } else {
+    // otherwise find the cluster, from the extent list if it's there
+    cluster = file_num[fd].cluster;
+    if(fat_find_cluster(fd, new_sec / vol->sectors_per_cluster, rerrno)) {
+      file_num[fd].cluster = cluster;
+      return ptr-1;
     }
-    return new_pos;
-  }
-  // otherwise we need to seek the cluster chain
-  file_cluster = new_pos / (fatfs.sectors_per_cluster * 512);
-  
-  file_num[fd].cluster = file_num[fd].full_first_cluster;
-  i = 0;
-  // walk the FAT cluster chain until we get to the right one
-  while(i<file_cluster) {
-    file_num[fd].cluster = fat_next_cluster(fd, rerrno);
-    i++;
+    file_num[fd].sector = file_num[fd].cluster * vol->sectors_per_cluster + vol->cluster0 +
+                          (new_sec % vol->sectors_per_cluster);
+    file_num[fd].sectors_left = vol->sectors_per_cluster - 1 - (new_sec % vol->sectors_per_cluster);
   }
-  file_num[fd].file_sector = new_pos / 512;
-  file_num[fd].cursor = new_pos & 0x1ff;
-  new_sec = new_pos - file_cluster * fatfs.sectors_per_cluster * 512;
-  new_sec = new_sec / 512;
-  file_num[fd].sector = file_num[fd].cluster * fatfs.sectors_per_cluster + fatfs.cluster0 + new_sec;
-  file_num[fd].sectors_left = fatfs.sectors_per_cluster - new_sec - 1;
-  if(block_read(file_num[fd].sector, file_num[fd].buffer)) {
+  file_num[fd].file_sector = new_sec;
+  file_num[fd].cursor = new_cursor;
+  if(fat_load_sector(fd)) {
     return ptr-1;
-//     iprintf("Bad block read 2.\r\n");
   }
   return new_pos;
 }
 
-int fat_get_next_dirent(int fd, struct dirent *out_de, int *rerrno) {
+int fat_lseek(int fd, int ptr, int dir, int *rerrno) {
+  int r;
+  if(fat_lock(fd, 1, rerrno)) {
+    return ptr-1;
+  }
+  r = fat_lseek_unlocked(fd, ptr, dir, rerrno);
+  fat_unlock(fd, 1);
+  return r;
+}
+
+static int fat_get_next_dirent_unlocked(int fd, struct dirent *out_de, int *rerrno) {
   direntS de;
   
   while(1) {
-    if(fat_read(fd, &de, sizeof(direntS), rerrno) < (int)sizeof(direntS)) {
+    if(fat_read_unlocked(fd, &de, sizeof(direntS), rerrno) < (int)sizeof(direntS)) {
       // either an error or end of the directory
 //       printf("end of directory, read less than %d bytes.\n", sizeof(direntS));
       return -1;
@@ -1621,7 +3219,7 @@ int fat_get_next_dirent(int fd, struct dirent *out_de, int *rerrno) {
       // not an LFN, volume label or deleted entry
       fatname_to_str(out_de->d_name, de.filename);
       
-      if(fatfs.type == PART_TYPE_FAT16) {
+      if(file_num[fd].vol->type == PART_TYPE_FAT16) {
         out_de->d_ino = de.first_cluster;
       } else {
         out_de->d_ino = de.first_cluster + (de.high_first_cluster << 16);
@@ -1631,22 +3229,103 @@ int fat_get_next_dirent(int fd, struct dirent *out_de, int *rerrno) {
   }
 }
 
+int fat_get_next_dirent(int fd, struct dirent *out_de, int *rerrno) {
+  int r;
+  if(fat_lock(fd, 0, rerrno)) {
+    return -1;
+  }
+  r = fat_get_next_dirent_unlocked(fd, out_de, rerrno);
+  fat_unlock(fd, 0);
+  return r;
+}
+
+static int fat_get_next_dirents_unlocked(int fd, fat_dirent *out, int count, int *rerrno) {
+  direntS *de;
+  int n = 0;
+  int r;
+  (*rerrno) = 0;
+  if(!(file_num[fd].attributes & FAT_ATT_SUBDIR)) {
+    (*rerrno) = ENOTDIR;
+    return -1;
+  }
+  if(!(file_num[fd].flags & FAT_FLAG_READ)) {
+    (*rerrno) = EBADF;
+    return -1;
+  }
+  /* entries never span sectors, so each one can be used where it is in the file's buffer.  Only
+   * moving to a sector outside the window needs the shared lock, as in fat_read() */
+  while(n < count) {
+    if(file_num[fd].cursor == 512) {
+      if(fat_next_in_window(fd)) {
+        r = fat_next_sector(fd);
+      } else {
+        GRISTLE_LOCK(fat_sys_lock);
+        fat_read_ahead(fd, (count - n) * sizeof(direntS));
+        r = fat_next_sector(fd);
+        GRISTLE_UNLOCK(fat_sys_lock);
+      }
+      if(r) {
+        break;    /* the end of the directory's clusters */
+      }
+    }
+    de = (direntS *)(file_num[fd].buffer + file_num[fd].cursor);
+    if(de->filename[0] == 0) {
+      /* the end of the directory, the cursor stays here so the next call ends too */
+      break;
+    }
+    file_num[fd].cursor += sizeof(direntS);
+    if((de->attributes == 0xf) || (de->attributes & FAT_ATT_VOL) ||
+       (de->filename[0] == (char)0xe5)) {
+      continue;   /* a long name part, volume label or deleted entry */
+    }
+    fatname_to_str(out[n].d_name, de->filename);
+    out[n].attributes = de->attributes;
+    out[n].size = de->size;
+    out[n].first_cluster = de->first_cluster;
+    if(file_num[fd].vol->type != PART_TYPE_FAT16) {
+      out[n].first_cluster += (uint32_t)de->high_first_cluster << 16;
+    }
+    out[n].created = fat_to_unix_date(de->create_date) + fat_to_unix_time(de->create_time) +
+                     de->create_time_fine;
+    out[n].modified = fat_to_unix_date(de->modified_date) + fat_to_unix_time(de->modified_time);
+    out[n].accessed = fat_to_unix_date(de->access_date);
+    n++;
+  }
+  if(n > 0) {
+    fat_update_atime(fd);
+  }
+  return n;
+}
+
+int fat_get_next_dirents(int fd, fat_dirent *out, int count, int *rerrno) {
+  int r;
+  if(fat_lock(fd, 0, rerrno)) {
+    return -1;
+  }
+  r = fat_get_next_dirents_unlocked(fd, out, count, rerrno);
+  fat_unlock(fd, 0);
+  return r;
+}
+
 /*************************************************************************************************/
 /* High level file system calls based on unistd.h                                                */
 /*************************************************************************************************/
 #ifdef GRISTLE_RO
 // if a read only filesystem build has been defined avoid including any system calls here
-int fat_unlink(const char *path __attribute__((__unused__)), int *rerrno) {
+int fat_unlink(struct fat_volume *vol __attribute__((__unused__)),
+               const char *path __attribute__((__unused__)), int *rerrno) {
     *rerrno = EROFS;
     return -1;
 }
 
-int fat_rmdir(const char *path __attribute__((__unused__)), int *rerrno) {
+int fat_rmdir(struct fat_volume *vol __attribute__((__unused__)),
+              const char *path __attribute__((__unused__)), int *rerrno) {
     *rerrno = EROFS;
     return -1;
 }
 
-int fat_mkdir(const char *path __attribute__((__unused__)), int mode __attribute__((__unused__)),
+int fat_mkdir(struct fat_volume *vol __attribute__((__unused__)),
+              const char *path __attribute__((__unused__)), int mode __attribute__((__unused__)),
               int *rerrno) {
     *rerrno = EROFS;
     return -1;
@@ -1661,32 +3340,45 @@ int fat_mkdir(const char *path __attribute__((__unused__)), int mode __attribute
  * Should be called on files by unlink() and on empty directories by rmdir()
  **/
 int fat_delete(int fd, int *rerrno __attribute__((__unused__))) {
+    struct fat_volume *vol = file_num[fd].vol;
+    fat_meta_sector *m;
+    char name[11];
     // remove the directory entry
     // in fat this just means setting the first character of the filename to 0xe5
-    block_read(file_num[fd].entry_sector, file_num[fd].buffer);
-    file_num[fd].buffer[file_num[fd].entry_number * 32] = 0xe5;
-    block_write(file_num[fd].entry_sector, file_num[fd].buffer);
+    if((m = fat_meta_get(vol, file_num[fd].entry_sector, 1))) {
+      m->data[file_num[fd].entry_number * 32] = 0xe5;
+      m->dirty = 1;
+    }
+    // the name is gone, and so is anything cached from inside a directory
+    memcpy(name, file_num[fd].filename, 8);
+    memcpy(name + 8, file_num[fd].extension, 3);
+    fat_dentry_put(vol, file_num[fd].parent_cluster, name, 0, 0, NULL);
+    fat_dindex_remove(vol, file_num[fd].parent_cluster, name, file_num[fd].entry_sector);
+    if(file_num[fd].attributes & FAT_ATT_SUBDIR) {
+      fat_dentry_forget(vol, file_num[fd].full_first_cluster);
+      fat_dindex_forget(vol, file_num[fd].full_first_cluster);
+    }
     
     // un-allocate the clusters
-    fat_free_clusters(file_num[fd].full_first_cluster);
+    fat_free_clusters(vol, file_num[fd].full_first_cluster);
     file_num[fd].flags = FAT_FLAG_OPEN;           // make sure that there are no dirty flags
     return 0;
 }
 
-int fat_unlink(const char *path, int *rerrno) {
+static int fat_unlink_unlocked(struct fat_volume *vol, const char *path, int *rerrno) {
   int fd;
   struct stat st;
   // check the file isn't open
   
   // find the file
-  fd = fat_open(path, O_RDONLY, 0777, rerrno);
+  fd = fat_open_unlocked(vol, path, O_RDONLY, 0777, rerrno);
   if(fd < 0) {
     return -1;
   }
 //   printf("fd.entry_sector = %d\n", file_num[fd].entry_sector);
 //   printf("fd.entry_number = %d\n", file_num[fd].entry_number);
   
-  if(fat_fstat(fd, &st, rerrno)) {
+  if(fat_fstat_unlocked(fd, &st, rerrno)) {
       return -1;
   }
   
@@ -1696,35 +3388,43 @@ int fat_unlink(const char *path, int *rerrno) {
       // on disk when used on directories.  POSIX standard says in this case we should return
       // EPERM as errno
       file_num[fd].flags = FAT_FLAG_OPEN;   // make sure atime isn't affected
-      fat_close(fd, rerrno);
+      fat_close_unlocked(fd, rerrno);
       (*rerrno) = EPERM;
       return -1;
   }
   
   fat_delete(fd, rerrno);
   
-  fat_close(fd, rerrno);
+  fat_close_unlocked(fd, rerrno);
   return 0;
 }
 
-int fat_rmdir(const char *path, int *rerrno) {
+int fat_unlink(struct fat_volume *vol, const char *path, int *rerrno) {
+  int r;
+  GRISTLE_LOCK(fat_sys_lock);
+  r = fat_unlink_unlocked(vol, path, rerrno);
+  GRISTLE_UNLOCK(fat_sys_lock);
+  return r;
+}
+
+static int fat_rmdir_unlocked(struct fat_volume *vol, const char *path, int *rerrno) {
   struct dirent de;
   int f_dir;
   int i;
   
   // same as unlink() but needs to check that the directory is empty first
-  if((f_dir = fat_open(path, O_RDONLY, 0777, rerrno)) == -1) {
+  if((f_dir = fat_open_unlocked(vol, path, O_RDONLY, 0777, rerrno)) == -1) {
     return -1;
   }
   
-  while(!(fat_get_next_dirent(f_dir, &de, rerrno))) {
+  while(!(fat_get_next_dirent_unlocked(f_dir, &de, rerrno))) {
     if(!((strcmp(de.d_name, ".") == 0) || (strcmp(de.d_name, "..") == 0))) {
       printf("Found an entry :( %s [", de.d_name);
       for(i=0;i<8;i++) {
         printf("%02X ", *(uint8_t *)&de.d_name[i]);
       }
       printf("] (name[0] == 0xE5: %d) %c %02X\n", de.d_name[0] == (char)0xE5, de.d_name[0], de.d_name[0]);
-      fat_close(f_dir, rerrno);
+      fat_close_unlocked(f_dir, rerrno);
       *rerrno = ENOTEMPTY;
       return -1;
     }
@@ -1732,14 +3432,23 @@ int fat_rmdir(const char *path, int *rerrno) {
   
   fat_delete(f_dir, rerrno);
   
-  if(fat_close(f_dir, rerrno)) {
+  if(fat_close_unlocked(f_dir, rerrno)) {
     return -1;
   }
   // no entries found, delete it
-  return 0;//fat_unlink(path, rerrno);
+  return 0;//fat_unlink(vol, path, rerrno);
+}
+
+int fat_rmdir(struct fat_volume *vol, const char *path, int *rerrno) {
+  int r;
+  GRISTLE_LOCK(fat_sys_lock);
+  r = fat_rmdir_unlocked(vol, path, rerrno);
+  GRISTLE_UNLOCK(fat_sys_lock);
+  return r;
 }
 
-int fat_mkdir(const char *path, int mode __attribute__((__unused__)), int *rerrno) {
+static int fat_mkdir_unlocked(struct fat_volume *vol, const char *path,
+                              int mode __attribute__((__unused__)), int *rerrno) {
   direntS d;
   uint32_t cluster;
   uint32_t parent_cluster;
@@ -1774,7 +3483,7 @@ int fat_mkdir(const char *path, int mode __attribute__((__unused__)), int *rerrn
   *(filename - 1) = 0;
   
   // allocate a cluster for the new directory
-  cluster = fat_get_free_cluster();
+  cluster = fat_get_free_cluster(vol);
   if((cluster == 0xFFFFFFF) || (cluster == 0)) {
     // not a valid cluster number, can't find one, disc full?
     *rerrno = ENOSPC;
@@ -1783,13 +3492,13 @@ int fat_mkdir(const char *path, int mode __attribute__((__unused__)), int *rerrn
   
   // open the parent directory
   if(strcmp(local_path, "") == 0) {
-    f_dir = fat_open("/", O_RDWR, 0777, &int_call);
+    f_dir = fat_open_unlocked(vol, "/", O_RDWR, 0777, &int_call);
   } else {
-    f_dir = fat_open(local_path, O_RDWR, 0777, &int_call);
+    f_dir = fat_open_unlocked(vol, local_path, O_RDWR, 0777, &int_call);
   }
   if(f_dir < 0) {
     *rerrno = int_call;
-    fat_free_clusters(cluster);
+    fat_free_clusters(vol, cluster);
     return -1;
   }
 //   printf("mkdir, int_call = %d\r\n", int_call);
@@ -1798,25 +3507,25 @@ int fat_mkdir(const char *path, int mode __attribute__((__unused__)), int *rerrn
   
   // seek to the end of the directory
   do {
-    if(fat_read(f_dir, &d, sizeof(d), rerrno) < (int)sizeof(d)) {
-      fat_close(f_dir, rerrno);
-      fat_free_clusters(cluster);
+    if(fat_read_unlocked(f_dir, &d, sizeof(d), rerrno) < (int)sizeof(d)) {
+      fat_close_unlocked(f_dir, rerrno);
+      fat_free_clusters(vol, cluster);
 //       printf("read1 exit\r\n");
       return -1;
     }
   } while(d.filename[0] != 0);
   
   // just read the first empty directory entry so we need to seek back to overwrite it
-  if(fat_lseek(f_dir, -32, SEEK_CUR, rerrno) == -33) {
-    fat_close(f_dir, rerrno);
-    fat_free_clusters(cluster);
+  if(fat_lseek_unlocked(f_dir, -32, SEEK_CUR, rerrno) == -33) {
+    fat_close_unlocked(f_dir, rerrno);
+    fat_free_clusters(vol, cluster);
 //     printf("lseek exit\r\n");
     return -1;
   }
   
   if(str_to_fatname(filename, dosname)) {
-    fat_free_clusters(cluster);
-    fat_close(f_dir, rerrno);
+    fat_free_clusters(vol, cluster);
+    fat_close_unlocked(f_dir, rerrno);
     *rerrno = ENAMETOOLONG;
 //     printf("filename exit\r\n");
     return -1;
@@ -1845,7 +3554,7 @@ int fat_mkdir(const char *path, int mode __attribute__((__unused__)), int *rerrn
   d.size = 0;
   
 //   printf("write new folder\n");
-  if(fat_write(f_dir, &d, sizeof(d), rerrno) == -1) {
+  if(fat_write_unlocked(f_dir, &d, sizeof(d), rerrno) == -1) {
 //     printf("write exit\r\n");
     return -1;
   }
@@ -1853,18 +3562,24 @@ int fat_mkdir(const char *path, int mode __attribute__((__unused__)), int *rerrn
   memset(&d, 0, sizeof(d));
   
 //   printf("here\n");
-  if(fat_write(f_dir, &d, sizeof(d), rerrno) == -1) {
+  if(fat_write_unlocked(f_dir, &d, sizeof(d), rerrno) == -1) {
 //     printf("write 2 exit\r\n");
     return -1;
   }
   
-  if(fat_close(f_dir, rerrno)) {
+  if(fat_close_unlocked(f_dir, rerrno)) {
 //     printf("close exit\r\n");
     return -1;
   }
+  // the parent was written as a file, so what's cached about it is out of date, and the new
+  // directory's cluster may have been another's
+  fat_dentry_forget(vol, parent_cluster);
+  fat_dentry_forget(vol, cluster);
+  fat_dindex_forget(vol, parent_cluster);
+  fat_dindex_forget(vol, cluster);
   
   // create . and .. entries in the new directory cluster and an end of directory entry
-  if((f_dir = fat_open(path, O_RDWR, 0777, &int_call)) == -1) {
+  if((f_dir = fat_open_unlocked(vol, path, O_RDWR, 0777, &int_call)) == -1) {
     *rerrno = int_call;
 //     printf("open exit\r\n");
     return -1;
@@ -1889,7 +3604,7 @@ int fat_mkdir(const char *path, int mode __attribute__((__unused__)), int *rerrn
   d.first_cluster = cluster & 0xffff;
   d.size = 0;           // directory entries have zero length according to the standard
   
-  if((fat_write(f_dir, &d, sizeof(direntS), rerrno)) == -1) {
+  if((fat_write_unlocked(f_dir, &d, sizeof(direntS), rerrno)) == -1) {
 //     printf("write 3 exit\r\n");
     return -1;
   }
@@ -1898,24 +3613,33 @@ int fat_mkdir(const char *path, int mode __attribute__((__unused__)), int *rerrn
   d.high_first_cluster = parent_cluster >> 16;
   d.first_cluster = parent_cluster & 0xffff;
   
-  if((fat_write(f_dir, &d, sizeof(direntS), rerrno)) == -1) {
+  if((fat_write_unlocked(f_dir, &d, sizeof(direntS), rerrno)) == -1) {
 //     printf("write 4 exit\r\n");
     return -1;
   }
   
   memset(&d, 0, sizeof(direntS));
   
-  for(i=0;i<(int)((block_get_block_size() * fatfs.sectors_per_cluster) / sizeof(direntS)) - 2;i++) {
-    if((fat_write(f_dir, &d, sizeof(direntS), rerrno)) == -1) {
+  for(i=0;i<(int)((block_get_block_size() * vol->sectors_per_cluster) / sizeof(direntS)) - 2;i++) {
+    if((fat_write_unlocked(f_dir, &d, sizeof(direntS), rerrno)) == -1) {
 //       printf("write 5 exit\r\n");
       return -1;
     }
   }
-  if(fat_close(f_dir, rerrno)) {
+  if(fat_close_unlocked(f_dir, rerrno)) {
 //     printf("close 2 exit\r\n");
     return -1;
   }
   
   return 0;
 }
+
+int fat_mkdir(struct fat_volume *vol, const char *path, int mode, int *rerrno) {
+  int r;
+  GRISTLE_LOCK(fat_sys_lock);
+  r = fat_mkdir_unlocked(vol, path, mode, rerrno);
+  GRISTLE_UNLOCK(fat_sys_lock);
+  return r;
+}
+
 #endif /* ifdef GRISTLE_RO */
@@ -43,6 +43,89 @@
 #define FAT_ERROR_CLUSTER 1
 #define FAT_END_OF_FILE 2
 
+/* RAM for the map of which parts of the FAT have free clusters, in bytes (at least 4).  Each bit
+ * stands for one FAT sector, or a group of them if the FAT has more sectors than the map has
+ * bits.  1KB covers a 32GB card with 32KB clusters one sector per bit. */
+#ifndef GRISTLE_FREE_MAP_BYTES
+#define GRISTLE_FREE_MAP_BYTES 1024
+#endif
+
+/* FAT and directory sectors kept in RAM, shared by all open files.  Each one costs 512 bytes and
+ * a few more to track it.  At least 1, a FAT sector and the directory sector being updated is
+ * what a file growing needs. */
+#ifndef GRISTLE_META_SECTORS
+#define GRISTLE_META_SECTORS 4
+#endif
+
+/* Directory entries kept in RAM, looked up by their directory and name, so that opening the same
+ * files again doesn't read the directories on the way to them.  Names which were looked for and
+ * aren't there are remembered too.  Each costs 56 bytes, at least 1. */
+#ifndef GRISTLE_DENTRIES
+#define GRISTLE_DENTRIES 8
+#endif
+
+/* Slots in the hash index of a directory's names, 0 (the default) for none.  An index finds the
+ * sector a name is in without reading the directory up to it, and where new entries go, so it
+ * is worth having when files are kept in directories of thousands.  Each slot costs 6 bytes, and
+ * an index is only used while it is less than 3/4 full, so 8192 slots serve 6000 names.  A
+ * directory's index is built the first time a name is looked up in it. */
+#ifndef GRISTLE_DIR_INDEX_SLOTS
+#define GRISTLE_DIR_INDEX_SLOTS 0
+#endif
+
+/* directories which have a name index at once, the least recently used one is replaced */
+#ifndef GRISTLE_DIR_INDEXES
+#define GRISTLE_DIR_INDEXES 1
+#endif
+
+/* Runs of clusters each open file remembers the place of, so that seeking doesn't have to follow
+ * the FAT from the start of the file.  Each costs 12 bytes per open file, a file in more pieces
+ * than this only has the first ones remembered. */
+#ifndef GRISTLE_EXTENTS
+#define GRISTLE_EXTENTS 16
+#endif
+
+/* Sectors each open file buffers, from 1 up to a cluster (more is never used).  Each costs 512
+ * bytes per open file.  A bigger buffer is read with one multi-block read and only the sectors
+ * which changed are written back, in one multi-block write, so a file read or written in order
+ * moves a buffer at a time, a whole cluster if it is that big, but a small read from anywhere
+ * else reads the whole buffer too.  1 (the default) buffers only the sector being read or
+ * written. */
+#ifndef GRISTLE_BUFFER_SECTORS
+#define GRISTLE_BUFFER_SECTORS 1
+#endif
+
+/* Locks, for when more than one task uses the filesystem.  Each open file has one, held by the
+ * calls which take its file number, and one more covers what files share: the volumes' FAT and
+ * directory caches, cluster allocation, the table of open files and the block driver.  Reading
+ * and writing inside a file's buffer only takes the file's lock, so tasks working on different
+ * files only wait for each other when they go to the medium.  A call which takes both takes its
+ * file's first.  The locks must be recursive, as some calls are made from inside others.  They
+ * do nothing by default; define GRISTLE_PTHREADS to use POSIX threads, or define all four, e.g.
+ * for FreeRTOS:
+ *
+ *   #define GRISTLE_LOCK_T        SemaphoreHandle_t
+ *   #define GRISTLE_LOCK_INIT(l)  ((l) = xSemaphoreCreateRecursiveMutex())
+ *   #define GRISTLE_LOCK(l)       xSemaphoreTakeRecursive((l), portMAX_DELAY)
+ *   #define GRISTLE_UNLOCK(l)     xSemaphoreGiveRecursive(l)
+ *
+ * The locks are made by the first fat_mount(), which must be done before other tasks start using
+ * the filesystem. */
+#ifdef GRISTLE_PTHREADS
+#include <pthread.h>
+#define GRISTLE_LOCK_T        pthread_mutex_t
+#define GRISTLE_LOCK_INIT(l)  fat_pthread_init(&(l))
+#define GRISTLE_LOCK(l)       pthread_mutex_lock(&(l))
+#define GRISTLE_UNLOCK(l)     pthread_mutex_unlock(&(l))
+#endif
+
+#ifndef GRISTLE_LOCK_T
+#define GRISTLE_LOCK_T        uint8_t
+#define GRISTLE_LOCK_INIT(l)  ((void)(l))
+#define GRISTLE_LOCK(l)       ((void)(l))
+#define GRISTLE_UNLOCK(l)     ((void)(l))
+#endif
+
 /* FAT file attribute bit masks */
 #define FAT_ATT_RO  0x01
 #define FAT_ATT_HID 0x02
@@ -52,7 +135,40 @@
 #define FAT_ATT_ARC 0x20
 #define FAT_ATT_DEV 0x40
 
-struct fat_info {
+typedef struct {
+  blockno_t sector;             // MAX_BLOCK if the slot is empty
+  uint32_t  used;               // when it was last used, for least recently used eviction
+  uint8_t   dirty;              // changed since it was read or written
+  uint8_t   data[512];
+} fat_meta_sector;
+
+typedef struct {
+  uint32_t  parent;             // first cluster of the directory the entry is in, 0 if the slot is empty
+  char      name[11];           // 8.3 name, as it is in the entry
+  uint8_t   number;             // the entry's place in its sector
+  blockno_t sector;             // sector the entry is in, 0 if the directory has no such entry
+  uint32_t  used;               // when it was last used, for least recently used eviction
+  uint8_t   entry[32];          // copy of the entry
+} fat_dentry;
+
+#if GRISTLE_DIR_INDEX_SLOTS > 0
+typedef struct {
+  uint32_t  parent;             // first cluster of the directory, 0 if the index is unused
+  uint32_t  used;               // when it was last used, for least recently used eviction
+  uint8_t   full;               // too many names for the slots, the directory is searched instead
+  uint32_t  count;              // slots which aren't empty, including ones of deleted names
+  uint32_t  end_cluster;        // where the last entry was found or made, see fat_dir_slot()
+  blockno_t end_sector;
+  uint16_t  hash[GRISTLE_DIR_INDEX_SLOTS];          // 0 for an empty slot, 1 for a deleted name
+  blockno_t sector[GRISTLE_DIR_INDEX_SLOTS];        // the sector a name with the hash is in
+} fat_dir_index;
+#endif
+
+/* A mounted FAT volume, everything Gristle knows about it and the FAT and directory sectors it
+ * has cached.  The application owns it, see fat_mount(), and open files refer to it, so several
+ * partitions can be mounted at once, each tuned for what it holds.  They all go through the one
+ * block driver, see block.h. */
+struct fat_volume {
   uint8_t   read_only;
   uint8_t   fat_entry_len;
   uint32_t  end_cluster_marker;
@@ -66,7 +182,21 @@ struct fat_info {
   uint8_t   type;               // type of filesystem (FAT16 or FAT32)
   blockno_t part_start;         // start of partition containing filesystem
   uint32_t  total_sectors;
-  uint8_t   sysbuf[512];
+  uint8_t   sysbuf[512];        // for the FSInfo sector, see fat_info_flush()
+  blockno_t fs_info;            // FAT32 FSInfo sector, 0 if there isn't a valid one
+  uint32_t  free_count;         // free clusters, 0xFFFFFFFF if unknown
+  uint32_t  last_allocated;     // allocation starts looking for a free cluster after this one
+  uint8_t   info_dirty;         // free_count or last_allocated changed since the FSInfo was written
+  uint8_t   map_shift;          // FAT sectors per bit of free_map, as a power of two
+  uint32_t  free_map[GRISTLE_FREE_MAP_BYTES / 4];   // clear bits mark FAT sectors with no free entries
+  uint32_t  meta_clock;         // counts uses of the metadata cache
+  fat_meta_sector meta[GRISTLE_META_SECTORS];       // FAT and directory sectors, see fat_meta_get()
+  uint32_t  dentry_clock;       // counts uses of the directory entry cache
+  fat_dentry dentries[GRISTLE_DENTRIES];           // see fat_dentry_find()
+#if GRISTLE_DIR_INDEX_SLOTS > 0
+  uint32_t  dindex_clock;       // counts uses of the directory name indexes
+  fat_dir_index dindex[GRISTLE_DIR_INDEXES];        // see fat_dindex_lookup()
+#endif
 };
 
 typedef struct {
@@ -126,6 +256,12 @@ typedef struct {
 #define FS_INFO_SIG2 0x01E4
 #define FREE_CLUSTERS 0x01E8
 #define LAST_ALLOCATED 0x01EC
+#define FS_INFO_SIG3 0x01FC
+
+/* values of the FSInfo signatures */
+#define FS_INFO_LEAD 0x41615252
+#define FS_INFO_STRUCT 0x61417272
+#define FS_INFO_TRAIL 0xAA550000
 
 typedef struct {
   char      filename[8];
@@ -144,9 +280,33 @@ typedef struct {
   uint32_t  size;
 } __attribute__((__packed__)) direntS;
 
+/* an entry of a directory as fat_get_next_dirents() gives it, all from the entry itself */
+typedef struct {
+  char      d_name[13];         // the 8.3 name with its dot, as in struct dirent
+  uint8_t   attributes;         // FAT_ATT_* flags
+  uint32_t  size;               // 0 for a directory
+  uint32_t  first_cluster;      // 0 for an empty file, as d_ino in struct dirent
+  time_t    created;
+  time_t    modified;
+  time_t    accessed;           // the date only
+} fat_dirent;
+
+typedef struct {
+  uint32_t  file_cluster;       // the run's first cluster, counted from the start of the file
+  uint32_t  cluster;            // where that is on the volume
+  uint32_t  length;             // clusters in the run
+} fat_extent;
+
 typedef struct {
+  struct fat_volume *vol;       // the volume the file is on
+  GRISTLE_LOCK_T lock;          // held by the calls which take the file's number
   uint8_t   flags;
-  uint8_t   buffer[512];
+  uint8_t   *buffer;            // the current sector, somewhere in window
+  uint8_t   window[GRISTLE_BUFFER_SECTORS * 512];
+  uint32_t  win_sector;         // the window's first sector, 0 until a new file has a cluster
+  uint8_t   win_count;          // sectors in the window, 0 if it holds nothing
+  uint8_t   dirty_lo;           // the window's changed sectors, while FAT_FLAG_DIRTY is set
+  uint8_t   dirty_hi;
   uint32_t  sector;
   uint32_t  cluster;
   uint8_t   sectors_left;
@@ -164,6 +324,11 @@ typedef struct {
   time_t    created;
   time_t    modified;
   time_t    accessed;
+  uint32_t  run_start;          // clusters reserved ahead of the file's end, see fat_alloc_cluster()
+  uint32_t  run_end;
+  uint32_t  write_end;          // where the write in progress will leave the file, 0 if none
+  uint16_t  extent_count;       // the extents cover the file's first clusters, without gaps
+  fat_extent extents[GRISTLE_EXTENTS];
 } FileS;
 
 // flag values for FileS
@@ -173,6 +338,7 @@ typedef struct {
 #define FAT_FLAG_APPEND 8
 #define FAT_FLAG_DIRTY 16
 #define FAT_FLAG_FS_DIRTY 32
+#define FAT_FLAG_RECORD 64
 
 #define FAT_INTERNAL_CALL 4242
 
@@ -181,7 +347,44 @@ typedef struct {
 
 int str_to_fatname(char *url, char *dosname);
 
-int fat_mount(blockno_t start, blockno_t volume_size, uint8_t part_type_hint);
+/**
+ * \brief Mount the FAT volume in a partition.
+ *
+ * Fills in the given volume from the partition's boot sector, ready for fat_open() and the other
+ * calls which take a path.  Files opened there refer back to it, so it must stay where it is until
+ * fat_umount().  It is big (mostly the caches sized by GRISTLE_META_SECTORS and friends), so it is
+ * best made static.  Each mounted partition needs its own.
+ *
+ * \param vol is the volume to fill in
+ * \param start is the partition's first block
+ * \param volume_size is the partition's length in blocks
+ * \param part_type_hint is the partition type from the partition table, or 0 to work it out
+ * \returns 0 on success, -1 on error.
+ **/
+int fat_mount(struct fat_volume *vol, blockno_t start, blockno_t volume_size,
+              uint8_t part_type_hint);
+
+/**
+ * \brief Write back what the filesystem keeps in memory before the volume is removed.
+ *
+ * FAT32 volumes keep their free cluster count and an allocation hint in the FSInfo sector.  Gristle
+ * loads them at mount but only writes them back here and in fat_fsync().  Changed FAT and
+ * directory sectors in the metadata cache (see GRISTLE_META_SECTORS) are written back here too,
+ * as they are by fat_fsync() and fat_close().  Files should be closed first.
+ *
+ * \returns 0 on success, -1 on error.
+ **/
+int fat_umount(struct fat_volume *vol);
+
+/**
+ * \brief Get the number of free clusters on the volume.
+ *
+ * This comes from the FSInfo sector on FAT32 volumes, and is kept up to date as clusters are
+ * allocated and freed.  If it isn't known, the first call counts the free entries in the FAT.
+ *
+ * \returns the number of free clusters, or 0xFFFFFFFF on a read error.
+ **/
+uint32_t fat_get_free_count(struct fat_volume *vol);
 
 /**
  * \brief basic open a file function
@@ -191,6 +394,7 @@ int fat_mount(blockno_t start, blockno_t volume_size, uint8_t part_type_hint);
  * the global errno parameter, it writes any error code to the integer pointer parameter.  This 
  * makes the function potentially thread safe although it hasn't been fully tested.
  * 
+ * \param vol is the mounted volume to open it on, the file number refers to it from then on
  * \param name is the file path/name to be opened
  * \param flags is a bitwise OR of flags from fcntl.h including read/write/create/append etc.
  * \param mode is the permissions setting for creating the file, largely ignored on FAT
@@ -198,17 +402,86 @@ int fat_mount(blockno_t start, blockno_t volume_size, uint8_t part_type_hint);
  * errno
  * \returns -1 on error or a file number for the opened file.
  **/
-int fat_open(const char *name, int flags, int mode, int *rerrno);
+int fat_open(struct fat_volume *vol, const char *name, int flags, int mode, int *rerrno);
 
 int fat_close(int fd, int *rerrno);
+
+/**
+ * \brief Write an open file's buffered data and directory entry to the volume.
+ *
+ * Unlike fat_close() the file stays open.  The FAT and directory sectors changed in the metadata
+ * cache are written too, for every file, not just this one.  This also flushes the block device's
+ * write cache, so when it returns 0 everything written to the file so far will survive a power
+ * loss.  This is the barrier that fsync() (and so SQLite's xSync) relies on.
+ *
+ * \param fd is the file number to sync
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns 0 on success, -1 on error.
+ **/
+int fat_fsync(int fd, int *rerrno);
+
+/**
+ * \brief Mark a file open for writing as a high rate stream, like a log or a video.
+ *
+ * The file's data sectors are then written through the block driver's recording session (see
+ * block_record_start()), so that a long append reaches an SD card as a few multi-block writes at
+ * its Speed Class rate rather than one write per sector.  New clusters are reserved a whole
+ * allocation unit (block_profile::au_blocks, or GRISTLE_RECORD_RUN sectors if that's unknown) at
+ * a time, lined up with the card's AUs, so the FAT isn't touched again until the file has filled
+ * one.  The directory entry, and so the size other readers see, is only updated every
+ * GRISTLE_RECORD_CHECKPOINT bytes, on fat_fsync() and on fat_close(), which also gives back the
+ * clusters the file didn't use.  This lasts until the file is closed.
+ *
+ * \param fd is the file number, open for writing
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns 0 on success, -1 on error.
+ **/
+int fat_record(int fd, int *rerrno);
+
+/**
+ * \brief Count the pieces an open file's clusters are in.
+ *
+ * A file in one piece can be read and written with multi-block transfers from start to end,
+ * each extra piece costs a seek on the FAT and splits a transfer.  Only the clusters which hold
+ * the file's data count, not ones reserved ahead of its end.  This follows the file's whole
+ * chain, so it is meant for tests and diagnostics.
+ *
+ * \param fd is the file number
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns the number of runs of consecutive clusters, 1 for a file in one piece, 0 for an empty
+ * file, or -1 on error.
+ **/
+int fat_get_fragments(int fd, int *rerrno);
+
+/**
+ * \brief Read the next entries of an open directory, with their sizes, attributes and times.
+ *
+ * fat_get_next_dirent() reads an entry at a time through fat_read() and only gives its name, so
+ * a caller which wants to know more has to open each entry, looking up its path again.  This
+ * takes the entries straight out of the directory's sectors, skipping long name parts, volume
+ * labels and deleted entries, so walking a big directory costs about one sector read for every
+ * 16 entries.  It carries on from where fat_get_next_dirent() left off, and the other way round.
+ *
+ * \param fd is the file number of a directory, open for reading
+ * \param out is where the entries go
+ * \param count is how many entries out has room for
+ * \param rerrno if there is an error the error code will be written to the integer pointed to by
+ * rerrno
+ * \returns the number of entries read, 0 at the end of the directory, or -1 on error.
+ **/
+int fat_get_next_dirents(int fd, fat_dirent *out, int count, int *rerrno);
+
 int fat_read(int, void *, size_t, int *);
 int fat_write(int, const void *, size_t, int *);
 int fat_fstat(int, struct stat *, int *);
 int fat_lseek(int, int, int, int *);
 int fat_get_next_dirent(int, struct dirent *, int *rerrno);
 
-int fat_unlink(const char *path, int *rerrno);
-int fat_rmdir(const char *path, int *rerrno);
-int fat_mkdir(const char *path, int mode, int *rerrno);
+int fat_unlink(struct fat_volume *vol, const char *path, int *rerrno);
+int fat_rmdir(struct fat_volume *vol, const char *path, int *rerrno);
+int fat_mkdir(struct fat_volume *vol, const char *path, int mode, int *rerrno);
 
 #endif /* ifndef GRISTLE_H */
@@ -6,7 +6,7 @@
 #include "partition.h"
 #include "gristle.h"
 
-extern struct fat_info fatfs;
+static struct fat_volume fatfs;
 
 int main(int argc, char *argv[]) {
     int mounted = 0;
@@ -29,14 +29,15 @@ int main(int argc, char *argv[]) {
     
     if(block_init() == 0) {
         // attempt to mount the card root
-        if(fat_mount(0, (image_size ? image_size : block_get_volume_size()), 0)) {
+        if(fat_mount(&fatfs, 0, (image_size ? image_size : block_get_volume_size()), 0)) {
             // root mount failed, try and read a partition table
             fsbuf = (uint8_t *)malloc(512);
             block_read(0, fsbuf);
             r = read_partition_table(fsbuf, (image_size ? image_size : block_get_volume_size()), &part_list);
             if(r > 0) {
                 for(i=0;i<r;i++) {
-                    if(fat_mount(part_list[i].start, part_list[i].length, part_list[i].type) == 0) {
+                    if(fat_mount(&fatfs, part_list[i].start, part_list[i].length,
+                                 part_list[i].type) == 0) {
                     mounted = 1;
                     break;
                     }
@@ -36,6 +36,8 @@
 #include "../src/block_drivers/block_pc.h"
 #include "../src/partition.h"
 
+static struct fat_volume fatfs;
+
 /**************************************************************
  * Filesystem image structure:
  * 
@@ -118,7 +120,7 @@ int test_open(int p) {
   
   for(i=0;i<cases;i++) {
     printf("[%4d] Testing %s", p++, desc[i]);
-    v = fat_open(filename[i], flags[i], 0, &rerrno);
+    v = fat_open(&fatfs, filename[i], flags[i], 0, &rerrno);
     if(rerrno == result[i]) {
       printf("  [ ok ]\n");
     } else {
@@ -135,7 +137,6 @@ int test_open(int p) {
   return p;
 }
 
-extern struct fat_info fatfs;
 extern FileS file_num[];
 
 int main(int argc, char *argv[]) {
@@ -159,7 +160,7 @@ int main(int argc, char *argv[]) {
   
   printf("[%4d] mount filesystem, FAT32", p++);
   
-  result = fat_mount(0, block_get_volume_size(), PART_TYPE_FAT32);
+  result = fat_mount(&fatfs, 0, block_get_volume_size(), PART_TYPE_FAT32);
 
   printf("   %d\n", result);
 
@@ -172,7 +173,7 @@ int main(int argc, char *argv[]) {
     printf("Found %d valid partitions.\n", parts);
     
     if(parts > 0) {
-      result = fat_mount(part_list[0].start, part_list[0].length, part_list[0].type);
+      result = fat_mount(&fatfs, part_list[0].start, part_list[0].length, part_list[0].type);
     }
     if(result != 0) {
       printf("Mount failed\n");
@@ -190,7 +191,7 @@ int main(int argc, char *argv[]) {
   uint32_t temp_uint = 0xDEADBEEF;
   memset(block_o_data, 0x42, 1024);
 //   printf("Open\n");
-//   fd = fat_open("/newfile.txt", O_WRONLY | O_CREAT, 0777, &rerrno);
+//   fd = fat_open(&fatfs, "/newfile.txt", O_WRONLY | O_CREAT, 0777, &rerrno);
 //   printf("fd = %d, errno=%d (%s)\n", fd, rerrno, strerror(rerrno));
 //   if(fd > -1) {
 //     printf("Write\n");
@@ -202,7 +203,7 @@ int main(int argc, char *argv[]) {
 //   }
   
 //   printf("Open\n");
-//   fd = fat_open("/newfile.png", O_WRONLY | O_CREAT, 0777, &rerrno);
+//   fd = fat_open(&fatfs, "/newfile.png", O_WRONLY | O_CREAT, 0777, &rerrno);
 //   printf("fd = %d, errno=%d (%s)\n", fd, rerrno, strerror(rerrno));
 //   if(fd > -1) {
 //     fp = fopen("gowrong_draft1.png", "rb");
@@ -221,16 +222,16 @@ int main(int argc, char *argv[]) {
 //   }
   
   printf("errno = (%d) %s\n", rerrno, strerror(rerrno));
-  result = fat_mkdir("/foo", 0777, &rerrno);
+  result = fat_mkdir(&fatfs, "/foo", 0777, &rerrno);
   printf("mkdir /foo: %d (%d) %s\n", result, rerrno, strerror(rerrno));
   
-  result = fat_mkdir("/foo/bar", 0777, &rerrno);
+  result = fat_mkdir(&fatfs, "/foo/bar", 0777, &rerrno);
   printf("mkdir /foo/bar: %d (%d) %s\n", result, rerrno, strerror(rerrno));
   
-  result = fat_mkdir("/web", 0777, &rerrno);
+  result = fat_mkdir(&fatfs, "/web", 0777, &rerrno);
   printf("mkdir /web: %d (%d) %s\n", result, rerrno, strerror(rerrno));
   
-  if((fd = fat_open("/foo/bar/file.html", O_WRONLY | O_CREAT, 0777, &rerrno)) == -1) {
+  if((fd = fat_open(&fatfs, "/foo/bar/file.html", O_WRONLY | O_CREAT, 0777, &rerrno)) == -1) {
     printf("Couldn't open file (%d) %s\n", rerrno, strerror(rerrno));
     exit(-1);
   }
@@ -247,7 +248,7 @@ int main(int argc, char *argv[]) {
   }
   
   printf("Open directory\n");
-  if((fd = fat_open("/foo/bar", O_RDONLY, 0777, &rerrno)) < 0) {
+  if((fd = fat_open(&fatfs, "/foo/bar", O_RDONLY, 0777, &rerrno)) < 0) {
     printf("Failed to open directory (%d) %s\n", rerrno, strerror(rerrno));
     exit(-1);
   }
@@ -261,8 +262,30 @@ int main(int argc, char *argv[]) {
   if(fat_close(fd, &rerrno)) {
     printf("Error closing directory, (%d) %s\n", rerrno, strerror(rerrno));
   }
-  
-  if(fat_open("/web/version.txt", O_RDONLY, 0777, &rerrno) < 0) {
+
+  printf("List directory with sizes\n");
+  if((fd = fat_open(&fatfs, "/foo/bar", O_RDONLY, 0777, &rerrno)) < 0) {
+    printf("Failed to open directory (%d) %s\n", rerrno, strerror(rerrno));
+    exit(-1);
+  }
+  fat_dirent entries[8];
+  int n;
+
+  while((n = fat_get_next_dirents(fd, entries, 8, &rerrno)) > 0) {
+    for(i=0;i<n;i++) {
+      printf("%-12s %s %u\n", entries[i].d_name,
+             (entries[i].attributes & FAT_ATT_SUBDIR) ? "<DIR>" : "     ", entries[i].size);
+    }
+  }
+  if(n < 0) {
+    printf("Directory read failed. (%d) %s\n", rerrno, strerror(rerrno));
+  }
+
+  if(fat_close(fd, &rerrno)) {
+    printf("Error closing directory, (%d) %s\n", rerrno, strerror(rerrno));
+  }
+
+  if(fat_open(&fatfs, "/web/version.txt", O_RDONLY, 0777, &rerrno) < 0) {
     printf("Error opening missing file (%d) %s\n", rerrno, strerror(rerrno));
   } else {
     printf("success! opened non existent file for reading.\n");
@@ -270,7 +293,7 @@ int main(int argc, char *argv[]) {
   
   printf("Trying to write a big file.\n");
   
-  if((fd = fat_open("big_file.bin", O_WRONLY | O_CREAT, 0777, &rerrno))) {
+  if((fd = fat_open(&fatfs, "big_file.bin", O_WRONLY | O_CREAT, 0777, &rerrno))) {
       printf("Error opening a file for writing.\n");
   }
   
@@ -279,12 +302,13 @@ int main(int argc, char *argv[]) {
           printf("Written %d bytes\n", i * 4);
       fat_write(fd, &temp_uint, 4, &rerrno);
   }
+  printf("Big file is in %d pieces.\n", fat_get_fragments(fd, &rerrno));
   fat_close(fd, &rerrno);
   
-//   result = fat_rmdir("/foo/bar", &rerrno);
+//   result = fat_rmdir(&fatfs, "/foo/bar", &rerrno);
 //   printf("rmdir /foo/bar: %d (%d) %s\n", result, rerrno, strerror(rerrno));
 //   
-//   result = fat_rmdir("/foo", &rerrno);
+//   result = fat_rmdir(&fatfs, "/foo", &rerrno);
 //   printf("rmdir /foo: %d (%d) %s\n", result, rerrno, strerror(rerrno));
   
   block_pc_snapshot_all("writenfs.img");
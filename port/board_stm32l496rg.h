@@ -166,6 +166,10 @@ static inline void board_init( void ) {
   // Setup the NVIC hardware interrupts.
   // Use 4 bits for 'priority' and 0 bits for 'subpriority'.
   NVIC_SetPriorityGrouping( 0x00 );
+  // SD/MMC interrupts drive the SDMMC command engine.
+  uint32_t sdmmc_pri_encoding = NVIC_EncodePriority( 0x00, 0x02, 0x00 );
+  NVIC_SetPriority( SDMMC1_IRQn, sdmmc_pri_encoding );
+  NVIC_EnableIRQ( SDMMC1_IRQn );
   /*
   // DMA interrupts should be high-priority. (0 is highest)
   uint32_t dma_pri_encoding = NVIC_EncodePriority( 0x00, 0x01, 0x00 );
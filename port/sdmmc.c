@@ -1,8 +1,52 @@
 /*
  * Minimal SD/MMC peripheral interface methods.
  */
+#include <string.h>
+
 #include "port/sdmmc.h"
 
+// Status flags which end the 'command' phase of a transfer.
+#define SDMMC_CMD_FLAGS  ( SDMMC_STA_CMDSENT | \
+                           SDMMC_STA_CMDREND | \
+                           SDMMC_STA_CTIMEOUT | \
+                           SDMMC_STA_CCRCFAIL )
+// Status flags which end the 'data' phase of a transfer.
+#define SDMMC_DATA_FLAGS ( SDMMC_STA_DATAEND | \
+                           SDMMC_STA_DCRCFAIL | \
+                           SDMMC_STA_DTIMEOUT | \
+                           SDMMC_STA_RXOVERR | \
+                           SDMMC_STA_TXUNDERR | \
+                           SDMMC_STA_STBITERR )
+// Status flags which indicate a failed data transfer.
+#define SDMMC_DATA_ERRS  ( SDMMC_DATA_FLAGS & ~SDMMC_STA_DATAEND )
+
+// Global command engine state.
+sdmmc_engine sdmmc_xfer = {
+  SDMMC_XFER_IDLE, 0x00000000, 0, SDMMC_WAIT_SPIN, 0, 0, NULL, 0
+};
+// Address of the currently-selected card, or 0 if no card is
+// selected. A selected card sits in the 'transfer' state, and an
+// unselected one which has an address sits in 'standby'.
+static uint16_t sdmmc_selected = 0x0000;
+
+static int sdmmc_wait_ready_for_data( SDMMC_TypeDef *SDMMCx,
+                                      uint16_t card_addr );
+static int sdmmc_read_data( SDMMC_TypeDef *SDMMCx,
+                            uint32_t cmd,
+                            uint32_t arg,
+                            uint32_t *buf,
+                            uint32_t len );
+static int sdmmc_write_data( SDMMC_TypeDef *SDMMCx,
+                             uint32_t cmd,
+                             uint32_t arg,
+                             uint32_t *buf );
+static void sdmmc_stream_drain( SDMMC_TypeDef *SDMMCx );
+static int sdmmc_fifo_write( SDMMC_TypeDef *SDMMCx, uint32_t *buf );
+// Set while the card programs a block written in write-behind mode.
+static int sdmmc_programming = 0;
+// Set while an open-ended multi-block write (CMD25) is receiving.
+static int sdmmc_writing = 0;
+
 /**
  * Setup an SD/MMC peripheral for simple 'polling mode'.
  * This is slow; no interrupts, hardware flow control, or DMA.
@@ -15,12 +59,15 @@ void sdmmc_setup( SDMMC_TypeDef *SDMMCx ) {
   // Clock control register:
   // * Set the interface to use the rising edge of clock signals.
   // * Disable clock bypass.
-  // * Disable hardware flow control for now. (TODO: Use hw flow ctrl)
-  // * Set bus width to 4 bits (microSD cards have DAT0-3 lines)
-  //   (TODO: Currently using 1 bit for debugging)
-  // * Disable power-saving mode for now. (TODO: Use PWRSAV bit)
-  // * Set CLKDIV to 0x76 for slow speeds.
-  //   Technically, the speed should be <=400KHz until init is done.
+  // * Enable hardware flow control if `SDMMC_HWFC` is set, so that
+  //   the FIFO cannot overrun or underrun at high clock speeds.
+  // * Start with a 1-bit bus; `sdmmc_set_bus_width` switches to
+  //   4 bits once the card has been identified.
+  // * Disable power-saving mode: the card needs a free-running
+  //   clock while it powers up. `sdmmc_set_clock` turns it on once
+  //   the card has been identified.
+  // * Set CLKDIV for the ~400KHz identification clock. The speed
+  //   should be <=400KHz until init is done.
   // * Set CLKEN to enable the clock.
   SDMMCx->CLKCR &= ~( SDMMC_CLKCR_CLKDIV |
                       SDMMC_CLKCR_WIDBUS |
@@ -28,9 +75,12 @@ void sdmmc_setup( SDMMC_TypeDef *SDMMCx ) {
                       SDMMC_CLKCR_BYPASS |
                       SDMMC_CLKCR_PWRSAV |
                       SDMMC_CLKCR_HWFC_EN );
-  SDMMCx->CLKCR |=  ( 0x76 << SDMMC_CLKCR_CLKDIV_Pos |
+  SDMMCx->CLKCR |=  ( SDMMC_CLK_INIT |
                       //0x1 << SDMMC_CLKCR_WIDBUS_Pos |
                       SDMMC_CLKCR_CLKEN );
+#if SDMMC_HWFC
+  SDMMCx->CLKCR |=  ( SDMMC_CLKCR_HWFC_EN );
+#endif
   // Set the card block size to 512 bytes.
   // TODO: It might not be in all cases, but for now this HAL assumes
   // that you will set standard-capacity cards to use 512B blocks.
@@ -38,13 +88,240 @@ void sdmmc_setup( SDMMC_TypeDef *SDMMCx ) {
   SDMMCx->DCTRL |=  ( 9 << SDMMC_DCTRL_DBLOCKSIZE_Pos );
   // Set the data timeout. For now, just use a fairly long value.
   SDMMCx->DTIMER =  ( 0x04000000 );
+  // Start with all interrupts masked and the command engine idle.
+  // `sdmmc_irq_setup` can switch to interrupt-driven waiting later.
+  SDMMCx->MASK   =  ( 0x00000000 );
+  sdmmc_xfer.state = SDMMC_XFER_IDLE;
+  sdmmc_xfer.wait_mode = SDMMC_WAIT_SPIN;
+  sdmmc_xfer.stream = NULL;
+  sdmmc_selected = 0x0000;
+  sdmmc_programming = 0;
+  sdmmc_writing = 0;
 }
 
-/** Send a command to the SD/MMC card. */
-void sdmmc_cmd_write( SDMMC_TypeDef *SDMMCx,
+/**
+ * Turn off the SD/MMC peripheral: stop the card clock, and stop
+ * driving the bus. The card should be idle, since anything which it
+ * is still sending or programming is abandoned. The command engine
+ * forgets the card, so `sdmmc_setup` must run before the next
+ * command, and the card must be identified again.
+ */
+void sdmmc_power_off( SDMMC_TypeDef *SDMMCx ) {
+  SDMMC_IRQ_OFF();
+  sdmmc_xfer.state = SDMMC_XFER_IDLE;
+  sdmmc_xfer.stream = NULL;
+  SDMMCx->MASK   =  ( 0x00000000 );
+  SDMMC_IRQ_ON();
+  SDMMCx->CLKCR &= ~( SDMMC_CLKCR_CLKEN );
+  SDMMCx->POWER &= ~( SDMMC_POWER_PWRCTRL );
+  sdmmc_selected = 0x0000;
+  sdmmc_programming = 0;
+  sdmmc_writing = 0;
+}
+
+/**
+ * Sleep until `ms` milliseconds have passed, waking on every
+ * interrupt (at least the 1ms SysTick) to check. The time goes into
+ * `sdmmc_xfer.sleep_us`, so that callers can tell how long the core
+ * was asleep while it waited on the card.
+ */
+void sdmmc_sleep_ms( uint32_t ms ) {
+  uint32_t start = timer_micros();
+  uint32_t start_tick = tick;
+  while ( ( tick - start_tick ) < ms ) { SDMMC_SLEEP(); }
+  sdmmc_xfer.sleep_us += timer_micros() - start;
+}
+
+/**
+ * Select how callers wait on the command engine. With
+ * `SDMMC_WAIT_SPIN`, the engine is advanced by polling the status
+ * register. With `SDMMC_WAIT_WFI`, the core sleeps until an interrupt
+ * arrives; the application must enable `SDMMC1_IRQn` in the NVIC,
+ * and SysTick also wakes the core to check for timeouts.
+ */
+void sdmmc_irq_setup( SDMMC_TypeDef *SDMMCx, int wait_mode ) {
+  SDMMC_IRQ_OFF();
+  sdmmc_xfer.wait_mode = wait_mode;
+  // The engine unmasks only the flags that matter for each phase,
+  // so the interrupt stays quiet while the engine is idle.
+  if ( sdmmc_xfer.state == SDMMC_XFER_IDLE ||
+       sdmmc_xfer.state >= SDMMC_XFER_DONE ) {
+    SDMMCx->MASK = ( 0x00000000 );
+  }
+  SDMMC_IRQ_ON();
+}
+
+/**
+ * Move the command engine into a new phase, and unmask the status
+ * flags which will end that phase. Each phase gets its own timeout.
+ */
+static void sdmmc_xfer_enter( SDMMC_TypeDef *SDMMCx,
+                              int state,
+                              uint32_t timeout ) {
+  sdmmc_xfer.start   = tick;
+  sdmmc_xfer.timeout = timeout;
+  sdmmc_xfer.state   = state;
+  if ( state == SDMMC_XFER_CMD ) {
+    SDMMCx->MASK = ( SDMMC_MASK_CMDSENTIE |
+                     SDMMC_MASK_CMDRENDIE |
+                     SDMMC_MASK_CTIMEOUTIE |
+                     SDMMC_MASK_CCRCFAILIE );
+  }
+  else if ( state == SDMMC_XFER_DATA ) {
+    SDMMCx->MASK = ( SDMMC_MASK_DATAENDIE |
+                     SDMMC_MASK_DCRCFAILIE |
+                     SDMMC_MASK_DTIMEOUTIE |
+                     SDMMC_MASK_RXOVERRIE |
+                     SDMMC_MASK_TXUNDERRIE );
+    // A streaming read also moves data in the interrupt.
+    if ( sdmmc_xfer.stream ) { sdmmc_stream_drain( SDMMCx ); }
+  }
+  else {
+    // There is no interrupt for the end of the busy signal,
+    // so `DAT0` is polled in `sdmmc_xfer_poll` instead.
+    SDMMCx->MASK = ( 0x00000000 );
+  }
+}
+
+/**
+ * Advance the command engine from the current status flags.
+ * This is the body of the SDMMC interrupt handler, but it is also
+ * called by the waiting methods, so it must be safe to call when
+ * there is nothing to do.
+ */
+void sdmmc_irq_handler( SDMMC_TypeDef *SDMMCx ) {
+  uint32_t sta = SDMMCx->STA;
+  if ( sdmmc_xfer.state == SDMMC_XFER_CMD ) {
+    if ( !( sta & SDMMC_CMD_FLAGS ) ) { return; }
+    // Latch and clear the 'command' flags. The response registers
+    // keep their values until the next command is sent.
+    sdmmc_xfer.sta |= ( sta & SDMMC_CMD_FLAGS );
+    SDMMCx->ICR     = ( sta & SDMMC_CMD_FLAGS );
+    if ( ( sta & SDMMC_STA_CTIMEOUT ) ||
+         ( ( sta & SDMMC_STA_CCRCFAIL ) &&
+           !( sdmmc_xfer.flags & SDMMC_XFER_F_NO_CRC ) ) ) {
+      sdmmc_xfer_enter( SDMMCx, SDMMC_XFER_ERROR, 0 );
+    }
+    else if ( sdmmc_xfer.flags & SDMMC_XFER_F_DATA ) {
+      sdmmc_xfer_enter( SDMMCx, SDMMC_XFER_DATA,
+                        SDMMC_DATA_TIMEOUT_MS );
+    }
+    else if ( sdmmc_xfer.flags & SDMMC_XFER_F_BUSY ) {
+      sdmmc_xfer_enter( SDMMCx, SDMMC_XFER_BUSY,
+                        SDMMC_BUSY_TIMEOUT_MS );
+    }
+    else {
+      sdmmc_xfer_enter( SDMMCx, SDMMC_XFER_DONE, 0 );
+    }
+  }
+  else if ( sdmmc_xfer.state == SDMMC_XFER_DATA ) {
+    if ( sdmmc_xfer.stream ) {
+      // Empty the FIFO first: `DATAEND` means that the last word
+      // arrived, not that it was read.
+      sdmmc_stream_drain( SDMMCx );
+      sta = SDMMCx->STA;
+    }
+    if ( !( sta & SDMMC_DATA_FLAGS ) ) { return; }
+    sdmmc_xfer.sta |= ( sta & SDMMC_DATA_FLAGS );
+    SDMMCx->ICR     = ( sta & SDMMC_DATA_FLAGS );
+    if ( sta & SDMMC_DATA_ERRS ) {
+      sdmmc_xfer_enter( SDMMCx, SDMMC_XFER_ERROR, 0 );
+    }
+    else if ( sdmmc_xfer.flags & SDMMC_XFER_F_BUSY ) {
+      // Writes: the card programs the data while holding DAT0 low.
+      sdmmc_xfer_enter( SDMMCx, SDMMC_XFER_BUSY,
+                        SDMMC_BUSY_TIMEOUT_MS );
+    }
+    else {
+      sdmmc_xfer_enter( SDMMCx, SDMMC_XFER_DONE, 0 );
+    }
+  }
+}
+
+/**
+ * Check on the command engine without blocking, and return its
+ * current state. This polls the parts of the transfer which do not
+ * raise interrupts (the busy signal) and enforces phase timeouts.
+ */
+int sdmmc_xfer_poll( SDMMC_TypeDef *SDMMCx ) {
+  SDMMC_IRQ_OFF();
+  sdmmc_irq_handler( SDMMCx );
+  if ( sdmmc_xfer.state == SDMMC_XFER_BUSY && SDMMC_DAT0_HIGH() ) {
+    sdmmc_xfer_enter( SDMMCx, SDMMC_XFER_DONE, 0 );
+  }
+  if ( sdmmc_xfer.state > SDMMC_XFER_IDLE &&
+       sdmmc_xfer.state < SDMMC_XFER_DONE &&
+       ( tick - sdmmc_xfer.start ) > sdmmc_xfer.timeout ) {
+    // Nothing happened in time; the card may have been removed.
+    sdmmc_xfer.sta |= SDMMC_XFER_TIMEOUT;
+    sdmmc_xfer_enter( SDMMCx, SDMMC_XFER_ERROR, 0 );
+  }
+  SDMMC_IRQ_ON();
+  return sdmmc_xfer.state;
+}
+
+/**
+ * Wait until the command engine leaves the given state, or any
+ * earlier one. In `SDMMC_WAIT_WFI` mode, the core sleeps between
+ * checks. Interrupts are disabled around the check and the `WFI`,
+ * so an interrupt which arrives in between still wakes the core.
+ */
+static int sdmmc_xfer_wait_past( SDMMC_TypeDef *SDMMCx, int state ) {
+  while ( sdmmc_xfer_poll( SDMMCx ) <= state &&
+          sdmmc_xfer.state != SDMMC_XFER_IDLE ) {
+    if ( sdmmc_xfer.wait_mode == SDMMC_WAIT_WFI ) {
+      // Read the timer with interrupts on, so that a SysTick which
+      // woke the core has been counted.
+      uint32_t start = timer_micros();
+      SDMMC_IRQ_OFF();
+      if ( sdmmc_xfer.state <= state ) { SDMMC_SLEEP(); }
+      SDMMC_IRQ_ON();
+      sdmmc_xfer.sleep_us += timer_micros() - start;
+    }
+  }
+  return sdmmc_xfer.state;
+}
+
+/**
+ * Block until the current command, its data phase and any busy
+ * signal are finished. Returns 0 on success, -1 on an error.
+ */
+int sdmmc_xfer_wait( SDMMC_TypeDef *SDMMCx ) {
+  if ( sdmmc_xfer_wait_past( SDMMCx, SDMMC_XFER_BUSY ) ==
+       SDMMC_XFER_ERROR ) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Start a command on the command engine, and return immediately.
+ * `flags` describes what follows the command's response: a data
+ * transfer, a busy signal, or neither. Use `sdmmc_xfer_wait` or
+ * `sdmmc_xfer_poll` to find out when it is done.
+ */
+void sdmmc_cmd_start( SDMMC_TypeDef *SDMMCx,
                       uint32_t cmd,
                       uint32_t dat,
-                      int resp_type ) {
+                      int resp_type,
+                      int flags ) {
+  // If the card is still receiving an open-ended write, or still
+  // programming a write-behind block, finish that first. CMD13 is
+  // the exception; it can be sent while the card is busy, and it is
+  // used to check on the card.
+  if ( ( sdmmc_writing || sdmmc_programming ) &&
+       cmd != SDMMC_CMD_GET_STAT ) {
+    sdmmc_card_wait_ready( SDMMCx );
+  }
+  // Clear any leftover 'command' flags from a previous transfer.
+  SDMMCx->ICR  =  ( SDMMC_CMD_FLAGS );
+  SDMMC_IRQ_OFF();
+  sdmmc_xfer.sta   = 0x00000000;
+  sdmmc_xfer.flags = flags;
+  sdmmc_xfer_enter( SDMMCx, SDMMC_XFER_CMD, SDMMC_CMD_TIMEOUT_MS );
+  SDMMC_IRQ_ON();
+  // CMD0 resets every card on the bus, which also deselects them.
+  if ( cmd == SDMMC_CMD_GO_IDLE ) { sdmmc_selected = 0x0000; }
   // The `ARG` register holds the command argument / data.
   SDMMCx->ARG  =  ( dat );
   // Set the `CMD` ('command') register. Use the internal `CPSM`
@@ -60,20 +337,25 @@ void sdmmc_cmd_write( SDMMC_TypeDef *SDMMCx,
                     ( cmd << SDMMC_CMD_CMDINDEX_Pos ) );
 }
 
+/** Send a command to the SD/MMC card. */
+void sdmmc_cmd_write( SDMMC_TypeDef *SDMMCx,
+                      uint32_t cmd,
+                      uint32_t dat,
+                      int resp_type ) {
+  sdmmc_cmd_start( SDMMCx, cmd, dat, resp_type, 0 );
+}
+
 /** Read the ID / category of a card's response to a command. */
 uint8_t sdmmc_cmd_read_type( SDMMC_TypeDef *SDMMCx ) {
   // Wait for a response to be received, or some sort of failure.
-  while ( !( SDMMCx->STA & ( SDMMC_STA_CMDSENT |
-                             SDMMC_STA_CMDREND |
-                             SDMMC_STA_CTIMEOUT |
-                             SDMMC_STA_CCRCFAIL ) ) ) {};
+  sdmmc_xfer_wait_past( SDMMCx, SDMMC_XFER_CMD );
   // If a command had a response, return its type.
-  if ( SDMMCx->STA & SDMMC_STA_CMDREND ) {
+  if ( sdmmc_xfer.sta & SDMMC_STA_CMDREND ) {
     return ( SDMMCx->RESPCMD & SDMMC_RESPCMD_RESPCMD );
   }
   // If there is no response and no error, return 0. I think that
   // CMDSENT indicates that no response was asked for, so this is OK.
-  else if ( SDMMCx->STA & SDMMC_STA_CMDSENT ) { return 0x00; }
+  else if ( sdmmc_xfer.sta & SDMMC_STA_CMDSENT ) { return 0x00; }
   // If there is an error, return 0xFF. This is the usual 'nothing
   // happened' response when SPI is used, so...sure.
   return 0xFF;
@@ -94,12 +376,12 @@ int sdmmc_cmd_read( SDMMC_TypeDef *SDMMCx,
                     void *buf ) {
   uint32_t *buf_ptr = ( uint32_t* )buf;
   // Wait for a response to be received, or some sort of failure.
-  while ( !( SDMMCx->STA & ( SDMMC_STA_CMDSENT |
-                             SDMMC_STA_CMDREND |
-                             SDMMC_STA_CTIMEOUT |
-                             SDMMC_STA_CCRCFAIL ) ) ) {};
-  if ( ( SDMMCx->STA & SDMMC_STA_CMDREND ) ||
-       ( ( SDMMCx->STA & SDMMC_STA_CCRCFAIL ) &&
+  // The interrupt handler latches the status flags as it clears
+  // them, so check the latched copy rather than `STA`.
+  sdmmc_xfer_wait_past( SDMMCx, SDMMC_XFER_CMD );
+  uint32_t sta = sdmmc_xfer.sta;
+  if ( ( sta & SDMMC_STA_CMDREND ) ||
+       ( ( sta & SDMMC_STA_CCRCFAIL ) &&
          ( ignore_crc && ( ( type == SDMMC_RESPONSE_SHORT ) ||
                            ( type == SDMMC_RESPONSE_LONG ) ) ) ) ) {
     // Only check for received data if a valid response was received.
@@ -120,8 +402,8 @@ int sdmmc_cmd_read( SDMMC_TypeDef *SDMMCx,
       return 0;
     }
   }
-  else if ( SDMMCx->STA & SDMMC_STA_CMDSENT ||
-            ( ( SDMMCx->STA & SDMMC_STA_CCRCFAIL ) &&
+  else if ( sta & SDMMC_STA_CMDSENT ||
+            ( ( sta & SDMMC_STA_CCRCFAIL ) &&
             ( ignore_crc && ( ( type == SDMMC_RESPONSE_NONE2 ) ||
             ( type == SDMMC_RESPONSE_NONE ) ) ) ) ) {
     // No response expected, and no unexpected errors: return 0.
@@ -140,17 +422,13 @@ int sdmmc_cmd_read( SDMMC_TypeDef *SDMMCx,
  * data and put all of this logic into one method.
  */
 void sdmmc_cmd_done( SDMMC_TypeDef *SDMMCx ) {
-  // Wait for one of the relevant status flags to be set.
-  // TODO: Add a timeout, or better yet make this part of
-  // the 'read response' methods.
-  while ( !( SDMMCx->STA & ( SDMMC_STA_CMDSENT |
-                             SDMMC_STA_CMDREND |
-                             SDMMC_STA_CTIMEOUT |
-                             SDMMC_STA_CCRCFAIL ) ) ) {};
+  // Wait for the command phase to end. This can no longer hang:
+  // the command engine gives up after `SDMMC_CMD_TIMEOUT_MS`.
+  sdmmc_xfer_wait_past( SDMMCx, SDMMC_XFER_CMD );
   // Clear all 'command receive' status and error flags.
   // Like many STM32 peripherals, setting a bit in the 'clear' register
   // actually clears the corresponding bit in the 'status' register.
-  SDMMCx->ICR |= ( SDMMC_ICR_CMDSENTC |
+  SDMMCx->ICR  = ( SDMMC_ICR_CMDSENTC |
                    SDMMC_ICR_CMDRENDC |
                    SDMMC_ICR_CTIMEOUTC |
                    SDMMC_ICR_CCRCFAILC );
@@ -174,52 +452,326 @@ void sdmmc_set_block_len( SDMMC_TypeDef *SDMMCx,
 
 /**
  * Send a command to tell the connected SD card to use a specified
- * bus width. This method blocks on and returns the SD card response.
+ * bus width, and switch the peripheral to match if it accepts.
+ * Returns 0 on success, -1 on an error.
  */
-void sdmmc_set_bus_width( SDMMC_TypeDef *SDMMCx,
-                          uint16_t card_addr,
-                          uint32_t width ) {
-  // CMD7 to select the card.
-  // TODO: This returns an 'R1b' response, which means that
-  // the `DAT0` wire is held low until the card is not busy.
-  // So...should I wait for the line to go high here by checking
-  // the GPIO IDR register, or is the STM32 SDMMC peripheral smart
-  // enough to not set its status flags until the busy signal clears?
+int sdmmc_set_bus_width( SDMMC_TypeDef *SDMMCx,
+                         uint16_t card_addr,
+                         uint32_t width ) {
+  // CMD7 to select the card, if it is not already selected.
+  // App CMD6 is only accepted in the 'transfer' state.
+  if ( sdmmc_select_card( SDMMCx, card_addr ) ) { return -1; }
+
+  // CMD55 needs to precede application commands, and once the
+  // card has an address, it only answers if it is addressed.
+  uint32_t resp;
   sdmmc_cmd_write( SDMMCx,
-                   SDMMC_CMD_SEL_DESEL,
+                   SDMMC_CMD_APP,
                    ( ( uint32_t )card_addr ) << 16,
                    SDMMC_RESPONSE_SHORT );
+  int err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                            SDMMC_CHECK_CRC, &resp );
+  sdmmc_cmd_done( SDMMCx );
+  if ( err ) { return -1; }
+  // App CMD6 to set the data bus width. The setting sticks until
+  // the card is reset or powered off.
+  sdmmc_cmd_write( SDMMCx,
+                   SDMMC_APP_SET_BUSW,
+                   width,
+                   SDMMC_RESPONSE_SHORT );
+  err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                        SDMMC_CHECK_CRC, &resp );
   sdmmc_cmd_done( SDMMCx );
+  if ( err ) { return -1; }
+  // The peripheral's `WIDBUS` field uses 0 for 1 bit, 1 for 4 bits.
+  SDMMCx->CLKCR &= ~( SDMMC_CLKCR_WIDBUS );
+  if ( width == SDMMC_BUS_WIDTH_4b ) {
+    SDMMCx->CLKCR |=  ( 0x1 << SDMMC_CLKCR_WIDBUS_Pos );
+  }
+  // The card stays selected for the transfers which follow.
+  return 0;
+}
 
-  // App CMD6 to set the data bus width. Apparently
-  // this can only be done when the card is in 'transmission mode',
-  // which it enters when selected by CMD7. But I'm not exactly
-  // sure if this needs to be set for each transaction, or if it will
-  // stick after being set in this method. I'm hoping for the latter.
-  // (CMD55 needs to precede application commands)
+/**
+ * Set the card clock to one of the `SDMMC_CLK_*` speeds. The card
+ * must be identified before it can run faster than `SDMMC_CLK_INIT`,
+ * and `SDMMC_CLK_HIGH` needs a successful `sdmmc_set_high_speed`.
+ */
+void sdmmc_set_clock( SDMMC_TypeDef *SDMMCx, uint32_t clk ) {
+  SDMMCx->CLKCR &= ~( SDMMC_CLKCR_CLKDIV |
+                      SDMMC_CLKCR_BYPASS |
+                      SDMMC_CLKCR_PWRSAV );
+  SDMMCx->CLKCR |=  ( clk );
+  // Identification needs a free-running clock; after that, the
+  // peripheral can stop it between commands to save power.
+#if SDMMC_PWRSAV
+  if ( clk != SDMMC_CLK_INIT ) {
+    SDMMCx->CLKCR |=  ( SDMMC_CLKCR_PWRSAV );
+  }
+#endif
+}
+
+/**
+ * Switch the card to 'high-speed' timing with CMD6, if it supports
+ * it. The card answers with a 64-byte status block which says which
+ * function was selected; function 1 in group 1 is 'high-speed'.
+ * Returns 1 if the card switched, 0 if it did not, -1 on an error.
+ * The card must be selected, and the clock should only be raised
+ * to `SDMMC_CLK_HIGH` afterwards.
+ */
+int sdmmc_set_high_speed( SDMMC_TypeDef *SDMMCx ) {
+  uint32_t status[ 16 ];
+  // Mode 1 ('set'), function 1 in group 1, no change to the others.
+  if ( sdmmc_card_wait_ready( SDMMCx ) ||
+       sdmmc_read_data( SDMMCx, SDMMC_CMD_SWITCH, 0x80FFFFF1,
+                        status, 64 ) ) {
+    return -1;
+  }
+  // The status block is sent MSB first, so the FIFO words hold its
+  // bytes in order. Bits 379:376 are byte 16, bits 3:0.
+  uint8_t group1 = ( ( uint8_t* )status )[ 16 ] & 0x0F;
+  return ( group1 == 0x1 ) ? 1 : 0;
+}
+
+/**
+ * Read the card's 'SD configuration register' with ACMD51. It is 8
+ * bytes long, and it says which optional commands the card supports.
+ * The card sends it MSB first, so `scr` holds its bytes in order:
+ * byte 0 is bits 63:56. The card must be selected.
+ * Returns 0 on success, -1 on an error.
+ */
+int sdmmc_read_scr( SDMMC_TypeDef *SDMMCx,
+                    uint16_t card_addr,
+                    uint32_t *scr ) {
+  if ( sdmmc_card_wait_ready( SDMMCx ) ) { return -1; }
+  // CMD55 with the card's address, to precede the app command.
+  uint32_t resp;
   sdmmc_cmd_write( SDMMCx,
                    SDMMC_CMD_APP,
-                   0x00000000,
+                   ( ( uint32_t )card_addr ) << 16,
                    SDMMC_RESPONSE_SHORT );
+  int err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                            SDMMC_CHECK_CRC, &resp );
   sdmmc_cmd_done( SDMMCx );
-  // TODO: Check response for errors.
+  if ( err ) { return -1; }
+  return sdmmc_read_data( SDMMCx, SDMMC_APP_GET_SCR, 0, scr, 8 );
+}
+
+/**
+ * Read the selected card's 64-byte 'SD Status' register with ACMD13,
+ * MSB first. It holds the card's speed class, allocation unit size
+ * and UHS speed grade, among other things.
+ * Returns 0 on success, -1 on an error.
+ */
+int sdmmc_read_sd_status( SDMMC_TypeDef *SDMMCx,
+                          uint16_t card_addr,
+                          uint32_t *status ) {
+  if ( sdmmc_card_wait_ready( SDMMCx ) ) { return -1; }
   uint32_t resp;
   sdmmc_cmd_write( SDMMCx,
-                   SDMMC_APP_SET_BUSW,
-                   width,
+                   SDMMC_CMD_APP,
+                   ( ( uint32_t )card_addr ) << 16,
                    SDMMC_RESPONSE_SHORT );
-  sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
-                  SDMMC_CHECK_CRC, &resp );
+  int err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                            SDMMC_CHECK_CRC, &resp );
+  sdmmc_cmd_done( SDMMCx );
+  if ( err ) { return -1; }
+  return sdmmc_read_data( SDMMCx, SDMMC_APP_GET_STAT, 0, status, 64 );
+}
+
+/**
+ * Read an SD 6.0 extension register page with CMD48, from `offset`
+ * to the end of the 512-byte page. The card sends a 512-byte block
+ * either way, so `buf` must hold 128 words; bytes past the end of
+ * the page read as zero. The card must be selected.
+ * Returns 0 on success, -1 on an error.
+ */
+int sdmmc_read_ext_reg( SDMMC_TypeDef *SDMMCx,
+                        uint32_t fno,
+                        uint32_t page,
+                        uint32_t offset,
+                        uint32_t *buf ) {
+  if ( sdmmc_card_wait_ready( SDMMCx ) ) { return -1; }
+  return sdmmc_read_data( SDMMCx, SDMMC_CMD_READ_EXTR,
+                          SDMMC_EXT_ARG( fno, page, offset,
+                                         512 - offset ),
+                          buf, 512 );
+}
+
+/**
+ * Write one byte of an SD 6.0 extension register page with CMD49.
+ * The data is still a full 512-byte block, with the value in its
+ * first byte. Some registers start an operation when they are
+ * written, like a cache flush, so this waits for the card to stop
+ * signalling busy before it returns. The card must be selected.
+ * Returns 0 on success, -1 on an error or timeout.
+ */
+int sdmmc_write_ext_reg( SDMMC_TypeDef *SDMMCx,
+                         uint32_t fno,
+                         uint32_t page,
+                         uint32_t offset,
+                         uint8_t value ) {
+  uint32_t block[ 128 ];
+  memset( block, 0, sizeof( block ) );
+  ( ( uint8_t* )block )[ 0 ] = value;
+  if ( sdmmc_card_wait_ready( SDMMCx ) ||
+       sdmmc_write_data( SDMMCx, SDMMC_CMD_WRITE_EXTR,
+                         SDMMC_EXT_ARG( fno, page, offset, 1 ),
+                         block ) ) {
+    return -1;
+  }
+  return sdmmc_card_wait_ready( SDMMCx );
+}
+
+/**
+ * Select a card with CMD7, so that it enters the 'transfer' state
+ * and accepts data commands. The card stays selected until
+ * `sdmmc_deselect_card` is called, so this does nothing if the card
+ * is already selected. Returns 0 on success, -1 on an error.
+ */
+int sdmmc_select_card( SDMMC_TypeDef *SDMMCx, uint16_t card_addr ) {
+  if ( sdmmc_selected == card_addr ) { return 0; }
+  // CMD7 has an 'R1b' response: the card holds `DAT0` low until
+  // it is ready, so let the command engine wait for that.
+  uint32_t resp;
+  sdmmc_cmd_start( SDMMCx,
+                   SDMMC_CMD_SEL_DESEL,
+                   ( ( uint32_t )card_addr ) << 16,
+                   SDMMC_RESPONSE_SHORT,
+                   SDMMC_XFER_F_BUSY );
+  int err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                            SDMMC_CHECK_CRC, &resp );
   sdmmc_cmd_done( SDMMCx );
+  if ( !err ) { err = sdmmc_xfer_wait( SDMMCx ); }
+  if ( err ) {
+    // We can't be sure which state the card ended up in.
+    sdmmc_selected = 0x0000;
+    return -1;
+  }
+  sdmmc_selected = card_addr;
+  return 0;
+}
 
-  // CMD7 to de-select the card.
+/**
+ * Deselect the current card with CMD7, returning it to 'standby'.
+ * This is only needed before commands which are not accepted in
+ * the 'transfer' state, such as CMD9 / CMD10, or before shutdown.
+ */
+void sdmmc_deselect_card( SDMMC_TypeDef *SDMMCx ) {
+  if ( sdmmc_selected == 0x0000 ) { return; }
   // It sounds like 0 is a reserved address, and sending it
-  // should de-select all cards.
+  // should de-select all cards. No card is addressed, so
+  // there is no response.
   sdmmc_cmd_write( SDMMCx,
                    SDMMC_CMD_SEL_DESEL,
                    0x00000000,
-                   SDMMC_RESPONSE_SHORT );
+                   SDMMC_RESPONSE_NONE );
   sdmmc_cmd_done( SDMMCx );
+  sdmmc_selected = 0x0000;
+}
+
+/**
+ * Get the card state which the driver expects: `SDMMC_STATE_RCV`
+ * while a multi-block write is open, `SDMMC_STATE_PRG` while a
+ * write-behind block is programming, `SDMMC_STATE_TRAN` if a card
+ * is selected, `SDMMC_STATE_STBY` otherwise.
+ */
+int sdmmc_card_state( void ) {
+  if ( sdmmc_writing ) { return SDMMC_STATE_RCV; }
+  if ( sdmmc_programming ) { return SDMMC_STATE_PRG; }
+  return sdmmc_selected ? SDMMC_STATE_TRAN : SDMMC_STATE_STBY;
+}
+
+/**
+ * Wait for the card to finish programming a block which was written
+ * in write-behind mode. The card holds `DAT0` low until it is done,
+ * so the command engine can usually finish the write's 'busy' phase
+ * without sending any commands. If that times out, fall back to
+ * asking the card with CMD13, in case `DAT0` could not be read.
+ * An open-ended multi-block write is stopped first.
+ * Returns 0 once the card is ready, -1 on an error or timeout.
+ */
+int sdmmc_card_wait_ready( SDMMC_TypeDef *SDMMCx ) {
+  if ( sdmmc_writing && sdmmc_write_stop( SDMMCx ) ) { return -1; }
+  if ( !sdmmc_programming ) { return 0; }
+  int err = sdmmc_xfer_wait( SDMMCx );
+  // Clear the flag before sending CMD13, so that it isn't re-entered.
+  sdmmc_programming = 0;
+  if ( err ) { err = sdmmc_wait_ready_for_data( SDMMCx, sdmmc_selected ); }
+  return err;
+}
+
+/**
+ * Bring the card back to a known state after a failed command or
+ * data transfer. The data path is stopped and the FIFO emptied, then
+ * CMD13 asks the card where it ended up: a card which is still
+ * sending or receiving data gets CMD12, and a card which is still
+ * programming gets time to finish. A card which was deselected is
+ * selected again by the next data command.
+ * Returns 0 once the card is ready for the next command, or -1 if
+ * it does not answer; then only a reset can help.
+ */
+int sdmmc_recover( SDMMC_TypeDef *SDMMCx, uint16_t card_addr ) {
+  SDMMC_IRQ_OFF();
+  sdmmc_xfer.state = SDMMC_XFER_IDLE;
+  sdmmc_xfer.stream = NULL;
+  SDMMCx->MASK = ( 0x00000000 );
+  SDMMC_IRQ_ON();
+  SDMMCx->DCTRL &= ~( SDMMC_DCTRL_DTEN );
+  for ( int i = 0; i < 32 && ( SDMMCx->STA & SDMMC_STA_RXDAVL ); ++i ) {
+    ( void )SDMMCx->FIFO;
+  }
+  SDMMCx->ICR = ( SDMMC_CMD_FLAGS | SDMMC_DATA_FLAGS | SDMMC_ICR_DBCKENDC );
+  // Find out whether the card is busy from CMD13, not `DAT0`. An
+  // open write is stopped below, if the card is still receiving.
+  sdmmc_programming = 0;
+  sdmmc_writing = 0;
+
+  int misses = 0;
+  uint32_t start = tick;
+  while ( ( tick - start ) <= SDMMC_BUSY_TIMEOUT_MS ) {
+    uint32_t resp = 0x00000000;
+    sdmmc_cmd_write( SDMMCx,
+                     SDMMC_CMD_GET_STAT,
+                     ( ( uint32_t )card_addr ) << 16,
+                     SDMMC_RESPONSE_SHORT );
+    int err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                              SDMMC_CHECK_CRC, &resp );
+    sdmmc_cmd_done( SDMMCx );
+    // One bad response can be noise; a few in a row cannot.
+    if ( err ) {
+      if ( ++misses > 2 ) { return -1; }
+      continue;
+    }
+    uint32_t state = ( resp >> 9 ) & 0xF;
+    if ( state == SDMMC_STATE_TRAN ) {
+      sdmmc_selected = card_addr;
+      return 0;
+    }
+    else if ( state == SDMMC_STATE_STBY ) {
+      sdmmc_selected = 0x0000;
+      return 0;
+    }
+    else if ( state == SDMMC_STATE_DATA || state == SDMMC_STATE_RCV ) {
+      // CMD12 to stop the transfer. After a write, the card may
+      // program what it received, so wait for the busy signal.
+      sdmmc_cmd_start( SDMMCx, SDMMC_CMD_STOP_TRANS, 0,
+                       SDMMC_RESPONSE_SHORT,
+                       SDMMC_XFER_F_BUSY );
+      sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                      SDMMC_CHECK_CRC, &resp );
+      sdmmc_cmd_done( SDMMCx );
+      sdmmc_xfer_wait( SDMMCx );
+    }
+    else if ( state == SDMMC_STATE_PRG || state == SDMMC_STATE_DIS ) {
+      SDMMC_SLEEP();
+    }
+    else {
+      // The card was reset, or is in a state we cannot get it out of.
+      return -1;
+    }
+  }
+  return -1;
 }
 
 /**
@@ -251,12 +803,14 @@ uint32_t sdmmc_get_volume_size( SDMMC_TypeDef *SDMMCx,
     return ( size_c + 1 ) * 1024;
   }
   else {
+    // `csd_regs[ 0 ]` holds bits 0-31, `csd_regs[ 1 ]` bits 32-63...
     // Get `size_c` from bits 62-73.
-    uint32_t size_c = csd_regs[ 3 ] & 0x00003FFF;
+    uint32_t size_c = ( ( csd_regs[ 2 ] & 0x000003FF ) << 2 ) |
+                      ( csd_regs[ 1 ] >> 30 );
     // Get `c_size_mult` from bits 47-49.
-    uint32_t c_size_mult = ( csd_regs[ 2 ] & 0x00038000 ) >> 15;
+    uint32_t c_size_mult = ( csd_regs[ 1 ] & 0x00038000 ) >> 15;
     // Get `read_bl_len` from bits 80-83.
-    uint32_t read_bl_len = ( csd_regs[ 3 ] & 0x000F0000 ) >> 16;
+    uint32_t read_bl_len = ( csd_regs[ 2 ] & 0x000F0000 ) >> 16;
     // Calculate number of 512-byte blocks. (See above comment block)
     // Note: ( X * 2^Y ) = X << Y, which simplifies this a bit.
     return ( ( ( size_c + 1 ) <<
@@ -305,67 +859,129 @@ int sdmmc_is_card_busy( SDMMC_TypeDef *SDMMCx, uint16_t card_addr ) {
 }
 
 /**
- * Read one block of data from an address on the SD/MMC card.
- * Standard-capacity cards take the byte offset of the starting
- * address as an argument, while high-capacity cards take the
- * block offset. TODO: This assumes that the block length is
- * always 512 bytes, but standard-capacity cards can have
- * a different block size. I plan to always set SC cards to
- * use 512-byte blocks, so I'm okay with that assumption.
+ * Poll CMD13 until the card reports that it is 'ready for data'.
+ * Returns 0 once it is, or -1 if the card stops responding or
+ * does not become ready within `SDMMC_BUSY_TIMEOUT_MS`.
  */
-void sdmmc_read_block( SDMMC_TypeDef *SDMMCx,
-                       uint32_t card_type,
-                       uint16_t card_addr,
-                       blockno_t start_block,
-                       uint32_t *buf ) {
+static int sdmmc_wait_ready_for_data( SDMMC_TypeDef *SDMMCx,
+                                      uint16_t card_addr ) {
+  uint32_t resp = 0x00000000;
+  uint32_t start = tick;
+  while ( !( resp & SDMMC_READY_FOR_DATA ) ) {
+    if ( ( tick - start ) > SDMMC_BUSY_TIMEOUT_MS ) { return -1; }
+    sdmmc_cmd_write( SDMMCx,
+                     SDMMC_CMD_GET_STAT,
+                     ( ( uint32_t )card_addr ) << 16,
+                     SDMMC_RESPONSE_SHORT );
+    int err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                              SDMMC_CHECK_CRC, &resp );
+    sdmmc_cmd_done( SDMMCx );
+    if ( err ) { return -1; }
+  }
+  return 0;
+}
+
+/**
+ * Send a command which makes the card send back one block of data,
+ * and read that block into `buf`. `len` is the block length in bytes:
+ * a power of two from 4 to 512. CMD17 sends a 512-byte block, but
+ * other commands send shorter ones; CMD6 sends 64 bytes, for example.
+ * The card must already be selected.
+ * Returns 0 on success, -1 on an error or timeout.
+ */
+static int sdmmc_read_data( SDMMC_TypeDef *SDMMCx,
+                            uint32_t cmd,
+                            uint32_t arg,
+                            uint32_t *buf,
+                            uint32_t len ) {
+  uint32_t block_size = 0;
+  while ( ( 1U << block_size ) < len ) { ++block_size; }
   // Clear the data control register.
   SDMMCx->DCTRL &= ~( SDMMC_DCTRL_DTDIR |
-                      SDMMC_DCTRL_DTEN );
-
-  uint32_t resp;
-  // Calculate the command argument.
-  uint32_t start_addr = ( uint32_t )start_block;
-  if ( card_type == SDMMC_SC ) { start_addr *= 512; }
-
-  // CMD7 to select the card. (TODO: Check for success)
-  sdmmc_cmd_write( SDMMCx,
-                   SDMMC_CMD_SEL_DESEL,
-                   ( ( uint32_t )card_addr ) << 16,
-                   SDMMC_RESPONSE_SHORT );
-  sdmmc_cmd_done( SDMMCx );
-
+                      SDMMC_DCTRL_DTEN |
+                      SDMMC_DCTRL_DBLOCKSIZE );
   // Prepare for read: set data length.
-  SDMMCx->DLEN   =  ( 512 );
+  SDMMCx->DLEN   =  ( len );
   // Set the data control register for 'card-to-controller' data
   // flow, and enable the data flow state machine.
   // Note: DTEN does not need to be cleared until the next transfer.
-  SDMMCx->DCTRL |=  ( SDMMC_DCTRL_DTDIR |
+  SDMMCx->DCTRL |=  ( block_size << SDMMC_DCTRL_DBLOCKSIZE_Pos |
+                      SDMMC_DCTRL_DTDIR |
                       SDMMC_DCTRL_DTEN );
 
-  // CMD17 to read a single block at the given address.
-  sdmmc_cmd_write( SDMMCx,
-                   SDMMC_CMD_READ_BLOCK,
-                   start_addr,
-                   SDMMC_RESPONSE_SHORT );
-  sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
-                  SDMMC_CHECK_CRC, &resp );
+  uint32_t resp;
+  sdmmc_cmd_start( SDMMCx, cmd, arg,
+                   SDMMC_RESPONSE_SHORT,
+                   SDMMC_XFER_F_DATA );
+  int err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                            SDMMC_CHECK_CRC, &resp );
   sdmmc_cmd_done( SDMMCx );
 
   // Read the data from the FIFO buffer as it becomes available.
-  // TODO: Synchronous polling is slow, but okay for testing.
+  // `DATAEND` can arrive while words are still in the FIFO, so
+  // count words instead. Give up if the command engine reports
+  // an error or a timeout, rather than spinning forever.
+  int words = ( int )( len / 4 );
   int buf_ind = 0;
-  while ( SDMMCx->DCOUNT != 0 ) {
-    while ( !( SDMMCx->STA & SDMMC_STA_RXDAVL ) ) {};
-    buf[ buf_ind ] = SDMMCx->FIFO;
-    ++buf_ind;
+  while ( !err && buf_ind < words ) {
+    uint32_t sta = SDMMCx->STA;
+#if SDMMC_FIFO_BURST
+    // 'Half-full' means that at least 8 words are waiting, so they
+    // can be read without checking the status flags in between.
+    if ( ( sta & SDMMC_STA_RXFIFOHF ) &&
+         ( words - buf_ind ) >= SDMMC_FIFO_BURST_LEN ) {
+      uint32_t *burst = &buf[ buf_ind ];
+      burst[ 0 ] = SDMMCx->FIFO;
+      burst[ 1 ] = SDMMCx->FIFO;
+      burst[ 2 ] = SDMMCx->FIFO;
+      burst[ 3 ] = SDMMCx->FIFO;
+      burst[ 4 ] = SDMMCx->FIFO;
+      burst[ 5 ] = SDMMCx->FIFO;
+      burst[ 6 ] = SDMMCx->FIFO;
+      burst[ 7 ] = SDMMCx->FIFO;
+      buf_ind += SDMMC_FIFO_BURST_LEN;
+      continue;
+    }
+#endif
+    if ( sta & SDMMC_STA_RXDAVL ) {
+      buf[ buf_ind ] = SDMMCx->FIFO;
+      ++buf_ind;
+    }
+    else if ( sdmmc_xfer_poll( SDMMCx ) == SDMMC_XFER_ERROR ) {
+      err = -1;
+    }
   }
+  if ( !err ) { err = sdmmc_xfer_wait( SDMMCx ); }
+  return err;
+}
 
-  // Done reading; CMD7 to de-select the card.
-  sdmmc_cmd_write( SDMMCx,
-                   SDMMC_CMD_SEL_DESEL,
-                   0x00000000,
-                   SDMMC_RESPONSE_SHORT );
-  sdmmc_cmd_done( SDMMCx );
+/**
+ * Read one block of data from an address on the SD/MMC card.
+ * Standard-capacity cards take the byte offset of the starting
+ * address as an argument, while high-capacity cards take the
+ * block offset. TODO: This assumes that the block length is
+ * always 512 bytes, but standard-capacity cards can have
+ * a different block size. I plan to always set SC cards to
+ * use 512-byte blocks, so I'm okay with that assumption.
+ * Returns 0 on success, -1 on an error or timeout.
+ */
+int sdmmc_read_block( SDMMC_TypeDef *SDMMCx,
+                      uint32_t card_type,
+                      uint16_t card_addr,
+                      blockno_t start_block,
+                      uint32_t *buf ) {
+  // Calculate the command argument.
+  uint32_t start_addr = ( uint32_t )start_block;
+  if ( card_type == SDMMC_SC ) { start_addr *= 512; }
+
+  // Make sure that the card is selected and not still programming
+  // a previous write. Both are usually free.
+  if ( sdmmc_card_wait_ready( SDMMCx ) ||
+       sdmmc_select_card( SDMMCx, card_addr ) ) { return -1; }
+
+  // CMD17 to read a single block at the given address.
+  return sdmmc_read_data( SDMMCx, SDMMC_CMD_READ_BLOCK,
+                          start_addr, buf, 512 );
 }
 
 /** Read N blocks of data from an address on the SD/MMC card. */
@@ -376,98 +992,463 @@ void sdmmc_read_blocks( SDMMC_TypeDef *SDMMCx,
   // TODO: CMD23 / CMD18 to read multiple blocks.
 }
 
-/** Write one block of data to an address on the SD/MMC card. */
-void sdmmc_write_block( SDMMC_TypeDef *SDMMCx,
+/**
+ * Move data from the FIFO into a streaming read's ring of buffers,
+ * until the FIFO is empty or every buffer is full. This runs in the
+ * interrupt handler, or with interrupts disabled. The 'half-full'
+ * interrupt is only unmasked while there is somewhere to put the
+ * data; otherwise the FIFO fills up and flow control stops the card.
+ */
+static void sdmmc_stream_drain( SDMMC_TypeDef *SDMMCx ) {
+  sdmmc_stream *s = sdmmc_xfer.stream;
+  uint32_t buf_words = s->buf_blocks * 128;
+  int moved = 0;
+  while ( s->words_left > 0 && ( s->filled - s->consumed ) < s->depth ) {
+    uint32_t *buf = &s->bufs[ ( s->filled % s->depth ) * buf_words ];
+    uint32_t sta = SDMMCx->STA;
+    if ( ( sta & SDMMC_STA_RXFIFOHF ) &&
+         s->words_left >= SDMMC_FIFO_BURST_LEN &&
+         ( buf_words - s->pos ) >= SDMMC_FIFO_BURST_LEN ) {
+      uint32_t *burst = &buf[ s->pos ];
+      burst[ 0 ] = SDMMCx->FIFO;
+      burst[ 1 ] = SDMMCx->FIFO;
+      burst[ 2 ] = SDMMCx->FIFO;
+      burst[ 3 ] = SDMMCx->FIFO;
+      burst[ 4 ] = SDMMCx->FIFO;
+      burst[ 5 ] = SDMMCx->FIFO;
+      burst[ 6 ] = SDMMCx->FIFO;
+      burst[ 7 ] = SDMMCx->FIFO;
+      s->pos += SDMMC_FIFO_BURST_LEN;
+      s->words_left -= SDMMC_FIFO_BURST_LEN;
+    }
+    else if ( sta & SDMMC_STA_RXDAVL ) {
+      buf[ s->pos ] = SDMMCx->FIFO;
+      ++s->pos;
+      --s->words_left;
+    }
+    else { break; }
+    moved = 1;
+    // The last buffer of the run may be short.
+    if ( s->pos == buf_words || s->words_left == 0 ) {
+      s->pos = 0;
+      ++s->filled;
+    }
+  }
+  // The card is making progress, even if the whole run is long.
+  if ( moved ) { sdmmc_xfer.start = tick; }
+  if ( sdmmc_xfer.state == SDMMC_XFER_DATA ) {
+    if ( s->words_left > 0 && ( s->filled - s->consumed ) < s->depth ) {
+      SDMMCx->MASK |=  ( SDMMC_MASK_RXFIFOHFIE );
+    }
+    else {
+      SDMMCx->MASK &= ~( SDMMC_MASK_RXFIFOHFIE );
+    }
+  }
+}
+
+/**
+ * Start a streaming read: CMD18 to read blocks starting at the
+ * given address, with the data path set up for the whole run. This
+ * returns once the card has accepted the command; the data arrives
+ * in the background, and `sdmmc_stream_next` returns each buffer as
+ * it fills up. `s->bufs`, `s->depth` and `s->buf_blocks` must be set.
+ * Returns 0 on success, -1 on an error.
+ */
+int sdmmc_stream_start( SDMMC_TypeDef *SDMMCx,
                         uint32_t card_type,
                         uint16_t card_addr,
+                        sdmmc_stream *s,
                         blockno_t start_block,
-                        uint32_t *buf ) {
-  // Clear the data control register.
-  SDMMCx->DCTRL &= ~( SDMMC_DCTRL_DTDIR |
-                      SDMMC_DCTRL_DTEN );
-
-  // Calculate the command argument.
+                        uint32_t num_blocks ) {
+#if SDMMC_HWFC == 0
+  // Without flow control, a slow caller would overrun the FIFO.
+  return -1;
+#endif
+  if ( num_blocks == 0 || s->depth == 0 || s->buf_blocks == 0 ) {
+    return -1;
+  }
+  if ( num_blocks > SDMMC_STREAM_MAX_BLOCKS ) {
+    num_blocks = SDMMC_STREAM_MAX_BLOCKS;
+  }
   uint32_t start_addr = ( uint32_t )start_block;
   if ( card_type == SDMMC_SC ) { start_addr *= 512; }
+  if ( sdmmc_card_wait_ready( SDMMCx ) ||
+       sdmmc_select_card( SDMMCx, card_addr ) ) { return -1; }
 
-  // CMD7 to select the card. (TODO: Check for success)
-  sdmmc_cmd_write( SDMMCx,
-                   SDMMC_CMD_SEL_DESEL,
-                   ( ( uint32_t )card_addr ) << 16,
-                   SDMMC_RESPONSE_SHORT );
+  s->blocks = num_blocks;
+  s->filled = 0;
+  s->consumed = 0;
+  s->pos = 0;
+  s->words_left = num_blocks * 128;
+  s->active = 1;
+  // Set up the data path for the whole run, in 512-byte blocks.
+  SDMMCx->DCTRL &= ~( SDMMC_DCTRL_DTDIR |
+                      SDMMC_DCTRL_DTEN |
+                      SDMMC_DCTRL_DBLOCKSIZE );
+  SDMMCx->DLEN   =  ( num_blocks * 512 );
+  SDMMCx->DCTRL |=  ( 9 << SDMMC_DCTRL_DBLOCKSIZE_Pos |
+                      SDMMC_DCTRL_DTDIR |
+                      SDMMC_DCTRL_DTEN );
+  SDMMC_IRQ_OFF();
+  sdmmc_xfer.stream = s;
+  SDMMC_IRQ_ON();
+
+  // CMD18 to read blocks until CMD12 is sent.
+  uint32_t resp;
+  sdmmc_cmd_start( SDMMCx, SDMMC_CMD_READ_BLOCKS, start_addr,
+                   SDMMC_RESPONSE_SHORT,
+                   SDMMC_XFER_F_DATA );
+  int err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                            SDMMC_CHECK_CRC, &resp );
   sdmmc_cmd_done( SDMMCx );
+  if ( err ) {
+    sdmmc_stream_stop( SDMMCx, s );
+    return -1;
+  }
+  return 0;
+}
 
-  // Poll CMD13 until 'ready for data' is set.
-  uint32_t resp = 0x00000000;
-  while ( !( resp & SDMMC_READY_FOR_DATA ) ) {
-    sdmmc_cmd_write( SDMMCx,
-                     SDMMC_CMD_GET_STAT,
-                     ( ( uint32_t )card_addr ) << 16,
-                     SDMMC_RESPONSE_SHORT );
-    sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
-                    SDMMC_CHECK_CRC, &resp );
-    sdmmc_cmd_done( SDMMCx );
+/**
+ * Wait for the next full buffer of a streaming read. The caller
+ * owns it until `sdmmc_stream_release`, while the following buffers
+ * keep filling up. In `SDMMC_WAIT_SPIN` mode, data only moves while
+ * this is called, so the ring acts as a simple read-ahead.
+ * Returns the buffer and sets `blocks`, or NULL at the end of the
+ * run or on an error.
+ */
+uint32_t *sdmmc_stream_next( SDMMC_TypeDef *SDMMCx,
+                             sdmmc_stream *s,
+                             uint32_t *blocks ) {
+  if ( !s->active ) { return NULL; }
+  while ( 1 ) {
+    SDMMC_IRQ_OFF();
+    sdmmc_stream_drain( SDMMCx );
+    SDMMC_IRQ_ON();
+    if ( s->filled != s->consumed ) { break; }
+    if ( s->words_left == 0 ||
+         sdmmc_xfer_poll( SDMMCx ) == SDMMC_XFER_ERROR ) {
+      return NULL;
+    }
+    if ( sdmmc_xfer.wait_mode == SDMMC_WAIT_WFI ) {
+      SDMMC_IRQ_OFF();
+      if ( s->filled == s->consumed &&
+           sdmmc_xfer.state == SDMMC_XFER_DATA ) { SDMMC_SLEEP(); }
+      SDMMC_IRQ_ON();
+    }
   }
+  uint32_t first = s->consumed * s->buf_blocks;
+  *blocks = s->blocks - first;
+  if ( *blocks > s->buf_blocks ) { *blocks = s->buf_blocks; }
+  return &s->bufs[ ( s->consumed % s->depth ) * s->buf_blocks * 128 ];
+}
 
-  // CMD24 to write a block of data.
-  sdmmc_cmd_write( SDMMCx,
-                   SDMMC_CMD_WRITE_BLOCK,
-                   start_addr,
-                   SDMMC_RESPONSE_SHORT );
-  sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
-                  SDMMC_CHECK_CRC, &resp );
-  sdmmc_cmd_done( SDMMCx );
+/**
+ * Hand a buffer back to a streaming read, so that it can be filled
+ * again. If the card was stopped because the ring was full, it
+ * starts sending again.
+ */
+void sdmmc_stream_release( SDMMC_TypeDef *SDMMCx, sdmmc_stream *s ) {
+  SDMMC_IRQ_OFF();
+  if ( s->filled != s->consumed ) { ++s->consumed; }
+  if ( sdmmc_xfer.stream == s ) {
+    // The card was waiting on the caller, not the other way around.
+    sdmmc_xfer.start = tick;
+    sdmmc_stream_drain( SDMMCx );
+  }
+  SDMMC_IRQ_ON();
+}
 
-  // Clear the 'DATAEND' and 'DBCKEND' flags.
-  SDMMCx->ICR   |=  ( SDMMC_ICR_DATAENDC | SDMMC_ICR_DBCKENDC );
-  // Prepare for write: set data length.
-  SDMMCx->DLEN   =  ( 512 );
-  // Note: DTEN does not need to be cleared until the next transfer.
-  SDMMCx->DCTRL |=  ( SDMMC_DCTRL_DTEN );
+/**
+ * Stop a streaming read: stop the data path, discard anything left
+ * in the FIFO, and send CMD12 so that the card stops sending. A card
+ * which reached its last block may reject CMD12, which is fine if
+ * the whole run arrived.
+ * Returns 0 on success, -1 on an error.
+ */
+int sdmmc_stream_stop( SDMMC_TypeDef *SDMMCx, sdmmc_stream *s ) {
+  if ( !s->active ) { return 0; }
+  SDMMC_IRQ_OFF();
+  sdmmc_xfer.stream = NULL;
+  SDMMCx->MASK &= ~( SDMMC_MASK_RXFIFOHFIE );
+  SDMMC_IRQ_ON();
+  s->active = 0;
+  int complete = ( s->words_left == 0 );
+  SDMMCx->DCTRL &= ~( SDMMC_DCTRL_DTEN );
+  for ( int i = 0; i < 32 && ( SDMMCx->STA & SDMMC_STA_RXDAVL ); ++i ) {
+    ( void )SDMMCx->FIFO;
+  }
+  SDMMCx->ICR = ( SDMMC_DATA_FLAGS | SDMMC_ICR_DBCKENDC );
 
-  // Write data to the FIFO buffer as space frees up.
-  // TODO: Synchronous polling is slow, but okay for testing.
-  int buf_ind = 1;
-  SDMMCx->FIFO = buf[ 0 ];
-  while ( !( SDMMCx->STA & SDMMC_STA_DATAEND ) ) {
+  // CMD12 to stop the transmission. The card may signal busy.
+  uint32_t resp;
+  sdmmc_cmd_start( SDMMCx, SDMMC_CMD_STOP_TRANS, 0,
+                   SDMMC_RESPONSE_SHORT,
+                   SDMMC_XFER_F_BUSY );
+  int err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                            SDMMC_CHECK_CRC, &resp );
+  sdmmc_cmd_done( SDMMCx );
+  if ( !err ) { err = sdmmc_xfer_wait( SDMMCx ); }
+  return ( err && !complete ) ? -1 : 0;
+}
+
+/**
+ * Write one 512-byte block to the FIFO as space frees up, while the
+ * data path sends it to the card. Returns 0 once every word is in the
+ * FIFO, or -1 if the command engine reports an error or a timeout.
+ */
+static int sdmmc_fifo_write( SDMMC_TypeDef *SDMMCx, uint32_t *buf ) {
+  int buf_ind = 0;
+  while ( buf_ind < 128 ) {
     // Use the 'half-empty' flag to send new data as long as
     // at least 8 words in the queue are empty.
     if ( SDMMCx->STA & SDMMC_STA_TXFIFOHE ) {
+#if SDMMC_FIFO_BURST
+      // There is room for 8 words, so write them all at once.
+      uint32_t *burst = &buf[ buf_ind ];
+      SDMMCx->FIFO = burst[ 0 ];
+      SDMMCx->FIFO = burst[ 1 ];
+      SDMMCx->FIFO = burst[ 2 ];
+      SDMMCx->FIFO = burst[ 3 ];
+      SDMMCx->FIFO = burst[ 4 ];
+      SDMMCx->FIFO = burst[ 5 ];
+      SDMMCx->FIFO = burst[ 6 ];
+      SDMMCx->FIFO = burst[ 7 ];
+      buf_ind += SDMMC_FIFO_BURST_LEN;
+#else
       SDMMCx->FIFO = buf[ buf_ind ];
       ++buf_ind;
+#endif
+    }
+    else if ( sdmmc_xfer_poll( SDMMCx ) == SDMMC_XFER_ERROR ) {
+      return -1;
     }
   }
+  return 0;
+}
 
-  // Poll CMD13 until the state is back to 'transfer'.
-  // TODO: Technically, it is okay to issue CMD7 and do other things
-  // while the SD card performs its data writes. But for testing,
-  // it seems safest to perform blocking writes and wait for each
-  // one to finish before proceeding. I've already bricked one card...
-  resp = 0x00000000;
-  while ( !( resp & SDMMC_READY_FOR_DATA ) ) {
-    sdmmc_cmd_write( SDMMCx,
-                     SDMMC_CMD_GET_STAT,
-                     ( ( uint32_t )card_addr ) << 16,
-                     SDMMC_RESPONSE_SHORT );
-    sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
-                    SDMMC_CHECK_CRC, &resp );
-    sdmmc_cmd_done( SDMMCx );
+/**
+ * Send a command which makes the card receive one 512-byte block of
+ * data, and send the block from `buf`. CMD24 writes a block to the
+ * card's memory, and CMD49 writes to an extension register page.
+ * The card must already be selected and ready. This returns once
+ * the block is sent; the card then holds `DAT0` low while it
+ * programs the block, and `sdmmc_card_wait_ready` waits for that.
+ * Returns 0 on success, -1 on an error or timeout.
+ */
+static int sdmmc_write_data( SDMMC_TypeDef *SDMMCx,
+                             uint32_t cmd,
+                             uint32_t arg,
+                             uint32_t *buf ) {
+  // Clear the data control register, and set 512-byte blocks.
+  SDMMCx->DCTRL &= ~( SDMMC_DCTRL_DTDIR |
+                      SDMMC_DCTRL_DTEN |
+                      SDMMC_DCTRL_DBLOCKSIZE );
+  SDMMCx->DCTRL |=  ( 9 << SDMMC_DCTRL_DBLOCKSIZE_Pos );
+
+  // The card holds `DAT0` low while it programs the block, so the
+  // command engine waits for that too.
+  uint32_t resp = 0x00000000;
+  sdmmc_cmd_start( SDMMCx, cmd, arg,
+                   SDMMC_RESPONSE_SHORT,
+                   SDMMC_XFER_F_DATA | SDMMC_XFER_F_BUSY );
+  int err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                            SDMMC_CHECK_CRC, &resp );
+  sdmmc_cmd_done( SDMMCx );
+
+  if ( !err ) {
+    // Clear the 'DATAEND' and 'DBCKEND' flags.
+    SDMMCx->ICR    =  ( SDMMC_ICR_DATAENDC | SDMMC_ICR_DBCKENDC );
+    // Prepare for write: set data length.
+    SDMMCx->DLEN   =  ( 512 );
+    // Note: DTEN does not need to be cleared until the next transfer.
+    SDMMCx->DCTRL |=  ( SDMMC_DCTRL_DTEN );
+
+    // Write data to the FIFO buffer as space frees up.
+    err = sdmmc_fifo_write( SDMMCx, buf );
+    // Wait for `DATAEND`.
+    if ( !err &&
+         sdmmc_xfer_wait_past( SDMMCx, SDMMC_XFER_DATA ) ==
+         SDMMC_XFER_ERROR ) {
+      err = -1;
+    }
   }
+  if ( !err ) { sdmmc_programming = 1; }
+  return err;
+}
 
-  // Done writing; CMD7 to de-select the card.
-  sdmmc_cmd_write( SDMMCx,
-                   SDMMC_CMD_SEL_DESEL,
-                   0x00000000,
-                   SDMMC_RESPONSE_SHORT );
+/**
+ * Write one block of data to an address on the SD/MMC card.
+ * Returns 0 on success, -1 on an error or timeout.
+ */
+int sdmmc_write_block( SDMMC_TypeDef *SDMMCx,
+                       uint32_t card_type,
+                       uint16_t card_addr,
+                       blockno_t start_block,
+                       uint32_t *buf ) {
+  // Calculate the command argument.
+  uint32_t start_addr = ( uint32_t )start_block;
+  if ( card_type == SDMMC_SC ) { start_addr *= 512; }
+
+  // Make sure that the card is selected, and wait for it to finish
+  // programming the previous block if it was written behind.
+  // The card is 'ready for data' once it stops signalling busy,
+  // so there is no need to poll CMD13 before every write.
+  if ( sdmmc_card_wait_ready( SDMMCx ) ||
+       sdmmc_select_card( SDMMCx, card_addr ) ) { return -1; }
+
+  // CMD24 to write a block of data.
+  int err = sdmmc_write_data( SDMMCx, SDMMC_CMD_WRITE_BLOCK,
+                              start_addr, buf );
+  if ( err ) { return err; }
+
+  // The card is now programming the block, and holds `DAT0` low
+  // until it is done. In write-behind mode, return now and let the
+  // next command wait for that, so the CPU can prepare the next
+  // block in the meantime. Otherwise, wait for the card here.
+#if SDMMC_WRITE_BEHIND == 0
+  err = sdmmc_card_wait_ready( SDMMCx );
+#endif
+  return err;
+}
+
+/**
+ * Start an open-ended multi-block write at `start_block` with CMD25.
+ * The card then takes blocks from `sdmmc_write_next`, in order,
+ * until `sdmmc_write_stop` sends CMD12. Leaving the write open lets
+ * the card program each block while the next one is on its way,
+ * instead of finishing and starting a write for every block.
+ * Returns 0 on success, -1 on an error.
+ */
+int sdmmc_write_start( SDMMC_TypeDef *SDMMCx,
+                       uint32_t card_type,
+                       uint16_t card_addr,
+                       blockno_t start_block ) {
+  uint32_t start_addr = ( uint32_t )start_block;
+  if ( card_type == SDMMC_SC ) { start_addr *= 512; }
+  if ( sdmmc_card_wait_ready( SDMMCx ) ||
+       sdmmc_select_card( SDMMCx, card_addr ) ) { return -1; }
+
+  // CMD25 to write blocks until CMD12 is sent. The data phases are
+  // started separately, so only wait for the response here.
+  uint32_t resp = 0x00000000;
+  sdmmc_cmd_start( SDMMCx, SDMMC_CMD_WRITE_BLOCKS, start_addr,
+                   SDMMC_RESPONSE_SHORT, 0 );
+  int err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                            SDMMC_CHECK_CRC, &resp );
   sdmmc_cmd_done( SDMMCx );
+  if ( !err ) { sdmmc_writing = 1; }
+  return err;
 }
 
-/** Write N blocks of data to an address on the SD/MMC card. */
-void sdmmc_write_blocks( SDMMC_TypeDef *SDMMCx,
-                         blockno_t start_block,
-                         uint32_t *buf,
-                         int blen ) {
-  // TODO: CMD23 / CMD 24 to write multiple blocks.
+/**
+ * Send the next `num_blocks` blocks of an open-ended multi-block
+ * write from `buf`. The data path sends each block once the card has
+ * stopped signalling busy for the previous one, so each block gets
+ * its own data timeout. Returns once the last block is sent.
+ * Returns 0 on success, -1 on an error or timeout.
+ */
+int sdmmc_write_next( SDMMC_TypeDef *SDMMCx,
+                      uint32_t *buf,
+                      uint32_t num_blocks ) {
+  if ( !sdmmc_writing ) { return -1; }
+  while ( num_blocks ) {
+    // `DLEN` is 25 bits, so very long runs take a few data phases.
+    uint32_t n = num_blocks;
+    if ( n > SDMMC_STREAM_MAX_BLOCKS ) { n = SDMMC_STREAM_MAX_BLOCKS; }
+    SDMMCx->DCTRL &= ~( SDMMC_DCTRL_DTDIR |
+                        SDMMC_DCTRL_DTEN |
+                        SDMMC_DCTRL_DBLOCKSIZE );
+    SDMMCx->ICR    =  ( SDMMC_DATA_FLAGS | SDMMC_ICR_DBCKENDC );
+    SDMMCx->DLEN   =  ( n * 512 );
+    // There is no command for this data phase, so enter the command
+    // engine's 'data' state directly.
+    SDMMC_IRQ_OFF();
+    sdmmc_xfer.sta   = 0x00000000;
+    sdmmc_xfer.flags = SDMMC_XFER_F_DATA;
+    sdmmc_xfer_enter( SDMMCx, SDMMC_XFER_DATA, SDMMC_DATA_TIMEOUT_MS );
+    SDMMC_IRQ_ON();
+    SDMMCx->DCTRL |=  ( 9 << SDMMC_DCTRL_DBLOCKSIZE_Pos |
+                        SDMMC_DCTRL_DTEN );
+    for ( uint32_t i = 0; i < n; ++i ) {
+      sdmmc_xfer.start = tick;
+      if ( sdmmc_fifo_write( SDMMCx, &buf[ i * 128 ] ) ) { return -1; }
+    }
+    // Wait for `DATAEND`.
+    if ( sdmmc_xfer_wait_past( SDMMCx, SDMMC_XFER_DATA ) ==
+         SDMMC_XFER_ERROR ) {
+      return -1;
+    }
+    buf += n * 128;
+    num_blocks -= n;
+  }
+  return 0;
+}
+
+/**
+ * Stop an open-ended multi-block write with CMD12, if one is open.
+ * The card then programs the last block while holding `DAT0` low,
+ * which is handled like a write-behind block.
+ * Returns 0 on success, -1 on an error.
+ */
+int sdmmc_write_stop( SDMMC_TypeDef *SDMMCx ) {
+  if ( !sdmmc_writing ) { return 0; }
+  // Clear the flag first, so that CMD12 does not try to stop it too.
+  sdmmc_writing = 0;
+  uint32_t resp = 0x00000000;
+  sdmmc_cmd_start( SDMMCx, SDMMC_CMD_STOP_TRANS, 0,
+                   SDMMC_RESPONSE_SHORT,
+                   SDMMC_XFER_F_BUSY );
+  int err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                            SDMMC_CHECK_CRC, &resp );
+  sdmmc_cmd_done( SDMMCx );
+  if ( err ) { return err; }
+  sdmmc_programming = 1;
+#if SDMMC_WRITE_BEHIND == 0
+  err = sdmmc_card_wait_ready( SDMMCx );
+#endif
+  return err;
+}
+
+/**
+ * Write N blocks of data to an address on the SD/MMC card, with one
+ * CMD25. Like `sdmmc_write_block`, this returns while the card is
+ * still programming the last block in write-behind mode.
+ * Returns 0 on success, -1 on an error or timeout.
+ */
+int sdmmc_write_blocks( SDMMC_TypeDef *SDMMCx,
+                        uint32_t card_type,
+                        uint16_t card_addr,
+                        blockno_t start_block,
+                        uint32_t *buf,
+                        uint32_t num_blocks ) {
+  if ( sdmmc_write_start( SDMMCx, card_type, card_addr, start_block ) ||
+       sdmmc_write_next( SDMMCx, buf, num_blocks ) ) {
+    return -1;
+  }
+  return sdmmc_write_stop( SDMMCx );
+}
+
+/**
+ * Send CMD20 ('Speed Class Control') with an `SDMMC_SCC_*` function.
+ * 'Start Recording' tells the card that a stream of whole, sequential
+ * allocation units is about to follow, so that it can get ready to
+ * take them at its Speed Class rate; the card signals busy until it
+ * is. Returns 0 on success, -1 on an error or timeout.
+ */
+int sdmmc_speed_class_control( SDMMC_TypeDef *SDMMCx,
+                               uint16_t card_addr,
+                               uint32_t arg ) {
+  if ( sdmmc_card_wait_ready( SDMMCx ) ||
+       sdmmc_select_card( SDMMCx, card_addr ) ) { return -1; }
+  uint32_t resp = 0x00000000;
+  sdmmc_cmd_start( SDMMCx, SDMMC_CMD_SPEED_CLASS, arg,
+                   SDMMC_RESPONSE_SHORT,
+                   SDMMC_XFER_F_BUSY );
+  int err = sdmmc_cmd_read( SDMMCx, SDMMC_RESPONSE_SHORT,
+                            SDMMC_CHECK_CRC, &resp );
+  sdmmc_cmd_done( SDMMCx );
+  if ( !err ) { err = sdmmc_xfer_wait( SDMMCx ); }
+  return err;
 }
 
 /**
@@ -478,3 +1459,8 @@ void sdmmc_erase_blocks( SDMMC_TypeDef *SDMMCx,
                          blockno_t num_blocks ) {
   // TODO
 }
+
+/** SDMMC1 interrupt handler: advance the command engine. */
+void SDMMC1_IRQn_handler( void ) {
+  sdmmc_irq_handler( SDMMC1 );
+}
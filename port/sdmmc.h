@@ -1,6 +1,7 @@
 /*
  * Minimal SD/MMC peripheral interface methods.
- * TODO: Error checking is not implemented.
+ * Commands are run by a small interrupt-driven state machine
+ * (the 'command engine'), which also enforces timeouts.
  */
 #ifndef __VVC_SDMMC
 #define __VVC_SDMMC
@@ -27,6 +28,12 @@
 // Bus width definitions.
 #define SDMMC_BUS_WIDTH_1b   ( 0x00000000 )
 #define SDMMC_BUS_WIDTH_4b   ( 0x00000002 )
+// Card clock settings for `sdmmc_set_clock`, from the 48MHz SDMMC
+// kernel clock: ~400KHz for identification, 24MHz for 'default
+// speed', and the undivided 48MHz clock for 'high-speed' cards.
+#define SDMMC_CLK_INIT       ( 0x76 << SDMMC_CLKCR_CLKDIV_Pos )
+#define SDMMC_CLK_DEFAULT    ( 0x00 << SDMMC_CLKCR_CLKDIV_Pos )
+#define SDMMC_CLK_HIGH       ( SDMMC_CLKCR_BYPASS )
 // Card type definition.
 #define SDMMC_SC             ( 0 )
 #define SDMMC_HC             ( 1 )
@@ -47,6 +54,128 @@
 // SD card status register bit flags.
 #define SDMMC_READY_FOR_DATA ( 0x00000100 )
 
+// Command engine states. The SDMMC interrupt handler advances the
+// engine through these as status flags arrive: a command is sent,
+// its response is received, then any data phase and busy signal.
+#define SDMMC_XFER_IDLE      ( 0 )
+#define SDMMC_XFER_CMD       ( 1 )
+#define SDMMC_XFER_DATA      ( 2 )
+#define SDMMC_XFER_BUSY      ( 3 )
+#define SDMMC_XFER_DONE      ( 4 )
+#define SDMMC_XFER_ERROR     ( 5 )
+// Command engine options for `sdmmc_cmd_start`.
+// The command is followed by a data transfer; wait for `DATAEND`.
+#define SDMMC_XFER_F_DATA    ( 0x01 )
+// The card holds `DAT0` low after the command or data; wait for it.
+#define SDMMC_XFER_F_BUSY    ( 0x02 )
+// The response has no valid CRC, so `CCRCFAIL` is not an error.
+#define SDMMC_XFER_F_NO_CRC  ( 0x04 )
+// Engine status flag for a software timeout. This uses a bit which
+// is reserved in the `STA` register, so it can share the same word.
+#define SDMMC_XFER_TIMEOUT   ( 0x80000000 )
+// How long each phase of a command may take, in `tick` milliseconds.
+#define SDMMC_CMD_TIMEOUT_MS  ( 100 )
+#define SDMMC_DATA_TIMEOUT_MS ( 250 )
+#define SDMMC_BUSY_TIMEOUT_MS ( 500 )
+// Write-behind mode: `sdmmc_write_block` returns as soon as the
+// data has been sent, and the card's busy signal is only checked
+// before the next command which needs the card. Set to 0 to wait
+// for every write to finish programming before returning.
+#ifndef SDMMC_WRITE_BEHIND
+#define SDMMC_WRITE_BEHIND   ( 1 )
+#endif
+// Move 8 words at a time whenever the FIFO is half-full (reads)
+// or half-empty (writes), instead of checking the status register
+// before every word. Set to 0 for the old word-at-a-time loops.
+#ifndef SDMMC_FIFO_BURST
+#define SDMMC_FIFO_BURST     ( 1 )
+#endif
+// Enable hardware flow control: the peripheral stops the card clock
+// instead of overrunning / underrunning the FIFO if the CPU falls
+// behind, for example during a long interrupt. Some STM32 errata
+// sheets list flow control issues, so check yours if you see CRC
+// errors at high clock speeds.
+#ifndef SDMMC_HWFC
+#define SDMMC_HWFC           ( 1 )
+#endif
+// Let the peripheral gate the card clock whenever the bus is idle
+// (`PWRSAV`), once the card is identified. The card only needs the
+// clock to move commands and data; it signals 'busy' without it.
+// Set to 0 to keep the clock running all the time.
+#ifndef SDMMC_PWRSAV
+#define SDMMC_PWRSAV         ( 1 )
+#endif
+// Number of words moved per FIFO burst. (Half of the 32-word FIFO.)
+#define SDMMC_FIFO_BURST_LEN ( 8 )
+// How to wait for the command engine: spin on the status register,
+// or sleep until the next interrupt.
+#define SDMMC_WAIT_SPIN      ( 0 )
+#define SDMMC_WAIT_WFI       ( 1 )
+
+// Hooks used while waiting on the command engine. Host-side builds
+// can override these, since they cannot run Cortex-M instructions.
+#ifndef SDMMC_IRQ_OFF
+#define SDMMC_IRQ_OFF()      __disable_irq()
+#endif
+#ifndef SDMMC_IRQ_ON
+#define SDMMC_IRQ_ON()       __enable_irq()
+#endif
+#ifndef SDMMC_SLEEP
+#define SDMMC_SLEEP()        __WFI()
+#endif
+// The card holds `DAT0` low while it is busy. The SDMMC peripheral
+// on this chip has no 'busy end' flag, so check the pin directly.
+// (PC8 is SDMMC1_D0 on the STM32L4)
+#ifndef SDMMC_DAT0_HIGH
+#define SDMMC_DAT0_HIGH()    ( GPIOC->IDR & GPIO_IDR_ID8 )
+#endif
+
+// Longest run which one streaming read can cover: `DLEN` is 25 bits.
+#define SDMMC_STREAM_MAX_BLOCKS ( 65535 )
+
+// Streaming read: a ring of `depth` buffers, each `buf_blocks` blocks
+// long. The SDMMC interrupt moves data from the FIFO into the next
+// free buffer while the caller works on a full one. Once every
+// buffer is full, hardware flow control stops the card clock until
+// the caller releases one, so streaming needs `SDMMC_HWFC`.
+typedef struct {
+  // `depth * buf_blocks * 128` words of buffer space.
+  uint32_t          *bufs;
+  uint32_t          depth;
+  uint32_t          buf_blocks;
+  // Blocks in the whole run.
+  uint32_t          blocks;
+  // Buffers filled by the interrupt, and released by the caller.
+  volatile uint32_t filled;
+  volatile uint32_t consumed;
+  // Words in the buffer being filled, and still to come from the card.
+  volatile uint32_t pos;
+  volatile uint32_t words_left;
+  int               active;
+} sdmmc_stream;
+
+// Command engine state. There is only one SD/MMC peripheral
+// on the STM32L4, so there is only one of these.
+typedef struct {
+  // Current `SDMMC_XFER_*` state.
+  volatile int      state;
+  // Status flags latched by the interrupt handler.
+  volatile uint32_t sta;
+  // `SDMMC_XFER_F_*` options for the current command.
+  int               flags;
+  // `SDMMC_WAIT_*` method to use while blocking.
+  int               wait_mode;
+  // `tick` value when the current phase started, and its limit.
+  volatile uint32_t start;
+  volatile uint32_t timeout;
+  // Streaming read which the interrupt handler fills, if any.
+  sdmmc_stream     *stream;
+  // Total time spent asleep in `SDMMC_SLEEP`, in microseconds.
+  // It wraps around; callers should only look at differences.
+  volatile uint32_t sleep_us;
+} sdmmc_engine;
+extern sdmmc_engine sdmmc_xfer;
+
 // SD card command index values. Because referring to them as
 // `CMD0`, `CMD1`, etc is confusing and not very helpful.
 // This is not an exhaustive list of valid commands.
@@ -110,7 +239,14 @@
 // 'stop transmission' command is received.
 // CMD23 might also limit the number of blocks to read?
 #define SDMMC_CMD_READ_BLOCKS    ( 18 )
-// (CMD19/20 not used. CMD21/22 reserved.)
+// (CMD19 not used.)
+// 'Speed Class Control': tell the card that the host is about to
+// record a stream, e.g. video, following the Speed Class rules. The
+// card gets ready to take whole allocation units at its class's
+// rate. The argument's top 4 bits are the 'SCC' function; see
+// `SDMMC_SCC_*`. The response is R1b.
+#define SDMMC_CMD_SPEED_CLASS    ( 20 )
+// (CMD21/22 reserved.)
 // Set 'block count' value which is used by CMD18 and CMD25.
 #define SDMMC_CMD_SET_NUM_BLOCKS ( 23 )
 // Write a block of data. If the card is an SDHC / SDXC card.
@@ -139,6 +275,13 @@
 #define SDMMC_CMD_ERASE_END      ( 33 )
 // Erase data between the addresses set by CMD32 and CMD33.
 #define SDMMC_CMD_ERASE          ( 38 )
+// Read from an SD 6.0 'extension register' page. The argument holds
+// the function number, page, byte offset and length - 1; see
+// `SDMMC_EXT_ARG`. The card always sends a 512-byte block.
+#define SDMMC_CMD_READ_EXTR      ( 48 )
+// Write to an SD 6.0 'extension register' page, with the same
+// argument as CMD48. The data is a 512-byte block, followed by busy.
+#define SDMMC_CMD_WRITE_EXTR     ( 49 )
 // Command indicating that an application-specific command will follow.
 #define SDMMC_CMD_APP            ( 55 )
 // Command to read/write blocks of data for use with application-
@@ -160,10 +303,47 @@
 // App command to read SD card configuration register.
 #define SDMMC_APP_GET_SCR        ( 51 )
 
-// Setup an SD/MMC peripheral for simple 'polling mode'.
-// This is slow; no interrupts, hardware flow control, or DMA.
+// CMD48 / CMD49 argument for `len` bytes at `offset` in a page.
+#define SDMMC_EXT_ARG( fno, page, offset, len ) \
+  ( ( ( uint32_t )( fno ) << 27 ) | ( ( uint32_t )( page ) << 18 ) | \
+    ( ( uint32_t )( offset ) << 9 ) | ( ( uint32_t )( len ) - 1 ) )
+// 'CMD_SUPPORT' bits in byte 3 of the SCR (bits 35:32).
+#define SDMMC_SCR_CMD20          ( 0x01 )
+#define SDMMC_SCR_CMD23          ( 0x02 )
+#define SDMMC_SCR_CMD48_49       ( 0x04 )
+#define SDMMC_SCR_CMD58_59       ( 0x08 )
+// CMD20 'SCC' functions, in argument bits 31:28.
+#define SDMMC_SCC_START_REC      ( 0x00000000 )
+
+// Setup an SD/MMC peripheral for 'polling mode' data transfers.
+// There is no DMA; the CPU moves data through the FIFO.
 void sdmmc_setup( SDMMC_TypeDef *SDMMCx );
+// Select how callers wait on the command engine. `SDMMC_WAIT_WFI`
+// expects the SDMMC interrupt to be enabled in the NVIC.
+void sdmmc_irq_setup( SDMMC_TypeDef *SDMMCx, int wait_mode );
+// Turn off the peripheral and the card clock, e.g. before powering
+// the card down. `sdmmc_setup` turns them back on.
+void sdmmc_power_off( SDMMC_TypeDef *SDMMCx );
+// Sleep until `tick` has advanced by `ms`, waking on interrupts,
+// and count the time in `sdmmc_xfer.sleep_us`.
+void sdmmc_sleep_ms( uint32_t ms );
+// Advance the command engine from the current status flags.
+// This is the body of the SDMMC interrupt handler.
+void sdmmc_irq_handler( SDMMC_TypeDef *SDMMCx );
+// Check on the command engine without blocking. Returns the
+// current `SDMMC_XFER_*` state, after applying any timeout.
+int sdmmc_xfer_poll( SDMMC_TypeDef *SDMMCx );
+// Block until the current command, data phase and busy signal
+// are finished. Returns 0 on success, -1 on an error or timeout.
+int sdmmc_xfer_wait( SDMMC_TypeDef *SDMMCx );
 
+// Start a command on the command engine and return immediately.
+// `flags` is a combination of `SDMMC_XFER_F_*` options.
+void sdmmc_cmd_start( SDMMC_TypeDef *SDMMCx,
+                      uint32_t cmd,
+                      uint32_t dat,
+                      int resp_type,
+                      int flags );
 // Send a command to the SD/MMC card.
 void sdmmc_cmd_write( SDMMC_TypeDef *SDMMCx,
                       uint32_t cmd,
@@ -187,10 +367,60 @@ void sdmmc_cmd_done( SDMMC_TypeDef *SDMMCx );
 // I think that the block size is defined in bytes.
 void sdmmc_set_block_len( SDMMC_TypeDef *SDMMCx,
                           uint32_t bsize );
-// Tell the connected SD card to use a specified bus width.
-void sdmmc_set_bus_width( SDMMC_TypeDef *SDMMCx,
+// Tell the connected SD card to use a specified bus width, and set
+// the peripheral to match. Returns 0 on success, -1 on an error.
+int sdmmc_set_bus_width( SDMMC_TypeDef *SDMMCx,
+                         uint16_t card_addr,
+                         uint32_t width );
+// Set the card clock to one of the `SDMMC_CLK_*` settings. Faster
+// ones also gate the clock while the bus is idle, if `SDMMC_PWRSAV`.
+void sdmmc_set_clock( SDMMC_TypeDef *SDMMCx, uint32_t clk );
+// Switch the selected card to 'high-speed' timing with CMD6. Returns
+// 1 if it switched, 0 if it does not support it, -1 on an error.
+int sdmmc_set_high_speed( SDMMC_TypeDef *SDMMCx );
+// Read the selected card's 8-byte SD configuration register with
+// ACMD51, MSB first. Returns 0 on success, -1 on an error.
+int sdmmc_read_scr( SDMMC_TypeDef *SDMMCx,
+                    uint16_t card_addr,
+                    uint32_t *scr );
+// Read the selected card's 64-byte SD Status register with ACMD13,
+// MSB first. Returns 0 on success, -1 on an error.
+int sdmmc_read_sd_status( SDMMC_TypeDef *SDMMCx,
                           uint16_t card_addr,
-                          uint32_t width );
+                          uint32_t *status );
+// Read a 512-byte block from an extension register page with CMD48,
+// starting at `offset`. Returns 0 on success, -1 on an error.
+int sdmmc_read_ext_reg( SDMMC_TypeDef *SDMMCx,
+                        uint32_t fno,
+                        uint32_t page,
+                        uint32_t offset,
+                        uint32_t *buf );
+// Write one byte of an extension register page with CMD49, and wait
+// for the card to apply it. Returns 0 on success, -1 on an error.
+int sdmmc_write_ext_reg( SDMMC_TypeDef *SDMMCx,
+                         uint32_t fno,
+                         uint32_t page,
+                         uint32_t offset,
+                         uint8_t value );
+// Select a card with CMD7 so that it accepts data commands.
+// The card stays selected across transfers; this does nothing if
+// it is already selected. Returns 0 on success, -1 on an error.
+int sdmmc_select_card( SDMMC_TypeDef *SDMMCx, uint16_t card_addr );
+// Deselect the current card, if any. Needed before CMD9 / CMD10.
+void sdmmc_deselect_card( SDMMC_TypeDef *SDMMCx );
+// The state which the card should be in: `SDMMC_STATE_RCV` during an
+// open-ended multi-block write, `SDMMC_STATE_PRG` if it is still
+// programming a write-behind block, `SDMMC_STATE_TRAN` if it is
+// selected, or `SDMMC_STATE_STBY` if it is not.
+int sdmmc_card_state( void );
+// Stop an open-ended multi-block write, and wait for a write-behind
+// block to finish programming, if there is one. Returns 0 once the
+// card is ready, -1 on an error or timeout.
+int sdmmc_card_wait_ready( SDMMC_TypeDef *SDMMCx );
+// Bring the card back to the 'transfer' state after a failed command
+// or transfer, stopping any data it is still sending or receiving.
+// Returns 0 if it is ready again, -1 if it no longer answers.
+int sdmmc_recover( SDMMC_TypeDef *SDMMCx, uint16_t card_addr );
 // Figure out how much storage capacity the SD card claims
 // to have, in 512-byte blocks. (NOT in bytes)
 uint32_t sdmmc_get_volume_size( SDMMC_TypeDef *SDMMCx,
@@ -200,27 +430,69 @@ uint32_t sdmmc_get_volume_size( SDMMC_TypeDef *SDMMCx,
 int sdmmc_is_card_busy( SDMMC_TypeDef *SDMMCx, uint16_t card_addr );
 
 // Read one block of data from an address on the SD/MMC card.
-void sdmmc_read_block( SDMMC_TypeDef *SDMMCx,
-                       uint32_t card_type,
-                       uint16_t card_addr,
-                       blockno_t start_block,
-                       uint32_t *buf );
+int sdmmc_read_block( SDMMC_TypeDef *SDMMCx,
+                      uint32_t card_type,
+                      uint16_t card_addr,
+                      blockno_t start_block,
+                      uint32_t *buf );
 // Read N blocks of data from an address on the SD/MMC card.
 void sdmmc_read_blocks( SDMMC_TypeDef *SDMMCx,
                         blockno_t start_block,
                         uint32_t *buf,
                         int blen );
+// Start a streaming read of `num_blocks` blocks into the ring of
+// buffers in `s`. Returns 0 once the card is sending, -1 on an error.
+int sdmmc_stream_start( SDMMC_TypeDef *SDMMCx,
+                        uint32_t card_type,
+                        uint16_t card_addr,
+                        sdmmc_stream *s,
+                        blockno_t start_block,
+                        uint32_t num_blocks );
+// Wait for the next full buffer of a streaming read, and return it.
+// `blocks` is set to the number of blocks in it. Returns NULL at the
+// end of the run, or on an error.
+uint32_t *sdmmc_stream_next( SDMMC_TypeDef *SDMMCx,
+                             sdmmc_stream *s,
+                             uint32_t *blocks );
+// Hand the buffer from `sdmmc_stream_next` back to the stream.
+void sdmmc_stream_release( SDMMC_TypeDef *SDMMCx, sdmmc_stream *s );
+// Stop a streaming read, whether or not it has finished.
+// Returns 0 on success, -1 on an error.
+int sdmmc_stream_stop( SDMMC_TypeDef *SDMMCx, sdmmc_stream *s );
 // Write one block of data to an address on the SD/MMC card.
-void sdmmc_write_block( SDMMC_TypeDef *SDMMCx,
+int sdmmc_write_block( SDMMC_TypeDef *SDMMCx,
+                       uint32_t card_type,
+                       uint16_t card_addr,
+                       blockno_t start_block,
+                       uint32_t *buf );
+// Write N blocks of data to an address on the SD/MMC card, with one
+// multi-block command. Returns 0 on success, -1 on an error.
+int sdmmc_write_blocks( SDMMC_TypeDef *SDMMCx,
                         uint32_t card_type,
                         uint16_t card_addr,
                         blockno_t start_block,
-                        uint32_t *buf );
-// Write N blocks of data to an address on the SD/MMC card.
-void sdmmc_write_blocks( SDMMC_TypeDef *SDMMCx,
-                         blockno_t start_block,
-                         uint32_t *buf,
-                         int blen );
+                        uint32_t *buf,
+                        uint32_t num_blocks );
+// Open-ended multi-block write: `sdmmc_write_start` sends CMD25, then
+// each `sdmmc_write_next` sends more blocks, in order, and
+// `sdmmc_write_stop` ends the write with CMD12. While it is open,
+// `sdmmc_card_state` returns `SDMMC_STATE_RCV`; any other command
+// stops it first. After an error, use `sdmmc_recover`.
+// Each returns 0 on success, -1 on an error.
+int sdmmc_write_start( SDMMC_TypeDef *SDMMCx,
+                       uint32_t card_type,
+                       uint16_t card_addr,
+                       blockno_t start_block );
+int sdmmc_write_next( SDMMC_TypeDef *SDMMCx,
+                      uint32_t *buf,
+                      uint32_t num_blocks );
+int sdmmc_write_stop( SDMMC_TypeDef *SDMMCx );
+// Send CMD20 with a `SDMMC_SCC_*` function to the selected card, and
+// wait for it to get ready. Only cards which set `SDMMC_SCR_CMD20`
+// in their SCR support it. Returns 0 on success, -1 on an error.
+int sdmmc_speed_class_control( SDMMC_TypeDef *SDMMCx,
+                               uint16_t card_addr,
+                               uint32_t arg );
 // Erase a block range on the SD/MMC card, given start ID and length.
 void sdmmc_erase_blocks( SDMMC_TypeDef *SDMMCx,
                          blockno_t start_block,
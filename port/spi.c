@@ -0,0 +1,137 @@
+/*
+ * Minimal SPI host interface methods, with DMA block transfers.
+ */
+#include "port/spi.h"
+
+// Channel registers are 0x14 bytes apart, starting at offset 0x08
+// of the DMA controller, and the request selection register sits
+// at offset 0xA8.
+#define SPI_DMA_CHANNEL( DMAx, ch ) \
+  ( ( DMA_Channel_TypeDef* )( ( uintptr_t )( DMAx ) + 0x08 + \
+                              0x14 * ( ( ch ) - 1 ) ) )
+#define SPI_DMA_CSELR( DMAx ) \
+  ( ( DMA_Request_TypeDef* )( ( uintptr_t )( DMAx ) + 0xA8 ) )
+// Each channel has 4 flags in `ISR` / `IFCR`: GIF, TCIF, HTIF, TEIF.
+#define SPI_DMA_FLAGS( ch ) ( 0xF << ( 4 * ( ( ch ) - 1 ) ) )
+
+/**
+ * Setup an SPI peripheral as a full-duplex master. The chip select
+ * pin is a GPIO output which the caller drives, so the peripheral's
+ * NSS input is held high in software. Frames are 8 bits, and the
+ * `RXNE` flag is set for each received byte.
+ */
+void spi_host_init( SPI_TypeDef *SPIx, int cpol, int cpha ) {
+  // The peripheral must be disabled while it is configured.
+  SPIx->CR1 &= ~( SPI_CR1_SPE );
+  SPIx->CR1 &= ~( SPI_CR1_BIDIMODE | SPI_CR1_CRCEN |
+                  SPI_CR1_RXONLY | SPI_CR1_LSBFIRST |
+                  SPI_CR1_BR | SPI_CR1_CPOL | SPI_CR1_CPHA );
+  SPIx->CR1 |=  ( SPI_CR1_MSTR | SPI_CR1_SSM | SPI_CR1_SSI |
+                  SPI_CLK_DIV256 |
+                  ( cpol ? SPI_CR1_CPOL : 0 ) |
+                  ( cpha ? SPI_CR1_CPHA : 0 ) );
+  SPIx->CR2 &= ~( SPI_CR2_DS | SPI_CR2_TXDMAEN | SPI_CR2_RXDMAEN |
+                  SPI_CR2_SSOE );
+  SPIx->CR2 |=  ( ( 0x7 << SPI_CR2_DS_Pos ) | SPI_CR2_FRXTH );
+  SPIx->CR1 |=  ( SPI_CR1_SPE );
+}
+
+/**
+ * Change the SPI clock prescaler. The reference manual only allows
+ * that while the peripheral is disabled, so wait for the current
+ * frame to finish first.
+ */
+void spi_set_clock( SPI_TypeDef *SPIx, uint32_t clk ) {
+  while ( SPIx->SR & SPI_SR_BSY ) {};
+  SPIx->CR1 &= ~( SPI_CR1_SPE );
+  SPIx->CR1 &= ~( SPI_CR1_BR );
+  SPIx->CR1 |=  ( clk & SPI_CR1_BR );
+  SPIx->CR1 |=  ( SPI_CR1_SPE );
+}
+
+/**
+ * Send one byte and return the byte which was received.
+ * The data register must be accessed with a byte-wide access:
+ * a 16-bit write would queue two frames in the TX FIFO.
+ */
+uint8_t spi_xfer( SPI_TypeDef *SPIx, uint8_t tx ) {
+  while ( !( SPIx->SR & SPI_SR_TXE ) ) {};
+  *( volatile uint8_t* )&( SPIx->DR ) = tx;
+  while ( !( SPIx->SR & SPI_SR_RXNE ) ) {};
+  return *( volatile uint8_t* )&( SPIx->DR );
+}
+
+/**
+ * Route the bus's DMA channels to its SPI peripheral, by writing
+ * the request number into the channels' `CSELR` fields.
+ */
+void spi_dma_setup( const spi_dma_bus *bus ) {
+  DMA_Request_TypeDef *sel = SPI_DMA_CSELR( bus->dma );
+  sel->CSELR &= ~( SPI_DMA_FLAGS( bus->rx_ch ) |
+                   SPI_DMA_FLAGS( bus->tx_ch ) );
+  sel->CSELR |=  ( ( bus->request << ( 4 * ( bus->rx_ch - 1 ) ) ) |
+                   ( bus->request << ( 4 * ( bus->tx_ch - 1 ) ) ) );
+}
+
+/**
+ * Exchange a block of bytes with DMA. The RX channel has priority
+ * over the TX channel, so received bytes are always drained before
+ * the next one is queued and the RX FIFO cannot overrun. The
+ * transfer is done when the RX channel has moved its last byte.
+ */
+int spi_dma_xfer( const spi_dma_bus *bus,
+                  const uint8_t *tx,
+                  uint8_t *rx,
+                  uint16_t len ) {
+  // Fixed 'memory' addresses for the directions which are not used.
+  static const uint8_t fill = 0xFF;
+  static uint8_t sink;
+  SPI_TypeDef *SPIx = bus->spi;
+  DMA_TypeDef *DMAx = bus->dma;
+  DMA_Channel_TypeDef *rxc = SPI_DMA_CHANNEL( DMAx, bus->rx_ch );
+  DMA_Channel_TypeDef *txc = SPI_DMA_CHANNEL( DMAx, bus->tx_ch );
+  if ( len == 0 ) { return 0; }
+  // Configure both channels for 8-bit transfers with the SPI data
+  // register. Only the memory side's address increments.
+  rxc->CCR   =  0;
+  txc->CCR   =  0;
+  DMAx->IFCR =  ( SPI_DMA_FLAGS( bus->rx_ch ) |
+                  SPI_DMA_FLAGS( bus->tx_ch ) );
+  rxc->CPAR  =  ( uint32_t )( uintptr_t )&( SPIx->DR );
+  rxc->CMAR  =  ( uint32_t )( uintptr_t )( rx ? rx : &sink );
+  rxc->CNDTR =  len;
+  rxc->CCR   =  ( ( rx ? DMA_CCR_MINC : 0 ) |
+                  ( 0x2 << DMA_CCR_PL_Pos ) );
+  txc->CPAR  =  ( uint32_t )( uintptr_t )&( SPIx->DR );
+  txc->CMAR  =  ( uint32_t )( uintptr_t )( tx ? tx : &fill );
+  txc->CNDTR =  len;
+  txc->CCR   =  ( ( tx ? DMA_CCR_MINC : 0 ) | DMA_CCR_DIR |
+                  ( 0x1 << DMA_CCR_PL_Pos ) );
+  // The reference manual's order: enable RX DMA requests, then the
+  // channels, then TX DMA requests, which starts the transfer.
+  SPIx->CR2 |=  ( SPI_CR2_RXDMAEN );
+  rxc->CCR  |=  ( DMA_CCR_EN );
+  txc->CCR  |=  ( DMA_CCR_EN );
+  SPIx->CR2 |=  ( SPI_CR2_TXDMAEN );
+  // Wait for the RX channel's 'transfer complete' flag, or for
+  // either channel's 'transfer error' flag.
+  uint32_t tc = DMA_ISR_TCIF1 << ( 4 * ( bus->rx_ch - 1 ) );
+  uint32_t te = ( ( DMA_ISR_TEIF1 << ( 4 * ( bus->rx_ch - 1 ) ) ) |
+                  ( DMA_ISR_TEIF1 << ( 4 * ( bus->tx_ch - 1 ) ) ) );
+  uint32_t start = tick;
+  int err = 0;
+  while ( !( DMAx->ISR & ( tc | te ) ) ) {
+    if ( ( tick - start ) > SPI_DMA_TIMEOUT_MS ) {
+      err = -1;
+      break;
+    }
+  }
+  if ( DMAx->ISR & te ) { err = -1; }
+  // Disable the channels and DMA requests again.
+  rxc->CCR  &= ~( DMA_CCR_EN );
+  txc->CCR  &= ~( DMA_CCR_EN );
+  SPIx->CR2 &= ~( SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN );
+  DMAx->IFCR =  ( SPI_DMA_FLAGS( bus->rx_ch ) |
+                  SPI_DMA_FLAGS( bus->tx_ch ) );
+  return err;
+}
@@ -0,0 +1,59 @@
+/*
+ * Minimal SPI host interface methods, with DMA block transfers.
+ */
+#ifndef __VVC_SPI
+#define __VVC_SPI
+
+// Standard library includes.
+#include <stdint.h>
+
+// Device header file.
+#include "stm32l4xx.h"
+
+// HAL includes.
+#include "port/tim.h"
+
+// Clock settings for `spi_set_clock`. These are `BR` prescaler
+// values; the SPI clock is the peripheral's APB clock divided by
+// 2, 4, ... 256. (With an 80MHz APB clock: 40MHz ... 312.5KHz.)
+#define SPI_CLK_DIV2      ( 0x0 << SPI_CR1_BR_Pos )
+#define SPI_CLK_DIV4      ( 0x1 << SPI_CR1_BR_Pos )
+#define SPI_CLK_DIV8      ( 0x2 << SPI_CR1_BR_Pos )
+#define SPI_CLK_DIV16     ( 0x3 << SPI_CR1_BR_Pos )
+#define SPI_CLK_DIV32     ( 0x4 << SPI_CR1_BR_Pos )
+#define SPI_CLK_DIV64     ( 0x5 << SPI_CR1_BR_Pos )
+#define SPI_CLK_DIV128    ( 0x6 << SPI_CR1_BR_Pos )
+#define SPI_CLK_DIV256    ( 0x7 << SPI_CR1_BR_Pos )
+// How long a DMA transfer may take, in `tick` milliseconds.
+#define SPI_DMA_TIMEOUT_MS ( 100 )
+
+// An SPI peripheral and the pair of DMA channels which serve it.
+// On the STM32L4, SPI1 uses DMA1 channels 2 (RX) and 3 (TX) with
+// request number 1; see the DMA chapter of the reference manual.
+typedef struct {
+  SPI_TypeDef *spi;
+  DMA_TypeDef *dma;
+  uint8_t      rx_ch;
+  uint8_t      tx_ch;
+  uint8_t      request;
+} spi_dma_bus;
+
+// Setup an SPI peripheral as a full-duplex master with 8-bit frames,
+// software chip select, and the slowest clock.
+void spi_host_init( SPI_TypeDef *SPIx, int cpol, int cpha );
+// Change the SPI clock prescaler, once the bus is idle.
+void spi_set_clock( SPI_TypeDef *SPIx, uint32_t clk );
+// Send one byte and return the byte received at the same time.
+uint8_t spi_xfer( SPI_TypeDef *SPIx, uint8_t tx );
+// Route the bus's DMA channels to its SPI peripheral.
+void spi_dma_setup( const spi_dma_bus *bus );
+// Exchange `len` bytes using DMA, without CPU involvement between
+// bytes. If `tx` is NULL, 0xFF is sent; if `rx` is NULL, received
+// bytes are discarded. Buffers must be in DMA-accessible memory.
+// Returns 0 on success, -1 on a DMA error or timeout.
+int spi_dma_xfer( const spi_dma_bus *bus,
+                  const uint8_t *tx,
+                  uint8_t *rx,
+                  uint16_t len );
+
+#endif
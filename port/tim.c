@@ -88,6 +88,21 @@ void timer_delay( uint32_t millis ) {
   while ( next_tick > tick ) {};
 }
 
+// Get a microsecond timestamp from the SysTick millisecond count
+// and the SysTick counter. This assumes that SysTick runs from the
+// core clock and interrupts once per millisecond. It wraps around
+// after about 71 minutes, so only use it to time short intervals.
+uint32_t timer_micros( void ) {
+  uint32_t ms, val;
+  // Re-read if the millisecond count ticked over in between.
+  do {
+    ms  = tick;
+    val = SysTick->VAL;
+  } while ( ms != tick );
+  return ms * 1000 +
+         ( SysTick->LOAD - val ) / ( SystemCoreClock / 1000000 );
+}
+
 void SysTick_handler( void ) {
   ++tick;
 }
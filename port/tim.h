@@ -31,4 +31,8 @@ void timer_adjust_trgo( TIM_TypeDef* TIMx, int freq_hz );
 // Delay for a specified number of milliseconds using the given timer.
 void timer_delay( uint32_t millis );
 
+// Microsecond timestamp, for timing short intervals.
+// Assumes a 1ms SysTick interrupt which increments `tick`.
+uint32_t timer_micros( void );
+
 #endif
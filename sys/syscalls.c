@@ -1,5 +1,8 @@
 #include "syscalls.h"
 
+// Block device API, for the write cache barrier.
+#include "block.h"
+
 // Open a file and return a file descriptor ID.
 int open( const char *__path, int __flags, mode_t __mode ) {
   // TODO
@@ -66,6 +69,18 @@ ssize_t write( int __fd, const void *__buf, size_t __count ) {
   return 0;
 }
 
+// Make sure that everything written to the card is stored on it,
+// so it survives a power loss. SQLite's `xSync` calls this.
+// File descriptors don't map to Gristle files here (`open` never
+// returns one), so `__fd` is not used: this only writes back the
+// card's write cache. Code which has a Gristle file number should
+// call `fat_fsync`, which also writes back the file's buffer and
+// its directory entry first.
+int fsync( int __fd ) {
+  ( void )__fd;
+  return block_flush_cache() ? -1 : 0;
+}
+
 // Change the access permissions on a file.
 int fchmod( int __fd, mode_t __mode ) {
   // TODO
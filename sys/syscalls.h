@@ -116,6 +116,9 @@ int fnctl( int __fd, int __cmd, ... );
 ssize_t read( int __fd, void *__buf, size_t __count );
 // Function to write N bytes to a file.
 ssize_t write( int __fd, const void *__buf, size_t __count );
+// Make sure that everything written to a file is stored on the
+// card, so it survives a power loss. SQLite's `xSync` calls this.
+int fsync( int __fd );
 // Change the access permissions on a file.
 int fchmod( int __fd, mode_t __mode );
 // Delete a filename. If it is the last link to a given file,
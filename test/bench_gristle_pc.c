@@ -0,0 +1,235 @@
+/*
+ * Benchmark for the block reads Gristle's caches save, on the
+ * in-memory image driver `block_pc`.
+ *
+ * Each case formats a fresh FAT32 image with 512 byte clusters,
+ * mounts it and counts the blocks an operation reads, with
+ * `block_pc_get_counts`. The image has no latency, so the counts are
+ * what would go to a card; times aren't shown.
+ *
+ * - Seeks: 2000 random 1KB reads from a 4MB file in about 20 pieces,
+ *   which needs the extent map and the FAT sectors in the cache.
+ * - Opens: what SQLite does on each transaction, opening a database
+ *   in a directory with a few other files and looking for its
+ *   journal, which isn't there. The directory entry cache answers
+ *   both after the first time.
+ * - Big directory: creating, opening and looking for missing files
+ *   in a directory of 5000. Build it with `GRISTLE_DIR_INDEX_SLOTS`
+ *   set to see what the index does (`bench_gristle_pc_index` has
+ *   8192 slots).
+ * - Listing: walking a directory of 2400 files and finding each
+ *   one's size and times, with fat_get_next_dirent and an open and
+ *   fstat of each name, and then with fat_get_next_dirents.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "block_pc.h"
+#include "fat_image.h"
+#include "gristle.h"
+#include "partition.h"
+
+#define IMAGE        "bench_gristle_pc.img"
+#define IMAGE_BLOCKS ( 32768 )
+#define SEEK_BYTES   ( 4 * 1024 * 1024 )
+#define SEEK_PAGE    ( 1024 )
+#define SEEK_PAGES   ( 2000 )
+#define OPENS        ( 100 )
+#define DIR_FILES    ( 5000 )
+#define LIST_FILES   ( 2400 )
+
+static struct fat_volume vol;
+static int failed = 0;
+
+/**
+ * Make a FAT32 volume with 512 byte clusters which fills the image,
+ * and mount it. If `every` is set, every `every`th cluster is taken
+ * by a lost chain, so that files have to be split around them.
+ */
+static void start( uint32_t every ) {
+  fat_image img;
+  memset( &img, 0, sizeof( img ) );
+  img.blocks = IMAGE_BLOCKS;
+  img.cluster = 1;
+  img.every = every;
+  int fd = fat_image_create( IMAGE, IMAGE_BLOCKS );
+  if ( fd < 0 || fat_image_format( fd, &img ) ) {
+    printf( "Could not create the image.\n" );
+    exit( 1 );
+  }
+  close( fd );
+  block_pc_set_image_name( IMAGE );
+  if ( block_init() || fat_mount( &vol, 0, IMAGE_BLOCKS, PART_TYPE_FAT32 ) ) {
+    printf( "Could not mount the image.\n" );
+    exit( 1 );
+  }
+  unlink( IMAGE );
+}
+
+static void stop( void ) {
+  if ( fat_umount( &vol ) ) { ++failed; }
+  block_halt();
+}
+
+static uint32_t reads( void ) {
+  uint32_t r, w;
+  block_pc_get_counts( &r, &w );
+  return r;
+}
+
+static uint8_t pattern( int file, uint32_t pos ) {
+  return ( uint8_t )( pos / 509 + file * 37 );
+}
+
+/** Create a file holding `len` bytes of its pattern. */
+static void make( const char *path, int file, uint32_t len ) {
+  static uint8_t b[ 4096 ];
+  int rerrno;
+  int fd = fat_open( &vol, path, O_WRONLY | O_CREAT | O_TRUNC, 0644, &rerrno );
+  for ( uint32_t pos = 0; fd >= 0 && pos < len; pos += sizeof( b ) ) {
+    uint32_t n = len - pos > sizeof( b ) ? sizeof( b ) : len - pos;
+    for ( uint32_t i = 0; i < n; ++i ) { b[ i ] = pattern( file, pos + i ); }
+    if ( fat_write( fd, b, n, &rerrno ) != ( int )n ) { ++failed; }
+  }
+  if ( fd < 0 || fat_close( fd, &rerrno ) ) { ++failed; }
+}
+
+static void bench_seeks( void ) {
+  static uint8_t b[ SEEK_PAGE ];
+  int rerrno;
+  // A lost cluster every 400 splits the file into about 20 pieces.
+  start( 400 );
+  make( "/DB.BIN", 1, SEEK_BYTES );
+  int fd = fat_open( &vol, "/DB.BIN", O_RDONLY, 0, &rerrno );
+  int pieces = fat_get_fragments( fd, &rerrno );
+  uint32_t seed = 1;
+  uint32_t r = reads();
+  for ( int n = 0; n < SEEK_PAGES; ++n ) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t pos = ( ( seed >> 8 ) % ( SEEK_BYTES / SEEK_PAGE ) ) * SEEK_PAGE;
+    if ( fat_lseek( fd, pos, SEEK_SET, &rerrno ) != ( int )pos ||
+         fat_read( fd, b, SEEK_PAGE, &rerrno ) != SEEK_PAGE || b[ 0 ] != pattern( 1, pos ) ) {
+      ++failed;
+    }
+  }
+  r = reads() - r;
+  if ( fat_close( fd, &rerrno ) ) { ++failed; }
+  printf( "seeks           | %d random %dB reads, %d pieces | %5.1f block reads each | failed %d\n",
+          SEEK_PAGES, SEEK_PAGE, pieces, ( double )r / SEEK_PAGES, failed );
+  stop();
+}
+
+static void bench_opens( void ) {
+  static uint8_t b[ 16 ];
+  int rerrno;
+  char path[ 32 ];
+  start( 0 );
+  fat_mkdir( &vol, "/DATA", 0755, &rerrno );
+  for ( int n = 0; n < 20; ++n ) {
+    sprintf( path, "/DATA/LOG%02d.TXT", n );
+    make( path, n, 1000 );
+  }
+  make( "/DATA/TEST.DB", 1, 64 * 1024 );
+  uint32_t r = 0;
+  for ( int n = 0; n <= OPENS; ++n ) {
+    // The first time round fills the cache.
+    if ( n == 1 ) { r = reads(); }
+    int fd = fat_open( &vol, "/DATA/TEST.DB", O_RDWR, 0, &rerrno );
+    if ( fd < 0 || fat_read( fd, b, sizeof( b ), &rerrno ) != sizeof( b ) || fat_close( fd, &rerrno ) ) {
+      ++failed;
+    }
+    if ( fat_open( &vol, "/DATA/TEST.JNL", O_RDONLY, 0, &rerrno ) >= 0 || rerrno != ENOENT ) {
+      ++failed;
+    }
+  }
+  r = reads() - r;
+  printf( "opens           | database and missing journal, %d times | %5.1f block reads each | failed %d\n",
+          OPENS, ( double )r / OPENS, failed );
+  stop();
+}
+
+static void bench_big_dir( void ) {
+  int rerrno;
+  char path[ 32 ];
+  uint32_t r[ 3 ] = { 0, 0, 0 };
+  start( 0 );
+  fat_mkdir( &vol, "/LOGS", 0755, &rerrno );
+  // The last OPENS of each are counted.
+  for ( int n = 0; n < DIR_FILES; ++n ) {
+    sprintf( path, "/LOGS/L%07d.TXT", n );
+    uint32_t before = reads();
+    int fd = fat_open( &vol, path, O_WRONLY | O_CREAT, 0644, &rerrno );
+    if ( n >= DIR_FILES - OPENS ) { r[ 0 ] += reads() - before; }
+    if ( fd < 0 || fat_write( fd, path, 1, &rerrno ) != 1 || fat_close( fd, &rerrno ) ) { ++failed; }
+  }
+  for ( int n = 0; n < OPENS; ++n ) {
+    // Spread over the directory, so the entry cache doesn't have them.
+    sprintf( path, "/LOGS/L%07d.TXT", n * ( DIR_FILES / OPENS ) );
+    uint32_t before = reads();
+    int fd = fat_open( &vol, path, O_RDONLY, 0, &rerrno );
+    r[ 1 ] += reads() - before;
+    if ( fd < 0 || fat_close( fd, &rerrno ) ) { ++failed; }
+    sprintf( path, "/LOGS/M%07d.TXT", n );
+    before = reads();
+    if ( fat_open( &vol, path, O_RDONLY, 0, &rerrno ) >= 0 || rerrno != ENOENT ) { ++failed; }
+    r[ 2 ] += reads() - before;
+  }
+  printf( "big directory   | %d files, %d index slots | block reads to create %5.1f, open %5.1f,"
+          " open missing %5.1f | failed %d\n", DIR_FILES, GRISTLE_DIR_INDEX_SLOTS,
+          ( double )r[ 0 ] / OPENS, ( double )r[ 1 ] / OPENS, ( double )r[ 2 ] / OPENS, failed );
+  stop();
+}
+
+static void bench_listing( void ) {
+  static fat_dirent e[ 16 ];
+  struct dirent de;
+  struct stat st;
+  int rerrno;
+  char path[ MAXNAMLEN + 8 ];
+  start( 0 );
+  fat_mkdir( &vol, "/LOGS", 0755, &rerrno );
+  for ( int n = 0; n < LIST_FILES; ++n ) {
+    sprintf( path, "/LOGS/L%07d.TXT", n );
+    make( path, n, 1 + n % 1000 );
+  }
+  uint32_t bytes[ 2 ] = { 0, 0 };
+  uint32_t r[ 2 ];
+  r[ 0 ] = reads();
+  int dir = fat_open( &vol, "/LOGS", O_RDONLY, 0, &rerrno );
+  while ( dir >= 0 && fat_get_next_dirent( dir, &de, &rerrno ) == 0 ) {
+    if ( de.d_name[ 0 ] == '.' ) { continue; }
+    sprintf( path, "/LOGS/%s", de.d_name );
+    int fd = fat_open( &vol, path, O_RDONLY, 0, &rerrno );
+    if ( fd < 0 || fat_fstat( fd, &st, &rerrno ) || fat_close( fd, &rerrno ) ) { ++failed; }
+    bytes[ 0 ] += st.st_size;
+  }
+  if ( dir < 0 || fat_close( dir, &rerrno ) ) { ++failed; }
+  r[ 0 ] = reads() - r[ 0 ];
+  r[ 1 ] = reads();
+  dir = fat_open( &vol, "/LOGS", O_RDONLY, 0, &rerrno );
+  int n;
+  while ( dir >= 0 && ( n = fat_get_next_dirents( dir, e, 16, &rerrno ) ) > 0 ) {
+    for ( int i = 0; i < n; ++i ) { bytes[ 1 ] += e[ i ].size; }
+  }
+  if ( dir < 0 || fat_close( dir, &rerrno ) ) { ++failed; }
+  r[ 1 ] = reads() - r[ 1 ];
+  if ( bytes[ 0 ] != bytes[ 1 ] ) { ++failed; }
+  printf( "listing         | %d files, %d index slots | block reads with fat_get_next_dirent and fstat %u,"
+          " with fat_get_next_dirents %u | failed %d\n", LIST_FILES, GRISTLE_DIR_INDEX_SLOTS,
+          r[ 0 ], r[ 1 ], failed );
+  stop();
+}
+
+int main( void ) {
+  bench_seeks();
+  bench_opens();
+  bench_big_dir();
+  bench_listing();
+  return failed != 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Benchmark for long appends through the Gristle filesystem, run
+ * against the register-level SDMMC / SD card simulator in
+ * `sdmmc_sim.c`.
+ *
+ * This formats a FAT32 volume on the simulated card, then appends a
+ * log file to it in small chunks, the way a data logger would, once
+ * as a plain file and once as a recording file (`fat_record`), on an
+ * empty volume and on one which is already half full. It
+ * shows the sustained write rate in simulated time, including the
+ * final `fat_close`, and how the writes reached the card: single
+ * and multi-block write commands, and how often a write went to
+ * another allocation unit from the last one. Cards with a penalty
+ * for that show why recording files reserve whole AUs. It also
+ * shows how many pieces the file ended up in, and how fast it reads
+ * back, with how many multi-block reads. Build it with
+ * `GRISTLE_BUFFER_SECTORS` set to see what bigger file buffers do
+ * (`bench_gristle_sim_cluster` buffers a whole cluster). Register
+ * accesses are trapped, so the simulator is slow; the card has small
+ * AUs to keep the file short.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "block_sd_foss.h"
+#include "fat_image.h"
+#include "gristle.h"
+#include "partition.h"
+#include "sdmmc_sim.h"
+
+extern SDMMC_TypeDef *sdmmc;
+
+#define IMAGE        "bench_gristle_sim.img"
+#define IMAGE_BLOCKS ( 131072 )
+// 4KB clusters.
+#define FS_CLUSTER   ( 8 )
+#define BENCH_BYTES  ( 256 * 1024 )
+#define BENCH_CHUNK  ( 1000 )
+
+typedef struct {
+  const char *name;
+  uint32_t    au_switch_ns;
+  // Clusters in use before the log file, from the start of the FAT.
+  uint32_t    used;
+} bench_case;
+
+static fat_image img;
+
+/**
+ * Make a FAT32 volume which fills the image, with `used` clusters
+ * after the root directory's already taken (by lost chains, which
+ * is all that matters to allocation).
+ */
+static void format( uint32_t used ) {
+  memset( &img, 0, sizeof( img ) );
+  img.blocks = IMAGE_BLOCKS;
+  img.cluster = FS_CLUSTER;
+  img.used = used;
+  int fd = fat_image_create( IMAGE, IMAGE_BLOCKS );
+  if ( fd < 0 || fat_image_format( fd, &img ) ) {
+    printf( "Could not create the image.\n" );
+    exit( 1 );
+  }
+  close( fd );
+}
+
+static struct fat_volume vol;
+
+static void run( const bench_case *c, int record ) {
+  static uint8_t buf[ BENCH_CHUNK ];
+  format( c->used );
+  sdmmc_sim_config cfg;
+  sdmmc_sim_defaults( &cfg );
+  // 64KB AUs, so that the file spans a few of them.
+  cfg.au_size = 3;
+  cfg.au_switch_ns = c->au_switch_ns;
+  sdmmc = sdmmc_sim_open( IMAGE, &cfg );
+  if ( sdmmc ) {
+    sdmmc_setup( sdmmc );
+    sdmmc_irq_setup( sdmmc, SDMMC_WAIT_WFI );
+  }
+  if ( !sdmmc || block_init() ||
+       fat_mount( &vol, 0, IMAGE_BLOCKS, PART_TYPE_FAT32 ) ) {
+    printf( "Could not mount the simulated card.\n" );
+    exit( 1 );
+  }
+
+  int failed = 0;
+  int rerrno;
+  sdmmc_sim_reset_stats();
+  uint64_t start = sdmmc_sim_now();
+  int fd = fat_open( &vol, "/LOG.BIN", O_WRONLY | O_CREAT | O_APPEND, 0644,
+                     &rerrno );
+  if ( fd < 0 || ( record && fat_record( fd, &rerrno ) ) ) {
+    printf( "Could not create the log file.\n" );
+    exit( 1 );
+  }
+  for ( uint32_t pos = 0; pos < BENCH_BYTES; pos += BENCH_CHUNK ) {
+    uint32_t n = BENCH_BYTES - pos;
+    if ( n > BENCH_CHUNK ) { n = BENCH_CHUNK; }
+    for ( uint32_t i = 0; i < n; ++i ) { buf[ i ] = ( uint8_t )( ( pos + i ) / 509 ); }
+    if ( fat_write( fd, buf, n, &rerrno ) != ( int )n ) { ++failed; }
+  }
+  if ( fat_close( fd, &rerrno ) || fat_umount( &vol ) ) { ++failed; }
+  sdmmc_card_wait_ready( sdmmc );
+  uint64_t wr_ns = sdmmc_sim_now() - start;
+  sdmmc_sim_stats s = *sdmmc_sim_get_stats();
+
+  // Read the file back to check it, and see how many pieces it's in.
+  struct stat st;
+  int pieces = -1;
+  sdmmc_sim_reset_stats();
+  start = sdmmc_sim_now();
+  fd = fat_open( &vol, "/LOG.BIN", O_RDONLY, 0, &rerrno );
+  if ( fd < 0 || fat_fstat( fd, &st, &rerrno ) ||
+       st.st_size != BENCH_BYTES ||
+       ( pieces = fat_get_fragments( fd, &rerrno ) ) < 1 ) {
+    ++failed;
+  }
+  for ( uint32_t pos = 0; fd >= 0 && pos < BENCH_BYTES; pos += BENCH_CHUNK ) {
+    uint32_t n = BENCH_BYTES - pos;
+    if ( n > BENCH_CHUNK ) { n = BENCH_CHUNK; }
+    if ( fat_read( fd, buf, n, &rerrno ) != ( int )n ) { ++failed; break; }
+    for ( uint32_t i = 0; i < n; ++i ) {
+      if ( buf[ i ] != ( uint8_t )( ( pos + i ) / 509 ) ) { ++failed; break; }
+    }
+  }
+  if ( fd >= 0 ) { fat_close( fd, &rerrno ); }
+  uint64_t rd_ns = sdmmc_sim_now() - start;
+  uint32_t rd_multi = sdmmc_sim_get_stats()->cmds[ SDMMC_CMD_READ_BLOCKS ];
+  // The free count must have kept up with the file, and with the
+  // clusters which a recording file reserved but did not use.
+  if ( fat_get_free_count( &vol ) !=
+       img.free - BENCH_BYTES / ( FS_CLUSTER * 512 ) ) {
+    ++failed;
+  }
+  printf( "%-26s %-9s buf %2d | write %6.0fKB/s | CMD17 %6u | CMD24 %6u |"
+          " CMD25 %5u | blocks %6u | AU switches %5u | pieces %2d |"
+          " read %6.0fKB/s | CMD18 %4u | failed %d\n",
+          c->name, record ? "recording" : "plain", GRISTLE_BUFFER_SECTORS,
+          BENCH_BYTES / 1024.0 / ( wr_ns / 1e9 ),
+          s.cmds[ SDMMC_CMD_READ_BLOCK ],
+          s.cmds[ SDMMC_CMD_WRITE_BLOCK ], s.cmds[ SDMMC_CMD_WRITE_BLOCKS ],
+          s.blocks_written, s.au_switches, pieces,
+          BENCH_BYTES / 1024.0 / ( rd_ns / 1e9 ), rd_multi, failed );
+  sdmmc_sim_close();
+}
+
+int main( void ) {
+  const bench_case cases[] = {
+    { "fast card",                0,       0 },
+    { "fast card, half full",     0,       8192 },
+    { "fast card, 5ms AU switch", 5000000, 0 },
+  };
+  for ( unsigned i = 0; i < sizeof( cases ) / sizeof( cases[ 0 ] ); ++i ) {
+    run( &cases[ i ], 0 );
+    run( &cases[ i ], 1 );
+  }
+  unlink( IMAGE );
+  return 0;
+}
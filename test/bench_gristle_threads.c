@@ -0,0 +1,212 @@
+/*
+ * Benchmark for Gristle used from several threads at once, with its
+ * POSIX thread locks, on the in-memory image driver `block_pc`.
+ *
+ * The driver is made to sleep for each block, as a task waiting for
+ * a card would, and each thread checks what it reads with a CRC, as
+ * a query would do some work on its rows. Files only share a lock
+ * while they go to the medium, so one thread's work can overlap
+ * another's wait. This reads a file per thread with 1, 2 and 4
+ * threads, and shows the total rate and how it scales from one
+ * thread. Then it runs a logger, appending records, and a query,
+ * reading another file, one after the other and then at the same
+ * time. The times are wall clock times, so they vary a little from
+ * run to run.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "block_pc.h"
+#include "fat_image.h"
+#include "gristle.h"
+#include "partition.h"
+
+#define IMAGE        "bench_gristle_threads.img"
+#define IMAGE_BLOCKS ( 65536 )
+#define FILE_BYTES   ( 128 * 1024 )
+#define RECORD       ( 100 )
+#define LOG_RECORDS  ( 800 )
+// Per block, like a slow card.
+#define READ_US      ( 100 )
+#define WRITE_US     ( 200 )
+// CRCs of each record a reader works out, which takes about as long
+// as reading it from the card does.
+#define WORK         ( 24 )
+
+static struct fat_volume vol;
+static int failed = 0;
+// What each reader's CRC should come to.
+static uint32_t crcs[ 4 ];
+static pthread_mutex_t failed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fail( void ) {
+  pthread_mutex_lock( &failed_lock );
+  ++failed;
+  pthread_mutex_unlock( &failed_lock );
+}
+
+/** Make a FAT32 volume with 4KB clusters which fills the image. */
+static void format( void ) {
+  fat_image img;
+  memset( &img, 0, sizeof( img ) );
+  img.blocks = IMAGE_BLOCKS;
+  img.cluster = 8;
+  int fd = fat_image_create( IMAGE, IMAGE_BLOCKS );
+  if ( fd < 0 || fat_image_format( fd, &img ) ) {
+    printf( "Could not create the image.\n" );
+    exit( 1 );
+  }
+  close( fd );
+}
+
+static uint8_t pattern( int file, uint32_t pos ) {
+  return ( uint8_t )( pos / 509 + file * 37 );
+}
+
+static uint32_t crc32( uint32_t crc, const uint8_t *p, uint32_t n ) {
+  crc = ~crc;
+  while ( n-- ) {
+    crc ^= *p++;
+    for ( int k = 0; k < 8; ++k ) {
+      crc = ( crc >> 1 ) ^ ( 0xEDB88320 & -( crc & 1 ) );
+    }
+  }
+  return ~crc;
+}
+
+static double now_ms( void ) {
+  struct timespec t;
+  clock_gettime( CLOCK_MONOTONIC, &t );
+  return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static void name( char *out, const char *prefix, int n ) {
+  sprintf( out, "/%s%d.BIN", prefix, n );
+}
+
+static uint32_t work( uint32_t crc, const uint8_t *record, uint32_t len ) {
+  for ( int w = 0; w < WORK; ++w ) {
+    crc = crc32( crc, record, len );
+  }
+  return crc;
+}
+
+// Read a whole file in records, and work on them.
+static void *reader( void *arg ) {
+  int n = ( int )( intptr_t )arg;
+  uint8_t buf[ RECORD ];
+  char path[ 16 ];
+  int rerrno;
+  name( path, "DB", n );
+  int fd = fat_open( &vol, path, O_RDONLY, 0, &rerrno );
+  if ( fd < 0 ) {
+    fail();
+    return NULL;
+  }
+  uint32_t crc = 0;
+  for ( uint32_t pos = 0; pos < FILE_BYTES; pos += RECORD ) {
+    uint32_t len = FILE_BYTES - pos;
+    if ( len > RECORD ) { len = RECORD; }
+    if ( fat_read( fd, buf, len, &rerrno ) != ( int )len ) { fail(); break; }
+    crc = work( crc, buf, len );
+  }
+  if ( crc != crcs[ n ] || fat_close( fd, &rerrno ) ) { fail(); }
+  return NULL;
+}
+
+// Append records to the log, and flush them now and then.
+static void *logger( void *arg ) {
+  uint8_t buf[ RECORD ];
+  int rerrno;
+  ( void )arg;
+  int fd = fat_open( &vol, "/LOG.BIN", O_WRONLY | O_CREAT | O_APPEND, 0644, &rerrno );
+  if ( fd < 0 ) {
+    fail();
+    return NULL;
+  }
+  for ( uint32_t r = 0; r < LOG_RECORDS; ++r ) {
+    for ( uint32_t i = 0; i < RECORD; ++i ) { buf[ i ] = pattern( 7, r * RECORD + i ); }
+    if ( fat_write( fd, buf, RECORD, &rerrno ) != RECORD ) { fail(); break; }
+    if ( r % 100 == 99 && fat_fsync( fd, &rerrno ) ) { fail(); }
+  }
+  if ( fat_close( fd, &rerrno ) ) { fail(); }
+  return NULL;
+}
+
+static double run( void *( *fn[] )( void* ), int n ) {
+  pthread_t t[ 4 ];
+  double start = now_ms();
+  for ( int i = 0; i < n; ++i ) {
+    pthread_create( &t[ i ], NULL, fn[ i ], ( void* )( intptr_t )i );
+  }
+  for ( int i = 0; i < n; ++i ) {
+    pthread_join( t[ i ], NULL );
+  }
+  return now_ms() - start;
+}
+
+int main( void ) {
+  static uint8_t buf[ 4096 ];
+  int rerrno;
+  format();
+  block_pc_set_image_name( IMAGE );
+  if ( block_init() || fat_mount( &vol, 0, IMAGE_BLOCKS, PART_TYPE_FAT32 ) ) {
+    printf( "Could not mount the image.\n" );
+    exit( 1 );
+  }
+  unlink( IMAGE );
+  // The files to read, written before the driver is slowed down.
+  for ( int n = 0; n < 4; ++n ) {
+    char path[ 16 ];
+    name( path, "DB", n );
+    int fd = fat_open( &vol, path, O_WRONLY | O_CREAT, 0644, &rerrno );
+    for ( uint32_t pos = 0; fd >= 0 && pos < FILE_BYTES; pos += sizeof( buf ) ) {
+      for ( uint32_t i = 0; i < sizeof( buf ); ++i ) { buf[ i ] = pattern( n, pos + i ); }
+      if ( fat_write( fd, buf, sizeof( buf ), &rerrno ) != sizeof( buf ) ) { ++failed; }
+    }
+    if ( fd < 0 || fat_close( fd, &rerrno ) ) { ++failed; }
+    for ( uint32_t pos = 0; pos < FILE_BYTES; pos += RECORD ) {
+      uint32_t len = FILE_BYTES - pos;
+      if ( len > RECORD ) { len = RECORD; }
+      for ( uint32_t i = 0; i < len; ++i ) { buf[ i ] = pattern( n, pos + i ); }
+      crcs[ n ] = work( crcs[ n ], buf, len );
+    }
+  }
+  block_pc_set_latency( READ_US, WRITE_US );
+
+  void *( *readers[] )( void* ) = { reader, reader, reader, reader };
+  double one = 0;
+  for ( int n = 1; n <= 4; n *= 2 ) {
+    double ms = run( readers, n );
+    if ( n == 1 ) { one = ms; }
+    printf( "%d reader%s       | %4dKB in %5.0fms | %5.0fKB/s | x%4.2f | failed %d\n",
+            n, n > 1 ? "s" : " ", n * FILE_BYTES / 1024, ms,
+            n * FILE_BYTES / 1024.0 / ( ms / 1e3 ), n * one / ms, failed );
+  }
+
+  // The logger and a query, one after the other and then at once.
+  void *( *both[] )( void* ) = { reader, logger };
+  double apart = run( both, 1 );
+  apart += run( &both[ 1 ], 1 );
+  fat_unlink( &vol, "/LOG.BIN", &rerrno );
+  double together = run( both, 2 );
+  // The log must all be there.
+  int fd = fat_open( &vol, "/LOG.BIN", O_RDONLY, 0, &rerrno );
+  for ( uint32_t pos = 0; fd >= 0 && pos < LOG_RECORDS * RECORD; pos += RECORD ) {
+    if ( fat_read( fd, buf, RECORD, &rerrno ) != RECORD ) { ++failed; break; }
+    for ( uint32_t i = 0; i < RECORD; ++i ) {
+      if ( buf[ i ] != pattern( 7, pos + i ) ) { ++failed; break; }
+    }
+  }
+  if ( fd < 0 || fat_close( fd, &rerrno ) || fat_umount( &vol ) ) { ++failed; }
+  printf( "logger + query  | one after the other %5.0fms | at once %5.0fms | x%4.2f | failed %d\n",
+          apart, together, apart / together, failed );
+  block_halt();
+  return failed != 0;
+}
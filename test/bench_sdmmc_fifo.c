@@ -0,0 +1,217 @@
+/*
+ * Benchmark for the polled SDMMC FIFO loops in `port/sdmmc.c`.
+ *
+ * The driver runs unmodified against a trapped register model
+ * (see `regmodel.h`) of the SDMMC peripheral's FIFO and data path.
+ * Simulated time advances by a fixed cost for every register access,
+ * and the card moves one FIFO word every 8 bus clocks (4-bit bus).
+ * Every millisecond, the CPU is also 'stalled' for a while to stand
+ * in for other interrupt handlers.
+ *
+ * The Makefile builds this twice: once with the default 8-word
+ * bursts and hardware flow control, and once with the old
+ * word-at-a-time loops and no flow control.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "port/sdmmc.h"
+#include "regmodel.h"
+
+#ifndef BENCH_NAME
+#define BENCH_NAME "burst + HWFC"
+#endif
+
+volatile uint32_t tick = 0;
+
+// Cost of one peripheral register access, in nanoseconds.
+// About 4 APB cycles: 50ns with an 80MHz core clock, or 250ns
+// with a 16MHz core clock.
+static uint64_t access_ns = 50;
+#define FIFO_WORDS   ( 32 )
+#define BLOCK_WORDS  ( 128 )
+#define BENCH_BLOCKS ( 64 )
+
+static SDMMC_TypeDef *regs;
+static struct {
+  uint32_t  r[ 64 ];
+  uint32_t  sta;
+  uint64_t  now;
+  uint64_t  next_stall;
+  uint64_t  stall_ns;
+  uint64_t  word_ns;
+  uint64_t  next_word;
+  uint64_t  busy_until;
+  // Data phase: words left to move between the card and the FIFO.
+  int       rx_left;
+  int       tx_left;
+  int       tx_pending;
+  uint32_t  fifo[ FIFO_WORDS ];
+  int       head;
+  int       count;
+  int       errors;
+} m;
+
+#define REG( field ) ( offsetof( SDMMC_TypeDef, field ) / 4 )
+
+static int hwfc( void ) { return ( m.r[ REG( CLKCR ) ] & SDMMC_CLKCR_HWFC_EN ) != 0; }
+
+static void data_error( uint32_t flag ) {
+  m.sta |= flag;
+  m.rx_left = 0;
+  m.tx_left = 0;
+  ++m.errors;
+}
+
+// Let time pass: the card moves FIFO words as the bus clock runs.
+static void advance( uint64_t ns ) {
+  uint64_t end = m.now + ns;
+  if ( m.stall_ns && end >= m.next_stall ) {
+    end += m.stall_ns;
+    m.next_stall += 1000000;
+  }
+  while ( ( m.rx_left || m.tx_left ) && m.next_word <= end ) {
+    if ( m.rx_left ) {
+      if ( m.count == FIFO_WORDS ) {
+        // With flow control, the clock stops until there is room.
+        if ( hwfc() ) { m.next_word = end; break; }
+        data_error( SDMMC_STA_RXOVERR );
+        break;
+      }
+      m.fifo[ ( m.head + m.count ) % FIFO_WORDS ] = 0xC0DE0000 | m.rx_left;
+      ++m.count;
+      if ( --m.rx_left == 0 ) { m.sta |= SDMMC_STA_DATAEND; }
+    }
+    else {
+      if ( m.count == 0 ) {
+        if ( hwfc() ) { m.next_word = end; break; }
+        data_error( SDMMC_STA_TXUNDERR );
+        break;
+      }
+      m.head = ( m.head + 1 ) % FIFO_WORDS;
+      --m.count;
+      if ( --m.tx_left == 0 ) {
+        m.sta |= SDMMC_STA_DATAEND;
+        // The card programs the block for 200us.
+        m.busy_until = end + 200000;
+      }
+    }
+    m.next_word += m.word_ns;
+  }
+  m.now = end;
+  tick = ( uint32_t )( m.now / 1000000 );
+}
+
+static uint32_t status( void ) {
+  uint32_t sta = m.sta;
+  if ( m.count > 0 ) { sta |= SDMMC_STA_RXDAVL; }
+  if ( m.count >= 8 ) { sta |= SDMMC_STA_RXFIFOHF; }
+  if ( m.tx_left && FIFO_WORDS - m.count >= 8 ) { sta |= SDMMC_STA_TXFIFOHE; }
+  return sta;
+}
+
+static uint32_t peek( void *ctx, uint32_t off ) {
+  ( void )ctx;
+  if ( off / 4 == REG( STA ) ) { return status(); }
+  return m.r[ off / 4 ];
+}
+
+static uint32_t reg_read( void *ctx, uint32_t off ) {
+  advance( access_ns );
+  if ( off / 4 == REG( FIFO ) && m.count > 0 ) {
+    uint32_t word = m.fifo[ m.head ];
+    m.head = ( m.head + 1 ) % FIFO_WORDS;
+    --m.count;
+    return word;
+  }
+  return peek( ctx, off );
+}
+
+static void reg_write( void *ctx, uint32_t off, uint32_t value ) {
+  ( void )ctx;
+  advance( access_ns );
+  m.r[ off / 4 ] = value;
+  if ( off / 4 == REG( ICR ) ) { m.sta &= ~value; }
+  else if ( off / 4 == REG( POWER ) ) { m.r[ off / 4 ] = value & 0x3; }
+  else if ( off / 4 == REG( FIFO ) && m.count < FIFO_WORDS ) {
+    m.fifo[ ( m.head + m.count ) % FIFO_WORDS ] = value;
+    ++m.count;
+  }
+  else if ( off / 4 == REG( CMD ) && ( value & SDMMC_CMD_CPSMEN ) ) {
+    uint32_t idx = value & SDMMC_CMD_CMDINDEX;
+    m.r[ REG( RESPCMD ) ] = idx;
+    m.r[ REG( RESP1 ) ] = ( SDMMC_STATE_TRAN << 9 ) | SDMMC_READY_FOR_DATA;
+    m.sta |= ( value & SDMMC_CMD_WAITRESP ) ?
+             SDMMC_STA_CMDREND : SDMMC_STA_CMDSENT;
+    m.head = 0;
+    m.count = 0;
+    m.next_word = m.now + m.word_ns;
+    if ( idx == SDMMC_CMD_READ_BLOCK ) { m.rx_left = BLOCK_WORDS; }
+    if ( idx == SDMMC_CMD_WRITE_BLOCK ) { m.tx_pending = 1; }
+  }
+  else if ( off / 4 == REG( DCTRL ) && ( value & SDMMC_DCTRL_DTEN ) &&
+            !( value & SDMMC_DCTRL_DTDIR ) && m.tx_pending ) {
+    m.tx_pending = 0;
+    m.tx_left = BLOCK_WORDS;
+    m.next_word = m.now + m.word_ns;
+  }
+}
+
+void host_irq_off( void ) {}
+void host_sleep( void ) { advance( 1000 ); }
+int host_dat0_high( void ) { return m.now >= m.busy_until; }
+uint32_t timer_micros( void ) { return ( uint32_t )( m.now / 1000 ); }
+
+static void run( int clk_mhz, uint64_t stall_ns ) {
+  static uint32_t buf[ BLOCK_WORDS ];
+  memset( &m, 0, sizeof( m ) );
+  m.word_ns = 8000 / clk_mhz;
+  m.stall_ns = stall_ns;
+  m.next_stall = 1000000;
+  sdmmc_setup( regs );
+  sdmmc_select_card( regs, 1 );
+
+  int failed = 0;
+  uint64_t acc = regmodel_accesses;
+  uint64_t start = m.now;
+  for ( int i = 0; i < BENCH_BLOCKS; ++i ) {
+    if ( sdmmc_read_block( regs, SDMMC_HC, 1, i, buf ) ) { ++failed; }
+  }
+  double rd_acc = ( double )( regmodel_accesses - acc ) / BENCH_BLOCKS;
+  double rd_us  = ( double )( m.now - start ) / 1000.0 / BENCH_BLOCKS;
+  acc = regmodel_accesses;
+  start = m.now;
+  for ( int i = 0; i < BENCH_BLOCKS; ++i ) {
+    if ( sdmmc_write_block( regs, SDMMC_HC, 1, i, buf ) ) { ++failed; }
+  }
+  sdmmc_card_wait_ready( regs );
+  double wr_acc = ( double )( regmodel_accesses - acc ) / BENCH_BLOCKS;
+  double wr_us  = ( double )( m.now - start ) / 1000.0 / BENCH_BLOCKS;
+  printf( "%-13s core %2dMHz  bus %2dMHz  stall %2lluus | read %6.1f acc %6.1fus |"
+          " write %6.1f acc %6.1fus | FIFO errors %2d, failed %2d\n",
+          BENCH_NAME, ( int )( 4000 / access_ns ), clk_mhz,
+          ( unsigned long long )( stall_ns / 1000 ),
+          rd_acc, rd_us, wr_acc, wr_us, m.errors, failed );
+}
+
+int main( void ) {
+  regmodel_ops ops = { reg_read, reg_write, peek, NULL };
+  regs = ( SDMMC_TypeDef* )regmodel_map( sizeof( SDMMC_TypeDef ), &ops );
+  if ( !regs ) {
+    printf( "Could not map the register model.\n" );
+    return 1;
+  }
+  // Register accesses and simulated time per 512-byte block.
+  const int clocks[] = { 12, 24, 48 };
+  const uint64_t access[] = { 50, 250 };
+  for ( unsigned a = 0; a < sizeof( access ) / sizeof( access[ 0 ] ); ++a ) {
+    access_ns = access[ a ];
+    for ( unsigned i = 0; i < sizeof( clocks ) / sizeof( clocks[ 0 ] ); ++i ) {
+      run( clocks[ i ], 0 );
+      run( clocks[ i ], 20000 );
+    }
+  }
+  regmodel_unmap( regs );
+  return 0;
+}
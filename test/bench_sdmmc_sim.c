@@ -0,0 +1,124 @@
+/*
+ * Benchmark for the SD card driver stack, run against the
+ * register-level SDMMC / SD card simulator in `sdmmc_sim.c`.
+ *
+ * This times `block_init`, then `block_read` (one block at a time,
+ * and streamed with `block_stream_start`) and `block_write` over a
+ * range of blocks in simulated time, for a few bus clocks and card
+ * latencies, along with the slowest single read and write. Transfers
+ * use the 4-bit bus which `block_init` sets up. For power, it shows
+ * how much of the time the card clock ran, and how much of the time
+ * spent in the driver the core was asleep. The numbers are only
+ * as good as the simulator's timing model, but they are repeatable,
+ * so they show whether a driver change helps.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "block_sd_foss.h"
+#include "sdmmc_sim.h"
+
+extern SDMMC_TypeDef *sdmmc;
+extern SDCard card;
+
+#define IMAGE        "bench_sdmmc_sim.img"
+#define IMAGE_BLOCKS ( 8192 )
+#define BENCH_BLOCKS ( 64 )
+
+typedef struct {
+  const char *name;
+  uint32_t    clk;
+  uint32_t    read_ns;
+  uint32_t    program_ns;
+} bench_case;
+
+static void run( const bench_case *c, int wait_mode ) {
+  static uint8_t buf[ 512 ];
+  int fd = open( IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+  if ( fd < 0 || ftruncate( fd, ( off_t )IMAGE_BLOCKS * 512 ) ) {
+    printf( "Could not create the image.\n" );
+    exit( 1 );
+  }
+  close( fd );
+  sdmmc_sim_config cfg;
+  sdmmc_sim_defaults( &cfg );
+  cfg.read_ns = c->read_ns;
+  cfg.program_ns = c->program_ns;
+  sdmmc = sdmmc_sim_open( IMAGE, &cfg );
+  if ( sdmmc ) {
+    sdmmc_setup( sdmmc );
+    sdmmc_irq_setup( sdmmc, wait_mode );
+  }
+  if ( !sdmmc || block_init() ) {
+    printf( "Could not initialize the simulated card.\n" );
+    exit( 1 );
+  }
+  uint32_t init_us = card.init_us;
+  // `block_init` picks the fastest clock; override it.
+  sdmmc_set_clock( sdmmc, c->clk );
+
+  int failed = 0;
+  sdmmc_sim_reset_stats();
+  block_sd_reset_stats();
+  block_sd_reset_energy();
+  uint64_t start = sdmmc_sim_now();
+  for ( int i = 0; i < BENCH_BLOCKS; ++i ) {
+    memset( buf, i, sizeof( buf ) );
+    if ( block_write( i, buf ) ) { ++failed; }
+  }
+  sdmmc_card_wait_ready( sdmmc );
+  uint64_t wr_ns = sdmmc_sim_now() - start;
+  start = sdmmc_sim_now();
+  for ( int i = 0; i < BENCH_BLOCKS; ++i ) {
+    if ( block_read( i, buf ) || buf[ 0 ] != ( uint8_t )i ) { ++failed; }
+  }
+  uint64_t rd_ns = sdmmc_sim_now() - start;
+  start = sdmmc_sim_now();
+  if ( block_stream_start( 0, BENCH_BLOCKS ) ) { ++failed; }
+  for ( int i = 0; i < BENCH_BLOCKS; ++i ) {
+    if ( block_read( i, buf ) || buf[ 0 ] != ( uint8_t )i ) { ++failed; }
+  }
+  if ( block_stream_stop() ) { ++failed; }
+  uint64_t st_ns = sdmmc_sim_now() - start;
+  const sdmmc_sim_stats *s = sdmmc_sim_get_stats();
+  const SDStats *sd = block_sd_get_stats();
+  const SDEnergy *en = block_sd_get_energy();
+  printf( "%-22s %-4s | init %6.1fms | read %7.1fus/blk %6.0fKB/s |"
+          " stream %7.1fus/blk %6.0fKB/s |"
+          " write %7.1fus/blk %6.0fKB/s | busy %5.1f%% |"
+          " clock %5.1f%% | asleep %5.1f%% |"
+          " max %6uus rd %6uus wr | FIFO errors %d, retries %d,"
+          " failed %d\n",
+          c->name, wait_mode == SDMMC_WAIT_WFI ? "WFI" : "spin",
+          init_us / 1000.0,
+          rd_ns / 1000.0 / BENCH_BLOCKS,
+          BENCH_BLOCKS * 512.0 / 1024.0 / ( rd_ns / 1e9 ),
+          st_ns / 1000.0 / BENCH_BLOCKS,
+          BENCH_BLOCKS * 512.0 / 1024.0 / ( st_ns / 1e9 ),
+          wr_ns / 1000.0 / BENCH_BLOCKS,
+          BENCH_BLOCKS * 512.0 / 1024.0 / ( wr_ns / 1e9 ),
+          100.0 * s->busy_ns / ( double )( rd_ns + st_ns + wr_ns ),
+          100.0 * s->clock_ns / ( double )( rd_ns + st_ns + wr_ns ),
+          100.0 * en->sleep_us / ( double )( en->active_us + en->sleep_us ),
+          sd->max_read_us, sd->max_write_us,
+          s->fifo_errors, sd->retries, failed );
+  sdmmc_sim_close();
+}
+
+int main( void ) {
+  const bench_case cases[] = {
+    { "400KHz, slow card", SDMMC_CLK_INIT,    500000, 1000000 },
+    { "24MHz, slow card",  SDMMC_CLK_DEFAULT, 500000, 1000000 },
+    { "24MHz, fast card",  SDMMC_CLK_DEFAULT, 100000,  250000 },
+    { "48MHz, fast card",  SDMMC_CLK_HIGH,    100000,  250000 },
+  };
+  for ( unsigned i = 0; i < sizeof( cases ) / sizeof( cases[ 0 ] ); ++i ) {
+    run( &cases[ i ], SDMMC_WAIT_SPIN );
+    run( &cases[ i ], SDMMC_WAIT_WFI );
+  }
+  unlink( IMAGE );
+  return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * Benchmark for the SPI-mode SD card driver, run against the
+ * register-level SPI / DMA / SD card simulator in `spi_sim.c`.
+ *
+ * This times `block_init`, then `block_read` (one block at a time,
+ * and streamed with `block_stream_start`), `block_write` and
+ * `block_write_blocks` over a range of blocks in simulated time, for
+ * a few SPI clocks and card latencies. Build it with
+ * `SD_SPI_DMA_BLOCKS=0` to compare DMA transfers with a CPU loop;
+ * the numbers are only as good as the simulator's timing model, but
+ * they are repeatable, so they show whether a driver change helps.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "block_sd.h"
+#include "spi_sim.h"
+
+#ifndef BENCH_NAME
+#define BENCH_NAME "DMA"
+#endif
+
+extern SDCard card;
+
+#define IMAGE        "bench_spi_sim.img"
+#define IMAGE_BLOCKS ( 8192 )
+#define BENCH_BLOCKS ( 64 )
+
+typedef struct {
+  const char *name;
+  uint32_t    clk;
+  uint32_t    read_ns;
+  uint32_t    program_ns;
+  uint32_t    multi_program_ns;
+} bench_case;
+
+static double kbps( uint64_t ns ) {
+  return BENCH_BLOCKS * 512.0 / 1024.0 / ( ns / 1e9 );
+}
+
+static void run( const bench_case *c ) {
+  // DMA buffers must be static; see `spi_sim.h`.
+  static uint8_t buf[ 512 ];
+  static uint8_t run_buf[ BENCH_BLOCKS * 512 ];
+  int fd = open( IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+  if ( fd < 0 || ftruncate( fd, ( off_t )IMAGE_BLOCKS * 512 ) ) {
+    printf( "Could not create the image.\n" );
+    exit( 1 );
+  }
+  close( fd );
+  spi_sim_config cfg;
+  spi_sim_defaults( &cfg );
+  cfg.read_ns = c->read_ns;
+  cfg.program_ns = c->program_ns;
+  cfg.multi_program_ns = c->multi_program_ns;
+  sd_bus.spi = spi_sim_open( IMAGE, &cfg );
+  sd_bus.dma = spi_sim_dma();
+  sd_cs_port = spi_sim_cs_port();
+  if ( !sd_bus.spi || block_init() ) {
+    printf( "Could not initialize the simulated card.\n" );
+    exit( 1 );
+  }
+  uint32_t init_us = card.init_us;
+  // `block_init` picks the fast clock; override it.
+  spi_set_clock( sd_bus.spi, c->clk );
+
+  int failed = 0;
+  spi_sim_reset_stats();
+  uint64_t start = spi_sim_now();
+  for ( int i = 0; i < BENCH_BLOCKS; ++i ) {
+    memset( buf, i, sizeof( buf ) );
+    if ( block_write( i, buf ) ) { ++failed; }
+  }
+  block_flush_cache();
+  uint64_t wr_ns = spi_sim_now() - start;
+  for ( int i = 0; i < BENCH_BLOCKS; ++i ) {
+    memset( run_buf + i * 512, i, 512 );
+  }
+  start = spi_sim_now();
+  if ( block_write_blocks( BENCH_BLOCKS, BENCH_BLOCKS, run_buf ) ) { ++failed; }
+  block_flush_cache();
+  uint64_t mw_ns = spi_sim_now() - start;
+  start = spi_sim_now();
+  for ( int i = 0; i < BENCH_BLOCKS; ++i ) {
+    if ( block_read( i, buf ) || buf[ 0 ] != ( uint8_t )i ) { ++failed; }
+  }
+  uint64_t rd_ns = spi_sim_now() - start;
+  start = spi_sim_now();
+  if ( block_stream_start( BENCH_BLOCKS, BENCH_BLOCKS ) ) { ++failed; }
+  for ( int i = 0; i < BENCH_BLOCKS; ++i ) {
+    if ( block_read( BENCH_BLOCKS + i, buf ) || buf[ 0 ] != ( uint8_t )i ) {
+      ++failed;
+    }
+  }
+  if ( block_stream_stop() ) { ++failed; }
+  uint64_t st_ns = spi_sim_now() - start;
+  const spi_sim_stats *s = spi_sim_get_stats();
+  uint64_t total = wr_ns + mw_ns + rd_ns + st_ns;
+  printf( "%-22s %-5s | init %6.1fms | read %6.0fKB/s |"
+          " stream %6.0fKB/s | write %6.0fKB/s | CMD25 %6.0fKB/s |"
+          " bus %5.1f%% | failed %d\n",
+          c->name, BENCH_NAME, init_us / 1000.0,
+          kbps( rd_ns ), kbps( st_ns ), kbps( wr_ns ), kbps( mw_ns ),
+          100.0 * s->bus_ns / ( double )total, failed );
+  spi_sim_close();
+}
+
+int main( void ) {
+  const bench_case cases[] = {
+    { "10MHz, slow card", SPI_CLK_DIV8, 500000, 1000000, 200000 },
+    { "20MHz, slow card", SPI_CLK_DIV4, 500000, 1000000, 200000 },
+    { "20MHz, fast card", SPI_CLK_DIV4, 100000,  250000,  50000 },
+  };
+  for ( unsigned i = 0; i < sizeof( cases ) / sizeof( cases[ 0 ] ); ++i ) {
+    run( &cases[ i ] );
+  }
+  unlink( IMAGE );
+  return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * FAT32 volumes for the host-side Gristle tests and benchmarks.
+ * See `fat_image.h`.
+ */
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fat_image.h"
+#include "gristle.h"
+
+int fat_image_create( const char *path, uint32_t blocks ) {
+  int fd = open( path, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+  if ( fd >= 0 && ftruncate( fd, ( off_t )blocks * 512 ) ) {
+    close( fd );
+    return -1;
+  }
+  return fd;
+}
+
+/** Is a cluster taken by a lost chain? */
+static int taken( const fat_image *img, uint32_t c ) {
+  return c >= 3 && c < img->clusters &&
+         ( c < img->used + 3 || ( img->every && c % img->every == 0 ) );
+}
+
+static int put( int fd, const uint8_t *b, uint32_t block ) {
+  return pwrite( fd, b, 512, ( off_t )block * 512 ) == 512 ? 0 : -1;
+}
+
+int fat_image_format( int fd, fat_image *img ) {
+  static uint8_t b[ 512 ];
+  int err = 0;
+  img->fat = ( ( img->blocks / img->cluster ) * 4 + 511 ) / 512;
+  img->clusters = ( img->blocks - FAT_IMAGE_RESERVED - 2 * img->fat ) / img->cluster + 2;
+  img->fat_start = img->start + FAT_IMAGE_RESERVED;
+  img->root_start = img->fat_start + 2 * img->fat;
+  img->free = 0;
+  for ( uint32_t c = 3; c < img->clusters; ++c ) {
+    if ( !taken( img, c ) ) { ++img->free; }
+  }
+  boot_sector_fat32 *bs = ( boot_sector_fat32* )b;
+  memset( b, 0, sizeof( b ) );
+  memcpy( bs->jump, "\xEB\x58\x90", 3 );
+  memcpy( bs->name, "GRISTLE ", 8 );
+  bs->sector_size = 512;
+  bs->cluster_size = img->cluster;
+  bs->reserved_sectors = FAT_IMAGE_RESERVED;
+  bs->num_fats = 2;
+  bs->media_descriptor = 0xF8;
+  bs->big_total_sectors = img->blocks;
+  bs->sectors_per_fat = img->fat;
+  bs->root_start = 2;
+  bs->fs_info_start = 1;
+  bs->boot_copy = 6;
+  bs->boot_sig = 0x29;
+  memcpy( bs->volume_label, "TEST       ", 11 );
+  memcpy( bs->fs_label, "FAT32   ", 8 );
+  b[ 510 ] = 0x55;
+  b[ 511 ] = 0xAA;
+  err |= put( fd, b, img->start );
+  // The FSInfo sector knows how many clusters are free, and where the
+  // run of used ones ends.
+  uint32_t info[ 4 ] = { img->free, img->used + 2, 0, 0 };
+  memset( b, 0, sizeof( b ) );
+  memcpy( &b[ FS_INFO_SIG1 ], "RRaA", 4 );
+  memcpy( &b[ FS_INFO_SIG2 ], "rrAa", 4 );
+  memcpy( &b[ FREE_CLUSTERS ], info, sizeof( info ) );
+  memcpy( &b[ FS_INFO_SIG3 ], "\x00\x00\x55\xAA", 4 );
+  err |= put( fd, b, img->start + 1 );
+  // Clusters 0 and 1 are reserved, and the root directory is an
+  // empty chain of one cluster.
+  uint32_t *fat = ( uint32_t* )b;
+  for ( uint32_t s = 0; s < img->fat; ++s ) {
+    for ( uint32_t i = 0; i < 128; ++i ) {
+      uint32_t c = s * 128 + i;
+      fat[ i ] = ( c == 0 ) ? 0x0FFFFFF8 : ( c < 3 || taken( img, c ) ) ? 0x0FFFFFFF : 0;
+    }
+    err |= put( fd, b, img->fat_start + s );
+    err |= put( fd, b, img->fat_start + img->fat + s );
+  }
+  memset( b, 0, sizeof( b ) );
+  for ( uint32_t i = 0; i < img->cluster; ++i ) {
+    err |= put( fd, b, img->root_start + i );
+  }
+  if ( img->fill ) {
+    memset( b, img->fill, sizeof( b ) );
+    for ( uint32_t i = img->root_start + img->cluster; i < img->start + img->blocks; ++i ) {
+      err |= put( fd, b, i );
+    }
+  }
+  return err ? -1 : 0;
+}
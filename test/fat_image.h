@@ -0,0 +1,51 @@
+/*
+ * FAT32 volumes for the host-side Gristle tests and benchmarks.
+ *
+ * `fat_image_format` writes a volume into an image file: a boot
+ * sector, an FSInfo sector with the right free count, two FATs and
+ * an empty root directory of one cluster, with 32 reserved sectors.
+ * Clusters can be taken by lost chains before it is mounted, either
+ * a run from the start of the FAT or one every so many clusters, so
+ * that allocation has to go around them. The data area can be filled
+ * with junk, so that anything which relies on a new cluster being
+ * clear has to clear it.
+ */
+#ifndef __VVC_FAT_IMAGE
+#define __VVC_FAT_IMAGE
+
+#include <stdint.h>
+
+#define FAT_IMAGE_RESERVED ( 32 )
+
+typedef struct {
+  // The volume's first block in the image, and its size in blocks.
+  uint32_t start;
+  uint32_t blocks;
+  // Blocks per cluster.
+  uint32_t cluster;
+  // Clusters after the root directory's which are already taken.
+  uint32_t used;
+  // If set, every `every`th cluster is taken too.
+  uint32_t every;
+  // If set, the data area after the root directory is filled with
+  // this byte; otherwise it is left as it is in the image.
+  uint8_t  fill;
+  // Worked out by `fat_image_format`: sectors per FAT, one past the
+  // last cluster, the free clusters, and where the first FAT and
+  // the root directory start.
+  uint32_t fat;
+  uint32_t clusters;
+  uint32_t free;
+  uint32_t fat_start;
+  uint32_t root_start;
+} fat_image;
+
+// Create (or empty) an image file of `blocks` blocks. Returns its
+// descriptor, or -1.
+int fat_image_create( const char *path, uint32_t blocks );
+
+// Write the volume `img` describes into the image open as `fd`, and
+// fill in the rest of `img`. Returns 0, or -1 if a write failed.
+int fat_image_format( int fd, fat_image *img );
+
+#endif
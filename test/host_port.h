@@ -0,0 +1,24 @@
+/*
+ * Host-side overrides for the hooks in `port/` which would
+ * otherwise run Cortex-M instructions or read GPIO pins.
+ * The test Makefile force-includes this before every source file.
+ */
+#ifndef __VVC_HOST_PORT
+#define __VVC_HOST_PORT
+
+// Called with 'interrupts off': lets the register model react
+// to the registers that the driver has written so far.
+void host_irq_off( void );
+// Called in place of `WFI`: lets time pass and raises any
+// pending 'interrupt' by calling the driver's handler.
+void host_sleep( void );
+// Current level of the simulated `DAT0` line.
+int host_dat0_high( void );
+
+#define SDMMC_IRQ_OFF()   host_irq_off()
+#define SDMMC_IRQ_ON()
+#define SDMMC_SLEEP()     host_sleep()
+#define SDMMC_DAT0_HIGH() host_dat0_high()
+#define SD_SLEEP()        host_sleep()
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * Trap-based peripheral register model for host-side tests.
+ * See `regmodel.h` for an overview.
+ */
+#define _GNU_SOURCE
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "regmodel.h"
+
+#if !defined( __x86_64__ ) || !defined( __linux__ )
+#error "The register model only supports x86-64 Linux."
+#endif
+
+// x86 'trap flag', which raises SIGTRAP after one instruction.
+#define EFLAGS_TF     ( 0x100 )
+// Page fault error code bit for writes.
+#define PF_ERR_WRITE  ( 0x2 )
+#define MAX_REGIONS   ( 8 )
+
+typedef struct {
+  uint8_t      *base;
+  size_t        size;
+  regmodel_ops  ops;
+} regmodel_region;
+
+static regmodel_region regions[ MAX_REGIONS ];
+static int handlers_installed = 0;
+// The access which is being single-stepped.
+static regmodel_region *pending = NULL;
+static uint32_t pending_off = 0;
+static int pending_write = 0;
+
+uint64_t regmodel_accesses = 0;
+
+static regmodel_region *find_region( uintptr_t addr ) {
+  for ( int i = 0; i < MAX_REGIONS; ++i ) {
+    uintptr_t base = ( uintptr_t )regions[ i ].base;
+    if ( base && addr >= base && addr < base + regions[ i ].size ) {
+      return &regions[ i ];
+    }
+  }
+  return NULL;
+}
+
+static void on_segv( int sig, siginfo_t *si, void *uctx ) {
+  ucontext_t *uc = ( ucontext_t* )uctx;
+  regmodel_region *r = find_region( ( uintptr_t )si->si_addr );
+  if ( !r ) {
+    // A real crash; let it happen.
+    signal( sig, SIG_DFL );
+    return;
+  }
+  pending       = r;
+  pending_off   = ( ( uintptr_t )si->si_addr - ( uintptr_t )r->base ) &
+                  ~( uint32_t )3;
+  pending_write = ( uc->uc_mcontext.gregs[ REG_ERR ] & PF_ERR_WRITE ) != 0;
+  ++regmodel_accesses;
+  // Unlock the page before touching its backing memory.
+  mprotect( r->base, r->size, PROT_READ | PROT_WRITE );
+  uint32_t *word = ( uint32_t* )( r->base + pending_off );
+  if ( pending_write ) {
+    *word = r->ops.peek ? r->ops.peek( r->ops.ctx, pending_off ) :
+                          r->ops.read( r->ops.ctx, pending_off );
+  }
+  else {
+    *word = r->ops.read( r->ops.ctx, pending_off );
+  }
+  // Run the faulting instruction, then trap again.
+  uc->uc_mcontext.gregs[ REG_EFL ] |= EFLAGS_TF;
+}
+
+static void on_trap( int sig, siginfo_t *si, void *uctx ) {
+  ( void )sig;
+  ( void )si;
+  ucontext_t *uc = ( ucontext_t* )uctx;
+  uc->uc_mcontext.gregs[ REG_EFL ] &= ~EFLAGS_TF;
+  regmodel_region *r = pending;
+  if ( !r ) { return; }
+  pending = NULL;
+  if ( pending_write ) {
+    uint32_t value = *( uint32_t* )( r->base + pending_off );
+    r->ops.write( r->ops.ctx, pending_off, value );
+  }
+  mprotect( r->base, r->size, PROT_NONE );
+}
+
+void *regmodel_map( size_t size, const regmodel_ops *ops ) {
+  if ( !handlers_installed ) {
+    struct sigaction sa;
+    memset( &sa, 0, sizeof( sa ) );
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sa.sa_sigaction = on_segv;
+    sigaction( SIGSEGV, &sa, NULL );
+    sa.sa_sigaction = on_trap;
+    sigaction( SIGTRAP, &sa, NULL );
+    handlers_installed = 1;
+  }
+  size_t page = ( size_t )sysconf( _SC_PAGESIZE );
+  size = ( size + page - 1 ) & ~( page - 1 );
+  for ( int i = 0; i < MAX_REGIONS; ++i ) {
+    if ( !regions[ i ].base ) {
+      void *base = mmap( NULL, size, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+      if ( base == MAP_FAILED ) { return NULL; }
+      regions[ i ].base = ( uint8_t* )base;
+      regions[ i ].size = size;
+      regions[ i ].ops  = *ops;
+      return base;
+    }
+  }
+  return NULL;
+}
+
+void regmodel_unmap( void *regs ) {
+  regmodel_region *r = find_region( ( uintptr_t )regs );
+  if ( !r ) { return; }
+  munmap( r->base, r->size );
+  memset( r, 0, sizeof( *r ) );
+}
@@ -0,0 +1,46 @@
+/*
+ * Trap-based peripheral register model for host-side tests.
+ *
+ * `regmodel_map` returns a block of memory which stands in for a
+ * peripheral's registers. The memory is kept inaccessible, so every
+ * load or store from the driver faults; the fault handler calls the
+ * model's callbacks, then single-steps the faulting instruction
+ * with the page unlocked. That way, unmodified driver code sees
+ * registers with side-effects, like a FIFO which pops on read or
+ * an 'interrupt clear' register which clears status flags.
+ *
+ * This only works on x86-64 Linux, and only from one thread.
+ * Accesses are treated as aligned 32-bit words.
+ */
+#ifndef __VVC_REGMODEL
+#define __VVC_REGMODEL
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Called when the driver reads a register. This may have
+// side-effects, and it returns the value which the driver sees.
+typedef uint32_t ( *regmodel_read_fn )( void *ctx, uint32_t offset );
+// Called after the driver writes a value to a register.
+typedef void ( *regmodel_write_fn )( void *ctx,
+                                     uint32_t offset,
+                                     uint32_t value );
+// Called before a store, to get the register's current value
+// without side-effects. (Stores like `|=` may read it first.)
+typedef uint32_t ( *regmodel_peek_fn )( void *ctx, uint32_t offset );
+
+typedef struct {
+  regmodel_read_fn  read;
+  regmodel_write_fn write;
+  regmodel_peek_fn  peek;
+  void             *ctx;
+} regmodel_ops;
+
+// Map `size` bytes of modelled registers. Returns NULL on failure.
+void *regmodel_map( size_t size, const regmodel_ops *ops );
+// Unmap a block of registers returned by `regmodel_map`.
+void regmodel_unmap( void *regs );
+// Number of register accesses (loads and stores) trapped so far.
+extern uint64_t regmodel_accesses;
+
+#endif
@@ -0,0 +1,1109 @@
+/*
+ * Register-level simulator for the STM32L4 SDMMC peripheral and
+ * an SD card. See `sdmmc_sim.h` for an overview.
+ *
+ * Times are kept in picoseconds internally, so that bus clocks
+ * which do not divide evenly into nanoseconds stay accurate.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sdmmc_sim.h"
+#include "regmodel.h"
+
+// The simulator owns simulated time, so it also owns `tick`.
+volatile uint32_t tick = 0;
+
+#define PS_PER_NS       ( 1000ULL )
+#define PS_PER_MS       ( 1000000000ULL )
+#define NEVER           ( ~0ULL )
+#define FIFO_WORDS      ( 32 )
+// Identical `STA` reads in a row which count as a spin loop.
+#define SPIN_POLLS      ( 8 )
+#define REG( field )    ( offsetof( SDMMC_TypeDef, field ) / 4 )
+#define NUM_REGS        ( sizeof( SDMMC_TypeDef ) / 4 )
+// Blocks which the card's write cache can hold.
+#define CACHE_BLOCKS    ( 64 )
+// Performance enhancement extension register: function number, and
+// byte offsets in its page.
+#define PERF_FNO        ( 2 )
+#define PERF_CACHE_SUP  ( 4 )
+#define PERF_CACHE_EN   ( 260 )
+#define PERF_CACHE_FLSH ( 261 )
+
+// Card status bits, as returned in R1 responses.
+#define CS_OUT_OF_RANGE ( 0x80000000 )
+#define CS_ADDR_ERROR   ( 0x40000000 )
+#define CS_ILLEGAL_CMD  ( 0x00400000 )
+#define CS_READY        ( 0x00000100 )
+#define CS_APP_CMD      ( 0x00000020 )
+// OCR bits.
+#define OCR_DONE        ( 0x80000000 )
+#define OCR_CCS         ( 0x40000000 )
+#define OCR_VOLTAGES    ( 0x00FF8000 )
+
+// Response formats.
+enum { R_NONE, R1, R1B, R2, R3, R6, R7 };
+// Card data transfer directions.
+enum { XFER_NONE, XFER_READ, XFER_WRITE };
+
+static struct {
+  sdmmc_sim_config cfg;
+  sdmmc_sim_stats  stats;
+  sdmmc_sim_faults faults;
+  SDMMC_TypeDef   *regs;
+  int              fd;
+  uint32_t         blocks;
+  uint32_t         r[ NUM_REGS ];
+  // Latched status flags.
+  uint32_t         sta;
+  uint64_t         now;
+  // Command path: flags and response registers to set at `cmd_at`.
+  int              cmd_active;
+  uint64_t         cmd_at;
+  uint32_t         cmd_sta;
+  uint32_t         cmd_resp[ 4 ];
+  uint32_t         cmd_respcmd;
+  // Card state.
+  int              state;
+  uint16_t         rca;
+  int              app_cmd;
+  uint32_t         errors;
+  int              acmd41_seen;
+  uint64_t         ready_at;
+  int              ccs;
+  int              high_speed;
+  int              width;
+  uint32_t         erase_start;
+  uint32_t         erase_end;
+  uint32_t         block_count;
+  uint64_t         busy_until;
+  // Card data transfer in progress.
+  int              xfer;
+  int              multi;
+  uint32_t         addr;
+  uint32_t         blocks_left;
+  uint8_t          block[ 512 ];
+  uint32_t         block_len;
+  uint32_t         pos;
+  uint64_t         data_at;
+  int              stalled;
+  // Allocation unit which the card last wrote to.
+  uint32_t         write_au;
+  // Set for register transfers (SCR, CMD48 / CMD49), not blocks.
+  int              ext;
+  uint32_t         ext_arg;
+  // Extension register pages, and the write cache.
+  uint8_t          ext_info[ 512 ];
+  uint8_t          perf[ 512 ];
+  uint32_t         cache_addr[ CACHE_BLOCKS ];
+  uint8_t          cache_data[ CACHE_BLOCKS ][ 512 ];
+  int              cache_count;
+  // Data path state machine (DPSM) and FIFO.
+  int              dp_active;
+  int              dp_read;
+  uint32_t         dcount;
+  uint64_t         dp_deadline;
+  int              fifo_rx;
+  uint32_t         fifo[ FIFO_WORDS ];
+  int              head;
+  int              count;
+  // Spin detection: repeated reads of an unchanged `STA` register.
+  uint32_t         last_sta;
+  int              idle_polls;
+} sim;
+
+void sdmmc_sim_defaults( sdmmc_sim_config *cfg ) {
+  cfg->kernel_mhz       = 48;
+  cfg->access_ns        = 50;
+  cfg->cmd_ns           = 2000;
+  cfg->read_ns          = 100000;
+  cfg->program_ns       = 250000;
+  cfg->multi_program_ns = 50000;
+  cfg->erase_ns         = 2000000;
+  cfg->init_ns          = 20000000;
+  cfg->high_capacity    = 1;
+  cfg->ext_cache        = 0;
+  cfg->cache_program_ns = 20000;
+  cfg->speed_class      = 4;
+  cfg->au_size          = 9;
+  cfg->uhs_grade        = 1;
+  cfg->cmd20            = 1;
+  cfg->au_switch_ns     = 0;
+}
+
+/** Card clock period, from the `CLKCR` register. */
+static uint64_t clk_ps( void ) {
+  uint32_t clkcr = sim.r[ REG( CLKCR ) ];
+  uint64_t div = ( clkcr & SDMMC_CLKCR_BYPASS ) ? 1 :
+                 ( ( clkcr & SDMMC_CLKCR_CLKDIV ) + 2 );
+  return div * 1000000ULL / sim.cfg.kernel_mhz;
+}
+
+/** Time to move one FIFO word over the card's data bus. */
+static uint64_t word_ps( void ) {
+  // The peripheral and the card must agree on the bus width.
+  int widbus = ( sim.r[ REG( CLKCR ) ] & SDMMC_CLKCR_WIDBUS ) >>
+               SDMMC_CLKCR_WIDBUS_Pos;
+  int lines = ( widbus == 1 && sim.width == 4 ) ? 4 : 1;
+  return clk_ps() * ( 32 / lines );
+}
+
+static int hwfc( void ) {
+  return ( sim.r[ REG( CLKCR ) ] & SDMMC_CLKCR_HWFC_EN ) != 0;
+}
+
+/** Set the card's `DAT0` busy signal until a given time. */
+static void set_busy( uint64_t until ) {
+  uint64_t from = ( sim.busy_until > sim.now ) ? sim.busy_until : sim.now;
+  if ( until > from ) {
+    sim.stats.busy_ns += ( until - from ) / PS_PER_NS;
+    sim.busy_until = until;
+  }
+}
+
+/** Finish programming / erasing once the busy signal ends. */
+static void card_update( void ) {
+  if ( sim.now >= sim.busy_until ) {
+    if ( sim.state == SDMMC_STATE_PRG ) { sim.state = SDMMC_STATE_TRAN; }
+    else if ( sim.state == SDMMC_STATE_DIS ) { sim.state = SDMMC_STATE_STBY; }
+  }
+}
+
+static int cache_on( void ) { return sim.perf[ PERF_CACHE_EN ] & 0x01; }
+
+/**
+ * Extra programming time for a write to block `addr`, if it is in
+ * another allocation unit from the last write, as the card has to
+ * close that AU and open this one. Returns the time it takes.
+ */
+static uint64_t au_switch( uint32_t addr ) {
+  // AU size codes 1 to 9 are 16KB to 4MB; larger AUs count as 4MB.
+  uint32_t code = sim.cfg.au_size > 9 ? 9 : sim.cfg.au_size;
+  uint32_t au = code ? addr / ( 16u << code ) : 0;
+  if ( au == sim.write_au ) { return 0; }
+  sim.write_au = au;
+  ++sim.stats.au_switches;
+  return ( uint64_t )sim.cfg.au_switch_ns * PS_PER_NS;
+}
+
+/** Write the cache back to the image. Returns the time it takes. */
+static uint64_t cache_flush( void ) {
+  if ( sim.cache_count == 0 ) { return 0; }
+  for ( int i = 0; i < sim.cache_count; ++i ) {
+    pwrite( sim.fd, sim.cache_data[ i ], 512,
+            ( off_t )sim.cache_addr[ i ] * 512 );
+  }
+  // Writing a batch of blocks back is quicker than programming
+  // them one at a time; that is what the cache is for.
+  uint64_t ns = sim.cfg.program_ns +
+                ( uint64_t )sim.cache_count * sim.cfg.multi_program_ns;
+  sim.cache_count = 0;
+  ++sim.stats.cache_flushes;
+  return ns * PS_PER_NS;
+}
+
+/**
+ * Put a written block in the cache. If the cache is full, it is
+ * written back first; returns the time that takes.
+ */
+static uint64_t cache_store( void ) {
+  uint64_t ps = 0;
+  int i = 0;
+  while ( i < sim.cache_count && sim.cache_addr[ i ] != sim.addr ) { ++i; }
+  if ( i == CACHE_BLOCKS ) {
+    ps = cache_flush();
+    i = 0;
+  }
+  if ( i == sim.cache_count ) { ++sim.cache_count; }
+  sim.cache_addr[ i ] = sim.addr;
+  memcpy( sim.cache_data[ i ], sim.block, 512 );
+  return ps;
+}
+
+/** Drop cached blocks in a range, when they are erased. */
+static void cache_drop( uint32_t start, uint32_t end ) {
+  int kept = 0;
+  for ( int i = 0; i < sim.cache_count; ++i ) {
+    if ( sim.cache_addr[ i ] >= start && sim.cache_addr[ i ] <= end ) { continue; }
+    sim.cache_addr[ kept ] = sim.cache_addr[ i ];
+    memcpy( sim.cache_data[ kept ], sim.cache_data[ i ], 512 );
+    ++kept;
+  }
+  sim.cache_count = kept;
+}
+
+/** Load the next block of read data, from the cache or the image. */
+static int load_block( void ) {
+  if ( sim.addr >= sim.blocks ) {
+    sim.errors |= CS_OUT_OF_RANGE;
+    return -1;
+  }
+  int i = 0;
+  while ( i < sim.cache_count && sim.cache_addr[ i ] != sim.addr ) { ++i; }
+  if ( i < sim.cache_count ) { memcpy( sim.block, sim.cache_data[ i ], 512 ); }
+  else { pread( sim.fd, sim.block, 512, ( off_t )sim.addr * 512 ); }
+  sim.block_len = 512;
+  sim.pos = 0;
+  return 0;
+}
+
+/** Card status for R1 responses. Error bits are cleared once read. */
+static uint32_t card_status( void ) {
+  uint32_t status = sim.errors | ( ( uint32_t )sim.state << 9 );
+  if ( sim.state != SDMMC_STATE_PRG && sim.state != SDMMC_STATE_RCV ) {
+    status |= CS_READY;
+  }
+  if ( sim.app_cmd ) { status |= CS_APP_CMD; }
+  sim.errors = 0;
+  return status;
+}
+
+/** Set bits `hi:lo` of a 128-bit register, stored as RESP1..RESP4. */
+static void set_bits( uint32_t *w, int hi, int lo, uint32_t value ) {
+  for ( int b = lo; b <= hi; ++b, value >>= 1 ) {
+    uint32_t *word = &w[ 3 - b / 32 ];
+    if ( value & 1 ) { *word |= ( 1U << ( b % 32 ) ); }
+    else { *word &= ~( 1U << ( b % 32 ) ); }
+  }
+}
+
+static void make_cid( uint32_t *w ) {
+  memset( w, 0, 16 );
+  set_bits( w, 127, 120, 0x03 );
+  set_bits( w, 119, 104, ( 'S' << 8 ) | 'D' );
+  set_bits( w, 103, 96, 'S' );
+  set_bits( w, 95, 64, ( 'I' << 24 ) | ( 'M' << 16 ) | ( 'S' << 8 ) | 'D' );
+  set_bits( w, 63, 56, 0x10 );
+  set_bits( w, 55, 24, 0x12345678 );
+  set_bits( w, 19, 8, 0x13A );
+  set_bits( w, 0, 0, 1 );
+}
+
+static void make_csd( uint32_t *w ) {
+  memset( w, 0, 16 );
+  set_bits( w, 103, 96, sim.high_speed ? 0x5A : 0x32 );
+  set_bits( w, 95, 84, 0x5B5 );
+  set_bits( w, 83, 80, 9 );
+  set_bits( w, 46, 46, 1 );
+  set_bits( w, 45, 39, 0x7F );
+  set_bits( w, 25, 22, 9 );
+  set_bits( w, 0, 0, 1 );
+  if ( sim.cfg.high_capacity ) {
+    // CSD version 2.0: capacity = ( C_SIZE + 1 ) * 512KB.
+    set_bits( w, 127, 126, 1 );
+    set_bits( w, 119, 112, 0x0E );
+    set_bits( w, 69, 48, sim.blocks / 1024 - 1 );
+  }
+  else {
+    // CSD version 1.0: capacity = ( C_SIZE + 1 ) * 2^( MULT + 2 )
+    // blocks of 2^READ_BL_LEN bytes.
+    uint32_t mult = 0;
+    while ( mult < 7 && ( sim.blocks >> ( mult + 2 ) ) > 4096 ) { ++mult; }
+    set_bits( w, 119, 112, 0x26 );
+    set_bits( w, 73, 62, ( sim.blocks >> ( mult + 2 ) ) - 1 );
+    set_bits( w, 49, 47, mult );
+  }
+}
+
+/** Build the 64-byte CMD6 'switch function' status block. */
+static void make_switch_status( uint32_t arg ) {
+  memset( sim.block, 0, 64 );
+  // Bits 511:496 are the maximum current; 100mA.
+  sim.block[ 1 ] = 100;
+  // Function group 1 supports 'default' and 'high-speed'.
+  sim.block[ 13 ] = 0x03;
+  // Function which is (or would be) selected in group 1, in bits
+  // 379:376. 0xF means 'no change', or an unsupported function.
+  uint32_t fn = arg & 0xF;
+  if ( fn == 0xF ) { fn = sim.high_speed ? 1 : 0; }
+  if ( fn > 1 ) { fn = 0xF; }
+  sim.block[ 16 ] = ( uint8_t )fn;
+  // Data structure version 1.
+  sim.block[ 17 ] = 0x01;
+  if ( ( arg & 0x80000000 ) && fn == 1 ) { sim.high_speed = 1; }
+  sim.block_len = 64;
+  sim.pos = 0;
+}
+
+/** Build the 8-byte SD configuration register, MSB first. */
+static void make_scr( void ) {
+  memset( sim.block, 0, 8 );
+  // SCR version 1.0, SD spec 2.00 / 3.0x, 1-bit and 4-bit buses,
+  // CMD23, and usually CMD20.
+  sim.block[ 0 ] = 0x02;
+  sim.block[ 1 ] = 0x05;
+  sim.block[ 2 ] = 0x80;
+  sim.block[ 3 ] = SDMMC_SCR_CMD23;
+  if ( sim.cfg.cmd20 ) { sim.block[ 3 ] |= SDMMC_SCR_CMD20; }
+  if ( sim.cfg.ext_cache ) {
+    // SD_SPEC4, SD_SPECX = 2 (spec 6.00), and CMD48 / CMD49.
+    sim.block[ 2 ] |= 0x04;
+    sim.block[ 3 ] |= 0x80 | SDMMC_SCR_CMD48_49;
+  }
+  sim.block_len = 8;
+  sim.pos = 0;
+}
+
+/** Build the 64-byte SD Status register, MSB first. */
+static void make_sd_status( void ) {
+  memset( sim.block, 0, 64 );
+  // Current bus width, in bits 511:510.
+  sim.block[ 0 ] = ( sim.width == 4 ) ? 0x80 : 0x00;
+  sim.block[ 8 ] = ( uint8_t )sim.cfg.speed_class;
+  sim.block[ 10 ] = ( uint8_t )( sim.cfg.au_size << 4 );
+  sim.block[ 14 ] = ( uint8_t )( sim.cfg.uhs_grade << 4 );
+  sim.block_len = 64;
+  sim.pos = 0;
+}
+
+/**
+ * Build the extension register pages: the 'general information'
+ * page (function 0, page 0) lists two extensions, laid out as in
+ * SD 6.0: power management first, then performance enhancement,
+ * whose register is at the start of page 0 of function `PERF_FNO`.
+ * That register says that there is a cache.
+ */
+static void make_ext_pages( void ) {
+  memset( sim.ext_info, 0, sizeof( sim.ext_info ) );
+  memset( sim.perf, 0, sizeof( sim.perf ) );
+  // Revision 0, two 48 byte descriptors from byte 16.
+  sim.ext_info[ 2 ] = 16 + 2 * 48;
+  sim.ext_info[ 4 ] = 2;
+  // Each descriptor: function code, name, the next descriptor's
+  // address at byte 40, the number of registers at 42 and the first
+  // register's address at 44.
+  static const struct { uint8_t sfc; const char *name; uint32_t reg; } ext[ 2 ] = {
+    { 1, "Power Management", ( PERF_FNO + 1 ) << 18 },
+    { 2, "Performance Enhancement", PERF_FNO << 18 },
+  };
+  for ( int i = 0; i < 2; ++i ) {
+    uint8_t *d = &sim.ext_info[ 16 + i * 48 ];
+    d[ 0 ] = ext[ i ].sfc;
+    memcpy( &d[ 2 ], ext[ i ].name, strlen( ext[ i ].name ) );
+    d[ 40 ] = ( i == 0 ) ? 16 + 48 : 0;
+    d[ 42 ] = 1;
+    memcpy( &d[ 44 ], &ext[ i ].reg, 4 );
+  }
+  sim.perf[ PERF_CACHE_SUP ] = 0x01;
+}
+
+/** Load the block for a CMD48 read of an extension register page. */
+static void ext_read( uint32_t arg ) {
+  uint32_t fno = ( arg >> 27 ) & 0xF;
+  uint32_t page = ( arg >> 18 ) & 0xFF;
+  uint32_t off = ( arg >> 9 ) & 0x1FF;
+  uint32_t len = ( arg & 0x1FF ) + 1;
+  const uint8_t *src = NULL;
+  if ( fno == 0 && page == 0 ) { src = sim.ext_info; }
+  else if ( fno == PERF_FNO && page == 0 ) { src = sim.perf; }
+  memset( sim.block, 0, 512 );
+  if ( len > 512 - off ) { len = 512 - off; }
+  if ( src ) { memcpy( sim.block, &src[ off ], len ); }
+  sim.block_len = 512;
+  sim.pos = 0;
+}
+
+/**
+ * Apply a CMD49 write to an extension register. Only the cache
+ * 'enable' and 'flush' bytes do anything. Returns the busy time.
+ */
+static uint64_t ext_write( void ) {
+  uint32_t fno = ( sim.ext_arg >> 27 ) & 0xF;
+  uint32_t page = ( sim.ext_arg >> 18 ) & 0xFF;
+  uint32_t off = ( sim.ext_arg >> 9 ) & 0x1FF;
+  uint64_t ps = ( uint64_t )sim.cfg.cmd_ns * PS_PER_NS;
+  if ( fno != PERF_FNO || page != 0 ) { return ps; }
+  if ( off == PERF_CACHE_EN ) {
+    // Turning the cache off writes it back first.
+    if ( !( sim.block[ 0 ] & 0x01 ) ) { ps += cache_flush(); }
+    sim.perf[ PERF_CACHE_EN ] = sim.block[ 0 ] & 0x01;
+  }
+  else if ( off == PERF_CACHE_FLSH && ( sim.block[ 0 ] & 0x01 ) ) {
+    // The flush bit clears itself once the card is done, which is
+    // when it stops signalling busy.
+    ps += cache_flush();
+  }
+  return ps;
+}
+
+static int addressed( uint32_t arg ) {
+  return ( arg >> 16 ) == sim.rca && sim.rca != 0;
+}
+
+static uint32_t block_addr( uint32_t arg ) {
+  return sim.cfg.high_capacity ? arg : arg / 512;
+}
+
+/** Start a card data transfer after the command's response. */
+static void start_xfer( int dir, int multi, uint32_t addr ) {
+  sim.xfer  = dir;
+  sim.multi = multi;
+  sim.addr  = addr;
+  sim.blocks_left = multi ? sim.block_count : 1;
+  sim.block_count = 0;
+  sim.stalled = 0;
+  sim.ext = 0;
+  sim.pos = 0;
+  sim.block_len = 512;
+}
+
+/**
+ * Run one command through the card's state machine. Returns the
+ * response format, and fills in the response words.
+ */
+static int card_command( uint32_t idx, uint32_t arg, uint32_t *resp ) {
+  card_update();
+  int app = sim.app_cmd;
+  sim.app_cmd = 0;
+  ++sim.stats.cmds[ ( app ? 64 : 0 ) + ( idx & 63 ) ];
+  int st = sim.state;
+
+  if ( app && idx == SDMMC_APP_HCS_OPCOND ) {
+    if ( st != SDMMC_STATE_IDLE && st != SDMMC_STATE_READY ) { goto illegal; }
+    if ( !sim.acmd41_seen ) {
+      sim.acmd41_seen = 1;
+      sim.ready_at = sim.now + ( uint64_t )sim.cfg.init_ns * PS_PER_NS;
+    }
+    resp[ 0 ] = OCR_VOLTAGES;
+    // High-capacity cards never finish powering up for hosts
+    // which do not set the 'HCS' bit.
+    int hcs_ok = !sim.cfg.high_capacity || ( arg & OCR_CCS );
+    if ( sim.now >= sim.ready_at && hcs_ok ) {
+      sim.state = SDMMC_STATE_READY;
+      sim.ccs = sim.cfg.high_capacity;
+      resp[ 0 ] |= OCR_DONE | ( sim.ccs ? OCR_CCS : 0 );
+    }
+    return R3;
+  }
+  if ( app && idx == SDMMC_APP_SET_BUSW ) {
+    if ( st != SDMMC_STATE_TRAN ) { goto illegal; }
+    resp[ 0 ] = card_status() | CS_APP_CMD;
+    sim.width = ( ( arg & 3 ) == 2 ) ? 4 : 1;
+    return R1;
+  }
+  if ( app && idx == SDMMC_APP_GET_STAT ) {
+    if ( st != SDMMC_STATE_TRAN ) { goto illegal; }
+    resp[ 0 ] = card_status() | CS_APP_CMD;
+    start_xfer( XFER_READ, 0, 0 );
+    sim.ext = 1;
+    make_sd_status();
+    sim.state = SDMMC_STATE_DATA;
+    return R1;
+  }
+  if ( app && idx == SDMMC_APP_GET_SCR ) {
+    if ( st != SDMMC_STATE_TRAN ) { goto illegal; }
+    resp[ 0 ] = card_status() | CS_APP_CMD;
+    start_xfer( XFER_READ, 0, 0 );
+    sim.ext = 1;
+    make_scr();
+    sim.state = SDMMC_STATE_DATA;
+    return R1;
+  }
+
+  switch ( idx ) {
+    case SDMMC_CMD_GO_IDLE:
+      sim.state = SDMMC_STATE_IDLE;
+      sim.rca = 0;
+      sim.acmd41_seen = 0;
+      sim.width = 1;
+      sim.high_speed = 0;
+      sim.xfer = XFER_NONE;
+      sim.errors = 0;
+      // The cache is turned off, and anything still in it is lost.
+      sim.perf[ PERF_CACHE_EN ] = 0;
+      sim.cache_count = 0;
+      return R_NONE;
+    case SDMMC_CMD_IF_COND:
+      if ( st != SDMMC_STATE_IDLE || ( ( arg >> 8 ) & 0xF ) != 1 ) { goto illegal; }
+      resp[ 0 ] = arg & 0xFFF;
+      return R7;
+    case SDMMC_CMD_APP:
+      if ( !( st == SDMMC_STATE_IDLE || addressed( arg ) ) ) { goto illegal; }
+      sim.app_cmd = 1;
+      resp[ 0 ] = card_status();
+      return R1;
+    case SDMMC_CMD_PUB_CID:
+      if ( st != SDMMC_STATE_READY ) { goto illegal; }
+      make_cid( resp );
+      sim.state = SDMMC_STATE_IDENT;
+      return R2;
+    case SDMMC_CMD_PUB_RCA:
+      if ( st != SDMMC_STATE_IDENT && st != SDMMC_STATE_STBY ) { goto illegal; }
+      sim.rca = 0x59B4;
+      sim.state = SDMMC_STATE_STBY;
+      resp[ 0 ] = ( ( uint32_t )sim.rca << 16 ) | ( card_status() & 0x1FFF );
+      return R6;
+    case SDMMC_CMD_GET_CSD:
+    case SDMMC_CMD_GET_CID:
+      if ( st != SDMMC_STATE_STBY || !addressed( arg ) ) { goto illegal; }
+      if ( idx == SDMMC_CMD_GET_CSD ) { make_csd( resp ); }
+      else { make_cid( resp ); }
+      return R2;
+    case SDMMC_CMD_SEL_DESEL:
+      if ( addressed( arg ) ) {
+        if ( st == SDMMC_STATE_STBY ) { sim.state = SDMMC_STATE_TRAN; }
+        else if ( st == SDMMC_STATE_DIS ) { sim.state = SDMMC_STATE_PRG; }
+        else if ( st != SDMMC_STATE_TRAN ) { goto illegal; }
+        resp[ 0 ] = card_status();
+        return R1B;
+      }
+      // Not addressed: deselect, without a response.
+      if ( st == SDMMC_STATE_TRAN || st == SDMMC_STATE_DATA ) {
+        sim.state = SDMMC_STATE_STBY;
+        sim.xfer = XFER_NONE;
+      }
+      else if ( st == SDMMC_STATE_PRG ) { sim.state = SDMMC_STATE_DIS; }
+      return R_NONE;
+    case SDMMC_CMD_GET_STAT:
+      if ( !addressed( arg ) || st < SDMMC_STATE_STBY ) { goto silent; }
+      resp[ 0 ] = card_status();
+      return R1;
+    case SDMMC_CMD_SET_BLOCKLEN:
+      if ( st != SDMMC_STATE_TRAN ) { goto illegal; }
+      resp[ 0 ] = card_status();
+      return R1;
+    case SDMMC_CMD_SET_NUM_BLOCKS:
+      if ( st != SDMMC_STATE_TRAN ) { goto illegal; }
+      sim.block_count = arg;
+      resp[ 0 ] = card_status();
+      return R1;
+    case SDMMC_CMD_READ_BLOCK:
+    case SDMMC_CMD_READ_BLOCKS:
+      if ( st != SDMMC_STATE_TRAN ) { goto illegal; }
+      start_xfer( XFER_READ, idx == SDMMC_CMD_READ_BLOCKS, block_addr( arg ) );
+      if ( load_block() ) {
+        sim.xfer = XFER_NONE;
+        resp[ 0 ] = card_status();
+        return R1;
+      }
+      resp[ 0 ] = card_status();
+      sim.state = SDMMC_STATE_DATA;
+      return R1;
+    case SDMMC_CMD_WRITE_BLOCK:
+    case SDMMC_CMD_WRITE_BLOCKS:
+      if ( st != SDMMC_STATE_TRAN ) { goto illegal; }
+      if ( block_addr( arg ) >= sim.blocks ) {
+        sim.errors |= CS_OUT_OF_RANGE;
+        resp[ 0 ] = card_status();
+        return R1;
+      }
+      resp[ 0 ] = card_status();
+      start_xfer( XFER_WRITE, idx == SDMMC_CMD_WRITE_BLOCKS, block_addr( arg ) );
+      sim.state = SDMMC_STATE_RCV;
+      return R1;
+    case SDMMC_CMD_STOP_TRANS:
+      if ( st == SDMMC_STATE_DATA ) {
+        sim.state = SDMMC_STATE_TRAN;
+      }
+      else if ( st == SDMMC_STATE_RCV ) {
+        // A partly-received block is discarded.
+        sim.state = SDMMC_STATE_PRG;
+        set_busy( sim.now + ( uint64_t )sim.cfg.program_ns * PS_PER_NS );
+      }
+      else { goto illegal; }
+      sim.xfer = XFER_NONE;
+      resp[ 0 ] = card_status();
+      return R1B;
+    case SDMMC_CMD_SPEED_CLASS:
+      // Only 'Start Recording' is modelled; the card is ready for the
+      // recording once its short busy signal ends.
+      if ( st != SDMMC_STATE_TRAN || !sim.cfg.cmd20 ||
+           ( arg & 0xF0000000 ) != SDMMC_SCC_START_REC ) {
+        goto illegal;
+      }
+      resp[ 0 ] = card_status();
+      return R1B;
+    case SDMMC_CMD_ERASE_START:
+    case SDMMC_CMD_ERASE_END:
+      if ( st != SDMMC_STATE_TRAN ) { goto illegal; }
+      if ( idx == SDMMC_CMD_ERASE_START ) { sim.erase_start = block_addr( arg ); }
+      else { sim.erase_end = block_addr( arg ); }
+      resp[ 0 ] = card_status();
+      return R1;
+    case SDMMC_CMD_ERASE:
+      if ( st != SDMMC_STATE_TRAN ) { goto illegal; }
+      resp[ 0 ] = card_status();
+      if ( sim.erase_end >= sim.blocks || sim.erase_start > sim.erase_end ) {
+        sim.errors |= CS_OUT_OF_RANGE;
+        return R1B;
+      }
+      {
+        // Erased blocks read back as zeroes.
+        static const uint8_t zero[ 512 ];
+        for ( uint32_t b = sim.erase_start; b <= sim.erase_end; ++b ) {
+          pwrite( sim.fd, zero, 512, ( off_t )b * 512 );
+        }
+        cache_drop( sim.erase_start, sim.erase_end );
+      }
+      sim.state = SDMMC_STATE_PRG;
+      set_busy( sim.now + ( uint64_t )sim.cfg.erase_ns * PS_PER_NS );
+      return R1B;
+    case SDMMC_CMD_SWITCH:
+      if ( st != SDMMC_STATE_TRAN ) { goto illegal; }
+      resp[ 0 ] = card_status();
+      start_xfer( XFER_READ, 0, 0 );
+      sim.ext = 1;
+      make_switch_status( arg );
+      sim.state = SDMMC_STATE_DATA;
+      return R1;
+    case SDMMC_CMD_READ_EXTR:
+      if ( st != SDMMC_STATE_TRAN || !sim.cfg.ext_cache ) { goto illegal; }
+      resp[ 0 ] = card_status();
+      start_xfer( XFER_READ, 0, 0 );
+      sim.ext = 1;
+      ext_read( arg );
+      sim.state = SDMMC_STATE_DATA;
+      return R1;
+    case SDMMC_CMD_WRITE_EXTR:
+      if ( st != SDMMC_STATE_TRAN || !sim.cfg.ext_cache ) { goto illegal; }
+      resp[ 0 ] = card_status();
+      start_xfer( XFER_WRITE, 0, 0 );
+      sim.ext = 1;
+      sim.ext_arg = arg;
+      sim.state = SDMMC_STATE_RCV;
+      return R1;
+    default:
+      break;
+  }
+illegal:
+  sim.errors |= CS_ILLEGAL_CMD;
+silent:
+  return R_NONE;
+}
+
+/** Handle a write to the `CMD` register. */
+static void start_command( uint32_t cmd ) {
+  uint32_t idx = cmd & SDMMC_CMD_CMDINDEX;
+  uint32_t waitresp = ( cmd & SDMMC_CMD_WAITRESP ) >> SDMMC_CMD_WAITRESP_Pos;
+  uint32_t resp[ 4 ] = { 0, 0, 0, 0 };
+  // A hung card only notices CMD0; a lost command is not seen at all.
+  int lost = ( sim.faults.hung && idx != SDMMC_CMD_GO_IDLE );
+  if ( !lost && sim.faults.no_response ) {
+    --sim.faults.no_response;
+    lost = 1;
+  }
+  if ( idx == SDMMC_CMD_GO_IDLE ) { sim.faults.hung = 0; }
+  int fmt = lost ? R_NONE : card_command( idx, sim.r[ REG( ARG ) ], resp );
+  uint64_t clk = clk_ps();
+  // 48 bits to send the command.
+  uint64_t t = sim.now + 48 * clk;
+  sim.cmd_active = 1;
+  sim.cmd_resp[ 0 ] = resp[ 0 ];
+  sim.cmd_resp[ 1 ] = resp[ 1 ];
+  sim.cmd_resp[ 2 ] = resp[ 2 ];
+  sim.cmd_resp[ 3 ] = resp[ 3 ];
+  sim.cmd_respcmd = ( fmt == R2 || fmt == R3 ) ? 0x3F : idx;
+  if ( waitresp == 0 || waitresp == 2 ) {
+    sim.cmd_sta = SDMMC_STA_CMDSENT;
+  }
+  else if ( fmt == R_NONE ) {
+    // Nobody answered: the peripheral gives up after 64 clocks.
+    t += 64 * clk;
+    sim.cmd_sta = SDMMC_STA_CTIMEOUT;
+  }
+  else {
+    t += ( uint64_t )sim.cfg.cmd_ns * PS_PER_NS;
+    t += ( ( fmt == R2 ) ? 136 : 48 ) * clk;
+    // R3 responses have no CRC, which the peripheral reports.
+    sim.cmd_sta = ( fmt == R3 ) ? SDMMC_STA_CCRCFAIL : SDMMC_STA_CMDREND;
+    if ( sim.faults.cmd_crc && fmt != R3 ) {
+      --sim.faults.cmd_crc;
+      sim.cmd_sta = SDMMC_STA_CCRCFAIL;
+    }
+  }
+  sim.cmd_at = t;
+  if ( fmt == R1B ) { set_busy( t + 8 * clk ); }
+  // Data follows the response.
+  if ( sim.xfer == XFER_READ ) {
+    sim.data_at = t + ( uint64_t )sim.cfg.read_ns * PS_PER_NS;
+  }
+  else if ( sim.xfer == XFER_WRITE ) {
+    sim.data_at = t + 2 * clk;
+  }
+}
+
+/** Start or reset the data path when `DCTRL` is written. */
+static void write_dctrl( uint32_t value ) {
+  if ( !( value & SDMMC_DCTRL_DTEN ) ) {
+    sim.dp_active = 0;
+    return;
+  }
+  if ( sim.dp_active ) { return; }
+  sim.dp_active = 1;
+  sim.dp_read = ( value & SDMMC_DCTRL_DTDIR ) != 0;
+  sim.fifo_rx = sim.dp_read;
+  sim.dcount = sim.r[ REG( DLEN ) ] & SDMMC_DLEN_DATALENGTH;
+  sim.head = 0;
+  sim.count = 0;
+  sim.dp_deadline = sim.now + ( uint64_t )sim.r[ REG( DTIMER ) ] * clk_ps();
+  if ( sim.xfer == XFER_WRITE && sim.data_at < sim.now ) {
+    sim.data_at = sim.now;
+  }
+}
+
+static void data_error( uint32_t flag );
+
+/** The card sent a whole block: move on to the next one, or finish. */
+static void end_read_block( void ) {
+  uint64_t clk = clk_ps();
+  if ( !sim.ext ) { ++sim.stats.blocks_read; }
+  // 16 CRC bits and an end bit, then the next block's access time.
+  sim.data_at += 17 * clk + ( uint64_t )sim.cfg.read_ns * PS_PER_NS;
+  if ( sim.multi && sim.blocks_left != 1 ) {
+    if ( sim.blocks_left ) { --sim.blocks_left; }
+    ++sim.addr;
+    if ( load_block() == 0 ) { return; }
+  }
+  sim.xfer = XFER_NONE;
+  if ( sim.state == SDMMC_STATE_DATA ) { sim.state = SDMMC_STATE_TRAN; }
+}
+
+/**
+ * End of a card data block: move on to the next block, or finish.
+ * Returns non-zero if an injected CRC error stopped the data path.
+ */
+static int end_block( void ) {
+  uint64_t clk = clk_ps();
+  sim.sta |= SDMMC_STA_DBCKEND;
+  if ( sim.xfer == XFER_READ ) {
+    // The card carries on after a bad CRC; only the host notices.
+    int bad = ( !sim.ext && sim.faults.read_crc );
+    end_read_block();
+    if ( bad ) {
+      --sim.faults.read_crc;
+      data_error( SDMMC_STA_DCRCFAIL );
+    }
+    return bad;
+  }
+  // Write: report the block's CRC status, then store and program it.
+  uint64_t done = sim.data_at + 24 * clk;
+  sim.pos = 0;
+  if ( sim.ext ) {
+    sim.xfer = XFER_NONE;
+    sim.state = SDMMC_STATE_PRG;
+    set_busy( done + ext_write() );
+    return 0;
+  }
+  if ( sim.faults.write_crc ) {
+    // The block is thrown away. A multi-block write waits for CMD12.
+    --sim.faults.write_crc;
+    sim.sta |= SDMMC_STA_DCRCFAIL;
+    sim.dp_active = 0;
+    if ( !sim.multi ) {
+      sim.xfer = XFER_NONE;
+      sim.state = SDMMC_STATE_TRAN;
+    }
+    return 1;
+  }
+  // With the cache on, the block only goes to the cache, unless
+  // it has to make room.
+  if ( cache_on() ) { done += cache_store(); }
+  else {
+    pwrite( sim.fd, sim.block, 512, ( off_t )sim.addr * 512 );
+    done += au_switch( sim.addr );
+  }
+  ++sim.stats.blocks_written;
+  if ( sim.multi && sim.blocks_left != 1 ) {
+    if ( sim.blocks_left ) { --sim.blocks_left; }
+    ++sim.addr;
+    sim.data_at = done + ( uint64_t )sim.cfg.multi_program_ns * PS_PER_NS;
+    set_busy( sim.data_at );
+    return 0;
+  }
+  sim.xfer = XFER_NONE;
+  sim.state = SDMMC_STATE_PRG;
+  set_busy( done + ( uint64_t )( cache_on() ? sim.cfg.cache_program_ns :
+                                              sim.cfg.program_ns ) * PS_PER_NS );
+  return 0;
+}
+
+/** Stop the data path because of an error. */
+static void data_error( uint32_t flag ) {
+  sim.sta |= flag;
+  sim.dp_active = 0;
+  if ( flag & ( SDMMC_STA_RXOVERR | SDMMC_STA_TXUNDERR ) ) {
+    ++sim.stats.fifo_errors;
+  }
+  // The card finishes (or abandons) its block on its own.
+  if ( sim.xfer == XFER_WRITE ) {
+    sim.xfer = XFER_NONE;
+    sim.state = SDMMC_STATE_TRAN;
+  }
+}
+
+/** Time of the next data path event, or `NEVER`. */
+static uint64_t next_data_event( void ) {
+  if ( !sim.dp_active ) { return NEVER; }
+  int dir = sim.dp_read ? XFER_READ : XFER_WRITE;
+  if ( sim.xfer != dir ) { return sim.dp_deadline; }
+  if ( sim.stalled ) { return NEVER; }
+  return sim.data_at;
+}
+
+/** Move one word between the card and the FIFO. */
+static void data_word( void ) {
+  uint32_t word;
+  if ( sim.dp_read ) {
+    if ( sim.count == FIFO_WORDS ) {
+      // With flow control, the clock stops until there is room.
+      if ( hwfc() ) { sim.stalled = 1; return; }
+      data_error( SDMMC_STA_RXOVERR );
+      return;
+    }
+    memcpy( &word, &sim.block[ sim.pos ], 4 );
+    sim.fifo[ ( sim.head + sim.count ) % FIFO_WORDS ] = word;
+    ++sim.count;
+  }
+  else {
+    if ( sim.count == 0 ) {
+      // The data path waits for the first word before it sends the
+      // start bit. Only an empty FIFO mid-block is an underrun.
+      if ( hwfc() || sim.pos == 0 ) { sim.stalled = 1; return; }
+      data_error( SDMMC_STA_TXUNDERR );
+      return;
+    }
+    word = sim.fifo[ sim.head ];
+    sim.head = ( sim.head + 1 ) % FIFO_WORDS;
+    --sim.count;
+    memcpy( &sim.block[ sim.pos ], &word, 4 );
+  }
+  sim.pos += 4;
+  sim.dcount = ( sim.dcount > 4 ) ? sim.dcount - 4 : 0;
+  sim.data_at += word_ps();
+  sim.dp_deadline = sim.data_at +
+                    ( uint64_t )sim.r[ REG( DTIMER ) ] * clk_ps();
+  if ( sim.pos >= sim.block_len && end_block() ) { return; }
+  if ( sim.dcount == 0 ) {
+    sim.sta |= SDMMC_STA_DATAEND;
+    sim.dp_active = 0;
+  }
+}
+
+/** Let simulated time pass until `end`, processing events. */
+/**
+ * Move simulated time forward to `t`, counting how long the card
+ * clock ran: whenever the peripheral is on with `CLKEN` set, unless
+ * `PWRSAV` lets it stop while the bus is idle. (Or while hardware
+ * flow control holds it.)
+ */
+static void set_now( uint64_t t ) {
+  uint32_t clkcr = sim.r[ REG( CLKCR ) ];
+  int on = ( ( sim.r[ REG( POWER ) ] & SDMMC_POWER_PWRCTRL ) ==
+             SDMMC_POWER_PWRCTRL ) && ( clkcr & SDMMC_CLKCR_CLKEN );
+  if ( on && ( clkcr & SDMMC_CLKCR_PWRSAV ) ) {
+    on = sim.cmd_active || ( sim.dp_active && !sim.stalled );
+  }
+  if ( on ) { sim.stats.clock_ns += ( t - sim.now ) / PS_PER_NS; }
+  sim.now = t;
+}
+
+static void run_until( uint64_t end ) {
+  while ( 1 ) {
+    uint64_t t_cmd  = sim.cmd_active ? sim.cmd_at : NEVER;
+    uint64_t t_data = next_data_event();
+    uint64_t t = ( t_cmd < t_data ) ? t_cmd : t_data;
+    if ( t > end ) { break; }
+    if ( t > sim.now ) { set_now( t ); }
+    if ( t == t_cmd ) {
+      sim.cmd_active = 0;
+      sim.sta |= sim.cmd_sta;
+      sim.r[ REG( RESPCMD ) ] = sim.cmd_respcmd;
+      sim.r[ REG( RESP1 ) ] = sim.cmd_resp[ 0 ];
+      sim.r[ REG( RESP2 ) ] = sim.cmd_resp[ 1 ];
+      sim.r[ REG( RESP3 ) ] = sim.cmd_resp[ 2 ];
+      sim.r[ REG( RESP4 ) ] = sim.cmd_resp[ 3 ];
+    }
+    else {
+      int dir = sim.dp_read ? XFER_READ : XFER_WRITE;
+      if ( sim.xfer != dir ) { data_error( SDMMC_STA_DTIMEOUT ); }
+      else { data_word(); }
+    }
+  }
+  if ( end > sim.now ) { set_now( end ); }
+  card_update();
+  tick = ( uint32_t )( sim.now / PS_PER_MS );
+}
+
+/**
+ * Time of the next event which could change the status flags, the
+ * `DAT0` line or the driver's timeouts: whichever comes first out of
+ * the command path, the data path, the end of the busy signal, and
+ * the next SysTick interrupt.
+ */
+static uint64_t next_event( void ) {
+  uint64_t next = ( sim.now / PS_PER_MS + 1 ) * PS_PER_MS;
+  uint64_t t = sim.cmd_active ? sim.cmd_at : NEVER;
+  if ( t < next ) { next = t; }
+  t = next_data_event();
+  if ( t < next ) { next = t; }
+  if ( sim.busy_until > sim.now && sim.busy_until < next ) {
+    next = sim.busy_until;
+  }
+  return next;
+}
+
+static uint32_t status( void ) {
+  uint32_t sta = sim.sta;
+  if ( sim.cmd_active ) { sta |= SDMMC_STA_CMDACT; }
+  if ( sim.dp_active ) {
+    sta |= sim.dp_read ? SDMMC_STA_RXACT : SDMMC_STA_TXACT;
+  }
+  if ( sim.fifo_rx ) {
+    if ( sim.count > 0 ) { sta |= SDMMC_STA_RXDAVL; }
+    else { sta |= SDMMC_STA_RXFIFOE; }
+    if ( sim.count >= 8 ) { sta |= SDMMC_STA_RXFIFOHF; }
+    if ( sim.count == FIFO_WORDS ) { sta |= SDMMC_STA_RXFIFOF; }
+  }
+  else {
+    if ( sim.count > 0 ) { sta |= SDMMC_STA_TXDAVL; }
+    else { sta |= SDMMC_STA_TXFIFOE; }
+    if ( FIFO_WORDS - sim.count >= 8 ) { sta |= SDMMC_STA_TXFIFOHE; }
+    if ( sim.count == FIFO_WORDS ) { sta |= SDMMC_STA_TXFIFOF; }
+  }
+  return sta;
+}
+
+static uint32_t peek( void *ctx, uint32_t off ) {
+  ( void )ctx;
+  uint32_t reg = off / 4;
+  if ( reg == REG( STA ) ) { return status(); }
+  if ( reg == REG( DCOUNT ) ) { return sim.dcount; }
+  if ( reg == REG( FIFOCNT ) ) { return ( sim.dcount + 3 ) / 4; }
+  if ( reg < NUM_REGS ) { return sim.r[ reg ]; }
+  return 0;
+}
+
+static uint32_t reg_read( void *ctx, uint32_t off ) {
+  run_until( sim.now + ( uint64_t )sim.cfg.access_ns * PS_PER_NS );
+  if ( off / 4 == REG( FIFO ) ) {
+    if ( !sim.fifo_rx || sim.count == 0 ) { return 0; }
+    uint32_t word = sim.fifo[ sim.head ];
+    sim.head = ( sim.head + 1 ) % FIFO_WORDS;
+    --sim.count;
+    if ( sim.stalled ) {
+      sim.stalled = 0;
+      if ( sim.data_at < sim.now ) { sim.data_at = sim.now; }
+    }
+    return word;
+  }
+  if ( off / 4 == REG( STA ) ) {
+    // A driver which keeps reading the same status is spinning, and
+    // trapping every access is slow. Skip ahead to the next event,
+    // as if it had spun until then.
+    uint32_t sta = status();
+    if ( sta == sim.last_sta && ++sim.idle_polls >= SPIN_POLLS ) {
+      run_until( next_event() );
+      sim.idle_polls = 0;
+      sta = status();
+    }
+    else if ( sta != sim.last_sta ) { sim.idle_polls = 0; }
+    sim.last_sta = sta;
+    return sta;
+  }
+  return peek( ctx, off );
+}
+
+static void reg_write( void *ctx, uint32_t off, uint32_t value ) {
+  ( void )ctx;
+  sim.idle_polls = 0;
+  run_until( sim.now + ( uint64_t )sim.cfg.access_ns * PS_PER_NS );
+  uint32_t reg = off / 4;
+  if ( reg == REG( FIFO ) ) {
+    if ( !sim.fifo_rx && sim.count < FIFO_WORDS ) {
+      sim.fifo[ ( sim.head + sim.count ) % FIFO_WORDS ] = value;
+      ++sim.count;
+    }
+    if ( sim.stalled ) {
+      sim.stalled = 0;
+      if ( sim.data_at < sim.now ) { sim.data_at = sim.now; }
+    }
+    return;
+  }
+  if ( reg >= NUM_REGS ) { return; }
+  if ( reg == REG( ICR ) ) {
+    sim.sta &= ~value;
+    return;
+  }
+  if ( reg == REG( STA ) || reg == REG( DCOUNT ) ||
+       reg == REG( FIFOCNT ) || ( reg >= REG( RESPCMD ) &&
+                                  reg <= REG( RESP4 ) ) ) {
+    return;
+  }
+  sim.r[ reg ] = value;
+  if ( reg == REG( CMD ) && ( value & SDMMC_CMD_CPSMEN ) ) {
+    start_command( value );
+  }
+  else if ( reg == REG( DCTRL ) ) {
+    write_dctrl( value );
+  }
+}
+
+SDMMC_TypeDef *sdmmc_sim_open( const char *image,
+                               const sdmmc_sim_config *cfg ) {
+  struct stat st;
+  memset( &sim, 0, sizeof( sim ) );
+  sim.fd = open( image, O_RDWR );
+  if ( sim.fd < 0 || fstat( sim.fd, &st ) ) { return NULL; }
+  sim.blocks = ( uint32_t )( st.st_size / 512 );
+  sim.cfg = *cfg;
+  sim.state = SDMMC_STATE_IDLE;
+  sim.width = 1;
+  make_ext_pages();
+  regmodel_ops ops = { reg_read, reg_write, peek, NULL };
+  sim.regs = ( SDMMC_TypeDef* )regmodel_map( sizeof( SDMMC_TypeDef ), &ops );
+  tick = 0;
+  return sim.regs;
+}
+
+void sdmmc_sim_close( void ) {
+  if ( sim.regs ) { regmodel_unmap( sim.regs ); }
+  if ( sim.fd >= 0 ) { close( sim.fd ); }
+  sim.regs = NULL;
+  sim.fd = -1;
+}
+
+void sdmmc_sim_configure( const sdmmc_sim_config *cfg ) { sim.cfg = *cfg; }
+void sdmmc_sim_inject( const sdmmc_sim_faults *faults ) {
+  sim.faults = *faults;
+}
+uint64_t sdmmc_sim_now( void ) { return sim.now / PS_PER_NS; }
+void sdmmc_sim_advance( uint64_t ns ) {
+  uint64_t end = sim.now + ns * PS_PER_NS;
+  while ( 1 ) {
+    uint64_t t = next_event();
+    run_until( ( t < end ) ? t : end );
+    // The CPU takes the SDMMC interrupt as soon as it is raised, if
+    // the driver enabled it (which `SDMMC_WAIT_WFI` implies).
+    if ( sdmmc_xfer.wait_mode == SDMMC_WAIT_WFI &&
+         ( status() & sim.r[ REG( MASK ) ] ) ) {
+      sdmmc_irq_handler( sim.regs );
+    }
+    if ( sim.now >= end ) { break; }
+  }
+}
+int sdmmc_sim_card_state( void ) {
+  card_update();
+  return sim.state;
+}
+int sdmmc_sim_high_speed( void ) { return sim.high_speed; }
+int sdmmc_sim_bus_width( void ) { return sim.width; }
+const sdmmc_sim_stats *sdmmc_sim_get_stats( void ) { return &sim.stats; }
+void sdmmc_sim_reset_stats( void ) { memset( &sim.stats, 0, sizeof( sim.stats ) ); }
+
+// Stands in for the SysTick-based timer in `port/tim.c`.
+uint32_t timer_micros( void ) { return ( uint32_t )( sim.now / 1000000ULL ); }
+
+// Hooks from `host_port.h`.
+void host_irq_off( void ) {}
+
+void host_sleep( void ) {
+  run_until( next_event() );
+  if ( status() & sim.r[ REG( MASK ) ] ) { sdmmc_irq_handler( sim.regs ); }
+}
+
+int host_dat0_high( void ) { return sim.now >= sim.busy_until; }
@@ -0,0 +1,135 @@
+/*
+ * Register-level simulator for the STM32L4 SDMMC peripheral and
+ * an SD card, backed by a disk image file.
+ *
+ * The simulator maps a trapped block of `SDMMC_TypeDef` registers
+ * (see `regmodel.h`), so the unmodified drivers in `port/sdmmc.c`
+ * and `block_sd_foss.c` can run on a Linux host. It models the
+ * status flags, the 32-word FIFO with optional hardware flow control,
+ * the data path, the `DAT0` busy signal, and the card's state machine
+ * for the commands which the drivers use:
+ *   CMD0/2/3/6/7/8/9/10/12/13/16/17/18/20/23/24/25/32/33/38/48/49/55,
+ *   ACMD6/13/41/51.
+ * Cards with `ext_cache` set also model an SD 6.0 write cache: once
+ * it is enabled through the performance enhancement extension
+ * register, written blocks only reach the image when the cache is
+ * flushed, or when it fills up. Command and data CRC errors, lost
+ * responses and hung cards can be injected, to test error recovery.
+ *
+ * Time is simulated. Every register access costs `access_ns`, bus
+ * transfers run at the configured card clock, and the card's command,
+ * read and programming latencies are configurable. The simulator
+ * keeps the global `tick` in step with simulated time, and it also
+ * provides the `host_port.h` hooks: sleeping fast-forwards to the
+ * next event and raises the SDMMC 'interrupt' if it is unmasked.
+ * Polling loops which keep reading an unchanged `STA` register are
+ * fast-forwarded the same way, since trapping every access is slow.
+ */
+#ifndef __VVC_SDMMC_SIM
+#define __VVC_SDMMC_SIM
+
+#include <stdint.h>
+
+#include "port/sdmmc.h"
+
+// Latencies and other card / host parameters.
+typedef struct {
+  // SDMMC kernel clock; the card clock is this / ( CLKDIV + 2 ).
+  uint32_t kernel_mhz;
+  // Cost of one peripheral register access.
+  uint32_t access_ns;
+  // Card: time to start responding to a command.
+  uint32_t cmd_ns;
+  // Card: access time before each block of read data.
+  uint32_t read_ns;
+  // Card: busy time after a single-block write, or after the
+  // last block of a multi-block write.
+  uint32_t program_ns;
+  // Card: busy time between blocks of a multi-block write.
+  uint32_t multi_program_ns;
+  // Card: busy time for an erase command.
+  uint32_t erase_ns;
+  // Card: how long ACMD41 reports 'busy' after it is first sent.
+  uint32_t init_ns;
+  // Card: high-capacity (SDHC / SDXC) or standard-capacity.
+  int      high_capacity;
+  // Card: SD 6.0 with CMD48 / CMD49 and a write cache.
+  int      ext_cache;
+  // Card: busy time after a single-block write into the cache.
+  uint32_t cache_program_ns;
+  // Card: SD Status register fields, as coded there: the speed class
+  // (4 is class 10), the AU size (9 is 4MB), and the UHS grade.
+  uint32_t speed_class;
+  uint32_t au_size;
+  uint32_t uhs_grade;
+  // Card: supports CMD20 (Speed Class Control), as SDXC cards must.
+  int      cmd20;
+  // Card: extra busy time when a write goes to another allocation
+  // unit from the last write, for the card's garbage collection.
+  uint32_t au_switch_ns;
+} sdmmc_sim_config;
+
+// Simulator statistics.
+typedef struct {
+  // Commands received by the card, by index. ACMDs are counted
+  // at `64 + index`.
+  uint32_t cmds[ 128 ];
+  uint32_t blocks_read;
+  uint32_t blocks_written;
+  uint32_t fifo_errors;
+  // Write cache flushes, requested or because the cache was full.
+  uint32_t cache_flushes;
+  // Writes which went to another allocation unit from the last one.
+  uint32_t au_switches;
+  // Total time the card has spent signalling 'busy' on `DAT0`.
+  uint64_t busy_ns;
+  // Total time the card clock was running.
+  uint64_t clock_ns;
+} sdmmc_sim_stats;
+
+// Faults to inject, for testing error recovery. Each count is how
+// many more times the fault happens before the card behaves again.
+typedef struct {
+  // Command responses which arrive with a bad CRC. (The card still
+  // runs the command.)
+  uint32_t cmd_crc;
+  // Commands which the card does not answer at all.
+  uint32_t no_response;
+  // Data blocks read from the card which arrive with a bad CRC.
+  uint32_t read_crc;
+  // Data blocks written to the card which it rejects with a bad
+  // CRC status. The block is not written.
+  uint32_t write_crc;
+  // The card stops answering anything but CMD0 until it is reset.
+  int      hung;
+} sdmmc_sim_faults;
+
+// Default configuration: a reasonably quick SDHC card.
+void sdmmc_sim_defaults( sdmmc_sim_config *cfg );
+// Start the simulator over a disk image. The image size sets the
+// card's capacity. Returns the simulated registers, or NULL.
+SDMMC_TypeDef *sdmmc_sim_open( const char *image,
+                               const sdmmc_sim_config *cfg );
+// Stop the simulator and close the image. This is a power loss, so
+// blocks which are still in the card's write cache are lost.
+void sdmmc_sim_close( void );
+// Change the configuration while the simulator is running.
+void sdmmc_sim_configure( const sdmmc_sim_config *cfg );
+// Inject faults; this replaces any which have not happened yet.
+void sdmmc_sim_inject( const sdmmc_sim_faults *faults );
+// Simulated time since `sdmmc_sim_open`, in nanoseconds.
+uint64_t sdmmc_sim_now( void );
+// Let simulated time pass, as if the CPU did something else. In
+// `SDMMC_WAIT_WFI` mode, SDMMC interrupts are taken meanwhile.
+void sdmmc_sim_advance( uint64_t ns );
+// Current card state, as an `SDMMC_STATE_*` value.
+int sdmmc_sim_card_state( void );
+// Whether the card has been switched to high-speed mode with CMD6.
+int sdmmc_sim_high_speed( void );
+// Current card bus width in bits (1 or 4), as set by ACMD6.
+int sdmmc_sim_bus_width( void );
+// Simulator statistics; `sdmmc_sim_reset_stats` clears them.
+const sdmmc_sim_stats *sdmmc_sim_get_stats( void );
+void sdmmc_sim_reset_stats( void );
+
+#endif
@@ -0,0 +1,900 @@
+/*
+ * Register-level simulator for the STM32L4 SPI peripheral, its DMA
+ * channels, and an SD card in SPI mode. See `spi_sim.h` for an
+ * overview.
+ *
+ * Times are kept in picoseconds internally, like `sdmmc_sim.c`.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "spi_sim.h"
+#include "regmodel.h"
+
+// The simulator owns simulated time, so it also owns `tick`.
+volatile uint32_t tick = 0;
+
+#define PS_PER_NS       ( 1000ULL )
+#define PS_PER_MS       ( 1000000000ULL )
+#define NEVER           ( ~0ULL )
+// SPI FIFO depths, in bytes.
+#define FIFO_BYTES      ( 4 )
+// Identical status reads in a row which count as a spin loop.
+#define SPIN_POLLS      ( 8 )
+#define SPI_REG( field ) ( offsetof( SPI_TypeDef, field ) / 4 )
+#define SPI_REGS        ( sizeof( SPI_TypeDef ) / 4 )
+#define GPIO_REG( field ) ( offsetof( GPIO_TypeDef, field ) / 4 )
+#define GPIO_REGS       ( sizeof( GPIO_TypeDef ) / 4 )
+// DMA controller layout: `ISR`, `IFCR`, 7 channels of 5 words
+// from offset 0x08, and `CSELR` at offset 0xA8.
+#define DMA_CHANNELS    ( 7 )
+#define DMA_CH_OFF( n ) ( 0x08U + 0x14U * ( ( n ) - 1 ) )
+#define DMA_CSELR_OFF   ( 0xA8 )
+#define DMA_SIZE        ( 0xAC )
+// The channels and request number which serve SPI1.
+#define SPI_RX_CH       ( 2 )
+#define SPI_TX_CH       ( 3 )
+#define SPI_DMA_REQ     ( 1 )
+// Bus clock limits: identification, then 'default speed'.
+#define CLK_INIT_HZ     ( 400000 )
+#define CLK_MAX_HZ      ( 25000000 )
+
+// R1 response bits.
+#define R1_IDLE         ( 0x01 )
+#define R1_ILLEGAL_CMD  ( 0x04 )
+#define R1_CRC_ERROR    ( 0x08 )
+#define R1_ADDR_ERROR   ( 0x20 )
+#define R1_PARAM_ERROR  ( 0x40 )
+// Data tokens and responses.
+#define TOKEN_START     ( 0xFE )
+#define TOKEN_MULTI     ( 0xFC )
+#define TOKEN_STOP      ( 0xFD )
+#define TOKEN_ECC_FAIL  ( 0x04 )
+#define TOKEN_RANGE     ( 0x08 )
+#define DATA_ACCEPTED   ( 0x05 )
+#define DATA_CRC_ERROR  ( 0x0B )
+#define DATA_WR_ERROR   ( 0x0D )
+// OCR bits.
+#define OCR_DONE        ( 0x80000000 )
+#define OCR_CCS         ( 0x40000000 )
+#define OCR_VOLTAGES    ( 0x00FF8000 )
+
+// States of a write transfer, from the card's side.
+enum { WR_NONE, WR_TOKEN, WR_DATA };
+
+typedef struct {
+  uint32_t ccr;
+  uint32_t cndtr;
+  uint32_t cpar;
+  uint32_t cmar;
+  // Bytes moved since the channel was enabled.
+  uint32_t pos;
+} dma_channel;
+
+static struct {
+  spi_sim_config cfg;
+  spi_sim_stats  stats;
+  spi_sim_faults faults;
+  SPI_TypeDef   *spi;
+  DMA_TypeDef   *dma;
+  GPIO_TypeDef  *gpio;
+  int            fd;
+  uint32_t       blocks;
+  uint64_t       now;
+  // SPI peripheral: registers, FIFOs, and the byte being shifted.
+  uint32_t       r[ SPI_REGS ];
+  uint32_t       ovr;
+  int            dr_read;
+  uint8_t        txf[ FIFO_BYTES ];
+  int            tx_count;
+  uint8_t        rxf[ FIFO_BYTES ];
+  int            rx_count;
+  int            shifting;
+  uint8_t        shift_byte;
+  uint64_t       shift_end;
+  // DMA controller.
+  uint32_t       isr;
+  uint32_t       cselr;
+  dma_channel    ch[ DMA_CHANNELS + 1 ];
+  // GPIO port with the chip select pin.
+  uint32_t       g[ GPIO_REGS ];
+  // Card state.
+  int            spi_mode;
+  int            idle;
+  int            app_cmd;
+  int            acmd41_seen;
+  uint64_t       ready_at;
+  int            ccs;
+  uint32_t       init_clocks;
+  uint64_t       busy_until;
+  // Command being received.
+  uint8_t        cmd[ 6 ];
+  int            cmd_len;
+  // Response bytes, and when the first one is ready.
+  uint8_t        resp[ 8 ];
+  int            resp_len;
+  int            resp_pos;
+  uint64_t       resp_at;
+  // Data packet being sent (token, data, CRC), and when it starts.
+  uint8_t        data[ 3 + 512 ];
+  int            data_len;
+  int            data_pos;
+  uint64_t       data_at;
+  // Multi-block read in progress, and the next block to send.
+  int            reading;
+  uint32_t       rd_addr;
+  // Write in progress: state, next block, and the data packet.
+  int            wr_state;
+  int            wr_multi;
+  uint32_t       wr_addr;
+  uint8_t        wr_buf[ 512 + 2 ];
+  int            wr_pos;
+  // Spin detection: repeated reads of an unchanged status register.
+  uint32_t       last_status;
+  int            idle_polls;
+} sim;
+
+void spi_sim_defaults( spi_sim_config *cfg ) {
+  cfg->pclk_mhz         = 80;
+  cfg->access_ns        = 50;
+  cfg->cs_pin           = 4;
+  cfg->cmd_ns           = 1000;
+  cfg->read_ns          = 100000;
+  cfg->program_ns       = 250000;
+  cfg->multi_program_ns = 50000;
+  cfg->init_ns          = 20000000;
+  cfg->high_capacity    = 1;
+  cfg->version1         = 0;
+  cfg->speed_class      = 4;
+  cfg->au_size          = 9;
+  cfg->uhs_grade        = 1;
+}
+
+/** SPI clock period, from the `BR` field of `CR1`. */
+static uint64_t clk_ps( void ) {
+  uint32_t br = ( sim.r[ SPI_REG( CR1 ) ] & SPI_CR1_BR ) >> SPI_CR1_BR_Pos;
+  return ( 1000000ULL / sim.cfg.pclk_mhz ) << ( br + 1 );
+}
+
+uint32_t spi_sim_clock_hz( void ) {
+  uint32_t br = ( sim.r[ SPI_REG( CR1 ) ] & SPI_CR1_BR ) >> SPI_CR1_BR_Pos;
+  return ( sim.cfg.pclk_mhz * 1000000 ) >> ( br + 1 );
+}
+
+static uint64_t byte_ps( void ) { return 8 * clk_ps(); }
+
+/** Whether chip select is driven low. */
+static int selected( void ) {
+  return !( sim.g[ GPIO_REG( ODR ) ] & ( 1U << sim.cfg.cs_pin ) );
+}
+
+/**
+ * Whether the card can make sense of the bus: SD cards use SPI
+ * mode 0 (or 3), and only run at up to 400KHz until initialized.
+ */
+static int bus_ok( void ) {
+  uint32_t cr1 = sim.r[ SPI_REG( CR1 ) ];
+  if ( !( cr1 & SPI_CR1_CPOL ) != !( cr1 & SPI_CR1_CPHA ) ) { return 0; }
+  uint32_t hz = spi_sim_clock_hz();
+  return hz <= ( sim.idle ? CLK_INIT_HZ : CLK_MAX_HZ );
+}
+
+/** CRC7 over a command frame, in the top 7 bits, with the end bit. */
+static uint8_t crc7( const uint8_t *p, int len ) {
+  uint8_t crc = 0;
+  for ( int i = 0; i < len; ++i ) {
+    for ( int b = 7; b >= 0; --b ) {
+      int in = ( ( p[ i ] >> b ) & 1 ) ^ ( crc >> 7 );
+      crc = ( uint8_t )( crc << 1 );
+      if ( in ) { crc ^= 0x12; }
+    }
+  }
+  return crc | 0x01;
+}
+
+/** CRC16-CCITT over a data block. */
+static uint16_t crc16( const uint8_t *p, int len ) {
+  uint16_t crc = 0;
+  for ( int i = 0; i < len; ++i ) {
+    crc ^= ( uint16_t )( p[ i ] << 8 );
+    for ( int b = 0; b < 8; ++b ) {
+      crc = ( crc & 0x8000 ) ? ( uint16_t )( ( crc << 1 ) ^ 0x1021 ) :
+                               ( uint16_t )( crc << 1 );
+    }
+  }
+  return crc;
+}
+
+/** Set bits `hi:lo` of a 128-bit register, stored big-endian. */
+static void set_bits( uint8_t *r, int hi, int lo, uint32_t value ) {
+  for ( int b = lo; b <= hi; ++b, value >>= 1 ) {
+    uint8_t *byte = &r[ 15 - b / 8 ];
+    if ( value & 1 ) { *byte |= ( uint8_t )( 1U << ( b % 8 ) ); }
+    else { *byte &= ( uint8_t )~( 1U << ( b % 8 ) ); }
+  }
+}
+
+static void make_cid( uint8_t *r ) {
+  memset( r, 0, 16 );
+  set_bits( r, 127, 120, 0x03 );
+  set_bits( r, 119, 104, ( 'S' << 8 ) | 'D' );
+  set_bits( r, 103, 96, 'S' );
+  set_bits( r, 95, 64, ( 'I' << 24 ) | ( 'M' << 16 ) | ( 'S' << 8 ) | 'P' );
+  set_bits( r, 63, 56, 0x10 );
+  set_bits( r, 55, 24, 0x87654321 );
+  set_bits( r, 19, 8, 0x13A );
+  set_bits( r, 0, 0, 1 );
+}
+
+static void make_csd( uint8_t *r ) {
+  memset( r, 0, 16 );
+  set_bits( r, 103, 96, 0x32 );
+  set_bits( r, 95, 84, 0x5B5 );
+  set_bits( r, 83, 80, 9 );
+  set_bits( r, 46, 46, 1 );
+  set_bits( r, 45, 39, 0x7F );
+  set_bits( r, 25, 22, 9 );
+  set_bits( r, 0, 0, 1 );
+  if ( sim.cfg.high_capacity ) {
+    // CSD version 2.0: capacity = ( C_SIZE + 1 ) * 512KB.
+    set_bits( r, 127, 126, 1 );
+    set_bits( r, 119, 112, 0x0E );
+    set_bits( r, 69, 48, sim.blocks / 1024 - 1 );
+  }
+  else {
+    // CSD version 1.0: capacity = ( C_SIZE + 1 ) * 2^( MULT + 2 )
+    // blocks of 2^READ_BL_LEN bytes.
+    uint32_t mult = 0;
+    while ( mult < 7 && ( sim.blocks >> ( mult + 2 ) ) > 4096 ) { ++mult; }
+    set_bits( r, 119, 112, 0x26 );
+    set_bits( r, 73, 62, ( sim.blocks >> ( mult + 2 ) ) - 1 );
+    set_bits( r, 49, 47, mult );
+  }
+}
+
+/** Queue a response, to start after the card's command latency. */
+static void respond( const uint8_t *bytes, int len ) {
+  memcpy( sim.resp, bytes, len );
+  sim.resp_len = len;
+  sim.resp_pos = 0;
+  // Ncr: the response starts within 1 to 8 bytes.
+  uint64_t ncr = ( uint64_t )sim.cfg.cmd_ns * PS_PER_NS;
+  if ( ncr > 7 * byte_ps() ) { ncr = 7 * byte_ps(); }
+  sim.resp_at = sim.now + ncr;
+}
+
+static void respond_r1( uint8_t r1 ) { respond( &r1, 1 ); }
+
+/** Queue a data packet: start token, `len` bytes, and their CRC. */
+static void send_data( const uint8_t *bytes, int len, uint64_t at ) {
+  sim.data[ 0 ] = TOKEN_START;
+  memcpy( &sim.data[ 1 ], bytes, len );
+  uint16_t crc = crc16( bytes, len );
+  sim.data[ 1 + len ] = ( uint8_t )( crc >> 8 );
+  sim.data[ 2 + len ] = ( uint8_t )crc;
+  sim.data_len = len + 3;
+  sim.data_pos = 0;
+  sim.data_at = at;
+}
+
+/** Queue the next block of a read, or an error token. */
+static void send_block( uint64_t at ) {
+  uint8_t block[ 512 ];
+  if ( sim.rd_addr >= sim.blocks || sim.faults.read_error ) {
+    if ( sim.rd_addr < sim.blocks ) { --sim.faults.read_error; }
+    sim.data[ 0 ] = ( sim.rd_addr >= sim.blocks ) ? TOKEN_RANGE : TOKEN_ECC_FAIL;
+    sim.data_len = 1;
+    sim.data_pos = 0;
+    sim.data_at = at;
+    sim.reading = 0;
+    return;
+  }
+  pread( sim.fd, block, 512, ( off_t )sim.rd_addr * 512 );
+  send_data( block, 512, at );
+  ++sim.rd_addr;
+  ++sim.stats.blocks_read;
+}
+
+/** Block number from a data command's address argument. */
+static int block_addr( uint32_t arg, uint32_t *addr ) {
+  if ( sim.ccs ) {
+    *addr = arg;
+    return 0;
+  }
+  *addr = arg / 512;
+  return ( arg % 512 ) ? -1 : 0;
+}
+
+/** Run one complete command frame through the card. */
+static void card_command( void ) {
+  uint32_t idx = sim.cmd[ 0 ] & 0x3F;
+  uint32_t arg = ( ( uint32_t )sim.cmd[ 1 ] << 24 ) |
+                 ( ( uint32_t )sim.cmd[ 2 ] << 16 ) |
+                 ( ( uint32_t )sim.cmd[ 3 ] << 8 ) | sim.cmd[ 4 ];
+  int crc_ok = crc7( sim.cmd, 5 ) == sim.cmd[ 5 ];
+
+  if ( !sim.spi_mode ) {
+    // Only CMD0 with chip select low (and a valid CRC, since the
+    // card starts in SD mode) switches it to SPI mode, and only
+    // once it has seen its 74 power-up clock cycles.
+    if ( idx != 0 || !crc_ok || sim.init_clocks < 10 ) { return; }
+    sim.spi_mode = 1;
+  }
+  if ( sim.now < sim.busy_until && idx != 0 ) {
+    ++sim.stats.busy_cmds;
+    return;
+  }
+  int app = sim.app_cmd;
+  sim.app_cmd = 0;
+  ++sim.stats.cmds[ ( app ? 64 : 0 ) + idx ];
+  uint8_t r1 = sim.idle ? R1_IDLE : 0;
+  if ( ( idx == 0 || idx == 8 ) && !crc_ok ) {
+    respond_r1( r1 | R1_CRC_ERROR );
+    return;
+  }
+  // In the idle state, the card only knows how to initialize.
+  if ( sim.idle && idx != 0 && idx != 8 && idx != 55 && idx != 58 &&
+       idx != 59 && !( app && idx == 41 ) ) {
+    respond_r1( r1 | R1_ILLEGAL_CMD );
+    return;
+  }
+
+  uint8_t r[ 16 ];
+  uint32_t addr;
+  switch ( app ? 64 + idx : idx ) {
+  case 0:
+    sim.idle = 1;
+    sim.acmd41_seen = 0;
+    sim.ccs = 0;
+    sim.reading = 0;
+    sim.wr_state = WR_NONE;
+    sim.data_len = 0;
+    sim.busy_until = 0;
+    respond_r1( R1_IDLE );
+    break;
+  case 8:
+    if ( sim.cfg.version1 ) {
+      respond_r1( r1 | R1_ILLEGAL_CMD );
+      break;
+    }
+    r[ 0 ] = r1;
+    r[ 1 ] = 0;
+    r[ 2 ] = 0;
+    r[ 3 ] = ( ( arg >> 8 ) & 0xF ) == 0x1 ? 0x1 : 0x0;
+    r[ 4 ] = arg & 0xFF;
+    respond( r, 5 );
+    break;
+  case 9:
+  case 10:
+    respond_r1( r1 );
+    if ( idx == 9 ) { make_csd( r ); }
+    else { make_cid( r ); }
+    send_data( r, 16, sim.resp_at + byte_ps() );
+    break;
+  case 12:
+    // Stop a multi-block read. The data stops after the command,
+    // one 'stuff' byte is discarded, then the card responds, and it
+    // may be busy for a moment.
+    sim.reading = 0;
+    sim.data_len = 0;
+    respond_r1( r1 );
+    sim.resp_at += byte_ps();
+    sim.busy_until = sim.resp_at + 2 * byte_ps();
+    break;
+  case 13:
+    r[ 0 ] = r1;
+    r[ 1 ] = 0;
+    respond( r, 2 );
+    break;
+  case 16:
+    respond_r1( r1 | ( ( !sim.ccs && arg != 512 ) ? R1_PARAM_ERROR : 0 ) );
+    break;
+  case 17:
+  case 18:
+  case 24:
+  case 25:
+    if ( block_addr( arg, &addr ) ) {
+      respond_r1( r1 | R1_ADDR_ERROR );
+      break;
+    }
+    if ( addr >= sim.blocks ) {
+      respond_r1( r1 | R1_PARAM_ERROR );
+      break;
+    }
+    respond_r1( r1 );
+    if ( idx == 17 || idx == 18 ) {
+      sim.rd_addr = addr;
+      sim.reading = ( idx == 18 );
+      send_block( sim.resp_at + ( uint64_t )sim.cfg.read_ns * PS_PER_NS );
+    }
+    else {
+      sim.wr_state = WR_TOKEN;
+      sim.wr_multi = ( idx == 25 );
+      sim.wr_addr = addr;
+    }
+    break;
+  case 55:
+    sim.app_cmd = 1;
+    respond_r1( r1 );
+    break;
+  case 58:
+    r[ 0 ] = r1;
+    addr = OCR_VOLTAGES | ( sim.idle ? 0 : OCR_DONE ) |
+           ( sim.ccs ? OCR_CCS : 0 );
+    r[ 1 ] = ( uint8_t )( addr >> 24 );
+    r[ 2 ] = ( uint8_t )( addr >> 16 );
+    r[ 3 ] = ( uint8_t )( addr >> 8 );
+    r[ 4 ] = ( uint8_t )addr;
+    respond( r, 5 );
+    break;
+  case 59:
+    respond_r1( r1 );
+    break;
+  case 64 + 13:
+    // R2: R1, then a second status byte. The SD Status register
+    // follows as a 64-byte data block.
+    r[ 0 ] = r1;
+    r[ 1 ] = 0;
+    respond( r, 2 );
+    {
+      uint8_t status[ 64 ];
+      memset( status, 0, sizeof( status ) );
+      status[ 8 ] = ( uint8_t )sim.cfg.speed_class;
+      status[ 10 ] = ( uint8_t )( sim.cfg.au_size << 4 );
+      status[ 14 ] = ( uint8_t )( sim.cfg.uhs_grade << 4 );
+      send_data( status, 64, sim.resp_at + 2 * byte_ps() );
+    }
+    break;
+  case 64 + 23:
+    respond_r1( r1 );
+    break;
+  case 64 + 41:
+    if ( !sim.acmd41_seen ) {
+      sim.acmd41_seen = 1;
+      sim.ready_at = sim.now + ( uint64_t )sim.cfg.init_ns * PS_PER_NS;
+    }
+    // A high-capacity card never finishes initializing for a host
+    // which does not say that it supports high capacity.
+    if ( sim.now >= sim.ready_at &&
+         ( !sim.cfg.high_capacity || ( arg & OCR_CCS ) ) ) {
+      sim.idle = 0;
+      sim.ccs = sim.cfg.high_capacity;
+    }
+    respond_r1( sim.idle ? R1_IDLE : 0 );
+    break;
+  default:
+    respond_r1( r1 | R1_ILLEGAL_CMD );
+    break;
+  }
+}
+
+/** A complete block of write data has arrived. */
+static void card_write_block( void ) {
+  uint8_t status;
+  uint64_t busy;
+  if ( sim.faults.write_reject ) {
+    --sim.faults.write_reject;
+    status = DATA_CRC_ERROR;
+    busy = 0;
+  }
+  else if ( sim.wr_addr >= sim.blocks ) {
+    status = DATA_WR_ERROR;
+    busy = 0;
+  }
+  else {
+    pwrite( sim.fd, sim.wr_buf, 512, ( off_t )sim.wr_addr * 512 );
+    ++sim.wr_addr;
+    ++sim.stats.blocks_written;
+    status = DATA_ACCEPTED;
+    busy = ( uint64_t )( sim.wr_multi ? sim.cfg.multi_program_ns :
+                                        sim.cfg.program_ns ) * PS_PER_NS;
+  }
+  // The data response comes right away, then the busy signal.
+  sim.resp[ 0 ] = status;
+  sim.resp_len = 1;
+  sim.resp_pos = 0;
+  sim.resp_at = sim.now;
+  sim.busy_until = sim.now + byte_ps() + busy;
+  sim.wr_state = sim.wr_multi ? WR_TOKEN : WR_NONE;
+}
+
+/**
+ * Exchange one byte with the card: it receives `in` on MOSI, and
+ * returns what the card drives on MISO meanwhile.
+ */
+static uint8_t card_byte( uint8_t in ) {
+  if ( !selected() ) {
+    // Power-up clocks are sent with chip select high.
+    if ( !sim.spi_mode ) { ++sim.init_clocks; }
+    return 0xFF;
+  }
+  // Output side: a response, then any data packet, then 'busy'.
+  uint8_t out = 0xFF;
+  if ( sim.resp_pos < sim.resp_len ) {
+    if ( sim.now >= sim.resp_at ) { out = sim.resp[ sim.resp_pos++ ]; }
+  }
+  else if ( sim.data_pos < sim.data_len ) {
+    if ( sim.now >= sim.data_at ) {
+      out = sim.data[ sim.data_pos++ ];
+      if ( sim.data_pos == sim.data_len && sim.reading ) {
+        send_block( sim.now + ( uint64_t )sim.cfg.read_ns * PS_PER_NS );
+      }
+    }
+  }
+  else if ( sim.now < sim.busy_until ) { out = 0x00; }
+
+  // Input side: write data, a data token, or a command.
+  if ( sim.wr_state == WR_DATA ) {
+    sim.wr_buf[ sim.wr_pos++ ] = in;
+    if ( sim.wr_pos == sizeof( sim.wr_buf ) ) { card_write_block(); }
+    return out;
+  }
+  if ( sim.wr_state == WR_TOKEN && sim.now >= sim.busy_until &&
+       sim.resp_pos == sim.resp_len ) {
+    if ( in == ( sim.wr_multi ? TOKEN_MULTI : TOKEN_START ) ) {
+      sim.wr_state = WR_DATA;
+      sim.wr_pos = 0;
+      return out;
+    }
+    if ( in == TOKEN_STOP && sim.wr_multi ) {
+      // The card goes busy one byte after the stop token.
+      sim.wr_state = WR_NONE;
+      sim.busy_until = sim.now + byte_ps() +
+                       ( uint64_t )sim.cfg.program_ns * PS_PER_NS;
+      return out;
+    }
+  }
+  if ( sim.cmd_len == 0 && ( in & 0xC0 ) != 0x40 ) { return out; }
+  sim.cmd[ sim.cmd_len++ ] = in;
+  if ( sim.cmd_len == 6 ) {
+    sim.cmd_len = 0;
+    card_command();
+  }
+  return out;
+}
+
+/** Whether a channel is enabled and routed to SPI1, with work left. */
+static int dma_ready( int n ) {
+  dma_channel *c = &sim.ch[ n ];
+  return ( c->ccr & DMA_CCR_EN ) && c->cndtr > 0 &&
+         ( ( sim.cselr >> ( 4 * ( n - 1 ) ) ) & 0xF ) == SPI_DMA_REQ;
+}
+
+/** Check a channel's setup when it is enabled; a bad one fails. */
+static void dma_check( int n ) {
+  dma_channel *c = &sim.ch[ n ];
+  uint32_t dr = ( uint32_t )( uintptr_t )&sim.spi->DR;
+  int dir = ( c->ccr & DMA_CCR_DIR ) != 0;
+  if ( c->cpar != dr || dir != ( n == SPI_TX_CH ) ||
+       ( c->ccr & ( DMA_CCR_PSIZE | DMA_CCR_MSIZE ) ) ) {
+    sim.isr |= ( DMA_ISR_TEIF1 | DMA_ISR_GIF1 ) << ( 4 * ( n - 1 ) );
+    c->ccr &= ~( DMA_CCR_EN );
+  }
+}
+
+/** Count one byte moved by a channel, and set its flags. */
+static uint8_t *dma_step( int n ) {
+  dma_channel *c = &sim.ch[ n ];
+  uint8_t *p = ( uint8_t* )( uintptr_t )c->cmar +
+               ( ( c->ccr & DMA_CCR_MINC ) ? c->pos : 0 );
+  uint32_t len = c->cndtr + c->pos;
+  ++c->pos;
+  --c->cndtr;
+  ++sim.stats.dma_bytes;
+  if ( c->pos == len / 2 ) {
+    sim.isr |= ( DMA_ISR_HTIF1 | DMA_ISR_GIF1 ) << ( 4 * ( n - 1 ) );
+  }
+  if ( c->cndtr == 0 ) {
+    sim.isr |= ( DMA_ISR_TCIF1 | DMA_ISR_GIF1 ) << ( 4 * ( n - 1 ) );
+  }
+  return p;
+}
+
+/**
+ * Move bytes between memory and the SPI FIFOs with DMA, for as long
+ * as the requests are active. This takes no simulated time; the
+ * bus is much slower than the DMA controller. RX is served first.
+ */
+static void dma_run( void ) {
+  uint32_t cr2 = sim.r[ SPI_REG( CR2 ) ];
+  while ( ( cr2 & SPI_CR2_RXDMAEN ) && sim.rx_count > 0 &&
+          dma_ready( SPI_RX_CH ) ) {
+    *dma_step( SPI_RX_CH ) = sim.rxf[ 0 ];
+    memmove( sim.rxf, sim.rxf + 1, --sim.rx_count );
+  }
+  while ( ( cr2 & SPI_CR2_TXDMAEN ) && sim.tx_count <= FIFO_BYTES / 2 &&
+          dma_ready( SPI_TX_CH ) ) {
+    sim.txf[ sim.tx_count++ ] = *dma_step( SPI_TX_CH );
+  }
+}
+
+/** Start shifting out the next byte, if there is one. */
+static void spi_start( void ) {
+  uint32_t cr1 = sim.r[ SPI_REG( CR1 ) ];
+  if ( sim.shifting || sim.tx_count == 0 ||
+       ( cr1 & ( SPI_CR1_SPE | SPI_CR1_MSTR ) ) !=
+       ( SPI_CR1_SPE | SPI_CR1_MSTR ) ) {
+    return;
+  }
+  sim.shift_byte = sim.txf[ 0 ];
+  memmove( sim.txf, sim.txf + 1, --sim.tx_count );
+  sim.shifting = 1;
+  sim.shift_end = sim.now + byte_ps();
+  sim.stats.bus_ns += byte_ps() / PS_PER_NS;
+}
+
+/** Let simulated time pass until `end`, processing events. */
+static void run_until( uint64_t end ) {
+  while ( 1 ) {
+    dma_run();
+    spi_start();
+    if ( !sim.shifting || sim.shift_end > end ) { break; }
+    if ( sim.shift_end > sim.now ) { sim.now = sim.shift_end; }
+    sim.shifting = 0;
+    uint8_t in = bus_ok() ? card_byte( sim.shift_byte ) : 0xFF;
+    if ( sim.rx_count < FIFO_BYTES ) { sim.rxf[ sim.rx_count++ ] = in; }
+    else {
+      sim.ovr = 1;
+      ++sim.stats.overruns;
+    }
+  }
+  if ( end > sim.now ) { sim.now = end; }
+  tick = ( uint32_t )( sim.now / PS_PER_MS );
+}
+
+/**
+ * Time of the next event which could change a status flag or the
+ * driver's timeouts: the end of the current byte, or the next
+ * SysTick interrupt.
+ */
+static uint64_t next_event( void ) {
+  uint64_t next = ( sim.now / PS_PER_MS + 1 ) * PS_PER_MS;
+  if ( sim.shifting && sim.shift_end < next ) { next = sim.shift_end; }
+  return next;
+}
+
+static void reg_access( void ) {
+  run_until( sim.now + ( uint64_t )sim.cfg.access_ns * PS_PER_NS );
+}
+
+/**
+ * A driver which keeps reading the same status is spinning, and
+ * trapping every access is slow. Skip ahead until the status read
+ * by `fn` changes, or until the next SysTick interrupt, as if it had
+ * spun until then.
+ */
+static int spinning( uint32_t status, uint32_t ( *fn )( void ) ) {
+  if ( status == sim.last_status && ++sim.idle_polls >= SPIN_POLLS ) {
+    uint32_t t = tick;
+    do {
+      run_until( next_event() );
+    } while ( fn() == status && tick == t );
+    sim.idle_polls = 0;
+    return 1;
+  }
+  if ( status != sim.last_status ) { sim.idle_polls = 0; }
+  return 0;
+}
+
+/* SPI registers. */
+
+static uint32_t spi_status( void ) {
+  uint32_t thresh = ( sim.r[ SPI_REG( CR2 ) ] & SPI_CR2_FRXTH ) ? 1 : 2;
+  uint32_t sr = 0;
+  if ( sim.rx_count >= ( int )thresh ) { sr |= SPI_SR_RXNE; }
+  if ( sim.tx_count <= FIFO_BYTES / 2 ) { sr |= SPI_SR_TXE; }
+  if ( sim.ovr ) { sr |= SPI_SR_OVR; }
+  if ( sim.shifting || sim.tx_count > 0 ) { sr |= SPI_SR_BSY; }
+  sr |= ( uint32_t )( sim.rx_count > 3 ? 3 : sim.rx_count ) << SPI_SR_FRLVL_Pos;
+  sr |= ( uint32_t )( sim.tx_count > 3 ? 3 : sim.tx_count ) << SPI_SR_FTLVL_Pos;
+  return sr;
+}
+
+static uint32_t spi_peek( void *ctx, uint32_t off ) {
+  ( void )ctx;
+  uint32_t reg = off / 4;
+  if ( reg == SPI_REG( SR ) ) { return spi_status(); }
+  if ( reg == SPI_REG( DR ) ) { return 0; }
+  return ( reg < SPI_REGS ) ? sim.r[ reg ] : 0;
+}
+
+static uint32_t spi_read( void *ctx, uint32_t off ) {
+  reg_access();
+  uint32_t reg = off / 4;
+  if ( reg == SPI_REG( DR ) ) {
+    sim.idle_polls = 0;
+    sim.dr_read = 1;
+    if ( sim.rx_count == 0 ) { return 0; }
+    uint8_t b = sim.rxf[ 0 ];
+    memmove( sim.rxf, sim.rxf + 1, --sim.rx_count );
+    return b;
+  }
+  if ( reg == SPI_REG( SR ) ) {
+    uint32_t sr = spi_status();
+    if ( spinning( sr, spi_status ) ) { sr = spi_status(); }
+    sim.last_status = sr;
+    // Reading `DR`, then `SR`, clears an overrun.
+    if ( sim.dr_read ) { sim.ovr = 0; }
+    sim.dr_read = 0;
+    return sr;
+  }
+  return spi_peek( ctx, off );
+}
+
+static void spi_write( void *ctx, uint32_t off, uint32_t value ) {
+  ( void )ctx;
+  sim.idle_polls = 0;
+  reg_access();
+  uint32_t reg = off / 4;
+  if ( reg == SPI_REG( DR ) ) {
+    // Driver writes are byte-wide; the register model passes the
+    // whole word, with the byte in the low bits.
+    if ( sim.tx_count < FIFO_BYTES ) {
+      sim.txf[ sim.tx_count++ ] = ( uint8_t )value;
+      ++sim.stats.cpu_bytes;
+    }
+    run_until( sim.now );
+    return;
+  }
+  if ( reg == SPI_REG( SR ) || reg >= SPI_REGS ) { return; }
+  sim.r[ reg ] = value;
+  run_until( sim.now );
+}
+
+/* DMA registers. */
+
+static uint32_t dma_isr( void ) { return sim.isr; }
+
+static uint32_t dma_peek( void *ctx, uint32_t off ) {
+  ( void )ctx;
+  if ( off == 0x00 ) { return sim.isr; }
+  if ( off == DMA_CSELR_OFF ) { return sim.cselr; }
+  for ( int n = 1; n <= DMA_CHANNELS; ++n ) {
+    if ( off < DMA_CH_OFF( n ) || off >= DMA_CH_OFF( n ) + 0x10 ) { continue; }
+    dma_channel *c = &sim.ch[ n ];
+    switch ( off - DMA_CH_OFF( n ) ) {
+    case 0x0: return c->ccr;
+    case 0x4: return c->cndtr;
+    case 0x8: return c->cpar;
+    default:  return c->cmar;
+    }
+  }
+  return 0;
+}
+
+static uint32_t dma_read( void *ctx, uint32_t off ) {
+  reg_access();
+  if ( off == 0x00 ) {
+    uint32_t isr = sim.isr;
+    if ( spinning( isr, dma_isr ) ) { isr = sim.isr; }
+    sim.last_status = isr;
+    return isr;
+  }
+  return dma_peek( ctx, off );
+}
+
+static void dma_write( void *ctx, uint32_t off, uint32_t value ) {
+  ( void )ctx;
+  sim.idle_polls = 0;
+  reg_access();
+  if ( off == 0x04 ) {
+    sim.isr &= ~value;
+    return;
+  }
+  if ( off == DMA_CSELR_OFF ) {
+    sim.cselr = value;
+    run_until( sim.now );
+    return;
+  }
+  for ( int n = 1; n <= DMA_CHANNELS; ++n ) {
+    if ( off < DMA_CH_OFF( n ) || off >= DMA_CH_OFF( n ) + 0x10 ) { continue; }
+    dma_channel *c = &sim.ch[ n ];
+    int enabled = ( c->ccr & DMA_CCR_EN ) != 0;
+    switch ( off - DMA_CH_OFF( n ) ) {
+    case 0x0:
+      c->ccr = value;
+      if ( !enabled && ( value & DMA_CCR_EN ) ) {
+        c->pos = 0;
+        dma_check( n );
+      }
+      break;
+    // The address and count registers are read-only while the
+    // channel is enabled.
+    case 0x4: if ( !enabled ) { c->cndtr = value & 0xFFFF; } break;
+    case 0x8: if ( !enabled ) { c->cpar = value; } break;
+    default:  if ( !enabled ) { c->cmar = value; } break;
+    }
+    run_until( sim.now );
+    return;
+  }
+}
+
+/* GPIO registers: only the output data matters. */
+
+static uint32_t gpio_peek( void *ctx, uint32_t off ) {
+  ( void )ctx;
+  uint32_t reg = off / 4;
+  if ( reg == GPIO_REG( IDR ) ) { return sim.g[ GPIO_REG( ODR ) ]; }
+  if ( reg == GPIO_REG( BSRR ) || reg == GPIO_REG( BRR ) ) { return 0; }
+  return ( reg < GPIO_REGS ) ? sim.g[ reg ] : 0;
+}
+
+static uint32_t gpio_read( void *ctx, uint32_t off ) {
+  reg_access();
+  return gpio_peek( ctx, off );
+}
+
+static void gpio_write( void *ctx, uint32_t off, uint32_t value ) {
+  ( void )ctx;
+  sim.idle_polls = 0;
+  reg_access();
+  uint32_t reg = off / 4;
+  uint32_t *odr = &sim.g[ GPIO_REG( ODR ) ];
+  if ( reg == GPIO_REG( BSRR ) ) {
+    *odr |= ( value & 0xFFFF );
+    *odr &= ~( value >> 16 );
+  }
+  else if ( reg == GPIO_REG( BRR ) ) { *odr &= ~( value & 0xFFFF ); }
+  else if ( reg < GPIO_REGS && reg != GPIO_REG( IDR ) ) { sim.g[ reg ] = value; }
+  // A deselected card drops any half-received command.
+  if ( !selected() ) { sim.cmd_len = 0; }
+}
+
+SPI_TypeDef *spi_sim_open( const char *image, const spi_sim_config *cfg ) {
+  struct stat st;
+  memset( &sim, 0, sizeof( sim ) );
+  sim.fd = open( image, O_RDWR );
+  if ( sim.fd < 0 || fstat( sim.fd, &st ) ) { return NULL; }
+  sim.blocks = ( uint32_t )( st.st_size / 512 );
+  sim.cfg = *cfg;
+  sim.idle = 1;
+  // Chip select idles high, with a pull-up on the card.
+  sim.g[ GPIO_REG( ODR ) ] = 1U << cfg->cs_pin;
+  regmodel_ops spi_ops = { spi_read, spi_write, spi_peek, NULL };
+  regmodel_ops dma_ops = { dma_read, dma_write, dma_peek, NULL };
+  regmodel_ops gpio_ops = { gpio_read, gpio_write, gpio_peek, NULL };
+  sim.spi = ( SPI_TypeDef* )regmodel_map( sizeof( SPI_TypeDef ), &spi_ops );
+  sim.dma = ( DMA_TypeDef* )regmodel_map( DMA_SIZE, &dma_ops );
+  sim.gpio = ( GPIO_TypeDef* )regmodel_map( sizeof( GPIO_TypeDef ), &gpio_ops );
+  tick = 0;
+  if ( !sim.spi || !sim.dma || !sim.gpio ) {
+    spi_sim_close();
+    return NULL;
+  }
+  return sim.spi;
+}
+
+DMA_TypeDef *spi_sim_dma( void ) { return sim.dma; }
+GPIO_TypeDef *spi_sim_cs_port( void ) { return sim.gpio; }
+
+void spi_sim_close( void ) {
+  if ( sim.spi ) { regmodel_unmap( sim.spi ); }
+  if ( sim.dma ) { regmodel_unmap( sim.dma ); }
+  if ( sim.gpio ) { regmodel_unmap( sim.gpio ); }
+  if ( sim.fd >= 0 ) { close( sim.fd ); }
+  sim.spi = NULL;
+  sim.dma = NULL;
+  sim.gpio = NULL;
+  sim.fd = -1;
+}
+
+void spi_sim_configure( const spi_sim_config *cfg ) { sim.cfg = *cfg; }
+void spi_sim_inject( const spi_sim_faults *faults ) { sim.faults = *faults; }
+uint64_t spi_sim_now( void ) { return sim.now / PS_PER_NS; }
+void spi_sim_advance( uint64_t ns ) {
+  run_until( sim.now + ns * PS_PER_NS );
+}
+int spi_sim_ready( void ) { return sim.spi_mode && !sim.idle; }
+const spi_sim_stats *spi_sim_get_stats( void ) { return &sim.stats; }
+void spi_sim_reset_stats( void ) { memset( &sim.stats, 0, sizeof( sim.stats ) ); }
+
+// Stands in for the SysTick-based timer in `port/tim.c`.
+uint32_t timer_micros( void ) { return ( uint32_t )( sim.now / 1000000ULL ); }
+
+// Hook from `host_port.h`.
+void host_sleep( void ) { run_until( next_event() ); }
@@ -0,0 +1,122 @@
+/*
+ * Register-level simulator for an STM32L4 SPI peripheral, its DMA
+ * channels, and an SD card in SPI mode, backed by a disk image file.
+ *
+ * The simulator maps trapped blocks of `SPI_TypeDef`, `DMA_TypeDef`
+ * (with its channel and request selection registers) and
+ * `GPIO_TypeDef` registers (see `regmodel.h`), so the unmodified
+ * drivers in `port/spi.c` and `block_sd.c` can run on a Linux host.
+ * It models the SPI FIFOs and status flags, DMA1 channels 2 and 3
+ * serving SPI1 (request 1), a GPIO chip select pin, and the card's
+ * side of the SPI-mode protocol for the commands which the driver
+ * uses:
+ *   CMD0/8/9/10/12/13/16/17/18/24/25/55/58/59, ACMD13/23/41.
+ * The card checks the CRC of CMD0 and CMD8, ignores commands while
+ * it is busy, and only understands the bus at up to 400KHz until it
+ * is initialized, and at up to 25MHz afterwards. Read errors and
+ * rejected writes can be injected, to test error handling.
+ *
+ * DMA channels hold 32-bit memory addresses, so the simulator can
+ * only reach buffers in the low 4GB of the address space: programs
+ * which use it must be linked with `-no-pie`, and DMA buffers must
+ * be static (the stack is mapped high).
+ *
+ * Time is simulated, as in `sdmmc_sim.c`: every register access costs
+ * `access_ns`, bytes take 8 SPI clock cycles, and the card's latencies
+ * are configurable. The simulator keeps the global `tick` in step with
+ * simulated time, and it provides the `host_port.h` sleep hook.
+ */
+#ifndef __VVC_SPI_SIM
+#define __VVC_SPI_SIM
+
+#include <stdint.h>
+
+#include "port/spi.h"
+
+// Latencies and other card / host parameters.
+typedef struct {
+  // SPI peripheral clock; the bus clock is this / 2^( BR + 1 ).
+  uint32_t pclk_mhz;
+  // Cost of one peripheral register access.
+  uint32_t access_ns;
+  // GPIO pin which drives the card's chip select line.
+  uint32_t cs_pin;
+  // Card: time to start responding to a command. (Capped at the
+  // spec's limit of 8 bytes.)
+  uint32_t cmd_ns;
+  // Card: access time before each block of read data.
+  uint32_t read_ns;
+  // Card: busy time after a single-block write, or after the
+  // stop token of a multi-block write.
+  uint32_t program_ns;
+  // Card: busy time between blocks of a multi-block write.
+  uint32_t multi_program_ns;
+  // Card: how long ACMD41 reports 'idle' after it is first sent.
+  uint32_t init_ns;
+  // Card: high-capacity (SDHC / SDXC) or standard-capacity.
+  int      high_capacity;
+  // Card: version 1.x, which does not know CMD8 (implies SDSC).
+  int      version1;
+  // Card: SD Status register fields, as coded there: the speed class
+  // (4 is class 10), the AU size (9 is 4MB), and the UHS grade.
+  uint32_t speed_class;
+  uint32_t au_size;
+  uint32_t uhs_grade;
+} spi_sim_config;
+
+// Simulator statistics.
+typedef struct {
+  // Commands received by the card, by index. ACMDs are counted
+  // at `64 + index`.
+  uint32_t cmds[ 128 ];
+  // Commands which the card ignored because it was busy.
+  uint32_t busy_cmds;
+  uint32_t blocks_read;
+  uint32_t blocks_written;
+  // Bytes moved through the data register by the CPU and by DMA.
+  uint32_t cpu_bytes;
+  uint32_t dma_bytes;
+  // Received bytes lost because the RX FIFO was full.
+  uint32_t overruns;
+  // Total time the bus clock was running.
+  uint64_t bus_ns;
+} spi_sim_stats;
+
+// Faults to inject. Each count is how many more times the fault
+// happens before the card behaves again.
+typedef struct {
+  // Data blocks which the card answers with an error token instead.
+  uint32_t read_error;
+  // Written data blocks which the card rejects with a CRC error
+  // response. The block is not written.
+  uint32_t write_reject;
+} spi_sim_faults;
+
+// Default configuration: a reasonably quick SDHC card, on an 80MHz
+// APB clock, with chip select on pin 4.
+void spi_sim_defaults( spi_sim_config *cfg );
+// Start the simulator over a disk image. The image size sets the
+// card's capacity. Returns the simulated SPI registers, or NULL.
+SPI_TypeDef *spi_sim_open( const char *image, const spi_sim_config *cfg );
+// The simulated DMA controller and chip select GPIO port.
+DMA_TypeDef *spi_sim_dma( void );
+GPIO_TypeDef *spi_sim_cs_port( void );
+// Stop the simulator and close the image.
+void spi_sim_close( void );
+// Change the configuration while the simulator is running.
+void spi_sim_configure( const spi_sim_config *cfg );
+// Inject faults; this replaces any which have not happened yet.
+void spi_sim_inject( const spi_sim_faults *faults );
+// Simulated time since `spi_sim_open`, in nanoseconds.
+uint64_t spi_sim_now( void );
+// Let simulated time pass, as if the CPU did something else.
+void spi_sim_advance( uint64_t ns );
+// Current SPI bus clock, in Hertz.
+uint32_t spi_sim_clock_hz( void );
+// Whether the card has finished initializing (left the idle state).
+int spi_sim_ready( void );
+// Simulator statistics; `spi_sim_reset_stats` clears them.
+const spi_sim_stats *spi_sim_get_stats( void );
+void spi_sim_reset_stats( void );
+
+#endif
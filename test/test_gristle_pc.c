@@ -0,0 +1,724 @@
+/*
+ * Host-side tests for the Gristle filesystem, on the in-memory image
+ * driver `block_pc`.
+ *
+ * Each group formats a fresh FAT32 image, mounts it and checks what
+ * Gristle's caches and allocator promise: that the volume ends up
+ * the way the FAT says, and that the operations they speed up read
+ * no more blocks than they should. The image's free clusters are
+ * filled with junk first, so anything which relies on a cluster
+ * being clear has to clear it.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "block_pc.h"
+#include "fat_image.h"
+#include "gristle.h"
+#include "partition.h"
+
+#define IMAGE        "test_gristle_pc.img"
+#define IMAGE_BLOCKS ( 16384 )
+
+static int p = 0;
+static int failures = 0;
+static struct fat_volume vol;
+// The volume the file helpers below work on.
+static struct fat_volume *on = &vol;
+
+static void check( const char *desc, int ok ) {
+  printf( "[%4d] Testing %s", p++, desc );
+  if ( ok ) { printf( "  [ ok ]\n" ); }
+  else {
+    printf( "  [fail]\n" );
+    ++failures;
+  }
+}
+
+// The volume `start` made, so that tests can look at the FAT.
+static fat_image img;
+
+/** Create the image, or give up. */
+static int create( void ) {
+  int fd = fat_image_create( IMAGE, IMAGE_BLOCKS );
+  if ( fd < 0 ) {
+    printf( "Could not create the image.\n" );
+    exit( 1 );
+  }
+  return fd;
+}
+
+/**
+ * Write a volume of `blocks` blocks with `cluster` blocks per cluster
+ * at block `start` of the image. If `every` is set, every `every`th
+ * cluster is taken by a lost chain, so that files have to be split
+ * around them. Free clusters are filled with junk.
+ */
+static void format( int fd, uint32_t start, uint32_t blocks, uint32_t cluster, uint32_t every ) {
+  memset( &img, 0, sizeof( img ) );
+  img.start = start;
+  img.blocks = blocks;
+  img.cluster = cluster;
+  img.every = every;
+  img.fill = 0xA5;
+  if ( fat_image_format( fd, &img ) ) {
+    printf( "Could not format the image.\n" );
+    exit( 1 );
+  }
+}
+
+/** Make an image with one volume which fills it, and mount it. */
+static void start( uint32_t cluster, uint32_t every ) {
+  int fd = create();
+  format( fd, 0, IMAGE_BLOCKS, cluster, every );
+  close( fd );
+  block_pc_set_image_name( IMAGE );
+  if ( block_init() || fat_mount( &vol, 0, IMAGE_BLOCKS, PART_TYPE_FAT32 ) ) {
+    printf( "Could not mount the image.\n" );
+    exit( 1 );
+  }
+  unlink( IMAGE );
+}
+
+static void stop( void ) {
+  fat_umount( &vol );
+  block_halt();
+}
+
+static uint32_t reads( void ) {
+  uint32_t r, w;
+  block_pc_get_counts( &r, &w );
+  return r;
+}
+
+/** A cluster's entry in the first FAT, as it is on the image. */
+static uint32_t fat_entry( uint32_t c ) {
+  static uint32_t b[ 128 ];
+  block_read( img.fat_start + c / 128, b );
+  return b[ c % 128 ] & 0x0FFFFFFF;
+}
+
+/** Count the free clusters in the first FAT on the image. */
+static uint32_t fat_free( void ) {
+  uint32_t n = 0;
+  for ( uint32_t c = 2; c < img.clusters; ++c ) {
+    if ( fat_entry( c ) == 0 ) { ++n; }
+  }
+  return n;
+}
+
+/** The free count in the volume's FSInfo sector, as it is on the image. */
+static uint32_t info_free( void ) {
+  static uint8_t b[ 512 ];
+  uint32_t v;
+  block_read( img.start + 1, b );
+  memcpy( &v, &b[ FREE_CLUSTERS ], 4 );
+  return v;
+}
+
+/** Unmount the volume and mount it again, as after a restart. */
+static int remount( void ) {
+  fat_umount( &vol );
+  return fat_mount( &vol, img.start, IMAGE_BLOCKS, PART_TYPE_FAT32 );
+}
+
+/**
+ * Find an 8.3 name, as it is stored, in the first sector of the root
+ * directory on the image, and give its size.
+ */
+static int raw_size( const char *name, uint32_t *size ) {
+  static uint8_t b[ 512 ];
+  block_read( img.root_start, b );
+  for ( int i = 0; i < 512; i += 32 ) {
+    if ( memcmp( &b[ i ], name, 11 ) == 0 ) {
+      memcpy( size, &b[ i + 28 ], 4 );
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Count the entries in a directory, or -1 if it can't be listed. */
+static int entries( const char *path ) {
+  struct dirent de;
+  int rerrno;
+  int n = 0;
+  int fd = fat_open( on, path, O_RDONLY, 0, &rerrno );
+  if ( fd < 0 ) { return -1; }
+  while ( fat_get_next_dirent( fd, &de, &rerrno ) == 0 ) { ++n; }
+  fat_close( fd, &rerrno );
+  return rerrno ? -1 : n;
+}
+
+static uint8_t pattern( int file, uint32_t pos ) {
+  return ( uint8_t )( pos / 509 + file * 37 );
+}
+
+/** Write `len` bytes of a file's pattern at its current position. */
+static int put( int fd, int file, uint32_t pos, uint32_t len ) {
+  static uint8_t b[ 4096 ];
+  int rerrno;
+  while ( len ) {
+    uint32_t n = len > sizeof( b ) ? sizeof( b ) : len;
+    for ( uint32_t i = 0; i < n; ++i ) { b[ i ] = pattern( file, pos + i ); }
+    if ( fat_write( fd, b, n, &rerrno ) != ( int )n ) { return -1; }
+    pos += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/** Check that `len` bytes at a file's current position are its pattern. */
+static int got( int fd, int file, uint32_t pos, uint32_t len ) {
+  static uint8_t b[ 4096 ];
+  int rerrno;
+  while ( len ) {
+    uint32_t n = len > sizeof( b ) ? sizeof( b ) : len;
+    if ( fat_read( fd, b, n, &rerrno ) != ( int )n ) { return 0; }
+    for ( uint32_t i = 0; i < n; ++i ) {
+      if ( b[ i ] != pattern( file, pos + i ) ) { return 0; }
+    }
+    pos += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/** Create a file holding `len` bytes of its pattern. */
+static int make( const char *path, int file, uint32_t len ) {
+  int rerrno;
+  int fd = fat_open( on, path, O_WRONLY | O_CREAT | O_TRUNC, 0644, &rerrno );
+  if ( fd < 0 ) { return -1; }
+  int r = put( fd, file, 0, len );
+  return ( fat_close( fd, &rerrno ) || r ) ? -1 : 0;
+}
+
+/** Check that a file holds `len` bytes of its pattern, and no more. */
+static int holds( const char *path, int file, uint32_t len ) {
+  int rerrno;
+  uint8_t b;
+  int fd = fat_open( on, path, O_RDONLY, 0, &rerrno );
+  if ( fd < 0 ) { return 0; }
+  int ok = got( fd, file, 0, len ) && fat_read( fd, &b, 1, &rerrno ) == 0;
+  return fat_close( fd, &rerrno ) == 0 && ok;
+}
+
+// The map of FAT sectors with free clusters.
+static void test_free_map( void ) {
+  int rerrno;
+  // A volume which is half taken, from its start.
+  start( 1, 0 );
+  uint32_t half = ( img.clusters - 3 ) / 2;
+  check( "a fresh volume is all free but the root",
+         fat_get_free_count( &vol ) == img.clusters - 3 && fat_free() == img.clusters - 3 );
+  if ( make( "/HALF.BIN", 1, half * 512 ) ) { ++failures; }
+  uint32_t r = reads();
+  if ( make( "/NEXT.BIN", 2, 64 * 512 ) ) { ++failures; }
+  check( "allocation skips the full part of the FAT",
+         reads() - r < img.fat / 4 );
+  check( "the free count follows allocation",
+         fat_get_free_count( &vol ) == img.clusters - 3 - half - 64 &&
+         fat_free() == img.clusters - 3 - half - 64 );
+  fat_unlink( &vol, "/HALF.BIN", &rerrno );
+  check( "the free count follows freeing",
+         fat_get_free_count( &vol ) == img.clusters - 3 - 64 && fat_free() == img.clusters - 3 - 64 );
+  // Fill the volume: allocation must find the freed clusters again,
+  // and stop at the last one.
+  int fd = fat_open( &vol, "/FULL.BIN", O_WRONLY | O_CREAT, 0644, &rerrno );
+  uint32_t len = 0;
+  while ( put( fd, 3, len, 512 ) == 0 ) { len += 512; }
+  fat_close( fd, &rerrno );
+  check( "a volume fills up to its last cluster",
+         len == ( img.clusters - 3 - 64 ) * 512 && fat_get_free_count( &vol ) == 0 &&
+         fat_free() == 0 && fat_entry( img.clusters ) == 0 );
+  check( "a full volume keeps what was written", holds( "/FULL.BIN", 3, len ) );
+  fat_unlink( &vol, "/FULL.BIN", &rerrno );
+  check( "a file fits again once another is deleted",
+         make( "/AGAIN.BIN", 4, 1000 * 512 ) == 0 && holds( "/AGAIN.BIN", 4, 1000 * 512 ) );
+  stop();
+}
+
+// The free count kept in the FSInfo sector.
+static void test_fs_info( void ) {
+  int rerrno;
+  start( 1, 0 );
+  if ( make( "/A.BIN", 1, 300 * 512 ) || make( "/B.BIN", 2, 100 * 512 ) ) { ++failures; }
+  fat_unlink( &vol, "/B.BIN", &rerrno );
+  uint32_t free = img.clusters - 3 - 300;
+  check( "the FSInfo count is not written before it has to be",
+         info_free() == img.clusters - 3 );
+  int fd = fat_open( &vol, "/C.BIN", O_WRONLY | O_CREAT, 0644, &rerrno );
+  put( fd, 3, 0, 10 * 512 );
+  fat_fsync( fd, &rerrno );
+  // An open file may hold more clusters than it has filled yet.
+  check( "fsync writes the FSInfo count",
+         info_free() == fat_get_free_count( &vol ) && info_free() <= free - 10 );
+  fat_close( fd, &rerrno );
+  free -= 10;
+  fat_umount( &vol );
+  check( "umount writes the FSInfo count", info_free() == free && fat_free() == free );
+  fat_mount( &vol, img.start, IMAGE_BLOCKS, PART_TYPE_FAT32 );
+  uint32_t r = reads();
+  check( "a mounted volume takes its free count from FSInfo",
+         fat_get_free_count( &vol ) == free && reads() == r );
+  // A count which can't be right is ignored, and the FAT is counted.
+  static uint8_t b[ 512 ];
+  fat_umount( &vol );
+  block_read( img.start + 1, b );
+  memset( &b[ FREE_CLUSTERS ], 0xEE, 4 );
+  block_write( img.start + 1, b );
+  fat_mount( &vol, img.start, IMAGE_BLOCKS, PART_TYPE_FAT32 );
+  r = reads();
+  check( "an impossible FSInfo count is counted again",
+         fat_get_free_count( &vol ) == free && reads() > r );
+  check( "a counted free count is written back", remount() == 0 && info_free() == free );
+  // So is one in an FSInfo sector whose signature is wrong, which is
+  // then never written.
+  fat_umount( &vol );
+  block_read( img.start + 1, b );
+  memcpy( &b[ FS_INFO_SIG2 ], "xxxx", 4 );
+  memset( &b[ FREE_CLUSTERS ], 0, 4 );
+  block_write( img.start + 1, b );
+  fat_mount( &vol, img.start, IMAGE_BLOCKS, PART_TYPE_FAT32 );
+  check( "an FSInfo sector with a bad signature is ignored",
+         fat_get_free_count( &vol ) == free );
+  if ( make( "/D.BIN", 4, 5 * 512 ) ) { ++failures; }
+  check( "an FSInfo sector with a bad signature is left alone",
+         remount() == 0 && info_free() == 0 && fat_get_free_count( &vol ) == free - 5 );
+  stop();
+}
+
+// The cache of FAT and directory sectors.
+static void test_meta_cache( void ) {
+  int rerrno;
+  uint32_t size = 0;
+  start( 1, 0 );
+  int fd = fat_open( &vol, "/F.BIN", O_WRONLY | O_CREAT, 0644, &rerrno );
+  put( fd, 1, 0, 3000 );
+  fat_fsync( fd, &rerrno );
+  check( "fsync writes a file's directory entry",
+         raw_size( "F       BIN", &size ) && size == 3000 );
+  // One FAT sector covers 128 clusters, so a long append only reads
+  // it once.
+  uint32_t r = reads();
+  put( fd, 1, 3000, 100 * 512 );
+  check( "an append reads the FAT from the cache", reads() - r <= 1 );
+  fat_close( fd, &rerrno );
+  check( "close writes a file's directory entry",
+         raw_size( "F       BIN", &size ) && size == 3000 + 100 * 512 );
+  // A root directory of one sector holds 16 entries, so these take
+  // three more clusters, which have junk in them until they are used.
+  char name[ 16 ];
+  int made = 0;
+  for ( int i = 0; i < 40; ++i ) {
+    sprintf( name, "/F%02d.BIN", i );
+    made += make( name, i, 100 + i ) == 0;
+  }
+  check( "a directory grows past its first cluster", made == 40 && entries( "/" ) == 41 );
+  int held = remount() == 0 && entries( "/" ) == 41;
+  for ( int i = 0; i < 40; ++i ) {
+    sprintf( name, "/F%02d.BIN", i );
+    held = held && holds( name, i, 100 + i );
+  }
+  check( "a grown directory is all written", held );
+  stop();
+}
+
+/** Read 1KB pages of a file at `count` pseudo-random places. */
+static int pages( int fd, int file, uint32_t len, int count ) {
+  int rerrno;
+  uint32_t seed = 1;
+  int ok = 1;
+  for ( int i = 0; i < count; ++i ) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t pos = ( ( seed >> 8 ) % ( len / 1024 ) ) * 1024;
+    ok = ok && fat_lseek( fd, pos, SEEK_SET, &rerrno ) == ( int )pos && got( fd, file, pos, 1024 );
+  }
+  return ok;
+}
+
+// Each open file's map of its cluster runs.
+static void test_extents( void ) {
+  int rerrno;
+  // A 4MB file in about 20 pieces, more than the map holds.
+  start( 1, 512 );
+  uint32_t len = 4 * 1024 * 1024;
+  if ( make( "/FRAG.BIN", 1, len ) ) { ++failures; }
+  int fd = fat_open( &vol, "/FRAG.BIN", O_RDONLY, 0, &rerrno );
+  check( "a file is split around taken clusters", fat_get_fragments( fd, &rerrno ) > 16 );
+  pages( fd, 1, len, 50 );
+  uint32_t r = reads();
+  check( "seeks across a fragmented file read the right data", pages( fd, 1, len, 500 ) );
+  // Each page is two sectors, one or two FAT sectors past the end of
+  // the map, and no walk from the start of the chain.
+  check( "seeks across a fragmented file don't walk the FAT", reads() - r < 500 * 6 );
+  check( "a seek past the end is refused",
+         fat_lseek( fd, len + 1, SEEK_SET, &rerrno ) != ( int )len + 1 );
+  fat_close( fd, &rerrno );
+  stop();
+  // A file in a piece per cluster.
+  start( 1, 2 );
+  len = 256 * 1024;
+  if ( make( "/BITS.BIN", 2, len ) ) { ++failures; }
+  fd = fat_open( &vol, "/BITS.BIN", O_RDONLY, 0, &rerrno );
+  check( "seeks across a file in hundreds of pieces read the right data",
+         fat_get_fragments( fd, &rerrno ) == ( int )len / 512 && pages( fd, 2, len, 500 ) );
+  fat_close( fd, &rerrno );
+  stop();
+  // The end of a file which fills its last sector.
+  start( 1, 0 );
+  uint32_t free = img.clusters - 3;
+  if ( make( "/END.BIN", 3, 1024 ) ) { ++failures; }
+  uint8_t b;
+  fd = fat_open( &vol, "/END.BIN", O_RDONLY, 0, &rerrno );
+  check( "a read-only file seeks to the end of its last sector",
+         fat_lseek( fd, 0, SEEK_END, &rerrno ) == 1024 && fat_read( fd, &b, 1, &rerrno ) == 0 );
+  fat_close( fd, &rerrno );
+  check( "seeking to the end doesn't allocate", fat_get_free_count( &vol ) == free - 2 );
+  fd = fat_open( &vol, "/END.BIN", O_RDWR, 0, &rerrno );
+  int ok = fat_lseek( fd, 0, SEEK_END, &rerrno ) == 1024 && put( fd, 3, 1024, 512 ) == 0;
+  fat_close( fd, &rerrno );
+  check( "a file appends after seeking to the end of its last sector",
+         ok && holds( "/END.BIN", 3, 1536 ) && fat_get_free_count( &vol ) == free - 3 &&
+         fat_free() == free - 3 );
+  // Truncation.
+  uint32_t size = 1;
+  fd = fat_open( &vol, "/END.BIN", O_WRONLY | O_TRUNC, 0, &rerrno );
+  fat_close( fd, &rerrno );
+  check( "O_TRUNC and close free the file's clusters",
+         fat_get_free_count( &vol ) == free && fat_free() == free );
+  check( "O_TRUNC and close empty the directory entry",
+         raw_size( "END     BIN", &size ) && size == 0 && holds( "/END.BIN", 3, 0 ) );
+  if ( make( "/OTHER.BIN", 4, 700 ) ) { ++failures; }
+  fd = fat_open( &vol, "/END.BIN", O_WRONLY, 0, &rerrno );
+  ok = put( fd, 5, 0, 600 ) == 0;
+  fat_close( fd, &rerrno );
+  check( "an emptied file gets a cluster of its own",
+         ok && holds( "/END.BIN", 5, 600 ) && holds( "/OTHER.BIN", 4, 700 ) &&
+         entries( "/" ) == 2 );
+  stop();
+}
+
+// Allocating clusters in runs after a file's tail.
+static void test_alloc_runs( void ) {
+  int rerrno;
+  start( 1, 0 );
+  uint32_t free = img.clusters - 3;
+  // Two logs appended in turn, a record at a time.
+  int a = fat_open( &vol, "/A.LOG", O_WRONLY | O_CREAT, 0644, &rerrno );
+  int b = fat_open( &vol, "/B.LOG", O_WRONLY | O_CREAT, 0644, &rerrno );
+  uint32_t len = 0;
+  int ok = 1;
+  for ( ; len < 200 * 1000; len += 1000 ) {
+    ok = ok && put( a, 1, len, 1000 ) == 0 && put( b, 2, len, 1000 ) == 0;
+  }
+  uint32_t clusters = ( len + 511 ) / 512;
+  int pieces = fat_get_fragments( a, &rerrno ) + fat_get_fragments( b, &rerrno );
+  check( "files appended in turn grow in runs", ok && pieces <= 2 * ( int )( clusters / 8 + 1 ) );
+  check( "an open file may hold clusters ahead of its end",
+         fat_get_free_count( &vol ) <= free - 2 * clusters );
+  fat_close( a, &rerrno );
+  fat_close( b, &rerrno );
+  check( "close gives back the clusters after a file's end",
+         fat_get_free_count( &vol ) == free - 2 * clusters && fat_free() == free - 2 * clusters );
+  check( "files appended in turn keep their data", holds( "/A.LOG", 1, len ) && holds( "/B.LOG", 2, len ) );
+  // One write which needs many clusters gets them in one piece.
+  a = fat_open( &vol, "/BIG.BIN", O_WRONLY | O_CREAT, 0644, &rerrno );
+  put( a, 3, 0, 64 * 1024 );
+  check( "a long write is allocated in one piece", fat_get_fragments( a, &rerrno ) == 1 );
+  fat_close( a, &rerrno );
+  // A file reopened for appending carries on after its tail.
+  a = fat_open( &vol, "/A.LOG", O_WRONLY | O_APPEND, 0, &rerrno );
+  pieces = fat_get_fragments( a, &rerrno );
+  put( a, 1, len, 10 * 1000 );
+  check( "an append carries on after the file's tail",
+         fat_get_fragments( a, &rerrno ) <= pieces + 1 );
+  fat_close( a, &rerrno );
+  check( "an appended file keeps its data", holds( "/A.LOG", 1, len + 10 * 1000 ) );
+  stop();
+}
+
+/** Open a file to read, and say why it can't be if it can't. */
+static int missing( const char *path ) {
+  int rerrno;
+  int fd = fat_open( on, path, O_RDONLY, 0, &rerrno );
+  if ( fd >= 0 ) {
+    fat_close( fd, &rerrno );
+    return 0;
+  }
+  return rerrno;
+}
+
+// The cache of directory entries.
+static void test_dentries( void ) {
+  int rerrno;
+  start( 1, 0 );
+  fat_mkdir( &vol, "/DATA", 0755, &rerrno );
+  if ( make( "/DATA/TEST.DB", 1, 4096 ) ) { ++failures; }
+  missing( "/DATA/TEST.DB" );
+  // What SQLite does on each transaction: open the database and see
+  // if there is a journal.
+  uint32_t r = reads();
+  int fd = fat_open( &vol, "/DATA/TEST.DB", O_RDWR, 0, &rerrno );
+  check( "a reopened file isn't looked up again", fd >= 0 && reads() - r <= 1 );
+  fat_close( fd, &rerrno );
+  missing( "/DATA/TEST.JNL" );
+  r = reads();
+  check( "a missing file isn't looked up again",
+         missing( "/DATA/TEST.JNL" ) == ENOENT && reads() == r );
+  check( "a file is created where it was missing",
+         make( "/DATA/TEST.JNL", 2, 1000 ) == 0 && holds( "/DATA/TEST.JNL", 2, 1000 ) );
+  fat_unlink( &vol, "/DATA/TEST.JNL", &rerrno );
+  check( "an unlinked file is missing", missing( "/DATA/TEST.JNL" ) == ENOENT );
+  check( "an unlinked file is created again",
+         make( "/DATA/TEST.JNL", 3, 1500 ) == 0 && holds( "/DATA/TEST.JNL", 3, 1500 ) &&
+         entries( "/DATA" ) == 4 );
+  // Entries cached in a directory which goes away.
+  fat_mkdir( &vol, "/OLD", 0755, &rerrno );
+  if ( make( "/OLD/F.BIN", 4, 100 ) ) { ++failures; }
+  missing( "/OLD/F.BIN" );
+  missing( "/OLD/G.BIN" );
+  fat_unlink( &vol, "/OLD/F.BIN", &rerrno );
+  check( "a directory is removed once its files are",
+         fat_rmdir( &vol, "/OLD", &rerrno ) == 0 && missing( "/OLD" ) == ENOENT );
+  check( "a removed directory's files are missing", missing( "/OLD/F.BIN" ) == ENOENT );
+  fat_mkdir( &vol, "/OLD", 0755, &rerrno );
+  check( "a new directory doesn't have the old one's files",
+         missing( "/OLD/F.BIN" ) == ENOENT && entries( "/OLD" ) == 2 );
+  check( "a new directory takes files",
+         make( "/OLD/G.BIN", 5, 200 ) == 0 && holds( "/OLD/G.BIN", 5, 200 ) && entries( "/OLD" ) == 3 );
+  // A name which was missing when a directory is made with it.
+  missing( "/DATA/SUB" );
+  missing( "/DATA/SUB/X.BIN" );
+  check( "a directory is made where it was missing",
+         fat_mkdir( &vol, "/DATA/SUB", 0755, &rerrno ) == 0 && entries( "/DATA/SUB" ) == 2 );
+  check( "a directory made where it was missing takes files",
+         make( "/DATA/SUB/X.BIN", 6, 300 ) == 0 && holds( "/DATA/SUB/X.BIN", 6, 300 ) );
+  check( "the cache agrees with the volume after a remount",
+         remount() == 0 && holds( "/DATA/TEST.DB", 1, 4096 ) && holds( "/DATA/TEST.JNL", 3, 1500 ) &&
+         holds( "/OLD/G.BIN", 5, 200 ) && holds( "/DATA/SUB/X.BIN", 6, 300 ) &&
+         entries( "/DATA" ) == 5 && entries( "/" ) == 2 );
+  stop();
+}
+
+// Looking names up in a large directory, through its index if
+// GRISTLE_DIR_INDEX_SLOTS is set (test_gristle_pc_index).
+static void test_big_dir( void ) {
+  int rerrno;
+  char name[ 32 ];
+  start( 1, 0 );
+  fat_mkdir( &vol, "/BIG", 0755, &rerrno );
+  int made = 0;
+  for ( int i = 0; i < 2000; ++i ) {
+    sprintf( name, "/BIG/F%05d.TXT", i );
+    made += make( name, i, 10 + i % 100 ) == 0;
+  }
+  check( "a large directory is filled", made == 2000 && entries( "/BIG" ) == 2002 );
+  // Far more names than the directory entry cache holds, so these
+  // are looked up in the directory.
+  int ok = 1;
+  uint32_t r = reads();
+  for ( int i = 0; i < 2000; i += 97 ) {
+    sprintf( name, "/BIG/F%05d.TXT", i );
+    ok = ok && holds( name, i, 10 + i % 100 );
+  }
+  r = reads() - r;
+  check( "files are found in a large directory", ok );
+#if GRISTLE_DIR_INDEX_SLOTS > 0
+  // The entry's sector and the file's.
+  check( "opening a file reads its directory's index", r <= 21 * 2 );
+#endif
+  r = reads();
+  ok = 1;
+  for ( int i = 0; i < 20; ++i ) {
+    sprintf( name, "/BIG/G%05d.TXT", i );
+    ok = ok && missing( name ) == ENOENT;
+  }
+  r = reads() - r;
+  check( "missing files are missing from a large directory", ok );
+#if GRISTLE_DIR_INDEX_SLOTS > 0
+  // Unless another name has the same hash.
+  check( "a missing file is known from its directory's index", r <= 2 );
+#endif
+  // Delete every other file, then make some again, with new data.
+  ok = 1;
+  for ( int i = 0; i < 2000; i += 2 ) {
+    sprintf( name, "/BIG/F%05d.TXT", i );
+    ok = ok && fat_unlink( &vol, name, &rerrno ) == 0;
+  }
+  check( "files are deleted from a large directory",
+         ok && entries( "/BIG" ) == 1002 && missing( "/BIG/F00100.TXT" ) == ENOENT &&
+         holds( "/BIG/F00101.TXT", 101, 10 + 101 % 100 ) );
+  ok = 1;
+  for ( int i = 0; i < 2000; i += 10 ) {
+    sprintf( name, "/BIG/F%05d.TXT", i );
+    ok = ok && make( name, i + 1, 500 ) == 0;
+  }
+  for ( int i = 0; i < 2000; i += 10 ) {
+    sprintf( name, "/BIG/F%05d.TXT", i );
+    ok = ok && holds( name, i + 1, 500 );
+  }
+  check( "deleted files are made again in a large directory",
+         ok && entries( "/BIG" ) == 1202 && missing( "/BIG/F00102.TXT" ) == ENOENT );
+  r = reads();
+  int fd = fat_open( &vol, "/BIG/NEW.TXT", O_WRONLY | O_CREAT, 0644, &rerrno );
+  r = reads() - r;
+  ok = fd >= 0 && put( fd, 7, 0, 50 ) == 0;
+  check( "a file is added to a large directory",
+         fat_close( fd, &rerrno ) == 0 && ok && holds( "/BIG/NEW.TXT", 7, 50 ) );
+#if GRISTLE_DIR_INDEX_SLOTS > 0
+  // Its entry goes in the last sector, which was read when the
+  // directory's index was built.
+  check( "adding a file to a large directory doesn't search it", r <= 1 );
+#endif
+  check( "a large directory agrees with the volume after a remount",
+         remount() == 0 && entries( "/BIG" ) == 1203 && holds( "/BIG/F00990.TXT", 991, 500 ) &&
+         holds( "/BIG/F01999.TXT", 1999, 10 + 1999 % 100 ) && missing( "/BIG/F01998.TXT" ) == ENOENT );
+  stop();
+}
+
+// Two volumes mounted at once.
+static void test_two_volumes( void ) {
+  static struct fat_volume other;
+  int rerrno;
+  int fd = create();
+  format( fd, 0, IMAGE_BLOCKS / 2, 1, 0 );
+  uint32_t first = img.free;
+  format( fd, IMAGE_BLOCKS / 2, IMAGE_BLOCKS / 2, 2, 0 );
+  uint32_t second = img.free;
+  close( fd );
+  block_pc_set_image_name( IMAGE );
+  check( "two volumes mount",
+         block_init() == 0 && fat_mount( &vol, 0, IMAGE_BLOCKS / 2, PART_TYPE_FAT32 ) == 0 &&
+         fat_mount( &other, IMAGE_BLOCKS / 2, IMAGE_BLOCKS / 2, PART_TYPE_FAT32 ) == 0 );
+  unlink( IMAGE );
+  check( "each volume has its own free count",
+         fat_get_free_count( &vol ) == first && fat_get_free_count( &other ) == second );
+  // The same names, with different data, written in turn.
+  int a = fat_open( &vol, "/LOG.TXT", O_WRONLY | O_CREAT, 0644, &rerrno );
+  int b = fat_open( &other, "/LOG.TXT", O_WRONLY | O_CREAT, 0644, &rerrno );
+  int ok = a >= 0 && b >= 0;
+  for ( uint32_t pos = 0; pos < 100 * 1000; pos += 1000 ) {
+    ok = ok && put( a, 1, pos, 1000 ) == 0 && put( b, 2, pos, 1000 ) == 0;
+  }
+  ok = fat_close( a, &rerrno ) == 0 && fat_close( b, &rerrno ) == 0 && ok;
+  on = &other;
+  ok = ok && holds( "/LOG.TXT", 2, 100 * 1000 ) && make( "/ONLY.TXT", 3, 700 ) == 0;
+  on = &vol;
+  check( "files of the same name on two volumes keep their own data",
+         ok && holds( "/LOG.TXT", 1, 100 * 1000 ) && missing( "/ONLY.TXT" ) == ENOENT );
+  check( "each volume counts its own clusters",
+         fat_get_free_count( &vol ) == first - 196 && fat_get_free_count( &other ) == second - 99 );
+  fat_unlink( &vol, "/LOG.TXT", &rerrno );
+  on = &other;
+  ok = holds( "/LOG.TXT", 2, 100 * 1000 );
+  on = &vol;
+  check( "unlinking a file on one volume leaves the other's", ok && missing( "/LOG.TXT" ) == ENOENT );
+  check( "one volume unmounts while the other stays",
+         fat_umount( &vol ) == 0 && fat_get_free_count( &other ) == second - 99 );
+  on = &other;
+  ok = holds( "/ONLY.TXT", 3, 700 ) && make( "/MORE.TXT", 4, 5000 ) == 0 &&
+       holds( "/MORE.TXT", 4, 5000 ) && entries( "/" ) == 3;
+  on = &vol;
+  check( "a volume works on after the other is unmounted", ok );
+  check( "both volumes mount again as they were left",
+         fat_umount( &other ) == 0 &&
+         fat_mount( &vol, 0, IMAGE_BLOCKS / 2, PART_TYPE_FAT32 ) == 0 &&
+         fat_mount( &other, IMAGE_BLOCKS / 2, IMAGE_BLOCKS / 2, PART_TYPE_FAT32 ) == 0 &&
+         fat_get_free_count( &vol ) == first && entries( "/" ) == 0 &&
+         fat_get_free_count( &other ) == second - 99 - 5 );
+  fat_umount( &other );
+  stop();
+}
+
+/** Check one of fat_get_next_dirents' entries against the file's fstat. */
+static int dirent_ok( const char *dir, const fat_dirent *e, const char *name, uint32_t size, int is_dir ) {
+  struct stat st;
+  char path[ 32 ];
+  int rerrno;
+  sprintf( path, "%s/%s", dir, name );
+  int fd = fat_open( on, path, O_RDONLY, 0, &rerrno );
+  int ok = fd >= 0 && fat_fstat( fd, &st, &rerrno ) == 0;
+  if ( fd >= 0 ) { fat_close( fd, &rerrno ); }
+  return ok && strcmp( e->d_name, name ) == 0 && e->size == size &&
+         ( ( e->attributes & FAT_ATT_SUBDIR ) != 0 ) == is_dir && e->first_cluster != 0 &&
+         e->created == st.st_ctime && e->modified == st.st_mtime;
+}
+
+// Reading directory entries with their sizes and times.
+static void test_dirents( void ) {
+  static fat_dirent e[ 50 ];
+  struct dirent de;
+  int rerrno;
+  start( 1, 0 );
+  fat_mkdir( &vol, "/D", 0755, &rerrno );
+  if ( make( "/D/A.TXT", 1, 1000 ) || make( "/D/B.BIN", 2, 5000 ) ) { ++failures; }
+  fat_mkdir( &vol, "/D/SUB", 0755, &rerrno );
+  int fd = fat_open( &vol, "/D", O_RDONLY, 0, &rerrno );
+  int n = fat_get_next_dirents( fd, e, 50, &rerrno );
+  check( "a directory's entries are read", n == 5 && strcmp( e[ 0 ].d_name, "." ) == 0 &&
+         strcmp( e[ 1 ].d_name, ".." ) == 0 );
+  check( "a file's entry has its name, size, attributes and times",
+         n == 5 && dirent_ok( "/D", &e[ 2 ], "A.TXT", 1000, 0 ) && dirent_ok( "/D", &e[ 3 ], "B.BIN", 5000, 0 ) );
+  check( "a directory's entry has its name and attributes",
+         n == 5 && dirent_ok( "/D", &e[ 4 ], "SUB", 0, 1 ) );
+  check( "the end of a directory stays the end",
+         fat_get_next_dirents( fd, e, 50, &rerrno ) == 0 && rerrno == 0 &&
+         fat_get_next_dirents( fd, e, 50, &rerrno ) == 0 );
+  fat_close( fd, &rerrno );
+  // The two calls mixed, and the first cluster as d_ino.
+  fd = fat_open( &vol, "/D", O_RDONLY, 0, &rerrno );
+  int ok = fat_get_next_dirent( fd, &de, &rerrno ) == 0 && fat_get_next_dirent( fd, &de, &rerrno ) == 0 &&
+           fat_get_next_dirents( fd, e, 1, &rerrno ) == 1 && strcmp( e[ 0 ].d_name, "A.TXT" ) == 0 &&
+           fat_get_next_dirent( fd, &de, &rerrno ) == 0 && strcmp( de.d_name, "B.BIN" ) == 0 &&
+           fat_get_next_dirents( fd, &e[ 1 ], 5, &rerrno ) == 1 && strcmp( e[ 1 ].d_name, "SUB" ) == 0;
+  fat_close( fd, &rerrno );
+  fd = fat_open( &vol, "/D", O_RDONLY, 0, &rerrno );
+  for ( n = 0; n < 3 && fat_get_next_dirent( fd, &de, &rerrno ) == 0; ++n ) {}
+  fat_close( fd, &rerrno );
+  check( "the two calls can be mixed, and agree on the first cluster",
+         ok && n == 3 && strcmp( de.d_name, "A.TXT" ) == 0 && ( uint32_t )de.d_ino == e[ 0 ].first_cluster );
+  // Entries over several sectors and clusters, a few at a time.
+  char name[ 16 ];
+  for ( int i = 0; i < 40; ++i ) {
+    sprintf( name, "/D/SUB/F%02d.BIN", i );
+    if ( make( name, i, 100 + i ) ) { ++failures; }
+  }
+  fd = fat_open( &vol, "/D/SUB", O_RDONLY, 0, &rerrno );
+  int got = 0;
+  ok = 1;
+  while ( ( n = fat_get_next_dirents( fd, e, 7, &rerrno ) ) > 0 ) {
+    for ( int i = 0; i < n; ++i, ++got ) {
+      if ( got < 2 ) { continue; }
+      sprintf( name, "F%02d.BIN", got - 2 );
+      ok = ok && strcmp( e[ i ].d_name, name ) == 0 && e[ i ].size == ( uint32_t )( 100 + got - 2 );
+    }
+  }
+  fat_close( fd, &rerrno );
+  check( "entries are read across sectors and clusters", ok && got == 42 && n == 0 );
+  fd = fat_open( &vol, "/D/A.TXT", O_RDONLY, 0, &rerrno );
+  check( "a file has no entries to read",
+         fat_get_next_dirents( fd, e, 1, &rerrno ) == -1 && rerrno == ENOTDIR );
+  fat_close( fd, &rerrno );
+  stop();
+}
+
+int main( void ) {
+  test_free_map();
+  test_fs_info();
+  test_meta_cache();
+  test_extents();
+  test_alloc_runs();
+  test_dentries();
+  test_big_dir();
+  test_two_volumes();
+  test_dirents();
+  printf( "\n%d tests, %d failures.\n", p, failures );
+  return failures ? 1 : 0;
+}
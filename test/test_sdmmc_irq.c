@@ -0,0 +1,311 @@
+/*
+ * Host-side tests for the SDMMC command engine in `port/sdmmc.c`.
+ *
+ * The SDMMC registers are modelled in plain RAM. Whenever the driver
+ * disables interrupts or sleeps, the model applies `ICR` writes,
+ * picks up newly-started commands, and delivers scripted status flags
+ * once their (simulated) time arrives. In `WFI` mode, sleeping also
+ * raises the 'interrupt' by calling `sdmmc_irq_handler`.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "port/sdmmc.h"
+
+volatile uint32_t tick = 0;
+uint32_t timer_micros( void ) { return tick * 1000; }
+
+// Register model state.
+static SDMMC_TypeDef regs;
+// Some registers are read-only to the driver, but not to the model.
+#define RO( reg ) ( *( volatile uint32_t* )&regs.reg )
+static int dat0_high = 1;
+static uint32_t dat0_release = 0;
+static int spins = 0;
+static int sleeps = 0;
+// Pending status flags, and the `tick` when they will be set.
+#define MAX_EVENTS ( 8 )
+static struct { uint32_t at; uint32_t sta; } events[ MAX_EVENTS ];
+static int num_events = 0;
+// Card behavior for the current test.
+static void ( *respond )( uint32_t idx, uint32_t arg ) = NULL;
+static uint32_t last_cmd = 0xFFFFFFFF;
+static uint32_t last_arg = 0;
+static int cmd_count[ 64 ];
+
+static void queue( uint32_t delay, uint32_t sta ) {
+  events[ num_events ].at  = tick + delay;
+  events[ num_events ].sta = sta;
+  ++num_events;
+}
+
+static void host_step( void ) {
+  // `ICR` bits clear the matching `STA` bits.
+  RO( STA ) &= ~regs.ICR;
+  regs.ICR  =  0;
+  // Pick up a command written to the `CMD` register.
+  if ( regs.CMD & SDMMC_CMD_CPSMEN ) {
+    last_cmd  = regs.CMD & SDMMC_CMD_CMDINDEX;
+    last_arg  = regs.ARG;
+    ++cmd_count[ last_cmd ];
+    regs.CMD &= ~SDMMC_CMD_CPSMEN;
+    if ( respond ) { respond( last_cmd, regs.ARG ); }
+  }
+  // Deliver any status flags which are due.
+  for ( int i = 0; i < num_events; ++i ) {
+    if ( ( int32_t )( tick - events[ i ].at ) >= 0 ) {
+      RO( STA ) |= events[ i ].sta;
+      events[ i ] = events[ num_events - 1 ];
+      --num_events;
+      --i;
+    }
+  }
+  if ( !dat0_high && ( int32_t )( tick - dat0_release ) >= 0 ) {
+    dat0_high = 1;
+  }
+}
+
+void host_irq_off( void ) {
+  // Spinning callers poll often; let 1ms pass every 16 polls.
+  if ( ( ++spins & 0x0F ) == 0 ) { ++tick; }
+  host_step();
+}
+
+void host_sleep( void ) {
+  ++sleeps;
+  ++tick;
+  host_step();
+  if ( regs.STA & regs.MASK ) { sdmmc_irq_handler( &regs ); }
+}
+
+int host_dat0_high( void ) { return dat0_high; }
+
+// A well-behaved card: short responses after 1ms, and 512-byte
+// data transfers which finish after 3ms. Writes hold `DAT0` low
+// (busy) for 10ms after the data is sent.
+static void card_ok( uint32_t idx, uint32_t arg ) {
+  ( void )arg;
+  RO( RESPCMD ) = idx;
+  // (Programming ends when `DAT0` goes high.)
+  RO( RESP1 )   = dat0_high ?
+    ( ( SDMMC_STATE_TRAN << 9 ) | SDMMC_READY_FOR_DATA ) :
+    ( SDMMC_STATE_PRG << 9 );
+  if ( !( regs.CMD & SDMMC_CMD_WAITRESP ) ) {
+    queue( 1, SDMMC_STA_CMDSENT );
+    return;
+  }
+  queue( 1, SDMMC_STA_CMDREND );
+  if ( idx == SDMMC_CMD_READ_BLOCK ) {
+    regs.FIFO = 0xA5A5A5A5;
+    queue( 2, SDMMC_STA_RXDAVL );
+    queue( 3, SDMMC_STA_DATAEND );
+  }
+  else if ( idx == SDMMC_CMD_WRITE_BLOCK ) {
+    RO( STA ) |= SDMMC_STA_TXFIFOHE;
+    queue( 3, SDMMC_STA_DATAEND );
+    dat0_high = 0;
+    dat0_release = tick + 13;
+  }
+}
+
+// A card which has been removed: nothing ever happens.
+static void card_gone( uint32_t idx, uint32_t arg ) {
+  ( void )idx;
+  ( void )arg;
+}
+
+// The peripheral's own response timeout fires.
+static void card_ctimeout( uint32_t idx, uint32_t arg ) {
+  ( void )idx;
+  ( void )arg;
+  queue( 1, SDMMC_STA_CTIMEOUT );
+}
+
+// Responses arrive without a valid CRC, like ACMD41.
+static void card_no_crc( uint32_t idx, uint32_t arg ) {
+  ( void )arg;
+  ( void )idx;
+  RO( RESPCMD ) = 0x3F;
+  RO( RESP1 )   = 0x80FF8000;
+  queue( 1, SDMMC_STA_CCRCFAIL );
+}
+
+// Reads fail with a data CRC error.
+static void card_bad_data( uint32_t idx, uint32_t arg ) {
+  card_ok( idx, arg );
+  if ( idx == SDMMC_CMD_READ_BLOCK ) {
+    num_events = 1;
+    queue( 3, SDMMC_STA_DCRCFAIL );
+  }
+}
+
+// Reads respond to the command, but no data ever arrives.
+static void card_no_data( uint32_t idx, uint32_t arg ) {
+  card_ok( idx, arg );
+  if ( idx == SDMMC_CMD_READ_BLOCK ) { num_events = 1; }
+}
+
+// Writes never finish programming.
+static void card_stuck_busy( uint32_t idx, uint32_t arg ) {
+  card_ok( idx, arg );
+  if ( idx == SDMMC_CMD_WRITE_BLOCK ) { dat0_release = tick + 100000; }
+}
+
+static void reset( void ( *card )( uint32_t, uint32_t ), int wait_mode ) {
+  memset( &regs, 0, sizeof( regs ) );
+  memset( cmd_count, 0, sizeof( cmd_count ) );
+  num_events = 0;
+  dat0_high = 1;
+  spins = 0;
+  sleeps = 0;
+  respond = card;
+  sdmmc_setup( &regs );
+  sdmmc_irq_setup( &regs, wait_mode );
+}
+
+static int p = 0;
+static int failures = 0;
+
+static void check( const char *desc, int ok ) {
+  printf( "[%4d] Testing %s", p++, desc );
+  if ( ok ) { printf( "  [ ok ]\n" ); }
+  else {
+    printf( "  [fail]\n" );
+    ++failures;
+  }
+}
+
+int main( void ) {
+  uint32_t resp[ 4 ];
+  uint32_t buf[ 128 ];
+  uint32_t start;
+  int mode;
+  const char *mode_names[ 2 ] = { "(spin)", "(WFI)" };
+  char desc[ 128 ];
+
+  printf( "Running SDMMC command engine tests...\n\n" );
+
+  for ( mode = SDMMC_WAIT_SPIN; mode <= SDMMC_WAIT_WFI; ++mode ) {
+    reset( card_ok, mode );
+    sdmmc_cmd_write( &regs, SDMMC_CMD_GET_STAT, 0x12340000,
+                     SDMMC_RESPONSE_SHORT );
+    int r = sdmmc_cmd_read( &regs, SDMMC_RESPONSE_SHORT,
+                            SDMMC_CHECK_CRC, resp );
+    sdmmc_cmd_done( &regs );
+    snprintf( desc, sizeof( desc ), "short response %s", mode_names[ mode ] );
+    check( desc, r == 0 && last_cmd == SDMMC_CMD_GET_STAT &&
+                 ( resp[ 0 ] & SDMMC_READY_FOR_DATA ) &&
+                 sdmmc_xfer.state == SDMMC_XFER_DONE &&
+                 ( mode == SDMMC_WAIT_SPIN || sleeps > 0 ) );
+
+    reset( card_ok, mode );
+    sdmmc_cmd_write( &regs, SDMMC_CMD_GO_IDLE, 0, SDMMC_RESPONSE_NONE );
+    snprintf( desc, sizeof( desc ), "no-response command %s", mode_names[ mode ] );
+    check( desc, sdmmc_cmd_read_type( &regs ) == 0x00 &&
+                 sdmmc_xfer.state == SDMMC_XFER_DONE );
+
+    reset( card_ok, mode );
+    memset( buf, 0, sizeof( buf ) );
+    r = sdmmc_read_block( &regs, SDMMC_HC, 1, 42, buf );
+    snprintf( desc, sizeof( desc ), "block read %s", mode_names[ mode ] );
+    check( desc, r == 0 && buf[ 0 ] == 0xA5A5A5A5 &&
+                 buf[ 127 ] == 0xA5A5A5A5 &&
+                 ( regs.DCTRL & SDMMC_DCTRL_DTDIR ) );
+
+    reset( card_ok, mode );
+    memset( buf, 0x5A, sizeof( buf ) );
+    start = tick;
+    r = sdmmc_write_block( &regs, SDMMC_HC, 1, 42, buf );
+    snprintf( desc, sizeof( desc ), "block write returns after data end %s", mode_names[ mode ] );
+    check( desc, r == 0 && ( tick - start ) < 13 && regs.FIFO == 0x5A5A5A5A &&
+                 sdmmc_card_state() == SDMMC_STATE_PRG );
+    r = sdmmc_read_block( &regs, SDMMC_HC, 1, 42, buf );
+    snprintf( desc, sizeof( desc ), "next command waits for DAT0 %s", mode_names[ mode ] );
+    check( desc, r == 0 && ( tick - start ) >= 13 &&
+                 sdmmc_card_state() == SDMMC_STATE_TRAN &&
+                 cmd_count[ SDMMC_CMD_GET_STAT ] == 0 );
+
+    reset( card_gone, mode );
+    start = tick;
+    sdmmc_cmd_write( &regs, SDMMC_CMD_GET_STAT, 0x12340000,
+                     SDMMC_RESPONSE_SHORT );
+    r = sdmmc_cmd_read( &regs, SDMMC_RESPONSE_SHORT,
+                        SDMMC_CHECK_CRC, resp );
+    sdmmc_cmd_done( &regs );
+    snprintf( desc, sizeof( desc ), "missing card times out %s", mode_names[ mode ] );
+    check( desc, r == -1 && ( sdmmc_xfer.sta & SDMMC_XFER_TIMEOUT ) &&
+                 ( tick - start ) > SDMMC_CMD_TIMEOUT_MS &&
+                 ( tick - start ) < SDMMC_CMD_TIMEOUT_MS + 10 );
+  }
+
+  reset( card_ctimeout, SDMMC_WAIT_WFI );
+  sdmmc_cmd_write( &regs, SDMMC_CMD_GET_STAT, 0, SDMMC_RESPONSE_SHORT );
+  check( "response timeout flag is an error",
+         sdmmc_cmd_read( &regs, SDMMC_RESPONSE_SHORT,
+                         SDMMC_CHECK_CRC, resp ) == -1 &&
+         sdmmc_cmd_read_type( &regs ) == 0xFF &&
+         sdmmc_xfer.state == SDMMC_XFER_ERROR );
+
+  reset( card_no_crc, SDMMC_WAIT_WFI );
+  sdmmc_cmd_write( &regs, SDMMC_APP_HCS_OPCOND, 0, SDMMC_RESPONSE_SHORT );
+  int r = sdmmc_cmd_read( &regs, SDMMC_RESPONSE_SHORT,
+                          SDMMC_NO_CRC, resp );
+  check( "CRC failure ignored when asked", r == 0 && resp[ 0 ] == 0x80FF8000 );
+  sdmmc_cmd_write( &regs, SDMMC_APP_HCS_OPCOND, 0, SDMMC_RESPONSE_SHORT );
+  r = sdmmc_cmd_read( &regs, SDMMC_RESPONSE_SHORT,
+                      SDMMC_CHECK_CRC, resp );
+  check( "CRC failure reported otherwise", r == -1 );
+
+  reset( card_ok, SDMMC_WAIT_SPIN );
+  sdmmc_cmd_start( &regs, SDMMC_CMD_GET_STAT, 0, SDMMC_RESPONSE_SHORT, 0 );
+  int work = 0;
+  while ( sdmmc_xfer_poll( &regs ) < SDMMC_XFER_DONE ) { ++work; }
+  check( "caller keeps working while a command runs",
+         work > 0 && sdmmc_xfer.state == SDMMC_XFER_DONE );
+
+  reset( card_bad_data, SDMMC_WAIT_WFI );
+  start = tick;
+  check( "data CRC error fails the read",
+         sdmmc_read_block( &regs, SDMMC_HC, 1, 0, buf ) == -1 &&
+         ( sdmmc_xfer.sta & SDMMC_STA_DCRCFAIL ) &&
+         ( tick - start ) < SDMMC_DATA_TIMEOUT_MS );
+
+  reset( card_no_data, SDMMC_WAIT_WFI );
+  start = tick;
+  check( "read with no data times out",
+         sdmmc_read_block( &regs, SDMMC_HC, 1, 0, buf ) == -1 &&
+         ( sdmmc_xfer.sta & SDMMC_XFER_TIMEOUT ) &&
+         ( tick - start ) > SDMMC_DATA_TIMEOUT_MS );
+
+  reset( card_stuck_busy, SDMMC_WAIT_WFI );
+  sdmmc_write_block( &regs, SDMMC_HC, 1, 0, buf );
+  start = tick;
+  check( "write stuck busy times out",
+         sdmmc_card_wait_ready( &regs ) == -1 &&
+         cmd_count[ SDMMC_CMD_GET_STAT ] > 0 &&
+         ( tick - start ) > SDMMC_BUSY_TIMEOUT_MS );
+
+  reset( card_ok, SDMMC_WAIT_SPIN );
+  sdmmc_read_block( &regs, SDMMC_HC, 7, 0, buf );
+  sdmmc_write_block( &regs, SDMMC_HC, 7, 1, buf );
+  sdmmc_read_block( &regs, SDMMC_HC, 7, 2, buf );
+  check( "card stays selected across transfers",
+         cmd_count[ SDMMC_CMD_SEL_DESEL ] == 1 &&
+         sdmmc_card_state() == SDMMC_STATE_TRAN );
+  sdmmc_deselect_card( &regs );
+  check( "deselect sends CMD7 to RCA 0",
+         cmd_count[ SDMMC_CMD_SEL_DESEL ] == 2 && last_arg == 0 &&
+         sdmmc_card_state() == SDMMC_STATE_STBY );
+  sdmmc_deselect_card( &regs );
+  check( "deselect twice sends nothing",
+         cmd_count[ SDMMC_CMD_SEL_DESEL ] == 2 );
+  sdmmc_select_card( &regs, 7 );
+  sdmmc_cmd_write( &regs, SDMMC_CMD_GO_IDLE, 0, SDMMC_RESPONSE_NONE );
+  sdmmc_cmd_done( &regs );
+  check( "CMD0 forgets the selected card",
+         sdmmc_card_state() == SDMMC_STATE_STBY );
+
+  printf( "\n%d tests, %d failures.\n", p, failures );
+  return failures ? 1 : 0;
+}
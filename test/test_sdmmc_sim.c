@@ -0,0 +1,563 @@
+/*
+ * Host-side tests for the SD card driver stack, run against the
+ * register-level SDMMC / SD card simulator in `sdmmc_sim.c`.
+ *
+ * `block_sd_foss.c` and `port/sdmmc.c` are built unmodified. The
+ * simulated card is backed by a scratch image file, so the tests
+ * can check what actually reached the 'card'.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "block_sd_foss.h"
+#include "sdmmc_sim.h"
+
+extern SDMMC_TypeDef *sdmmc;
+extern SDCard card;
+
+#define IMAGE        "sdmmc_sim.img"
+#define IMAGE_BLOCKS ( 8192 )
+
+static int p = 0;
+static int failures = 0;
+
+static void check( const char *desc, int ok ) {
+  printf( "[%4d] Testing %s", p++, desc );
+  if ( ok ) { printf( "  [ ok ]\n" ); }
+  else {
+    printf( "  [fail]\n" );
+    ++failures;
+  }
+}
+
+/** Set up the peripheral and the card, as after an MCU reset. */
+static int boot( int wait_mode ) {
+  sdmmc_setup( sdmmc );
+  sdmmc_irq_setup( sdmmc, wait_mode );
+  return block_init();
+}
+
+/**
+ * Create a blank image, and start the simulator over it: a card
+ * which was just powered on. Then boot with it.
+ */
+static int start( const sdmmc_sim_config *cfg, int wait_mode ) {
+  int fd = open( IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+  if ( fd < 0 || ftruncate( fd, ( off_t )IMAGE_BLOCKS * 512 ) ) { return -1; }
+  close( fd );
+  sdmmc = sdmmc_sim_open( IMAGE, cfg );
+  if ( !sdmmc ) { return -1; }
+  return boot( wait_mode );
+}
+
+static void image_read( uint32_t block, void *buf ) {
+  int fd = open( IMAGE, O_RDONLY );
+  pread( fd, buf, 512, ( off_t )block * 512 );
+  close( fd );
+}
+
+static void fill( uint8_t *buf, uint32_t seed );
+
+static void image_write( uint32_t block, const void *buf ) {
+  int fd = open( IMAGE, O_WRONLY );
+  pwrite( fd, buf, 512, ( off_t )block * 512 );
+  close( fd );
+}
+
+/**
+ * Read `n` blocks starting at `block`, spending `work_ns` on each one
+ * as if it were processed, and check them against `fill`. Returns the
+ * simulated time taken, or 0 if any block was wrong.
+ */
+static uint64_t scan( uint32_t block, uint32_t n, uint32_t work_ns, int stream ) {
+  static uint8_t rbuf[ 512 ], wbuf[ 512 ];
+  uint64_t start = sdmmc_sim_now();
+  if ( stream && block_stream_start( block, n ) ) { return 0; }
+  for ( uint32_t b = block; b < block + n; ++b ) {
+    fill( wbuf, b );
+    if ( block_read( b, rbuf ) || memcmp( wbuf, rbuf, 512 ) ) { return 0; }
+    sdmmc_sim_advance( work_ns );
+  }
+  if ( block_stream_stop() ) { return 0; }
+  return sdmmc_sim_now() - start;
+}
+
+static void fill( uint8_t *buf, uint32_t seed ) {
+  for ( int i = 0; i < 512; ++i ) { buf[ i ] = ( uint8_t )( seed * 31 + i * 7 ); }
+}
+
+int main( void ) {
+  static uint8_t wbuf[ 512 ], rbuf[ 512 ], ibuf[ 512 ];
+  const sdmmc_sim_stats *stats = sdmmc_sim_get_stats();
+  sdmmc_sim_config cfg;
+  sdmmc_sim_defaults( &cfg );
+
+  // High-capacity card, interrupt-driven waits.
+  int r = start( &cfg, SDMMC_WAIT_WFI );
+  check( "SDHC card initializes", r == 0 && card.type == SD_CARD_HC );
+  check( "SDHC capacity from CSD v2",
+         block_get_volume_size() == IMAGE_BLOCKS );
+  check( "ACMD41 repeats until the card powers up",
+         stats->cmds[ 64 + SDMMC_APP_HCS_OPCOND ] > 1 &&
+         sdmmc_sim_now() >= cfg.init_ns );
+  check( "ACMD41 polls are paced",
+         stats->cmds[ 64 + SDMMC_APP_HCS_OPCOND ] <=
+         cfg.init_ns / 1000000 / SD_ACMD41_POLL_MS + 2 );
+  check( "card is selected after init",
+         sdmmc_sim_card_state() == SDMMC_STATE_TRAN );
+  check( "init ends on a 4-bit high-speed bus",
+         sdmmc_sim_bus_width() == 4 && sdmmc_sim_high_speed() &&
+         ( sdmmc->CLKCR & SDMMC_CLKCR_BYPASS ) &&
+         ( sdmmc->CLKCR & SDMMC_CLKCR_WIDBUS ) );
+  check( "cards without CMD48 / CMD49 get no write cache",
+         !card.cache && stats->cmds[ 64 + SDMMC_APP_GET_SCR ] == 1 &&
+         stats->cmds[ SDMMC_CMD_READ_EXTR ] == 0 &&
+         block_flush_cache() == 0 );
+  check( "cold init reports its time",
+         !card.warm && card.init_us >= cfg.init_ns / 1000 &&
+         card.init_us <= sdmmc_sim_now() / 1000 );
+
+  // Reset the MCU, but not the card.
+  sdmmc_sim_reset_stats();
+  r = boot( SDMMC_WAIT_WFI );
+  check( "warm boot re-uses the card",
+         r == 0 && card.warm && card.type == SD_CARD_HC &&
+         block_get_volume_size() == IMAGE_BLOCKS &&
+         stats->cmds[ SDMMC_CMD_GO_IDLE ] == 0 &&
+         stats->cmds[ 64 + SDMMC_APP_HCS_OPCOND ] == 0 );
+  check( "warm boot is fast", card.init_us < 1000 );
+  check( "warm boot keeps the fast bus",
+         sdmmc_sim_card_state() == SDMMC_STATE_TRAN &&
+         ( sdmmc->CLKCR & SDMMC_CLKCR_BYPASS ) &&
+         ( sdmmc->CLKCR & SDMMC_CLKCR_WIDBUS ) );
+
+  sdmmc_sim_reset_stats();
+  fill( wbuf, 1 );
+  r = block_write( 100, wbuf );
+  check( "write returns while the card programs",
+         r == 0 && sdmmc_sim_card_state() == SDMMC_STATE_PRG );
+  image_read( 100, ibuf );
+  check( "written block reaches the image", memcmp( wbuf, ibuf, 512 ) == 0 );
+  memset( rbuf, 0, sizeof( rbuf ) );
+  r = block_read( 100, rbuf );
+  check( "read back after write-behind",
+         r == 0 && memcmp( wbuf, rbuf, 512 ) == 0 &&
+         sdmmc_sim_card_state() == SDMMC_STATE_TRAN );
+  check( "no CMD7 or FIFO errors per transfer",
+         stats->cmds[ SDMMC_CMD_SEL_DESEL ] == 0 &&
+         stats->fifo_errors == 0 &&
+         stats->blocks_read == 1 && stats->blocks_written == 1 );
+
+  for ( uint32_t b = 0; b < 16; ++b ) {
+    fill( wbuf, b + 2 );
+    block_write( 200 + b, wbuf );
+  }
+  int ok = 1;
+  for ( uint32_t b = 0; b < 16; ++b ) {
+    fill( wbuf, b + 2 );
+    ok &= ( block_read( 200 + b, rbuf ) == 0 &&
+            memcmp( wbuf, rbuf, 512 ) == 0 );
+  }
+  check( "sequence of writes then reads", ok );
+
+  check( "read past the end of the card fails",
+         block_read( IMAGE_BLOCKS, rbuf ) == -1 );
+  check( "card recovers after a failed read",
+         block_read( 100, rbuf ) == 0 );
+  // Streaming reads.
+  for ( uint32_t b = 1000; b < 1100; ++b ) {
+    fill( wbuf, b );
+    image_write( b, wbuf );
+  }
+  sdmmc_sim_reset_stats();
+  uint64_t t_stream = scan( 1000, 37, 0, 1 );
+  check( "stream reads a run with one CMD18",
+         t_stream > 0 && stats->cmds[ SDMMC_CMD_READ_BLOCKS ] == 1 &&
+         stats->cmds[ SDMMC_CMD_READ_BLOCK ] == 0 &&
+         stats->cmds[ SDMMC_CMD_STOP_TRANS ] == 1 &&
+         stats->fifo_errors == 0 &&
+         sdmmc_sim_card_state() == SDMMC_STATE_TRAN );
+  uint64_t t_single = scan( 1000, 48, 100000, 0 );
+  t_stream = scan( 1000, 48, 100000, 1 );
+  check( "stream overlaps the card with the caller's work",
+         t_single > 0 && t_stream > 0 && t_stream * 4 < t_single * 3 );
+  sdmmc_sim_reset_stats();
+  block_stream_start( 1050, 20 );
+  fill( wbuf, 1050 );
+  r = block_read( 1050, rbuf );
+  ok = ( r == 0 && memcmp( wbuf, rbuf, 512 ) == 0 );
+  // Reading somewhere else stops the stream.
+  fill( wbuf, 1090 );
+  r = block_read( 1090, rbuf );
+  check( "other reads stop the stream",
+         ok && r == 0 && memcmp( wbuf, rbuf, 512 ) == 0 &&
+         stats->cmds[ SDMMC_CMD_STOP_TRANS ] == 1 &&
+         stats->cmds[ SDMMC_CMD_READ_BLOCK ] == 1 );
+  block_stream_start( 1060, 20 );
+  fill( wbuf, 1 );
+  r = block_write( 100, wbuf );
+  check( "writes stop the stream",
+         r == 0 && stats->cmds[ SDMMC_CMD_STOP_TRANS ] == 2 &&
+         block_read( 100, rbuf ) == 0 && memcmp( wbuf, rbuf, 512 ) == 0 );
+
+  // Card profile. The scratch area has data in it, which the probe
+  // must leave alone.
+  for ( uint32_t b = 1; b < 1 + SD_PROBE_BLOCKS; ++b ) {
+    fill( wbuf, b + 5000 );
+    image_write( b, wbuf );
+  }
+  sdmmc_sim_reset_stats();
+  r = block_probe( 1, 64 );
+  const block_profile *prof = block_get_profile();
+  check( "probe reads the SD Status register",
+         r == 0 && prof->probed && prof->speed_class == 10 &&
+         prof->uhs_grade == 1 && prof->au_blocks == 8192 &&
+         stats->cmds[ 64 + SDMMC_APP_GET_STAT ] == 1 );
+  check( "probe times random reads",
+         stats->blocks_read >= SD_PROBE_READS + SD_PROBE_BLOCKS &&
+         prof->read_us >= cfg.read_ns / 1000 &&
+         prof->read_us < cfg.read_ns / 1000 * 2 &&
+         prof->read_max_us >= prof->read_us );
+  check( "probe times a sequential write",
+         stats->blocks_written == SD_PROBE_BLOCKS &&
+         prof->write_us >= cfg.program_ns / 1000 &&
+         prof->write_us < cfg.program_ns / 1000 * 2 );
+  ok = 1;
+  for ( uint32_t b = 1; b < 1 + SD_PROBE_BLOCKS; ++b ) {
+    fill( wbuf, b + 5000 );
+    image_read( b, ibuf );
+    ok &= ( memcmp( wbuf, ibuf, 512 ) == 0 );
+  }
+  check( "probe leaves the scratch area as it was", ok );
+  sdmmc_sim_reset_stats();
+  r = block_probe( 1, 0 );
+  check( "probe without a scratch area does not write",
+         r == 0 && prof->probed && prof->read_us > 0 &&
+         prof->write_us == 0 && stats->blocks_written == 0 );
+
+  // Error recovery.
+  sdmmc_sim_faults faults;
+  memset( &faults, 0, sizeof( faults ) );
+  block_sd_reset_stats();
+  const SDStats *sd = block_sd_get_stats();
+  faults.read_crc = 1;
+  sdmmc_sim_inject( &faults );
+  fill( wbuf, 1010 );
+  r = block_read( 1010, rbuf );
+  check( "read retried after a data CRC error",
+         r == 0 && memcmp( wbuf, rbuf, 512 ) == 0 &&
+         sd->retries == 1 && sd->recoveries == 1 && sd->reinits == 0 &&
+         block_get_error() == 0 );
+  faults.read_crc = 0;
+  faults.cmd_crc = 1;
+  sdmmc_sim_inject( &faults );
+  r = block_read( 1011, rbuf );
+  fill( wbuf, 1011 );
+  check( "read retried after a response CRC error",
+         r == 0 && memcmp( wbuf, rbuf, 512 ) == 0 && sd->retries == 2 );
+  faults.cmd_crc = 0;
+  faults.write_crc = 1;
+  sdmmc_sim_inject( &faults );
+  fill( wbuf, 5 );
+  r = block_write( 500, wbuf );
+  sdmmc_card_wait_ready( sdmmc );
+  image_read( 500, ibuf );
+  check( "write retried after a CRC status error",
+         r == 0 && memcmp( wbuf, ibuf, 512 ) == 0 && sd->retries == 3 );
+  faults.write_crc = 0;
+  faults.read_crc = 1;
+  sdmmc_sim_inject( &faults );
+  sdmmc_sim_reset_stats();
+  check( "stream survives a data CRC error",
+         scan( 1000, 40, 0, 1 ) > 0 &&
+         stats->cmds[ SDMMC_CMD_STOP_TRANS ] >= 1 &&
+         sdmmc_sim_card_state() == SDMMC_STATE_TRAN );
+  faults.read_crc = 0;
+  faults.hung = 1;
+  sdmmc_sim_inject( &faults );
+  block_sd_reset_stats();
+  fill( wbuf, 1020 );
+  r = block_read( 1020, rbuf );
+  check( "hung card is re-initialized",
+         r == 0 && memcmp( wbuf, rbuf, 512 ) == 0 &&
+         sd->reinits == 1 && sd->failures == 0 &&
+         sdmmc_sim_bus_width() == 4 );
+  faults.hung = 0;
+  faults.read_crc = 1000;
+  sdmmc_sim_inject( &faults );
+  uint64_t t0 = sdmmc_sim_now();
+  block_sd_reset_stats();
+  r = block_read( 1020, rbuf );
+  check( "retries are bounded",
+         r == -1 && sd->retries == SD_RETRIES && sd->failures == 1 &&
+         block_get_error() == SD_ERR_IO &&
+         sdmmc_sim_now() - t0 < 1000000000ULL );
+  faults.read_crc = 0;
+  sdmmc_sim_inject( &faults );
+  r = block_read( 1020, rbuf );
+  uint32_t total = 0;
+  for ( int i = 0; i < SD_LATENCY_BUCKETS; ++i ) { total += sd->latency[ i ]; }
+  check( "card works again, latency is recorded",
+         r == 0 && memcmp( wbuf, rbuf, 512 ) == 0 && sd->reads == 2 &&
+         total == 2 && sd->max_read_us >= ( sdmmc_sim_now() - t0 ) / 2000 );
+
+  block_halt();
+  check( "halt returns the card to idle",
+         sdmmc_sim_card_state() == SDMMC_STATE_IDLE );
+  sdmmc_sim_close();
+
+  // A card which never finishes powering up.
+  cfg.init_ns = 4000000000U;
+  r = start( &cfg, SDMMC_WAIT_WFI );
+  check( "init gives up on a card which stays busy",
+         r == -1 && card.type == SD_CARD_ERROR &&
+         sdmmc_sim_now() < ( SD_INIT_TIMEOUT_MS + 100 ) * 1000000ULL );
+  sdmmc_sim_close();
+
+  // Standard-capacity card, polled waits. The simulator starts with
+  // a freshly powered card, so this is also a cold boot after the
+  // last card was halted.
+  sdmmc_sim_defaults( &cfg );
+  cfg.high_capacity = 0;
+  r = start( &cfg, SDMMC_WAIT_SPIN );
+  check( "SDSC card initializes", r == 0 && card.type == SD_CARD_SC );
+  check( "SDSC capacity from CSD v1",
+         block_get_volume_size() == IMAGE_BLOCKS );
+  check( "SDSC block length set with CMD16",
+         sdmmc_sim_get_stats()->cmds[ SDMMC_CMD_SET_BLOCKLEN ] == 1 );
+  fill( wbuf, 99 );
+  r = block_write( 4000, wbuf );
+  image_read( 4000, ibuf );
+  check( "SDSC write uses byte addresses",
+         r == 0 && memcmp( wbuf, ibuf, 512 ) == 0 );
+  r = block_read( 4000, rbuf );
+  check( "SDSC read back", r == 0 && memcmp( wbuf, rbuf, 512 ) == 0 );
+  sdmmc_sim_close();
+
+  // Power-cycle the card but keep the retained cache: the warm
+  // path must notice that the card lost its address.
+  sdmmc = sdmmc_sim_open( IMAGE, &cfg );
+  r = boot( SDMMC_WAIT_SPIN );
+  check( "power-cycled card falls back to a cold boot",
+         r == 0 && !card.warm && card.type == SD_CARD_SC &&
+         block_read( 4000, rbuf ) == 0 && memcmp( wbuf, rbuf, 512 ) == 0 );
+  sdmmc_sim_close();
+
+  // SD 6.0 card with a write cache.
+  sdmmc_sim_defaults( &cfg );
+  cfg.ext_cache = 1;
+  r = start( &cfg, SDMMC_WAIT_WFI );
+  check( "write cache is found and enabled at init",
+         r == 0 && card.cache &&
+         sdmmc_sim_get_stats()->cmds[ SDMMC_CMD_WRITE_EXTR ] == 1 );
+  fill( wbuf, 7 );
+  r = block_write( 300, wbuf );
+  image_read( 300, ibuf );
+  check( "cached write does not reach the image yet",
+         r == 0 && memcmp( wbuf, ibuf, 512 ) != 0 );
+  check( "cached block reads back",
+         block_read( 300, rbuf ) == 0 && memcmp( wbuf, rbuf, 512 ) == 0 );
+  sdmmc_sim_reset_stats();
+  r = block_flush_cache();
+  image_read( 300, ibuf );
+  check( "flush writes the cache back",
+         r == 0 && stats->cache_flushes == 1 &&
+         memcmp( wbuf, ibuf, 512 ) == 0 );
+  r = boot( SDMMC_WAIT_WFI );
+  check( "warm boot keeps the write cache on",
+         r == 0 && card.warm && card.cache );
+  fill( wbuf, 8 );
+  block_write( 301, wbuf );
+  memset( &faults, 0, sizeof( faults ) );
+  faults.no_response = 1;
+  sdmmc_sim_inject( &faults );
+  r = block_halt();
+  image_read( 301, ibuf );
+  check( "halt fails and keeps the card if the flush fails",
+         r == -1 && card.cache && memcmp( wbuf, ibuf, 512 ) != 0 &&
+         sdmmc_sim_card_state() == SDMMC_STATE_TRAN );
+  r = block_halt();
+  image_read( 301, ibuf );
+  check( "halt flushes the cache",
+         r == 0 && memcmp( wbuf, ibuf, 512 ) == 0 );
+  sdmmc_sim_close();
+
+  // A retry which resets the card loses its cache, and says so.
+  r = start( &cfg, SDMMC_WAIT_WFI );
+  fill( wbuf, 9 );
+  block_write( 300, wbuf );
+  memset( &faults, 0, sizeof( faults ) );
+  faults.hung = 1;
+  sdmmc_sim_inject( &faults );
+  block_sd_reset_stats();
+  fill( wbuf, 10 );
+  r = block_write( 301, wbuf );
+  check( "re-init with the cache on reports it lost",
+         r == 0 && sd->reinits == 1 && card.cache &&
+         block_get_error() == SD_ERR_CACHE_LOST );
+  faults.hung = 0;
+  check( "flush fails until the loss is acknowledged",
+         block_flush_cache() == -1 && block_flush_cache() == -1 &&
+         block_get_error() == SD_ERR_CACHE_LOST );
+  block_sd_clear_error();
+  r = block_flush_cache();
+  image_read( 301, ibuf );
+  check( "flush works again once acknowledged",
+         r == 0 && block_get_error() == 0 &&
+         memcmp( wbuf, ibuf, 512 ) == 0 );
+  sdmmc_sim_close();
+
+  // Multi-block writes and recording sessions, on a card with small
+  // (16KB, 32-block) allocation units.
+  static uint8_t run[ 64 * 512 ];
+  for ( uint32_t b = 0; b < 64; ++b ) { fill( &run[ b * 512 ], b + 700 ); }
+  sdmmc_sim_defaults( &cfg );
+  cfg.au_size = 1;
+  r = start( &cfg, SDMMC_WAIT_WFI );
+  sdmmc_sim_reset_stats();
+  t0 = sdmmc_sim_now();
+  r |= block_write_blocks( 600, 20, run );
+  r |= sdmmc_card_wait_ready( sdmmc );
+  uint64_t t_multi = sdmmc_sim_now() - t0;
+  ok = 1;
+  for ( uint32_t b = 0; b < 20; ++b ) {
+    image_read( 600 + b, ibuf );
+    ok &= ( memcmp( &run[ b * 512 ], ibuf, 512 ) == 0 );
+  }
+  check( "multi-block write sends a run with one CMD25",
+         r == 0 && ok && stats->cmds[ SDMMC_CMD_WRITE_BLOCKS ] == 1 &&
+         stats->cmds[ SDMMC_CMD_WRITE_BLOCK ] == 0 &&
+         stats->cmds[ SDMMC_CMD_STOP_TRANS ] == 1 &&
+         stats->blocks_written == 20 && stats->fifo_errors == 0 &&
+         sdmmc_sim_card_state() == SDMMC_STATE_TRAN );
+  t0 = sdmmc_sim_now();
+  for ( uint32_t b = 0; b < 20; ++b ) { block_write( 600 + b, &run[ b * 512 ] ); }
+  sdmmc_card_wait_ready( sdmmc );
+  uint64_t t_blocks = sdmmc_sim_now() - t0;
+  check( "multi-block write is faster than single blocks",
+         t_multi * 3 < t_blocks );
+
+  sdmmc_sim_reset_stats();
+  r = block_record_start( 64 );
+  check( "recording is announced with CMD20, AU size read",
+         r == 0 && stats->cmds[ SDMMC_CMD_SPEED_CLASS ] == 1 &&
+         stats->cmds[ 64 + SDMMC_APP_GET_STAT ] == 1 &&
+         block_get_profile()->au_blocks == 32 );
+  for ( uint32_t i = 0; i < 7; ++i ) {
+    r |= block_record_write( &run[ i * 4 * 512 ], 4 );
+  }
+  check( "recorded blocks share one open write",
+         r == 0 && stats->cmds[ SDMMC_CMD_WRITE_BLOCKS ] == 1 &&
+         stats->cmds[ SDMMC_CMD_STOP_TRANS ] == 0 &&
+         stats->blocks_written == 28 &&
+         sdmmc_sim_card_state() == SDMMC_STATE_RCV );
+  r = block_record_write( &run[ 28 * 512 ], 4 );
+  check( "the write is closed at the end of the AU",
+         r == 0 && stats->cmds[ SDMMC_CMD_WRITE_BLOCKS ] == 1 &&
+         stats->cmds[ SDMMC_CMD_STOP_TRANS ] == 1 &&
+         sdmmc_sim_card_state() != SDMMC_STATE_RCV );
+  r = block_record_write( &run[ 32 * 512 ], 24 );
+  check( "a run which fits in the AU stays open",
+         r == 0 && stats->cmds[ SDMMC_CMD_WRITE_BLOCKS ] == 2 &&
+         sdmmc_sim_card_state() == SDMMC_STATE_RCV );
+  r = block_read( 100, rbuf );
+  r |= block_record_write( &run[ 56 * 512 ], 8 );
+  ok = 1;
+  for ( uint32_t b = 0; b < 64; ++b ) {
+    image_read( 64 + b, ibuf );
+    ok &= ( memcmp( &run[ b * 512 ], ibuf, 512 ) == 0 );
+  }
+  check( "other commands close the write, recording resumes",
+         r == 0 && ok && stats->cmds[ SDMMC_CMD_WRITE_BLOCKS ] == 3 &&
+         stats->cmds[ SDMMC_CMD_STOP_TRANS ] == 3 &&
+         stats->blocks_written == 64 && stats->fifo_errors == 0 );
+  r = block_record_start( 160 );
+  r |= block_record_write( run, 16 );
+  check( "moving the session announces it again",
+         r == 0 && stats->cmds[ SDMMC_CMD_SPEED_CLASS ] == 2 &&
+         sdmmc_sim_card_state() == SDMMC_STATE_RCV );
+  r = block_flush_cache();
+  check( "flush finishes the open write",
+         r == 0 && sdmmc_sim_card_state() == SDMMC_STATE_TRAN );
+  block_sd_reset_stats();
+  faults.write_crc = 1;
+  sdmmc_sim_inject( &faults );
+  r = block_record_write( &run[ 16 * 512 ], 16 );
+  ok = 1;
+  for ( uint32_t b = 0; b < 32; ++b ) {
+    image_read( 160 + b, ibuf );
+    ok &= ( memcmp( &run[ b * 512 ], ibuf, 512 ) == 0 );
+  }
+  check( "recording falls back to single blocks after an error",
+         r == 0 && ok && sd->retries >= 1 && sd->failures == 0 );
+  r = block_record_stop();
+  check( "stopping ends the session",
+         r == 0 && block_record_write( run, 1 ) == -1 &&
+         sdmmc_sim_card_state() != SDMMC_STATE_RCV );
+  sdmmc_sim_close();
+  cfg.cmd20 = 0;
+  r = start( &cfg, SDMMC_WAIT_WFI );
+  r |= block_record_start( 32 );
+  r |= block_record_write( run, 32 );
+  image_read( 63, ibuf );
+  check( "cards without CMD20 record without announcing",
+         r == 0 && memcmp( &run[ 31 * 512 ], ibuf, 512 ) == 0 &&
+         stats->cmds[ SDMMC_CMD_SPEED_CLASS ] == 0 &&
+         stats->cmds[ SDMMC_CMD_WRITE_BLOCKS ] == 1 );
+  block_record_stop();
+  sdmmc_sim_close();
+
+  // Power saving: the card clock only runs while the bus is busy,
+  // waits sleep, and an idle card is powered down after a while.
+  sdmmc_sim_defaults( &cfg );
+  r = start( &cfg, SDMMC_WAIT_WFI );
+  sdmmc_sim_reset_stats();
+  sdmmc_sim_advance( 10000000 );
+  check( "card clock is gated while the bus is idle",
+         r == 0 && ( sdmmc->CLKCR & SDMMC_CLKCR_PWRSAV ) &&
+         stats->clock_ns == 0 );
+  block_sd_reset_energy();
+  t0 = sdmmc_sim_now();
+  fill( wbuf, 11 );
+  r = block_write( 500, wbuf );
+  r |= block_read( 500, rbuf );
+  uint64_t busy_ns = sdmmc_sim_now() - t0;
+  sdmmc_sim_advance( 5000000 );
+  const SDEnergy *en = block_sd_get_energy();
+  uint64_t us = ( sdmmc_sim_now() - t0 ) / 1000;
+  uint64_t sum = en->active_us + en->sleep_us + en->idle_us + en->off_us;
+  check( "clock only runs for the transfers",
+         r == 0 && stats->clock_ns > 0 && stats->clock_ns < busy_ns );
+  check( "energy counters add up, waits count as sleep",
+         en->sleep_us > en->active_us && en->idle_us >= 5000 &&
+         sum + 2 >= us && sum <= us + 2 );
+  block_sd_set_power_down( 20 );
+  sdmmc_sim_advance( 10000000 );
+  check( "card stays up until it has been idle long enough",
+         block_sd_idle() == 0 && !card.off );
+  sdmmc_sim_advance( 15000000 );
+  r = block_sd_idle();
+  check( "idle card is powered down",
+         r == 1 && card.off &&
+         sdmmc_sim_card_state() == SDMMC_STATE_IDLE &&
+         !( sdmmc->POWER & SDMMC_POWER_PWRCTRL ) );
+  sdmmc_sim_reset_stats();
+  block_sd_reset_energy();
+  sdmmc_sim_advance( 50000000 );
+  check( "powered-down card has no clock, and counts as off",
+         stats->clock_ns == 0 && block_sd_get_energy()->off_us >= 50000 );
+  r = block_read( 500, rbuf );
+  check( "next access powers the card back up",
+         r == 0 && !card.off && memcmp( wbuf, rbuf, 512 ) == 0 &&
+         block_sd_get_energy()->power_ups == 1 &&
+         sdmmc_xfer.wait_mode == SDMMC_WAIT_WFI );
+  block_sd_set_power_down( SD_POWER_DOWN_MS );
+  sdmmc_sim_close();
+
+  unlink( IMAGE );
+  printf( "\n%d tests, %d failures.\n", p, failures );
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,282 @@
+/*
+ * Host-side tests for the SPI-mode SD card driver, run against the
+ * register-level SPI / DMA / SD card simulator in `spi_sim.c`.
+ *
+ * `block_sd.c` and `port/spi.c` are built unmodified. The simulated
+ * card is backed by a scratch image file, so the tests can check
+ * what actually reached the 'card'.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "block_sd.h"
+#include "spi_sim.h"
+
+extern SDCard card;
+
+#define IMAGE        "spi_sim.img"
+#define IMAGE_BLOCKS ( 8192 )
+
+static int p = 0;
+static int failures = 0;
+
+static void check( const char *desc, int ok ) {
+  printf( "[%4d] Testing %s", p++, desc );
+  if ( ok ) { printf( "  [ ok ]\n" ); }
+  else {
+    printf( "  [fail]\n" );
+    ++failures;
+  }
+}
+
+/**
+ * Create a blank image, and start the simulator over it: a card
+ * which was just powered on. Then point the driver at it and boot.
+ */
+static int start( const spi_sim_config *cfg ) {
+  int fd = open( IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+  if ( fd < 0 || ftruncate( fd, ( off_t )IMAGE_BLOCKS * 512 ) ) { return -1; }
+  close( fd );
+  sd_bus.spi = spi_sim_open( IMAGE, cfg );
+  if ( !sd_bus.spi ) { return -1; }
+  sd_bus.dma = spi_sim_dma();
+  sd_cs_port = spi_sim_cs_port();
+  return block_init();
+}
+
+static void image_read( uint32_t block, void *buf ) {
+  int fd = open( IMAGE, O_RDONLY );
+  pread( fd, buf, 512, ( off_t )block * 512 );
+  close( fd );
+}
+
+static void image_write( uint32_t block, const void *buf ) {
+  int fd = open( IMAGE, O_WRONLY );
+  pwrite( fd, buf, 512, ( off_t )block * 512 );
+  close( fd );
+}
+
+static void fill( uint8_t *buf, uint32_t seed ) {
+  for ( int i = 0; i < 512; ++i ) { buf[ i ] = ( uint8_t )( seed * 31 + i * 7 ); }
+}
+
+int main( void ) {
+  // DMA buffers must be static; see `spi_sim.h`.
+  static uint8_t wbuf[ 512 ], rbuf[ 512 ], ibuf[ 512 ];
+  static uint8_t run[ 16 * 512 ];
+  const spi_sim_stats *stats = spi_sim_get_stats();
+  spi_sim_faults faults;
+  spi_sim_config cfg;
+  spi_sim_defaults( &cfg );
+
+  // High-capacity card.
+  int r = start( &cfg );
+  check( "SDHC card initializes",
+         r == 0 && card.card_type == SD_CARD_HC && spi_sim_ready() );
+  check( "SDHC capacity from CSD v2",
+         block_get_volume_size() == IMAGE_BLOCKS && !card.read_only );
+  check( "ACMD41 repeats until the card powers up",
+         stats->cmds[ 64 + 41 ] > 1 && spi_sim_now() >= cfg.init_ns );
+  check( "ACMD41 polls are paced",
+         stats->cmds[ 64 + 41 ] <=
+         cfg.init_ns / 1000000 / SD_ACMD41_POLL_MS + 2 );
+  check( "init ends on the fast SPI clock",
+         spi_sim_clock_hz() == 20000000 );
+  check( "init reports its time",
+         card.init_us >= cfg.init_ns / 1000 &&
+         card.init_us <= spi_sim_now() / 1000 );
+
+  spi_sim_reset_stats();
+  fill( wbuf, 1 );
+  r = block_write( 100, wbuf );
+  image_read( 100, ibuf );
+  check( "written block reaches the image",
+         r == 0 && memcmp( wbuf, ibuf, 512 ) == 0 );
+  memset( rbuf, 0, sizeof( rbuf ) );
+  r = block_read( 100, rbuf );
+  check( "read back after write-behind",
+         r == 0 && memcmp( wbuf, rbuf, 512 ) == 0 &&
+         stats->busy_cmds == 0 );
+  check( "data blocks move by DMA",
+         stats->dma_bytes >= 2 * 512 && stats->cpu_bytes < 2 * 512 &&
+         stats->overruns == 0 );
+
+  for ( uint32_t b = 0; b < 16; ++b ) {
+    fill( wbuf, b + 2 );
+    block_write( 200 + b, wbuf );
+  }
+  int ok = 1;
+  for ( uint32_t b = 0; b < 16; ++b ) {
+    fill( wbuf, b + 2 );
+    ok &= ( block_read( 200 + b, rbuf ) == 0 &&
+            memcmp( wbuf, rbuf, 512 ) == 0 );
+  }
+  check( "sequence of writes then reads", ok && stats->busy_cmds == 0 );
+
+  check( "read past the end of the card fails",
+         block_read( IMAGE_BLOCKS, rbuf ) == -1 );
+  check( "card recovers after a failed read",
+         block_read( 100, rbuf ) == 0 );
+
+  // Multi-block writes.
+  for ( uint32_t b = 0; b < 16; ++b ) { fill( run + b * 512, b + 400 ); }
+  spi_sim_reset_stats();
+  uint64_t t = spi_sim_now();
+  r = block_write_blocks( 400, 16, run );
+  block_flush_cache();
+  uint64_t t_multi = spi_sim_now() - t;
+  ok = ( r == 0 );
+  for ( uint32_t b = 0; b < 16; ++b ) {
+    image_read( 400 + b, ibuf );
+    ok &= ( memcmp( run + b * 512, ibuf, 512 ) == 0 );
+  }
+  check( "run of blocks is written with one CMD25",
+         ok && stats->cmds[ 25 ] == 1 && stats->cmds[ 24 ] == 0 &&
+         stats->cmds[ 64 + 23 ] == 1 && stats->blocks_written == 16 &&
+         stats->busy_cmds == 0 );
+  t = spi_sim_now();
+  for ( uint32_t b = 0; b < 16; ++b ) { block_write( 400 + b, run + b * 512 ); }
+  block_flush_cache();
+  uint64_t t_single = spi_sim_now() - t;
+  check( "CMD25 is faster than single-block writes",
+         t_multi * 3 < t_single * 2 );
+  check( "a run of one block is a single-block write",
+         block_write_blocks( 500, 1, run ) == 0 && stats->cmds[ 25 ] == 1 );
+  check( "run past the end of the card fails",
+         block_write_blocks( IMAGE_BLOCKS - 8, 16, run ) == -1 );
+
+  // Streaming reads.
+  for ( uint32_t b = 1000; b < 1100; ++b ) {
+    fill( wbuf, b );
+    image_write( b, wbuf );
+  }
+  spi_sim_reset_stats();
+  ok = ( block_stream_start( 1000, 37 ) == 0 );
+  for ( uint32_t b = 1000; b < 1037; ++b ) {
+    fill( wbuf, b );
+    ok &= ( block_read( b, rbuf ) == 0 && memcmp( wbuf, rbuf, 512 ) == 0 );
+  }
+  ok &= ( block_stream_stop() == 0 );
+  check( "stream reads a run with one CMD18",
+         ok && stats->cmds[ 18 ] == 1 && stats->cmds[ 17 ] == 0 &&
+         stats->cmds[ 12 ] == 1 && stats->blocks_read >= 37 );
+  spi_sim_reset_stats();
+  block_stream_start( 1050, 20 );
+  fill( wbuf, 1050 );
+  r = block_read( 1050, rbuf );
+  ok = ( r == 0 && memcmp( wbuf, rbuf, 512 ) == 0 );
+  // Reading somewhere else stops the stream.
+  fill( wbuf, 1090 );
+  r = block_read( 1090, rbuf );
+  check( "other reads stop the stream",
+         ok && r == 0 && memcmp( wbuf, rbuf, 512 ) == 0 &&
+         stats->cmds[ 12 ] == 1 && stats->cmds[ 17 ] == 1 );
+  block_stream_start( 1060, 20 );
+  fill( wbuf, 9 );
+  r = block_write( 1061, wbuf );
+  image_read( 1061, ibuf );
+  check( "writes stop the stream",
+         r == 0 && stats->cmds[ 12 ] == 2 && memcmp( wbuf, ibuf, 512 ) == 0 );
+  spi_sim_reset_stats();
+  ok = ( block_stream_start( IMAGE_BLOCKS - 2, 8 ) == 0 );
+  ok &= ( block_read( IMAGE_BLOCKS - 2, rbuf ) == 0 );
+  ok &= ( block_read( IMAGE_BLOCKS - 1, rbuf ) == 0 );
+  check( "stream is cut short at the end of the card",
+         ok && stats->cmds[ 12 ] == 1 && block_read( 100, rbuf ) == 0 );
+
+  // Card profile. The scratch area has data in it, which the probe
+  // must leave alone.
+  for ( uint32_t b = 1; b < 1 + SD_PROBE_BLOCKS; ++b ) {
+    fill( wbuf, b + 5000 );
+    image_write( b, wbuf );
+  }
+  spi_sim_reset_stats();
+  r = block_probe( 1, 64 );
+  const block_profile *prof = block_get_profile();
+  check( "probe reads the SD Status register",
+         r == 0 && prof->probed && prof->speed_class == 10 &&
+         prof->uhs_grade == 1 && prof->au_blocks == 8192 &&
+         stats->cmds[ 64 + 13 ] == 1 );
+  check( "probe times random reads and a sequential write",
+         prof->read_us >= cfg.read_ns / 1000 &&
+         prof->read_max_us >= prof->read_us &&
+         stats->blocks_written == SD_PROBE_BLOCKS &&
+         prof->write_us >= cfg.program_ns / 1000 );
+  ok = 1;
+  for ( uint32_t b = 1; b < 1 + SD_PROBE_BLOCKS; ++b ) {
+    fill( wbuf, b + 5000 );
+    image_read( b, ibuf );
+    ok &= ( memcmp( wbuf, ibuf, 512 ) == 0 );
+  }
+  check( "probe leaves the scratch area as it was", ok );
+
+  // Errors.
+  memset( &faults, 0, sizeof( faults ) );
+  faults.read_error = 1;
+  spi_sim_inject( &faults );
+  check( "read error token fails the read",
+         block_read( 100, rbuf ) == -1 && block_get_error() == SD_ERR_IO );
+  fill( wbuf, 1 );
+  check( "card reads again after a read error",
+         block_read( 100, rbuf ) == 0 && memcmp( wbuf, rbuf, 512 ) == 0 );
+  faults.read_error = 0;
+  faults.write_reject = 1;
+  spi_sim_inject( &faults );
+  fill( wbuf, 77 );
+  r = block_write( 100, wbuf );
+  image_read( 100, ibuf );
+  check( "rejected write fails", r == -1 && memcmp( wbuf, ibuf, 512 ) != 0 );
+  faults.write_reject = 1;
+  spi_sim_inject( &faults );
+  r = block_write_blocks( 600, 4, run );
+  check( "rejected block fails a multi-block write", r == -1 );
+  r = block_write( 100, wbuf );
+  image_read( 100, ibuf );
+  check( "card writes again after rejected writes",
+         r == 0 && memcmp( wbuf, ibuf, 512 ) == 0 );
+
+  // Flushing and halting wait for the card to finish programming.
+  r = block_write( 101, wbuf );
+  t = spi_sim_now();
+  check( "flush waits for programming",
+         r == 0 && block_flush_cache() == 0 &&
+         spi_sim_now() - t >= cfg.program_ns / 2 );
+  block_write( 102, wbuf );
+  t = spi_sim_now();
+  check( "halt waits for programming",
+         block_halt() == 0 && spi_sim_now() - t >= cfg.program_ns / 2 );
+  spi_sim_close();
+
+  // Standard-capacity cards are byte-addressed.
+  cfg.high_capacity = 0;
+  spi_sim_reset_stats();
+  r = start( &cfg );
+  check( "SDSC card initializes",
+         r == 0 && card.card_type == SD_CARD_SC &&
+         stats->cmds[ 16 ] == 1 && stats->cmds[ 58 ] == 1 );
+  check( "SDSC capacity from CSD v1",
+         block_get_volume_size() == IMAGE_BLOCKS );
+  fill( wbuf, 5 );
+  r = block_write( 300, wbuf );
+  image_read( 300, ibuf );
+  check( "SDSC write uses byte addresses",
+         r == 0 && memcmp( wbuf, ibuf, 512 ) == 0 &&
+         block_read( 300, rbuf ) == 0 && memcmp( wbuf, rbuf, 512 ) == 0 );
+  spi_sim_close();
+
+  // Version 1.x cards do not know CMD8.
+  cfg.version1 = 1;
+  spi_sim_reset_stats();
+  r = start( &cfg );
+  check( "v1 card initializes without CMD58",
+         r == 0 && card.card_type == SD_CARD_SC &&
+         stats->cmds[ 58 ] == 0 && block_read( 300, rbuf ) == 0 );
+  spi_sim_close();
+
+  unlink( IMAGE );
+  printf( "\n%d tests, %d failures.\n", p, failures );
+  return failures ? 1 : 0;
+}